@@ -18,6 +18,11 @@
 #include <signal.h>
 
 #include "log.h"
+#include "xdp_attach.h"
+#include "pin.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "prog_stats.h"
 
 // Include skeleton file
 #include "redirect.skel.h"
@@ -30,7 +35,7 @@ struct datarec {
 
 static int ifindex_iface = 0;
 static int redir_ifindex_iface = 0;
-static __u32 xdp_flags = 0;
+static struct xdp_attach xdp_ifaces;
 
 static const char *const usages[] = {
     "redirect [options] [[--] args]",
@@ -38,93 +43,78 @@ static const char *const usages[] = {
     NULL,
 };
 
-static void cleanup_ifaces() {
-    __u32 curr_prog_id = 0;
-
-    if (ifindex_iface != 0) {
-        if (!bpf_xdp_query_id(ifindex_iface, xdp_flags, &curr_prog_id)) {
-            if (curr_prog_id) {
-                bpf_xdp_detach(ifindex_iface, xdp_flags, NULL);
-                log_trace("Detached XDP program from interface %d", ifindex_iface);
-            }
-        }
-    }
-
-    if (redir_ifindex_iface != 0) {
-        if (!bpf_xdp_query_id(redir_ifindex_iface, xdp_flags, &curr_prog_id)) {
-            if (curr_prog_id) {
-                bpf_xdp_detach(redir_ifindex_iface, xdp_flags, NULL);
-                log_trace("Detached XDP program from interface %d", redir_ifindex_iface);
-            }
-        }
-    }
-}
-
 void sigint_handler(int sig_no) {
     log_debug("Closing program...");
-    cleanup_ifaces();
+    xdp_attach_detach_all(&xdp_ifaces);
     exit(0);
 }
 
-void poll_stats(struct redirect_bpf *skel) {
-    /* TODO 1: get the map file descriptor for the skeleton */
-    int map_fd = 0;
-    
-    map_fd = bpf_map__fd(skel->maps.xdp_stats_map);
-    if (map_fd < 0) {
-        log_fatal("Error while retrieving the map file descriptor");
-        exit(1);
+struct stats_ctx {
+    int map_fd;
+    struct datarec prev;
+    struct metrics *metrics;
+    struct prog_stats progs;
+};
+
+/* Print the rates since the previous tick, called every --interval */
+static void print_stats(void *ctx, double elapsed) {
+    struct stats_ctx *stats = ctx;
+    int cpus = libbpf_num_possible_cpus();
+    struct datarec values[cpus];
+    struct datarec tot_values = {0};
+    int key = 0;
+
+    if (bpf_map_lookup_elem(stats->map_fd, &key, values)) {
+        log_error("Error while retrieving the value from the map");
+        return;
     }
 
-    struct datarec old_values = {0};
-
-    while(true) {
-        /* TODO 2: define the value type (struct datarec) */
-        int cpus = libbpf_num_possible_cpus();
-        struct datarec values[cpus];
-        struct datarec tot_values = {0};
-        int key = 0;
-        int err = 0;
-        
-        /* TODO 4: get the value of the map for the key 0 */
-        err = bpf_map_lookup_elem(map_fd, &key, &values);
-        if (err != 0) {
-            log_fatal("Error while retrieving the value from the map");
-            exit(1);
-        }
-
-        for (int i = 0; i < cpus; i++) {
-            tot_values.rx_packets += values[i].rx_packets;
-            tot_values.rx_bytes += values[i].rx_bytes;
-        }
-
-
-        if (tot_values.rx_packets == 0 && tot_values.rx_bytes == 0) {
-            continue;
-        }
-        
-        /* TODO 5: print the number of packets received */
-        log_info("Number of packets received: %llu", tot_values.rx_packets - old_values.rx_packets);
-        /* TODO 6: print the number of bytes received */
-        log_info("Number of bytes received: %llu", tot_values.rx_bytes - old_values.rx_bytes);
-
-        old_values.rx_packets = tot_values.rx_packets;
-        old_values.rx_bytes = tot_values.rx_bytes;
-        sleep(1);
+    for (int i = 0; i < cpus; i++) {
+        tot_values.rx_packets += values[i].rx_packets;
+        tot_values.rx_bytes += values[i].rx_bytes;
+    }
+
+    if (tot_values.rx_packets != stats->prev.rx_packets) {
+        log_info("Packets received: %.0f pkt/s", (tot_values.rx_packets - stats->prev.rx_packets) / elapsed);
+        log_info("Bytes received: %.0f byte/s", (tot_values.rx_bytes - stats->prev.rx_bytes) / elapsed);
+    }
+
+    stats->prev = tot_values;
+    prog_stats_print(&stats->progs, elapsed);
+
+    if (metrics_enabled(stats->metrics)) {
+        metrics_begin(stats->metrics);
+        metrics_family(stats->metrics, "xdp_redirect_packets_total", "counter", "Packets seen by the redirecting XDP program");
+        metrics_u64(stats->metrics, "xdp_redirect_packets_total", NULL, tot_values.rx_packets);
+        metrics_family(stats->metrics, "xdp_redirect_bytes_total", "counter", "Bytes seen by the redirecting XDP program");
+        metrics_u64(stats->metrics, "xdp_redirect_bytes_total", NULL, tot_values.rx_bytes);
+        prog_stats_render_metrics(stats->metrics, &stats->progs);
+        metrics_commit(stats->metrics);
     }
 }
 
 int main(int argc, const char **argv) {
     struct redirect_bpf *skel = NULL;
+    struct event_loop loop = {0};
+    struct metrics metrics = {0};
+    struct stats_ctx stats = {0};
+    float interval = 1;
+    int metrics_port = 0;
     int err;
     const char *iface = NULL;
     const char *redir_iface = NULL;
+    const char *xdp_mode = NULL;
+    const char *pin_dir = NULL;
 
     struct argparse_option options[] = {
         OPT_HELP(),
         OPT_GROUP("Basic options"),
         OPT_STRING('i', "iface", &iface, "Interface where to attach the BPF program", NULL, 0, 0),
         OPT_STRING('r', "redir_iface", &redir_iface, "Interface where to redirect packets", NULL, 0, 0),
+        OPT_STRING(0, "xdp-mode", &xdp_mode, "XDP mode: drv (default), skb or hw, falls back to the slower ones", NULL, 0, 0),
+        OPT_FLOAT('I', "interval", &interval, "Statistics interval in seconds (default 1, at least 0.01)", NULL, 0, 0),
+        OPT_INTEGER(0, "metrics-port", &metrics_port, "Serve Prometheus metrics on 127.0.0.1:<port>/metrics", NULL, 0, 0),
+        OPT_STRING(0, "pin-dir", &pin_dir, "bpffs directory where maps and links are pinned, to keep them across restarts", NULL, 0, 0),
         OPT_END(),
     };
 
@@ -134,33 +124,16 @@ int main(int argc, const char **argv) {
     "\nIf '-p' argument is specified, the interface will be put in promiscuous mode");
     argc = argparse_parse(&argparse, argc, argv);
 
-    if (iface != NULL) {
-        log_info("XDP program will be attached to %s interface", iface);
-        ifindex_iface = if_nametoindex(iface);
-        if (!ifindex_iface) {
-            log_fatal("Error while retrieving the ifindex of %s", iface);
-            exit(1);
-        } else {
-            log_info("Got ifindex for iface: %s, which is %d", iface, ifindex_iface);
-        }
-    } else {
-        log_error("Error, you must specify the interface where to attach the XDP program");
+    if (xdp_attach_parse_mode(xdp_mode, &xdp_ifaces.mode) || event_loop_check_interval(interval))
         exit(1);
-    }
 
-    if (redir_iface != NULL) {
-        log_info("XDP program will be attached to %s interface", redir_iface);
-        redir_ifindex_iface = if_nametoindex(redir_iface);
-        if (!redir_ifindex_iface) {
-            log_fatal("Error while retrieving the ifindex of %s", redir_iface);
-            exit(1);
-        } else {
-            log_info("Got ifindex for redir_iface: %s, which is %d", redir_iface, redir_ifindex_iface);
-        }
-    } else {
-        log_error("Error, you must specify the interface where to attach the XDP program");
+    ifindex_iface = xdp_attach_add_iface(&xdp_ifaces, iface, NULL);
+    if (ifindex_iface < 0)
+        exit(1);
+
+    redir_ifindex_iface = xdp_attach_add_iface(&xdp_ifaces, redir_iface, NULL);
+    if (redir_ifindex_iface < 0)
         exit(1);
-    }
 
     /* Open BPF application */
     skel = redirect_bpf__open();
@@ -175,6 +148,13 @@ int main(int argc, const char **argv) {
 
     skel->rodata->redir_ifindex = redir_ifindex_iface;
 
+    /* Reuse the counters of the previous run, if any */
+    if (pin_dir != NULL) {
+        if (pin_maps(skel->obj, pin_dir, NULL) < 0)
+            exit(1);
+        xdp_ifaces.pin_dir = pin_dir;
+    }
+
     /* Load and verify BPF programs */
     if (redirect_bpf__load(skel)) {
         log_fatal("Error while loading BPF skeleton");
@@ -195,20 +175,15 @@ int main(int argc, const char **argv) {
         goto cleanup;
     }
 
-    xdp_flags = 0;
-    xdp_flags |= XDP_FLAGS_DRV_MODE;
-
     /* Attach the XDP program to the interface */
-    err = bpf_xdp_attach(ifindex_iface, bpf_program__fd(skel->progs.xdp_prog_map), xdp_flags, NULL);
-
+    err = xdp_attach_iface(&xdp_ifaces, 0, bpf_program__fd(skel->progs.xdp_prog_map));
     if (err) {
         log_fatal("Error while attaching the XDP program to the interface");
         goto cleanup;
     }
 
-    /* Attach the XDP program to the interface */
-    err = bpf_xdp_attach(redir_ifindex_iface, bpf_program__fd(skel->progs.xdp_pass), xdp_flags, NULL);
-
+    /* Attach the XDP program to the redirect interface */
+    err = xdp_attach_iface(&xdp_ifaces, 1, bpf_program__fd(skel->progs.xdp_pass));
     if (err) {
         log_fatal("Error while attaching the XDP program to the interface");
         goto cleanup;
@@ -216,12 +191,20 @@ int main(int argc, const char **argv) {
 
     log_info("Successfully attached!");
 
-    sleep(1);
-
-    poll_stats(skel);
+    stats.map_fd = bpf_map__fd(skel->maps.xdp_stats_map);
+    stats.metrics = &metrics;
+    prog_stats_init(&stats.progs, skel->obj);
+    err = event_loop_init(&loop, interval, print_stats, &stats);
+    if (!err)
+        err = metrics_init(&metrics, &loop, metrics_port, 0);
+    if (!err)
+        err = event_loop_run(&loop);
 
 cleanup:
-    cleanup_ifaces();
+    metrics_destroy(&metrics);
+    prog_stats_destroy(&stats.progs);
+    event_loop_destroy(&loop);
+    xdp_attach_detach_all(&xdp_ifaces);
     redirect_bpf__destroy(skel);
     log_info("Program stopped correctly");
     return -err;
@@ -13,6 +13,11 @@
 #include <bpf/bpf_endian.h>
 #include <stdint.h>
 
+#include "flow_cache.h"
+#include "parsing_helpers.h"
+#include "vlan.h"
+#include "map_values.h"
+
 const volatile struct {
    int ifindex_if1;
    int ifindex_if2;
@@ -20,11 +25,6 @@ const volatile struct {
    int ifindex_if4;
 } hhdv1_cfg = {};
 
-struct value_t {
-   __u64 threshold;
-   __u64 packets_rcvd;
-};
-
 struct {
     __uint(type, BPF_MAP_TYPE_HASH);
     __type(key, __u32);
@@ -39,46 +39,6 @@ struct {
    __uint(max_entries, 16);
 } ip_to_port SEC(".maps");
 
-static __always_inline int parse_ethhdr(void *data, void *data_end, __u16 *nh_off, struct ethhdr **ethhdr) {
-   struct ethhdr *eth = (struct ethhdr *)data;
-   int hdr_size = sizeof(*eth);
-
-   /* Byte-count bounds check; check if current pointer + size of header
-	 * is after data_end.
-	 */
-   if ((void *)eth + hdr_size > data_end)
-      return -1;
-
-   *nh_off += hdr_size;
-   *ethhdr = eth;
-
-   return eth->h_proto; /* network-byte-order */
-}
-
-static __always_inline int parse_iphdr(void *data, void *data_end, __u16 *nh_off, struct iphdr **iphdr) {
-   struct iphdr *ip = (struct iphdr *)(data + *nh_off);
-   int hdr_size = sizeof(*ip);
-
-   /* Byte-count bounds check; check if current pointer + size of header
-    * is after data_end.
-    */
-   if ((void *)ip + hdr_size > data_end)
-      return -1;
-
-   hdr_size = ip->ihl * 4;
-   if (hdr_size < sizeof(*ip))
-      return -1;
-
-   /* Variable-length IPv4 header, need to use byte-based arithmetic */
-   if ((void *)ip + hdr_size > data_end)
-      return -1;
-
-   *nh_off += hdr_size;
-   *iphdr = ip;
-
-   return ip->protocol;
-}
-
 SEC("xdp")
 int xdp_hhdv1(struct xdp_md *ctx) {
    void *data_end = (void *)(long)ctx->data_end;
@@ -89,10 +49,23 @@ int xdp_hhdv1(struct xdp_md *ctx) {
    struct iphdr *ip;
    int eth_type, ip_type;
    int action = XDP_PASS;
+   struct flow_key fkey = {};
+   struct vlan_info vlan;
+   __u32 out_ifindex;
 
    bpf_printk("Packet received from interface %d", ctx->ingress_ifindex);
 
    eth_type = parse_ethhdr(data, data_end, &nf_off, &eth);
+   eth_type = parse_vlan(ctx, data, data_end, &nf_off, eth_type, &vlan);
+
+   switch (vlan_account(&vlan, data_end - data)) {
+      case VLAN_ACTION_DROP:
+         return XDP_DROP;
+      case VLAN_ACTION_PASS:
+         return XDP_PASS;
+      default:
+         break;
+   }
 
    if (eth_type != bpf_htons(ETH_P_IP)) {
       bpf_printk("Packet is not an IPv4 packet");
@@ -106,12 +79,20 @@ int xdp_hhdv1(struct xdp_md *ctx) {
       return XDP_DROP;
    }
 
+   if (flow_cache_cfg.enabled) {
+      flow_cache_key(ctx, ip, data + nf_off, data_end, &fkey);
+      fkey.vlan_id = vlan.key.outer_vid;
+      struct flow_verdict *fv = flow_cache_lookup(&fkey);
+      if (fv)
+         return flow_cache_apply(fv);
+   }
+
    if (ctx->ingress_ifindex != hhdv1_cfg.ifindex_if4) {
       struct value_t *val = bpf_map_lookup_elem(&threshold_map, &ip->saddr);
       if (!val) {
          bpf_printk("No threshold set for IP %d", ip->saddr);
          bpf_printk("Dropping packet");
-         goto drop;
+         goto drop_cached;
       }
 
       bpf_printk("Current # of packets received for IP %d: %d. Threshold is: %d", ip->saddr, val->packets_rcvd, val->threshold);
@@ -119,10 +100,13 @@ int xdp_hhdv1(struct xdp_md *ctx) {
       if (val->packets_rcvd > val->threshold) {
          bpf_printk("Threshold exceeded for IP %d", ip->saddr);
          bpf_printk("Dropping packet");
-         goto drop;
+         /* The counter only grows until userspace reloads the rules */
+         goto drop_cached;
       }
 
-      /* Forward packet to interface 4 */
+      /* Forward packet to interface 4. Packets below the threshold must
+       * still be counted, so this verdict is never cached.
+       */
       return bpf_redirect(hhdv1_cfg.ifindex_if4, 0);
    } else {
       bpf_printk("Packet received from interface %d", ctx->ingress_ifindex);
@@ -132,26 +116,36 @@ int xdp_hhdv1(struct xdp_md *ctx) {
 
       if (!port) {
          bpf_printk("IP %d not found in map", ip->daddr);
-         goto drop;
+         goto drop_cached;
       }
 
       bpf_printk("IP %d found in map. Forwarding packet to port %d", ip->daddr, *port);
 
       switch (*port) {
          case 1:
-            return bpf_redirect(hhdv1_cfg.ifindex_if1, 0);
+            out_ifindex = hhdv1_cfg.ifindex_if1;
+            break;
          case 2:
-            return bpf_redirect(hhdv1_cfg.ifindex_if2, 0);
+            out_ifindex = hhdv1_cfg.ifindex_if2;
+            break;
          case 3:
-            return bpf_redirect(hhdv1_cfg.ifindex_if3, 0);
+            out_ifindex = hhdv1_cfg.ifindex_if3;
+            break;
          default:
             bpf_printk("Port %d not found", *port);
             goto drop;
       }
-      
-      goto drop;
+
+      if (flow_cache_cfg.enabled)
+         flow_cache_insert(&fkey, XDP_REDIRECT, out_ifindex);
+
+      return bpf_redirect(out_ifindex, 0);
    }
 
+drop_cached:
+   if (flow_cache_cfg.enabled)
+      flow_cache_insert(&fkey, XDP_DROP, 0);
+
 drop:
    return XDP_DROP;
 }
@@ -22,128 +22,227 @@
 
 #include "log.h"
 #include "hhd_v1.h"
-
-struct map_value_t {
-   __u64 threshold;
-   __u64 packets_rcvd;
-};
+#include "flow_cache_user.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "prog_stats.h"
+#include "config_snapshot.h"
+#include "ebpf/map_values.h"
 
 static const char *const usages[] = {
     "hhd_v1 [options] [[--] args]",
     "hhd_v1 [options]",
+    "hhd_v1 compile -c <config.yaml> -o <snapshot>",
     NULL,
 };
 
-int load_maps_config(const char *config_file, struct hhd_v1_bpf *skel) {
-    struct ips *ips;
-    cyaml_err_t err;
-    int ret = EXIT_SUCCESS;
+static const char *const compile_usages[] = {
+    "hhd_v1 compile -c <config.yaml> -o <snapshot>",
+    NULL,
+};
 
-    /* Load input file. */
-	err = cyaml_load_file(config_file, &config, &ips_schema, (void **) &ips, NULL);
-	if (err != CYAML_OK) {
-		fprintf(stderr, "ERROR: %s\n", cyaml_strerror(err));
-		return EXIT_FAILURE;
-	}
+/*
+ * Load the configuration in the maps (config_load.h). When the maps are reused
+ * from a previous run (warm), the counters are kept and the IPs and VLAN rules
+ * that are no longer in the configuration are removed. config_file is either
+ * the YAML file or a snapshot compiled from it.
+ */
+int load_maps_config(const char *config_file, struct hhd_v1_bpf *skel, bool warm) {
+    struct config_maps maps = {
+        .threshold_map = skel->maps.threshold_map,
+        .ip_to_port = skel->maps.ip_to_port,
+        .vlan_policy = skel->maps.vlan_policy,
+    };
+
+    if (config_load(config_file, &config_hhd_schema, &maps, warm))
+        return EXIT_FAILURE;
 
-    log_info("Loaded %d IPs", ips->ips_count);
+    /* Rules changed, invalidate the cached verdicts */
+    flow_cache_bump_gen(&skel->bss->flow_cache_gen);
 
-    // Get file descriptor of the map
-    int threshold_map_fd = bpf_map__fd(skel->maps.threshold_map);
+    return EXIT_SUCCESS;
+}
 
-    // Check if the file descriptor is valid
-    if (threshold_map_fd < 0) {
-        log_error("Failed to get file descriptor of BPF map: %s", strerror(errno));
-        ret = EXIT_FAILURE;
-        goto cleanup_yaml;
+struct stats_ctx {
+    struct hhd_v1_bpf *skel;
+    int flow_cache;
+    __u64 prev[FLOW_CACHE_STAT_MAX];
+    struct metrics *metrics;
+    struct prog_stats progs;
+    struct vlan_stats_prev vlans;
+    /* threshold_map, read with one batch lookup per tick for the metrics */
+    __u32 max_ips;
+    __u32 *keys;
+    struct value_t *values;
+    struct metrics_ip_entry *entries;
+};
+
+static int stats_init(struct stats_ctx *stats, struct hhd_v1_bpf *skel, int flow_cache, struct metrics *metrics) {
+    stats->skel = skel;
+    stats->flow_cache = flow_cache;
+    stats->metrics = metrics;
+    prog_stats_init(&stats->progs, skel->obj);
+    stats->max_ips = bpf_map__max_entries(skel->maps.threshold_map);
+    stats->keys = calloc(stats->max_ips, sizeof(*stats->keys));
+    stats->values = calloc(stats->max_ips, sizeof(*stats->values));
+    stats->entries = calloc(stats->max_ips, sizeof(*stats->entries));
+
+    if (!stats->keys || !stats->values || !stats->entries) {
+        log_error("Failed to allocate the statistics buffers");
+        return -1;
     }
 
-    /* Load the IPs in the BPF map */
-    for (int i = 0; i < ips->ips_count; i++) {
-        log_info("Loading IP %s", ips->ips[i].ip);
-        log_info("Threshold: %d", ips->ips[i].threshold);
+    return 0;
+}
 
-        // Convert the IP to an integer
-        struct in_addr addr;
-        int ret = inet_pton(AF_INET, ips->ips[i].ip, &addr);
-        if (ret != 1) {
-            log_error("Failed to convert IP %s to integer", ips->ips[i].ip);
-            ret = EXIT_FAILURE;
-            goto cleanup_yaml;
-        }
+static void stats_destroy(struct stats_ctx *stats) {
+    prog_stats_destroy(&stats->progs);
+    vlan_stats_prev_free(&stats->vlans);
+    free(stats->keys);
+    free(stats->values);
+    free(stats->entries);
+}
 
-        // Now write the IP to the BPF map
-        struct map_value_t value = {
-            .threshold = ips->ips[i].threshold,
-            .packets_rcvd = 0,
-        };
+/* Per-source packet counters (top --metrics-top) and flow cache counters */
+static void render_metrics(struct stats_ctx *stats) {
+    struct metrics *m = stats->metrics;
+    __u32 count = stats->max_ips;
 
-        ret = bpf_map_update_elem(threshold_map_fd, &addr.s_addr, &value, BPF_ANY);
-        if (ret != 0) {
-            log_error("Failed to update BPF map: %s", strerror(errno));
-            ret = EXIT_FAILURE;
-            goto cleanup_yaml;  
-        }        
+    metrics_begin(m);
+
+    if (metrics_map_dump(bpf_map__fd(stats->skel->maps.threshold_map), sizeof(*stats->keys),
+                         sizeof(*stats->values), stats->keys, stats->values, &count) == 0) {
+        for (__u32 i = 0; i < count; i++) {
+            stats->entries[i].addr = stats->keys[i];
+            stats->entries[i].packets = stats->values[i].packets_rcvd;
+            stats->entries[i].bytes = 0;
+        }
+        metrics_ip_top(m, "hhd_source", "the monitored sources", stats->entries, count, false);
+    } else {
+        log_error("Error while reading the per-source counters");
     }
 
-    // Get fd of port map
-    int port_map_fd = bpf_map__fd(skel->maps.ip_to_port);
+    if (stats->flow_cache)
+        flow_cache_render_metrics(m, stats->prev);
+    prog_stats_render_metrics(m, &stats->progs);
+
+    metrics_commit(m);
+}
+
+/* ns/run, flow cache and per-VLAN counters, printed every --interval */
+static void print_stats(void *ctx, double elapsed) {
+    struct stats_ctx *stats = ctx;
+
+    prog_stats_print(&stats->progs, elapsed);
+    if (stats->flow_cache)
+        flow_cache_print_stats(bpf_map__fd(stats->skel->maps.flow_cache_stats), stats->prev);
+    vlan_print_stats(&stats->vlans, bpf_map__fd(stats->skel->maps.vlan_stats), elapsed);
+
+    if (metrics_enabled(stats->metrics))
+        render_metrics(stats);
+}
+
+/* "compile" subcommand: turn the YAML configuration into a snapshot for -c */
+static int compile_config(int argc, const char **argv) {
+    const char *config_file = "config.yaml";
+    const char *output = NULL;
+    struct config_snapshot_entry *entries;
+    struct config_rules *ips;
+    int ret = EXIT_FAILURE;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_STRING('c', "config", &config_file, "YAML configuration to compile (default config.yaml)", NULL, 0, 0),
+        OPT_STRING('o', "output", &output, "Snapshot to write", NULL, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, compile_usages, 0);
+    argparse_describe(&argparse, "\nCompile the YAML configuration into a binary snapshot that loads without parsing", "");
+    argc = argparse_parse(&argparse, argc, argv);
 
-    // Check if the file descriptor is valid
-    if (port_map_fd < 0) {
-        log_error("Failed to get file descriptor of BPF map: %s", strerror(errno));
-        ret = EXIT_FAILURE;
-        goto cleanup_yaml;
+    if (output == NULL) {
+        argparse_usage(&argparse);
+        return EXIT_FAILURE;
     }
 
-    /* Load the IPs in the BPF map */
-    for (int i = 0; i < ips->ips_count; i++) {
-        log_info("Loading IP %s", ips->ips[i].ip);
-        log_info("Port: %d", ips->ips[i].port);
+    if (config_parse(config_file, &config_hhd_schema, &ips))
+        return EXIT_FAILURE;
+
+    entries = calloc(ips->ips_count, sizeof(*entries));
+    if (ips->ips_count && !entries) {
+        log_fatal("Failed to allocate the snapshot entries");
+        goto cleanup;
+    }
 
-        // Convert the IP to an integer
+    for (__u64 i = 0; i < ips->ips_count; i++) {
         struct in_addr addr;
-        int ret = inet_pton(AF_INET, ips->ips[i].ip, &addr);
-        if (ret != 1) {
-            log_error("Failed to convert IP %s to integer", ips->ips[i].ip);
-            ret = EXIT_FAILURE;
-            goto cleanup_yaml;
-        }
 
-        uint32_t port = ips->ips[i].port;
+        if (inet_pton(AF_INET, ips->ips[i].ip, &addr) != 1) {
+            log_fatal("Failed to convert IP %s to integer", ips->ips[i].ip);
+            goto cleanup;
+        }
 
-        ret = bpf_map_update_elem(port_map_fd, &addr.s_addr, &port, BPF_ANY);
-        if (ret != 0) {
-            log_error("Failed to update BPF map: %s", strerror(errno));
-            ret = EXIT_FAILURE;
-            goto cleanup_yaml;  
-        }        
+        entries[i].addr = addr.s_addr;
+        entries[i].threshold = ips->ips[i].threshold;
+        entries[i].port = ips->ips[i].port;
     }
 
-cleanup_yaml:
-    /* Free the data */
-	cyaml_free(&config, &ips_schema, ips, 0);
+    if (config_snapshot_write(output, entries, ips->ips_count, ips->vlans, ips->vlans_count) == 0) {
+        log_info("Compiled %llu IPs and %llu VLAN rules from %s into %s", ips->ips_count, ips->vlans_count,
+                 config_file, output);
+        ret = EXIT_SUCCESS;
+    }
 
+cleanup:
+    free(entries);
+    config_free(ips, &config_hhd_schema);
     return ret;
 }
 
 int main(int argc, const char **argv) {
     struct hhd_v1_bpf *skel = NULL;
+    struct event_loop loop = {0};
+    struct metrics metrics = {0};
+    struct stats_ctx stats = {0};
+    float interval = 1;
+    int metrics_port = 0;
+    int metrics_top = METRICS_DEFAULT_TOP;
     int err;
     const char *config_file = NULL;
+    int flow_cache = 0;
+    int flow_cache_ttl = FLOW_CACHE_DEFAULT_TTL_MS;
+    int flow_cache_size = 0;
     const char *iface1 = NULL;
     const char *iface2 = NULL;
     const char *iface3 = NULL;
     const char *iface4 = NULL;
+    const char *xdp_mode = NULL;
+    const char *pin_dir = NULL;
+    bool default_config;
+    int reused = 0;
+
+    if (argc > 1 && strcmp(argv[1], "compile") == 0)
+        return compile_config(argc - 1, argv + 1);
 
     struct argparse_option options[] = {
         OPT_HELP(),
         OPT_GROUP("Basic options"),
-        OPT_STRING('c', "config", &config_file, "Path to the YAML configuration file", NULL, 0, 0),
+        OPT_STRING('c', "config", &config_file, "Path to the YAML configuration file or to its compiled snapshot", NULL, 0, 0),
         OPT_STRING('1', "iface1", &iface1, "1st interface where to attach the BPF program", NULL, 0, 0),
         OPT_STRING('2', "iface2", &iface2, "2nd interface where to attach the BPF program", NULL, 0, 0),
-        OPT_STRING('3', "iface3", &iface2, "3rd interface where to attach the BPF program", NULL, 0, 0),
-        OPT_STRING('4', "iface4", &iface2, "4th interface where to attach the BPF program", NULL, 0, 0),
+        OPT_STRING('3', "iface3", &iface3, "3rd interface where to attach the BPF program", NULL, 0, 0),
+        OPT_STRING('4', "iface4", &iface4, "4th interface where to attach the BPF program", NULL, 0, 0),
+        OPT_STRING(0, "xdp-mode", &xdp_mode, "XDP mode: drv (default), skb or hw, falls back to the slower ones", NULL, 0, 0),
+        OPT_FLOAT('I', "interval", &interval, "Statistics interval in seconds (default 1, at least 0.01)", NULL, 0, 0),
+        OPT_INTEGER(0, "metrics-port", &metrics_port, "Serve Prometheus metrics on 127.0.0.1:<port>/metrics", NULL, 0, 0),
+        OPT_INTEGER(0, "metrics-top", &metrics_top, "Number of addresses in the per-IP metrics (default 10)", NULL, 0, 0),
+        OPT_STRING(0, "pin-dir", &pin_dir, "bpffs directory where maps and links are pinned, to keep them across restarts", NULL, 0, 0),
+        OPT_GROUP("Flow cache options"),
+        OPT_BOOLEAN('f', "flow-cache", &flow_cache, "Cache the per-flow verdicts in a per-CPU LRU map", NULL, 0, 0),
+        OPT_INTEGER('t', "flow-cache-ttl", &flow_cache_ttl, "Lifetime of a cached verdict in ms (default 1000)", NULL, 0, 0),
+        OPT_INTEGER(0, "flow-cache-size", &flow_cache_size, "Number of flows in the per-CPU cache", NULL, 0, 0),
         OPT_END(),
     };
 
@@ -153,6 +252,7 @@ int main(int argc, const char **argv) {
     "\nThe '-1/2/3/4' argument is used to specify the interface where to attach the program");
     argc = argparse_parse(&argparse, argc, argv);
 
+    default_config = config_file == NULL;
     if (config_file == NULL) {
         log_warn("Use default configuration file: %s", "config.yaml");
         config_file = "config.yaml";
@@ -164,7 +264,14 @@ int main(int argc, const char **argv) {
         exit(1);
     }
 
-    get_iface_ifindex(iface1, iface2, iface3, iface4);
+    if (xdp_attach_parse_mode(xdp_mode, &xdp_ifaces.mode) || event_loop_check_interval(interval))
+        exit(1);
+
+    if (xdp_attach_add_iface(&xdp_ifaces, iface1, "veth1") < 0 ||
+        xdp_attach_add_iface(&xdp_ifaces, iface2, "veth2") < 0 ||
+        xdp_attach_add_iface(&xdp_ifaces, iface3, "veth3") < 0 ||
+        xdp_attach_add_iface(&xdp_ifaces, iface4, "veth4") < 0)
+        exit(1);
 
     /* Open BPF application */
     skel = hhd_v1_bpf__open();
@@ -174,10 +281,38 @@ int main(int argc, const char **argv) {
     }
 
     /* Add iface configuration to hhd_v1.cfg */
-    skel->rodata->hhdv1_cfg.ifindex_if1 = ifindex_iface1;
-    skel->rodata->hhdv1_cfg.ifindex_if2 = ifindex_iface2;
-    skel->rodata->hhdv1_cfg.ifindex_if3 = ifindex_iface3;
-    skel->rodata->hhdv1_cfg.ifindex_if4 = ifindex_iface4;
+    skel->rodata->hhdv1_cfg.ifindex_if1 = xdp_ifaces.ifaces[0].ifindex;
+    skel->rodata->hhdv1_cfg.ifindex_if2 = xdp_ifaces.ifaces[1].ifindex;
+    skel->rodata->hhdv1_cfg.ifindex_if3 = xdp_ifaces.ifaces[2].ifindex;
+    skel->rodata->hhdv1_cfg.ifindex_if4 = xdp_ifaces.ifaces[3].ifindex;
+
+    /* Configure the flow verdict cache */
+    skel->rodata->flow_cache_cfg.enabled = flow_cache;
+    skel->rodata->flow_cache_cfg.ttl_ns = (__u64)flow_cache_ttl * 1000000ULL;
+    if (!flow_cache) {
+        bpf_map__set_max_entries(skel->maps.flow_cache, 1);
+    } else if (flow_cache_size > 0) {
+        bpf_map__set_max_entries(skel->maps.flow_cache, flow_cache_size);
+    }
+
+    /* A compiled snapshot can hold far more addresses than the default map sizes */
+    if (config_snapshot_is(config_file)) {
+        struct bpf_map *const ips_maps[] = {skel->maps.threshold_map, skel->maps.ip_to_port, NULL};
+
+        if (config_snapshot_size_maps(config_file, ips_maps, skel->maps.vlan_policy))
+            exit(1);
+    }
+
+    /* Reuse the maps of the previous run, if any */
+    if (pin_dir != NULL) {
+        /* The cached verdicts are only valid for the rules of this run */
+        static const char *const no_pin[] = {"flow_cache", NULL};
+
+        reused = pin_maps(skel->obj, pin_dir, no_pin);
+        if (reused < 0)
+            exit(1);
+        xdp_ifaces.pin_dir = pin_dir;
+    }
 
     /* Set program type to XDP */
     bpf_program__set_type(skel->progs.xdp_hhdv1, BPF_PROG_TYPE_XDP);
@@ -203,16 +338,23 @@ int main(int argc, const char **argv) {
     }
 
     /* Before attaching the program, we can load the map configuration */
-    err = load_maps_config(config_file, skel);
-    if (err) {
-        log_fatal("Error while loading map configuration");
-        goto cleanup;
+    if (reused > 0 && default_config) {
+        log_info("Warm restart, keeping the configuration of the pinned maps");
+    } else {
+        err = load_maps_config(config_file, skel, reused > 0);
+        if (err) {
+            log_fatal("Error while loading map configuration");
+            goto cleanup;
+        }
     }
 
-    xdp_flags = 0;
-    xdp_flags |= XDP_FLAGS_DRV_MODE;
+    for (int i = 0; i < xdp_ifaces.count; i++) {
+        err = vlan_check_offload(xdp_ifaces.ifaces[i].name, skel->maps.vlan_policy);
+        if (err)
+            goto cleanup;
+    }
 
-    err = attach_bpf_progs(xdp_flags, skel);
+    err = xdp_attach_all(&xdp_ifaces, bpf_program__fd(skel->progs.xdp_hhdv1));
     if (err) {
         log_fatal("Error while attaching BPF programs");
         goto cleanup;
@@ -220,10 +362,19 @@ int main(int argc, const char **argv) {
 
     log_info("Successfully attached!");
 
-    sleep(10000);
+    err = stats_init(&stats, skel, flow_cache, &metrics);
+    if (!err)
+        err = event_loop_init(&loop, interval, print_stats, &stats);
+    if (!err)
+        err = metrics_init(&metrics, &loop, metrics_port, metrics_top);
+    if (!err)
+        err = event_loop_run(&loop);
 
 cleanup:
-    cleanup_ifaces();
+    metrics_destroy(&metrics);
+    event_loop_destroy(&loop);
+    stats_destroy(&stats);
+    xdp_attach_detach_all(&xdp_ifaces);
     hhd_v1_bpf__destroy(skel);
     log_info("Program stopped correctly");
     return -err;
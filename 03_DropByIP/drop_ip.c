@@ -22,18 +22,27 @@
 
 #include "log.h"
 #include "drop_ip.h"
+#include "flow_cache_user.h"
+#include "conntrack_user.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "prog_stats.h"
+#include "config_snapshot.h"
+#include "feed_ingest.h"
+#include "ebpf/map_values.h"
 
 #define ONE_MILLION 1000000
 #define ONE_BILLION 1000000000
 
-struct datarec {
-    __u64 rx_packets;
-    __u64 rx_bytes;
-};
-
 static const char *const usages[] = {
     "drop_ip [options] [[--] args]",
     "drop_ip [options]",
+    "drop_ip compile -c <config.yaml> -o <snapshot>",
+    NULL,
+};
+
+static const char *const compile_usages[] = {
+    "drop_ip compile -c <config.yaml> -o <snapshot>",
     NULL,
 };
 
@@ -41,142 +50,273 @@ static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va
     return vfprintf(stderr, format, args);
 }
 
-int load_maps_config(const char *config_file, struct drop_ip_bpf *skel) {
-    struct ips *ips;
-    cyaml_err_t err;
-    int ret = EXIT_SUCCESS;
+/*
+ * Load the configuration in the maps (config_load.h). When the maps are reused
+ * from a previous run (warm), the counters are kept and the IPs and VLAN rules
+ * that are no longer in the configuration are removed. config_file is either
+ * the YAML file or a snapshot compiled from it.
+ */
+int load_maps_config(const char *config_file, struct drop_ip_bpf *skel, bool warm) {
+    struct config_maps maps = {
+        .stats_map = skel->maps.xdp_stats_map,
+        .vlan_policy = skel->maps.vlan_policy,
+    };
+
+    if (config_load(config_file, &config_drop_schema, &maps, warm))
+        return EXIT_FAILURE;
 
-    /* Load input file. */
-	err = cyaml_load_file(config_file, &config, &ips_schema, (void **) &ips, NULL);
-	if (err != CYAML_OK) {
-		fprintf(stderr, "ERROR: %s\n", cyaml_strerror(err));
-		return EXIT_FAILURE;
-	}
+    /* Rules changed, invalidate the cached verdicts */
+    flow_cache_bump_gen(&skel->bss->flow_cache_gen);
 
-    log_info("Loaded %d IPs", ips->ips_count);
+    return EXIT_SUCCESS;
+}
 
-    // Get file descriptor of the map
-    int xdp_stats_map_fd = bpf_map__fd(skel->maps.xdp_stats_map);
+struct stats_ctx {
+    struct drop_ip_bpf *skel;
+    int flow_cache;
+    int conntrack;
+    bool feed;
+    __u64 prev[FLOW_CACHE_STAT_MAX];
+    struct conntrack_stats ct;
+    __u64 prev_rates[2];
+    struct metrics *metrics;
+    struct prog_stats progs;
+    struct vlan_stats_prev vlans;
+    /* xdp_stats_map, read with one batch lookup per tick */
+    __u32 max_ips;
+    __u32 *keys;
+    struct datarec *values;
+    struct metrics_ip_entry *entries;
+};
 
-    // Check if the file descriptor is valid
-    if (xdp_stats_map_fd < 0) {
-        log_error("Failed to get file descriptor of BPF map: %s", strerror(errno));
-        ret = EXIT_FAILURE;
-        goto cleanup_yaml;
+static int stats_init(struct stats_ctx *stats, struct drop_ip_bpf *skel, int flow_cache, struct metrics *metrics) {
+    stats->skel = skel;
+    stats->flow_cache = flow_cache;
+    stats->conntrack = skel->rodata->conntrack_cfg.enabled;
+    stats->feed = skel->rodata->drop_ip_cfg.feed;
+    stats->metrics = metrics;
+    prog_stats_init(&stats->progs, skel->obj);
+    stats->max_ips = bpf_map__max_entries(skel->maps.xdp_stats_map);
+    stats->keys = calloc(stats->max_ips, sizeof(*stats->keys));
+    stats->values = calloc(stats->max_ips, sizeof(*stats->values));
+    stats->entries = calloc(stats->max_ips, sizeof(*stats->entries));
+
+    if (!stats->keys || !stats->values || !stats->entries) {
+        log_error("Failed to allocate the statistics buffers");
+        return -1;
     }
 
-    /* Load the IPs in the BPF map */
-    for (int i = 0; i < ips->ips_count; i++) {
-        log_info("Loading IP %s", ips->ips[i].ip);
+    /* The pinned table of a previous run starts with its flows and counters */
+    if (stats->conntrack && conntrack_read_stats(bpf_map__fd(skel->maps.conntrack_stats),
+                                                 bpf_map__fd(skel->maps.conntrack), &stats->ct)) {
+        log_error("Error while reading the connection tracking statistics");
+        return -1;
+    }
 
-        // Convert the IP to an integer
-        struct in_addr addr;
-        int ret = inet_pton(AF_INET, ips->ips[i].ip, &addr);
-        if (ret != 1) {
-            log_error("Failed to convert IP %s to integer", ips->ips[i].ip);
-            ret = EXIT_FAILURE;
-            goto cleanup_yaml;
+    return 0;
+}
+
+static void stats_destroy(struct stats_ctx *stats) {
+    prog_stats_destroy(&stats->progs);
+    vlan_stats_prev_free(&stats->vlans);
+    free(stats->keys);
+    free(stats->values);
+    free(stats->entries);
+}
+
+/* Rates of the traffic of the listed IPs and of the feed since the previous tick */
+static void print_drop_rates(struct stats_ctx *stats, __u32 count, double elapsed) {
+    __u64 sum[2] = {0};
+
+    for (__u32 i = 0; i < count; i++) {
+        sum[0] += stats->values[i].rx_packets;
+        sum[1] += stats->values[i].rx_bytes;
+    }
+
+    if (stats->feed) {
+        int cpus = libbpf_num_possible_cpus();
+        struct datarec values[cpus];
+        __u32 key = 0;
+
+        if (bpf_map_lookup_elem(bpf_map__fd(stats->skel->maps.feed_stats), &key, values) == 0) {
+            for (int i = 0; i < cpus; i++) {
+                sum[0] += values[i].rx_packets;
+                sum[1] += values[i].rx_bytes;
+            }
         }
+    }
 
-        // Now write the IP to the BPF map
-        struct datarec value = {
-            .rx_bytes = 0,
-            .rx_packets = 0,
-        };
-
-        ret = bpf_map_update_elem(xdp_stats_map_fd, &addr.s_addr, &value, BPF_ANY);
-        if (ret != 0) {
-            log_error("Failed to update BPF map: %s", strerror(errno));
-            ret = EXIT_FAILURE;
-            goto cleanup_yaml;  
-        }        
+    if (sum[0] > stats->prev_rates[0]) {
+        double rate = (sum[0] - stats->prev_rates[0]) / elapsed;
+
+        log_info("%10.0f pkt/s (%.2f Mpps)", rate, rate / ONE_MILLION);
     }
 
-cleanup_yaml:
-    /* Free the data */
-	cyaml_free(&config, &ips_schema, ips, 0);
+    if (sum[1] > stats->prev_rates[1]) {
+        double rate = (sum[1] - stats->prev_rates[1]) / elapsed;
 
-    return ret;
+        log_info("%10.0f byte/s (%.2f Gbps)", rate, rate * 8 / ONE_BILLION);
+    }
+
+    stats->prev_rates[0] = sum[0];
+    stats->prev_rates[1] = sum[1];
 }
 
-void poll_stats(struct drop_ip_bpf *skel) {
-    /* TODO 1: get the map file descriptor for the skeleton */
-    int map_fd = 0;
-    __u64 prev[2] = {0};
-    map_fd = bpf_map__fd(skel->maps.xdp_stats_map);
-    if (map_fd < 0) {
-        log_fatal("Error while retrieving the map file descriptor");
-        exit(1);
+/* Per-IP counters (top --metrics-top) and flow cache counters */
+static void render_metrics(struct stats_ctx *stats, __u32 count) {
+    struct metrics *m = stats->metrics;
+
+    metrics_begin(m);
+
+    for (__u32 i = 0; i < count; i++) {
+        stats->entries[i].addr = stats->keys[i];
+        stats->entries[i].packets = stats->values[i].rx_packets;
+        stats->entries[i].bytes = stats->values[i].rx_bytes;
     }
+    metrics_ip_top(m, "drop_ip_dropped", "the traffic dropped per source", stats->entries, count, true);
 
-    while (true) {
-        struct datarec value;
-        int key = 0;
-        int err = 0;
-        float bit_rate, rate;
-        __u64 sum[2] = {0};
-        // Get the first key
-        err = bpf_map_get_next_key(map_fd, NULL, &key);
-        if (err) {
-            log_fatal("Error while retrieving the first key");
-            exit(1);
-        }
+    if (stats->flow_cache)
+        flow_cache_render_metrics(m, stats->prev);
+    if (stats->conntrack)
+        conntrack_render_metrics(m, &stats->ct);
+    prog_stats_render_metrics(m, &stats->progs);
 
-        do {
-            err = bpf_map_lookup_elem(map_fd, &key, &value);
-            if (err) {
-                log_fatal("Error while retrieving the value from the map");
-                exit(1);
-            }
+    metrics_commit(m);
+}
 
-            if (value.rx_packets != 0 || value.rx_bytes != 0) {
-                // log_info("Key: %d, Number of packets received: %llu", key, value.rx_packets);
-                // log_info("Key: %d, Number of bytes received: %llu", key, value.rx_bytes);
-                sum[0] += value.rx_packets;
-                sum[1] += value.rx_bytes;
-            }
+/* Rates, ns/run, flow cache and per-VLAN counters, printed every --interval */
+static void print_stats(void *ctx, double elapsed) {
+    struct stats_ctx *stats = ctx;
+    __u32 count = stats->max_ips;
 
-            // Save the current key
-            int old_key = key;
-            // Attempt to get the next key
-            err = bpf_map_get_next_key(map_fd, &old_key, &key);
-            // If there are no more keys, break from the loop
-            if (err) {
-                break;
-            }
-        } while (true);
+    if (metrics_map_dump(bpf_map__fd(stats->skel->maps.xdp_stats_map), sizeof(*stats->keys),
+                         sizeof(*stats->values), stats->keys, stats->values, &count)) {
+        log_error("Error while reading the per-IP counters");
+        return;
+    }
 
-        if (sum[0] > prev[0]) {
-            rate = (sum[0] - prev[0]) / ONE_MILLION;
-            log_info("%10llu pkt/s (%.2f Mpps)", (sum[0] - prev[0]) / 1, rate);
-        }
+    print_drop_rates(stats, count, elapsed);
+    prog_stats_print(&stats->progs, elapsed);
+    if (stats->flow_cache)
+        flow_cache_print_stats(bpf_map__fd(stats->skel->maps.flow_cache_stats), stats->prev);
+    if (stats->conntrack)
+        conntrack_print_stats(stats->skel->maps.conntrack, bpf_map__fd(stats->skel->maps.conntrack_stats), &stats->ct,
+                              elapsed);
+    vlan_print_stats(&stats->vlans, bpf_map__fd(stats->skel->maps.vlan_stats), elapsed);
+
+    if (metrics_enabled(stats->metrics))
+        render_metrics(stats, count);
+}
+
+/* "compile" subcommand: turn the YAML configuration into a snapshot for -c */
+static int compile_config(int argc, const char **argv) {
+    const char *config_file = "config.yaml";
+    const char *output = NULL;
+    struct config_snapshot_entry *entries;
+    struct config_rules *ips;
+    int ret = EXIT_FAILURE;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_STRING('c', "config", &config_file, "YAML configuration to compile (default config.yaml)", NULL, 0, 0),
+        OPT_STRING('o', "output", &output, "Snapshot to write", NULL, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, compile_usages, 0);
+    argparse_describe(&argparse, "\nCompile the YAML configuration into a binary snapshot that loads without parsing", "");
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (output == NULL) {
+        argparse_usage(&argparse);
+        return EXIT_FAILURE;
+    }
+
+    if (config_parse(config_file, &config_drop_schema, &ips))
+        return EXIT_FAILURE;
+
+    entries = calloc(ips->ips_count, sizeof(*entries));
+    if (ips->ips_count && !entries) {
+        log_fatal("Failed to allocate the snapshot entries");
+        goto cleanup;
+    }
+
+    for (__u64 i = 0; i < ips->ips_count; i++) {
+        struct in_addr addr;
 
-        if (sum[1] > prev[1]) {
-            bit_rate = (((sum[1] - prev[1]) / 1.0) * 8) / ONE_BILLION;
-            log_info("%10llu byte/s (%.2f Gbps)", (sum[1] - prev[1]) / 1,
-                     bit_rate);
+        if (inet_pton(AF_INET, ips->ips[i].ip, &addr) != 1) {
+            log_fatal("Failed to convert IP %s to integer", ips->ips[i].ip);
+            goto cleanup;
         }
 
-        prev[0] = sum[0];
-        prev[1] = sum[1];
+        entries[i].addr = addr.s_addr;
+    }
 
-        sleep(1); // Sleep for a bit before starting over
+    if (config_snapshot_write(output, entries, ips->ips_count, ips->vlans, ips->vlans_count) == 0) {
+        log_info("Compiled %llu IPs and %llu VLAN rules from %s into %s", ips->ips_count, ips->vlans_count,
+                 config_file, output);
+        ret = EXIT_SUCCESS;
     }
+
+cleanup:
+    free(entries);
+    config_free(ips, &config_drop_schema);
+    return ret;
 }
 
 int main(int argc, const char **argv) {
     struct drop_ip_bpf *skel = NULL;
+    struct event_loop loop = {0};
+    struct metrics metrics = {0};
+    struct stats_ctx stats = {0};
+    float interval = 1;
+    int metrics_port = 0;
+    int metrics_top = METRICS_DEFAULT_TOP;
     int err;
     const char *config_file = NULL;
+    int flow_cache = 0;
+    int flow_cache_ttl = FLOW_CACHE_DEFAULT_TTL_MS;
+    int flow_cache_size = 0;
+    int conntrack = 0;
+    int conntrack_size = 0;
+    int conntrack_timeout = CONNTRACK_DEFAULT_ESTABLISHED_TIMEOUT_S;
     const char *iface1 = NULL;
     const char *iface2 = NULL;
+    const char *xdp_mode = NULL;
+    const char *pin_dir = NULL;
+    const char *feed_file = NULL;
+    int feed_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct feed feed = {0};
+    struct feed_stats feed_stats;
+    bool default_config;
+    int reused = 0;
+
+    if (argc > 1 && strcmp(argv[1], "compile") == 0)
+        return compile_config(argc - 1, argv + 1);
 
     struct argparse_option options[] = {
         OPT_HELP(),
         OPT_GROUP("Basic options"),
-        OPT_STRING('c', "config", &config_file, "Path to the YAML configuration file", NULL, 0, 0),
+        OPT_STRING('c', "config", &config_file, "Path to the YAML configuration file or to its compiled snapshot", NULL, 0, 0),
         OPT_STRING('1', "iface1", &iface1, "1st interface where to attach the BPF program", NULL, 0, 0),
         OPT_STRING('2', "iface2", &iface2, "2nd interface where to attach the BPF program", NULL, 0, 0),
+        OPT_STRING(0, "xdp-mode", &xdp_mode, "XDP mode: drv (default), skb or hw, falls back to the slower ones", NULL, 0, 0),
+        OPT_FLOAT('I', "interval", &interval, "Statistics interval in seconds (default 1, at least 0.01)", NULL, 0, 0),
+        OPT_INTEGER(0, "metrics-port", &metrics_port, "Serve Prometheus metrics on 127.0.0.1:<port>/metrics", NULL, 0, 0),
+        OPT_INTEGER(0, "metrics-top", &metrics_top, "Number of addresses in the per-IP metrics (default 10)", NULL, 0, 0),
+        OPT_STRING(0, "pin-dir", &pin_dir, "bpffs directory where maps and links are pinned, to keep them across restarts", NULL, 0, 0),
+        OPT_GROUP("Blocklist feed options"),
+        OPT_STRING(0, "feed", &feed_file, "Plain-text blocklist, one IPv4 address or CIDR prefix per line", NULL, 0, 0),
+        OPT_INTEGER(0, "feed-threads", &feed_threads, "Threads parsing the feed, and as many inserting it (default the online CPUs)", NULL, 0, 0),
+        OPT_GROUP("Flow cache options"),
+        OPT_BOOLEAN('f', "flow-cache", &flow_cache, "Cache the per-flow verdicts in a per-CPU LRU map", NULL, 0, 0),
+        OPT_INTEGER('t', "flow-cache-ttl", &flow_cache_ttl, "Lifetime of a cached verdict in ms (default 1000)", NULL, 0, 0),
+        OPT_INTEGER(0, "flow-cache-size", &flow_cache_size, "Number of flows in the per-CPU cache", NULL, 0, 0),
+        OPT_GROUP("Connection tracking options"),
+        OPT_BOOLEAN(0, "conntrack", &conntrack, "Forward the traffic of iface2 and let the replies skip the lists", NULL, 0, 0),
+        OPT_INTEGER(0, "conntrack-size", &conntrack_size, "Number of flows in the connection table", NULL, 0, 0),
+        OPT_INTEGER(0, "conntrack-timeout", &conntrack_timeout, "Idle timeout of the established TCP flows in s (default 3600)", NULL, 0, 0),
         OPT_END(),
     };
 
@@ -186,6 +326,7 @@ int main(int argc, const char **argv) {
     "\nThe '-1/2' argument is used to specify the interface where to attach the program");
     argc = argparse_parse(&argparse, argc, argv);
 
+    default_config = config_file == NULL;
     if (config_file == NULL) {
         log_warn("Use default configuration file: %s", "config.yaml");
         config_file = "config.yaml";
@@ -202,7 +343,12 @@ int main(int argc, const char **argv) {
     /* Set up libbpf errors and debug info callback */
     libbpf_set_print(libbpf_print_fn);
 
-    get_iface_ifindex(iface1, iface2);
+    if (xdp_attach_parse_mode(xdp_mode, &xdp_ifaces.mode) || event_loop_check_interval(interval))
+        exit(1);
+
+    if (xdp_attach_add_iface(&xdp_ifaces, iface1, "veth1") < 0 ||
+        xdp_attach_add_iface(&xdp_ifaces, iface2, "veth2") < 0)
+        exit(1);
 
     /* Open BPF application */
     skel = drop_ip_bpf__open();
@@ -212,8 +358,63 @@ int main(int argc, const char **argv) {
     }
 
     /* Add iface configuration to drop_ip.cfg */
-    skel->rodata->drop_ip_cfg.ifindex_if1 = ifindex_iface1;
-    skel->rodata->drop_ip_cfg.ifindex_if2 = ifindex_iface2;
+    skel->rodata->drop_ip_cfg.ifindex_if1 = xdp_ifaces.ifaces[0].ifindex;
+    skel->rodata->drop_ip_cfg.ifindex_if2 = xdp_ifaces.ifaces[1].ifindex;
+
+    /* Configure the flow verdict cache */
+    skel->rodata->flow_cache_cfg.enabled = flow_cache;
+    skel->rodata->flow_cache_cfg.ttl_ns = (__u64)flow_cache_ttl * 1000000ULL;
+    if (!flow_cache) {
+        bpf_map__set_max_entries(skel->maps.flow_cache, 1);
+    } else if (flow_cache_size > 0) {
+        bpf_map__set_max_entries(skel->maps.flow_cache, flow_cache_size);
+    }
+
+    /* Configure the connection tracking */
+    skel->rodata->conntrack_cfg.enabled = conntrack;
+    conntrack_set_timeouts(skel->rodata->conntrack_cfg.timeout_ns, conntrack_timeout);
+    if (!conntrack) {
+        bpf_map__set_max_entries(skel->maps.conntrack, 1);
+    } else if (conntrack_size > 0) {
+        bpf_map__set_max_entries(skel->maps.conntrack, conntrack_size);
+    }
+
+    /* A compiled snapshot can hold far more addresses than the default map sizes */
+    if (config_snapshot_is(config_file)) {
+        struct bpf_map *const ips_maps[] = {skel->maps.xdp_stats_map, NULL};
+
+        if (config_snapshot_size_maps(config_file, ips_maps, skel->maps.vlan_policy))
+            exit(1);
+    }
+
+    /* The feed maps are not preallocated, size them for every line */
+    if (feed_file != NULL) {
+        if (feed_open(feed_file, &feed))
+            exit(1);
+        skel->rodata->drop_ip_cfg.feed = 1;
+        if (feed.lines > UINT32_MAX) {
+            log_fatal("The feed %s has %llu lines, more than a map can hold", feed_file, feed.lines);
+            exit(1);
+        }
+        if (feed.lines > 0) {
+            bpf_map__set_max_entries(skel->maps.feed_addrs, feed.lines);
+            bpf_map__set_max_entries(skel->maps.feed_prefixes, feed.lines);
+        }
+    }
+
+    /* Reuse the maps of the previous run, if any */
+    if (pin_dir != NULL) {
+        /* The cached verdicts are only valid for the rules of this run, the feed is loaded again */
+        static const char *const no_pin[] = {"flow_cache", "feed_addrs", "feed_prefixes", NULL};
+        /* The flows survive a restart, but a disabled table has a single entry */
+        static const char *const no_pin_conntrack[] = {"flow_cache", "feed_addrs", "feed_prefixes", "conntrack",
+                                                       NULL};
+
+        reused = pin_maps(skel->obj, pin_dir, conntrack ? no_pin : no_pin_conntrack);
+        if (reused < 0)
+            exit(1);
+        xdp_ifaces.pin_dir = pin_dir;
+    }
 
     /* Set program type to XDP */
     bpf_program__set_type(skel->progs.xdp_drop_by_ip, BPF_PROG_TYPE_XDP);
@@ -239,27 +440,62 @@ int main(int argc, const char **argv) {
     }
 
     /* Before attaching the program, we can load the map configuration */
-    // err = load_maps_config(config_file, skel);
-    // if (err) {
-    //     log_fatal("Error while loading map configuration");
-    //     goto cleanup;
-    // }
+    if (reused > 0 && default_config) {
+        log_info("Warm restart, keeping the configuration of the pinned maps");
+    } else {
+        err = load_maps_config(config_file, skel, reused > 0);
+        if (err) {
+            log_fatal("Error while loading map configuration");
+            goto cleanup;
+        }
+    }
 
-    xdp_flags = 0;
-    xdp_flags |= XDP_FLAGS_DRV_MODE;
+    for (int i = 0; i < xdp_ifaces.count; i++) {
+        err = vlan_check_offload(xdp_ifaces.ifaces[i].name, skel->maps.vlan_policy);
+        if (err)
+            goto cleanup;
+    }
 
-    err = attach_bpf_progs(xdp_flags, skel);
+    if (feed_file != NULL) {
+        err = feed_ingest(&feed, feed_threads, skel->maps.feed_addrs, skel->maps.feed_prefixes, &feed_stats);
+        if (err) {
+            log_fatal("Error while loading the feed %s", feed_file);
+            goto cleanup;
+        }
+
+        /* An empty feed can be loaded within the clock resolution */
+        double seconds = feed_stats.seconds > 0 ? feed_stats.seconds : 0;
+
+        log_info("Loaded %llu addresses and %llu prefixes from %s: %llu lines (%llu invalid, %llu duplicates) "
+                 "in %.2f s, %.2f M lines/s, %.0f MB/s", feed_stats.addrs, feed_stats.prefixes, feed_file,
+                 feed_stats.lines, feed_stats.invalid, feed_stats.duplicates, seconds,
+                 seconds ? feed_stats.lines / seconds / ONE_MILLION : 0,
+                 seconds ? feed_stats.bytes / seconds / ONE_MILLION : 0);
+        feed_close(&feed);
+    }
+
+    err = xdp_attach_all(&xdp_ifaces, bpf_program__fd(skel->progs.xdp_drop_by_ip));
     if (err) {
-        log_fatal("Error while attaching BPF programs: %s", strerror(errno));
+        log_fatal("Error while attaching BPF programs");
         goto cleanup;
     }
 
     log_info("Successfully attached!");
-    sleep(1000);
-    // poll_stats(skel);
+
+    err = stats_init(&stats, skel, flow_cache, &metrics);
+    if (!err)
+        err = event_loop_init(&loop, interval, print_stats, &stats);
+    if (!err)
+        err = metrics_init(&metrics, &loop, metrics_port, metrics_top);
+    if (!err)
+        err = event_loop_run(&loop);
 
 cleanup:
-    cleanup_ifaces();
+    metrics_destroy(&metrics);
+    event_loop_destroy(&loop);
+    stats_destroy(&stats);
+    feed_close(&feed);
+    xdp_attach_detach_all(&xdp_ifaces);
     drop_ip_bpf__destroy(skel);
     log_info("Program stopped correctly");
     return -err;
@@ -14,17 +14,19 @@
 #include <stdint.h>
 
 #include "bpf_log.h"
+#include "conntrack.h"
+#include "flow_cache.h"
+#include "parsing_helpers.h"
+#include "vlan.h"
+#include "map_values.h"
 
 const volatile struct {
    int ifindex_if1;
    int ifindex_if2;
+   /* Check the feed maps, filled from a plain-text blocklist (--feed) */
+   int feed;
 } drop_ip_cfg = {};
 
-struct datarec {
-    __u64 rx_packets;
-    __u64 rx_bytes;
-};
-
 struct {
     __uint(type, BPF_MAP_TYPE_HASH);
     __type(key, __u32);
@@ -32,45 +34,42 @@ struct {
     __uint(max_entries, 1024);
 } xdp_stats_map SEC(".maps");
 
-static __always_inline int parse_ethhdr(void *data, void *data_end, __u16 *nh_off, struct ethhdr **ethhdr) {
-   struct ethhdr *eth = (struct ethhdr *)data;
-   int hdr_size = sizeof(*eth);
-
-   /* Byte-count bounds check; check if current pointer + size of header
-	 * is after data_end.
-	 */
-   // eth->h_proto = 14;
-   if ((void *)eth + hdr_size > data_end)
-      return -1;
-
-   *nh_off += hdr_size;
-   *ethhdr = eth;
-
-   return eth->h_proto; /* network-byte-order */
-}
-
-static __always_inline int parse_iphdr(void *data, void *data_end, __u16 *nh_off, struct iphdr **iphdr) {
-   struct iphdr *ip = (struct iphdr *)(data + *nh_off);
-   int hdr_size = sizeof(*ip);
+/*
+ * Blocklist feed: single addresses in feed_addrs, shorter prefixes in
+ * feed_prefixes. They can hold tens of millions of entries, so they are not
+ * preallocated and there is one aggregate counter instead of one per address.
+ */
+struct {
+   __uint(type, BPF_MAP_TYPE_HASH);
+   __type(key, __u32);
+   __type(value, __u8);
+   __uint(max_entries, 1);
+   __uint(map_flags, BPF_F_NO_PREALLOC);
+} feed_addrs SEC(".maps");
 
-   /* Byte-count bounds check; check if current pointer + size of header
-    * is after data_end.
-    */
-   if ((void *)ip + hdr_size > data_end)
-      return -1;
+struct {
+   __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+   __type(key, struct feed_prefix);
+   __type(value, __u8);
+   __uint(max_entries, 1);
+   __uint(map_flags, BPF_F_NO_PREALLOC);
+} feed_prefixes SEC(".maps");
 
-   hdr_size = ip->ihl * 4;
-   if (hdr_size < sizeof(*ip))
-      return -1;
+struct {
+   __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+   __type(key, __u32);
+   __type(value, struct datarec);
+   __uint(max_entries, 1);
+} feed_stats SEC(".maps");
 
-   /* Variable-length IPv4 header, need to use byte-based arithmetic */
-   if ((void *)ip + hdr_size > data_end)
-      return -1;
+static __always_inline struct datarec *feed_match(__u32 saddr) {
+   struct feed_prefix prefix = {.prefixlen = 32, .addr = saddr};
+   __u32 zero = 0;
 
-   *nh_off += hdr_size;
-   *iphdr = ip;
+   if (!bpf_map_lookup_elem(&feed_addrs, &saddr) && !bpf_map_lookup_elem(&feed_prefixes, &prefix))
+      return NULL;
 
-   return ip->protocol;
+   return bpf_map_lookup_elem(&feed_stats, &zero);
 }
 
 SEC("xdp")
@@ -83,10 +82,22 @@ int xdp_drop_by_ip(struct xdp_md *ctx) {
    struct iphdr *ip;
    int eth_type, ip_type;
    int action = XDP_PASS;
+   struct flow_key fkey = {};
+   struct vlan_info vlan;
 
    bpf_log_debug("Packet received from interface %d", ctx->ingress_ifindex);
 
    eth_type = parse_ethhdr(data, data_end, &nf_off, &eth);
+   eth_type = parse_vlan(ctx, data, data_end, &nf_off, eth_type, &vlan);
+
+   switch (vlan_account(&vlan, data_end - data)) {
+      case VLAN_ACTION_DROP:
+         return XDP_DROP;
+      case VLAN_ACTION_PASS:
+         return XDP_PASS;
+      default:
+         break;
+   }
 
    if (eth_type != bpf_htons(ETH_P_IP)) {
       bpf_log_err("Packet is not an IPv4 packet");
@@ -101,10 +112,27 @@ int xdp_drop_by_ip(struct xdp_md *ctx) {
    }
 
    if (ctx->ingress_ifindex == drop_ip_cfg.ifindex_if1) {
+      /* Replies of the connections started from the inside skip the lists */
+      if (conntrack_cfg.enabled && conntrack_inbound(ip, data + nf_off, data_end))
+         goto redirect;
+
+      /* Only the allowed flows are cached, blocked ones must be counted */
+      if (flow_cache_cfg.enabled) {
+         flow_cache_key(ctx, ip, data + nf_off, data_end, &fkey);
+         fkey.vlan_id = vlan.key.outer_vid;
+         struct flow_verdict *fv = flow_cache_lookup(&fkey);
+         if (fv)
+            return flow_cache_apply(fv);
+      }
+
       struct datarec *val = bpf_map_lookup_elem(&xdp_stats_map, &ip->saddr);
+      if (!val && drop_ip_cfg.feed)
+         val = feed_match(ip->saddr);
       if (!val) {
          bpf_log_debug("No threshold set for IP %d", ip->saddr);
          bpf_log_debug("Dropping packet");
+         if (flow_cache_cfg.enabled)
+            flow_cache_insert(&fkey, XDP_REDIRECT, drop_ip_cfg.ifindex_if2);
          goto redirect;
       }
 
@@ -115,6 +143,11 @@ int xdp_drop_by_ip(struct xdp_md *ctx) {
       goto drop;
    } else {
       bpf_log_debug("Packet received from interface %d", ctx->ingress_ifindex);     
+      /* With connection tracking, the inside can start connections */
+      if (conntrack_cfg.enabled) {
+         conntrack_outbound(ip, data + nf_off, data_end);
+         return bpf_redirect(drop_ip_cfg.ifindex_if1, 0);
+      }
       goto drop;
    }
 
@@ -0,0 +1,406 @@
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/in.h>
+#include <bpf/bpf_endian.h>
+
+#include "bpf_log.h"
+#include "parsing_helpers.h"
+#include "syn_proxy.h"
+
+/*
+ * SYN-flood mitigation for the TCP ports of this host in syn_proxy_cfg.
+ *
+ * A SYN is answered right here with a SYN-ACK whose sequence number is a SYN
+ * cookie computed by the kernel, bounced back with XDP_TX: a flood never
+ * reaches the listen queue nor allocates anything. The ACK that completes the
+ * handshake is checked against the cookie and passed to the stack, where a
+ * SYNPROXY rule of iptables/nft opens the connection to the listener on
+ * behalf of the client: the listener itself would reject an ACK whose SYN it
+ * never saw. Packets of the connections the stack already has are found with
+ * a socket lookup and passed, anything else to the protected ports is
+ * dropped.
+ *
+ * The SYN-ACK only carries the MSS option, so the connections go without
+ * window scaling, SACK and timestamps, as with the cookies of the stack.
+ */
+
+/* TCP header and the MSS option of the SYN-ACK */
+#define SYN_PROXY_TCP_LEN (sizeof(struct tcphdr) + 4)
+/* Longest TCP header, doff has 4 bits */
+#define TCP_MAXLEN 60
+#define SYN_PROXY_WINDOW 65535
+#define SYN_PROXY_TTL 64
+
+#define TCPOPT_MSS 2
+#define TCPOLEN_MSS 4
+/* Flag word of the TCP header: data offset and flags */
+#define TCP_FLAG_WORD_SYNACK ((SYN_PROXY_TCP_LEN / 4) << 12 | 0x12)
+
+#define IP_DF 0x4000
+#define IP_MF 0x2000
+#define IP_OFFSET 0x1fff
+
+const volatile struct syn_proxy_cfg syn_proxy_cfg = {};
+
+struct {
+   __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+   __type(key, __u32);
+   __type(value, __u64);
+   __uint(max_entries, SYN_PROXY_STAT_MAX);
+} syn_proxy_stats SEC(".maps");
+
+static __always_inline void syn_proxy_count(__u32 stat) {
+   __u64 *cnt = bpf_map_lookup_elem(&syn_proxy_stats, &stat);
+
+   /* Per-CPU counter, no need for atomics */
+   if (cnt)
+      *cnt += 1;
+}
+
+static __always_inline bool syn_proxy_protected(__be16 port) {
+   __u16 p = bpf_ntohs(port);
+
+   return syn_proxy_cfg.ports[p / 64] & (1ULL << (p % 64));
+}
+
+static __always_inline __u16 csum_fold(__u64 sum) {
+   sum = (sum & 0xffffffff) + (sum >> 32);
+   sum = (sum & 0xffffffff) + (sum >> 32);
+   sum = (sum & 0xffff) + (sum >> 16);
+   sum = (sum & 0xffff) + (sum >> 16);
+   return ~sum;
+}
+
+/* The stack has a socket for the connection, other than the listener */
+static __always_inline bool syn_proxy_has_socket(struct xdp_md *ctx, struct bpf_sock_tuple *tuple, __u32 size) {
+   struct bpf_sock *sk;
+   bool connected;
+
+   sk = bpf_skc_lookup_tcp(ctx, tuple, size, BPF_F_CURRENT_NETNS, 0);
+   if (!sk)
+      return false;
+
+   connected = sk->state != BPF_TCP_LISTEN;
+   bpf_sk_release(sk);
+   return connected;
+}
+
+static __always_inline void swap_eth(struct ethhdr *eth) {
+   __u8 tmp[ETH_ALEN];
+
+   __builtin_memcpy(tmp, eth->h_source, ETH_ALEN);
+   __builtin_memcpy(eth->h_source, eth->h_dest, ETH_ALEN);
+   __builtin_memcpy(eth->h_dest, tmp, ETH_ALEN);
+}
+
+/*
+ * Turn the SYN into the SYN-ACK, checksum excluded. The cookie is in the low
+ * 32 bits, the MSS it encodes in the high ones.
+ */
+static __always_inline void syn_proxy_write_synack(struct tcphdr *tcp, __s64 cookie) {
+   __u8 *opt = (void *)(tcp + 1);
+   __be16 port = tcp->source;
+
+   tcp->source = tcp->dest;
+   tcp->dest = port;
+   tcp->ack_seq = bpf_htonl(bpf_ntohl(tcp->seq) + 1);
+   tcp->seq = bpf_htonl((__u32)cookie);
+   ((__be16 *)tcp)[6] = bpf_htons(TCP_FLAG_WORD_SYNACK);
+   tcp->window = bpf_htons(SYN_PROXY_WINDOW);
+   tcp->check = 0;
+   tcp->urg_ptr = 0;
+
+   opt[0] = TCPOPT_MSS;
+   opt[1] = TCPOLEN_MSS;
+   *(__be16 *)(opt + 2) = bpf_htons(cookie >> 32);
+}
+
+/*
+ * Resize the packet to l4_len bytes after l4_off. Trimming or growing the
+ * tail leaves the headers in place.
+ */
+static __always_inline int syn_proxy_resize(struct xdp_md *ctx, __u16 l4_off, int l4_len) {
+   int len = (long)ctx->data_end - (long)ctx->data;
+
+   return bpf_xdp_adjust_tail(ctx, (int)(l4_off + l4_len) - len);
+}
+
+/*
+ * The cookie helpers take the TCP header length from the packet, and the
+ * verifier checks it against the range proven for the header: with a
+ * variable length that is its maximum, 60 bytes. So, as in the xdp_synproxy
+ * selftest of the kernel, the frame is first resized to a full-length TCP
+ * header, whose range is proven at constant offsets. The payload of a SYN is
+ * not needed, and the reply trims the frame again.
+ */
+static __always_inline __s64 syn_proxy_cookie_ipv4(struct xdp_md *ctx, __u16 l3_off) {
+   __u16 l4_off = l3_off + sizeof(struct iphdr);
+   void *data, *data_end;
+   struct iphdr *ip;
+   struct tcphdr *tcp;
+   __u32 th_len;
+
+   if (syn_proxy_resize(ctx, l4_off, TCP_MAXLEN))
+      return -1;
+
+   data = (void *)(long)ctx->data;
+   data_end = (void *)(long)ctx->data_end;
+   ip = data + l3_off;
+   tcp = data + l4_off;
+   if ((void *)(ip + 1) > data_end || (void *)tcp + TCP_MAXLEN > data_end)
+      return -1;
+
+   th_len = tcp->doff * 4;
+   if (th_len < sizeof(*tcp))
+      return -1;
+
+   return bpf_tcp_raw_gen_syncookie_ipv4(ip, tcp, th_len);
+}
+
+static __always_inline __s64 syn_proxy_cookie_ipv6(struct xdp_md *ctx, __u16 l3_off) {
+   __u16 l4_off = l3_off + sizeof(struct ipv6hdr);
+   void *data, *data_end;
+   struct ipv6hdr *ip6;
+   struct tcphdr *tcp;
+   __u32 th_len;
+
+   if (syn_proxy_resize(ctx, l4_off, TCP_MAXLEN))
+      return -1;
+
+   data = (void *)(long)ctx->data;
+   data_end = (void *)(long)ctx->data_end;
+   ip6 = data + l3_off;
+   tcp = data + l4_off;
+   if ((void *)(ip6 + 1) > data_end || (void *)tcp + TCP_MAXLEN > data_end)
+      return -1;
+
+   th_len = tcp->doff * 4;
+   if (th_len < sizeof(*tcp))
+      return -1;
+
+   return bpf_tcp_raw_gen_syncookie_ipv6(ip6, tcp, th_len);
+}
+
+static __always_inline int syn_proxy_reply_ipv4(struct xdp_md *ctx, __u16 l3_off, __s64 cookie) {
+   __u16 l4_off = l3_off + sizeof(struct iphdr);
+   void *data, *data_end;
+   struct ethhdr *eth;
+   struct iphdr *ip;
+   struct tcphdr *tcp;
+   __be32 addr;
+   __u64 sum;
+
+   if (syn_proxy_resize(ctx, l4_off, SYN_PROXY_TCP_LEN))
+      return XDP_DROP;
+
+   data = (void *)(long)ctx->data;
+   data_end = (void *)(long)ctx->data_end;
+   eth = data;
+   ip = data + l3_off;
+   tcp = data + l4_off;
+   if ((void *)(eth + 1) > data_end || (void *)(ip + 1) > data_end || (void *)tcp + SYN_PROXY_TCP_LEN > data_end)
+      return XDP_DROP;
+
+   swap_eth(eth);
+
+   addr = ip->saddr;
+   ip->saddr = ip->daddr;
+   ip->daddr = addr;
+   ip->tos = 0;
+   ip->tot_len = bpf_htons(sizeof(*ip) + SYN_PROXY_TCP_LEN);
+   ip->id = 0;
+   ip->frag_off = bpf_htons(IP_DF);
+   ip->ttl = SYN_PROXY_TTL;
+   ip->check = 0;
+   ip->check = csum_fold((__u32)bpf_csum_diff(NULL, 0, (__be32 *)ip, sizeof(*ip), 0));
+
+   syn_proxy_write_synack(tcp, cookie);
+   sum = (__u64)ip->saddr + ip->daddr + bpf_htons(IPPROTO_TCP) + bpf_htons(SYN_PROXY_TCP_LEN);
+   sum += (__u32)bpf_csum_diff(NULL, 0, (__be32 *)tcp, SYN_PROXY_TCP_LEN, 0);
+   tcp->check = csum_fold(sum);
+
+   syn_proxy_count(SYN_PROXY_COOKIE_SENT);
+   return XDP_TX;
+}
+
+static __always_inline int syn_proxy_reply_ipv6(struct xdp_md *ctx, __u16 l3_off, __s64 cookie) {
+   __u16 l4_off = l3_off + sizeof(struct ipv6hdr);
+   void *data, *data_end;
+   struct ethhdr *eth;
+   struct ipv6hdr *ip6;
+   struct tcphdr *tcp;
+   struct in6_addr addr;
+   __u64 sum;
+
+   if (syn_proxy_resize(ctx, l4_off, SYN_PROXY_TCP_LEN))
+      return XDP_DROP;
+
+   data = (void *)(long)ctx->data;
+   data_end = (void *)(long)ctx->data_end;
+   eth = data;
+   ip6 = data + l3_off;
+   tcp = data + l4_off;
+   if ((void *)(eth + 1) > data_end || (void *)(ip6 + 1) > data_end || (void *)tcp + SYN_PROXY_TCP_LEN > data_end)
+      return XDP_DROP;
+
+   swap_eth(eth);
+
+   addr = ip6->saddr;
+   ip6->saddr = ip6->daddr;
+   ip6->daddr = addr;
+   /* Version 6, no traffic class nor flow label */
+   *(__be32 *)ip6 = bpf_htonl(0x60000000);
+   ip6->payload_len = bpf_htons(SYN_PROXY_TCP_LEN);
+   ip6->hop_limit = SYN_PROXY_TTL;
+
+   syn_proxy_write_synack(tcp, cookie);
+   sum = (__u64)bpf_htonl(SYN_PROXY_TCP_LEN) + bpf_htonl(IPPROTO_TCP);
+   sum += (__u32)bpf_csum_diff(NULL, 0, (__be32 *)&ip6->saddr, 2 * sizeof(addr), 0);
+   sum += (__u32)bpf_csum_diff(NULL, 0, (__be32 *)tcp, SYN_PROXY_TCP_LEN, 0);
+   tcp->check = csum_fold(sum);
+
+   syn_proxy_count(SYN_PROXY_COOKIE_SENT);
+   return XDP_TX;
+}
+
+/*
+ * Verdict for a packet other than a SYN: -1 when it is an ACK without a
+ * socket, whose cookie is up to the caller.
+ */
+static __always_inline int syn_proxy_verdict(struct tcphdr *tcp, bool has_socket) {
+   if (has_socket) {
+      syn_proxy_count(SYN_PROXY_ESTABLISHED);
+      return XDP_PASS;
+   }
+
+   if (!tcp->ack || tcp->syn || tcp->rst) {
+      syn_proxy_count(SYN_PROXY_DROP);
+      return XDP_DROP;
+   }
+
+   return -1;
+}
+
+static __always_inline int syn_proxy_cookie_verdict(struct tcphdr *tcp, int err) {
+   if (!err) {
+      syn_proxy_count(SYN_PROXY_COOKIE_VALID);
+      return XDP_PASS;
+   }
+
+   bpf_log_debug("Invalid cookie in the ACK to port %d\n", bpf_ntohs(tcp->dest));
+   syn_proxy_count(SYN_PROXY_COOKIE_FAILED);
+   return XDP_DROP;
+}
+
+static __always_inline int syn_proxy_ipv4(struct xdp_md *ctx, __u16 l3_off) {
+   void *data = (void *)(long)ctx->data;
+   void *data_end = (void *)(long)ctx->data_end;
+   struct bpf_sock_tuple tuple = {};
+   struct iphdr *ip = data + l3_off;
+   struct tcphdr *tcp;
+   __s64 cookie;
+   int action;
+
+   if ((void *)(ip + 1) > data_end || ip->protocol != IPPROTO_TCP || ip->ihl < 5)
+      return XDP_PASS;
+
+   tcp = (void *)ip + ip->ihl * 4;
+   if ((void *)(tcp + 1) > data_end || !syn_proxy_protected(tcp->dest))
+      return XDP_PASS;
+
+   if (tcp->syn && !tcp->ack) {
+      /* Answered from a plain header only */
+      if (ip->ihl != 5 || (ip->frag_off & bpf_htons(IP_MF | IP_OFFSET))) {
+         syn_proxy_count(SYN_PROXY_DROP);
+         return XDP_DROP;
+      }
+
+      cookie = syn_proxy_cookie_ipv4(ctx, l3_off);
+      if (cookie < 0) {
+         syn_proxy_count(SYN_PROXY_DROP);
+         return XDP_DROP;
+      }
+
+      return syn_proxy_reply_ipv4(ctx, l3_off, cookie);
+   }
+
+   tuple.ipv4.saddr = ip->saddr;
+   tuple.ipv4.daddr = ip->daddr;
+   tuple.ipv4.sport = tcp->source;
+   tuple.ipv4.dport = tcp->dest;
+   action = syn_proxy_verdict(tcp, syn_proxy_has_socket(ctx, &tuple, sizeof(tuple.ipv4)));
+   if (action >= 0)
+      return action;
+
+   return syn_proxy_cookie_verdict(tcp, bpf_tcp_raw_check_syncookie_ipv4(ip, tcp));
+}
+
+/* Extension headers are left to the stack, a SYN hidden behind them meets its own cookies */
+static __always_inline int syn_proxy_ipv6(struct xdp_md *ctx, __u16 l3_off) {
+   void *data = (void *)(long)ctx->data;
+   void *data_end = (void *)(long)ctx->data_end;
+   struct bpf_sock_tuple tuple = {};
+   struct ipv6hdr *ip6 = data + l3_off;
+   struct tcphdr *tcp;
+   __s64 cookie;
+   int action;
+
+   if ((void *)(ip6 + 1) > data_end || ip6->nexthdr != IPPROTO_TCP)
+      return XDP_PASS;
+
+   tcp = (void *)(ip6 + 1);
+   if ((void *)(tcp + 1) > data_end || !syn_proxy_protected(tcp->dest))
+      return XDP_PASS;
+
+   if (tcp->syn && !tcp->ack) {
+      cookie = syn_proxy_cookie_ipv6(ctx, l3_off);
+      if (cookie < 0) {
+         syn_proxy_count(SYN_PROXY_DROP);
+         return XDP_DROP;
+      }
+
+      return syn_proxy_reply_ipv6(ctx, l3_off, cookie);
+   }
+
+   __builtin_memcpy(tuple.ipv6.saddr, &ip6->saddr, sizeof(tuple.ipv6.saddr));
+   __builtin_memcpy(tuple.ipv6.daddr, &ip6->daddr, sizeof(tuple.ipv6.daddr));
+   tuple.ipv6.sport = tcp->source;
+   tuple.ipv6.dport = tcp->dest;
+   action = syn_proxy_verdict(tcp, syn_proxy_has_socket(ctx, &tuple, sizeof(tuple.ipv6)));
+   if (action >= 0)
+      return action;
+
+   return syn_proxy_cookie_verdict(tcp, bpf_tcp_raw_check_syncookie_ipv6(ip6, tcp));
+}
+
+SEC("xdp")
+int xdp_syn_proxy(struct xdp_md *ctx) {
+   void *data = (void *)(long)ctx->data;
+   void *data_end = (void *)(long)ctx->data_end;
+   __u16 vids[VLAN_MAX_DEPTH];
+   struct ethhdr *eth;
+   __u16 nh_off = 0;
+   __u8 depth;
+   int proto;
+
+   proto = parse_ethhdr(data, data_end, &nh_off, &eth);
+   if (proto < 0)
+      return XDP_PASS;
+
+   proto = parse_vlanhdrs(data, data_end, &nh_off, proto, vids, &depth);
+
+   if (proto == bpf_htons(ETH_P_IP))
+      return syn_proxy_ipv4(ctx, nh_off);
+   if (proto == bpf_htons(ETH_P_IPV6))
+      return syn_proxy_ipv6(ctx, nh_off);
+
+   return XDP_PASS;
+}
+
+char LICENSE[] SEC("license") = "Dual BSD/GPL";
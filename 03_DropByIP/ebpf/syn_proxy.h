@@ -0,0 +1,25 @@
+#pragma once
+
+/* Shared between the SYN proxy program and its loader */
+#include <linux/types.h>
+
+#define SYN_PROXY_PORT_WORDS (65536 / 64)
+
+enum syn_proxy_stat {
+   /* SYN-ACKs sent with a cookie */
+   SYN_PROXY_COOKIE_SENT = 0,
+   /* ACKs with a valid cookie, passed to the SYNPROXY rule of the stack */
+   SYN_PROXY_COOKIE_VALID,
+   /* ACKs without a socket nor a valid cookie */
+   SYN_PROXY_COOKIE_FAILED,
+   /* Packets of the connections the stack already has */
+   SYN_PROXY_ESTABLISHED,
+   /* Other packets to the protected ports without a socket, dropped */
+   SYN_PROXY_DROP,
+   SYN_PROXY_STAT_MAX,
+};
+
+struct syn_proxy_cfg {
+   /* Bitmap of the protected TCP ports, host byte order */
+   __u64 ports[SYN_PROXY_PORT_WORDS];
+};
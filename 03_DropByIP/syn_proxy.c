@@ -0,0 +1,301 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <linux/if_link.h>
+
+#include <argparse.h>
+#include <net/if.h>
+
+#include "log.h"
+#include "xdp_attach.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "prog_stats.h"
+
+#include "ebpf/syn_proxy.h"
+
+// Include skeleton file
+#include "syn_proxy.skel.h"
+
+#define TCP_LOOSE_SYSCTL "/proc/sys/net/netfilter/nf_conntrack_tcp_loose"
+#define NFT_SYNPROXY_MODULE "/sys/module/nft_synproxy"
+
+/* Registered xtables targets, for iptables and ip6tables */
+static const char *const xt_targets[] = {"/proc/net/ip_tables_targets", "/proc/net/ip6_tables_targets", NULL};
+
+static struct xdp_attach xdp_ifaces;
+
+static const char *const usages[] = {
+    "syn_proxy -i <iface> -p <ports> [options]",
+    NULL,
+};
+
+static const char *const stat_names[SYN_PROXY_STAT_MAX] = {"cookie_sent", "cookie_valid", "cookie_failed",
+                                                           "established", "dropped"};
+
+struct stats_ctx {
+    struct syn_proxy_bpf *skel;
+    struct metrics *metrics;
+    struct prog_stats progs;
+    __u64 prev[SYN_PROXY_STAT_MAX];
+};
+
+static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va_list args) {
+    return vfprintf(stderr, format, args);
+}
+
+/* Comma-separated ports and ranges, e.g. 22,80,8000-8100 */
+static int parse_ports(const char *str, struct syn_proxy_cfg *cfg) {
+    char *list = strdup(str), *save = NULL;
+    int count = 0;
+
+    if (!list)
+        return -1;
+
+    for (char *tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *end;
+        long first = strtol(tok, &end, 10), last = first;
+
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+
+        if (*end != '\0' || first < 1 || last > 65535 || first > last) {
+            log_fatal("Invalid port or range: %s", tok);
+            free(list);
+            return -1;
+        }
+
+        for (long p = first; p <= last; p++)
+            cfg->ports[p / 64] |= 1ULL << (p % 64);
+        count += last - first + 1;
+    }
+
+    free(list);
+    return count;
+}
+
+static bool xt_target_loaded(const char *name) {
+    char line[64];
+    bool found = false;
+
+    for (int i = 0; xt_targets[i] && !found; i++) {
+        FILE *f = fopen(xt_targets[i], "r");
+
+        if (!f)
+            continue;
+        while (!found && fgets(line, sizeof(line), f)) {
+            line[strcspn(line, "\n")] = '\0';
+            found = strcmp(line, name) == 0;
+        }
+        fclose(f);
+    }
+
+    return found;
+}
+
+/*
+ * The stack never saw the SYN of an ACK validated here, so the listener
+ * rejects it (no recent SYN queue overflow), whatever tcp_syncookies says.
+ * As in the xdp_synproxy selftest of the kernel, the SYNPROXY target of
+ * iptables/nft takes it instead: it checks the cookie again and opens the
+ * connection to the listener on behalf of the client. It only gets the ACK
+ * when conntrack is strict and marks a flow without handshake INVALID. The
+ * target is loaded with the first rule using it, that is taken as the sign
+ * of a rule.
+ */
+static int check_synproxy(void) {
+    FILE *f = fopen(TCP_LOOSE_SYSCTL, "r");
+    int loose = -1;
+
+    if (f) {
+        if (fscanf(f, "%d", &loose) != 1)
+            loose = -1;
+        fclose(f);
+    }
+
+    if (loose < 0) {
+        log_fatal("Connection tracking is not loaded (no %s), SYNPROXY needs it", TCP_LOOSE_SYSCTL);
+        return -1;
+    }
+
+    if (loose != 0) {
+        log_fatal("%s is %d, set it to 0 or conntrack accepts the ACKs before SYNPROXY sees them", TCP_LOOSE_SYSCTL,
+                  loose);
+        return -1;
+    }
+
+    if (!xt_target_loaded("SYNPROXY") && access(NFT_SYNPROXY_MODULE, F_OK)) {
+        log_fatal("No SYNPROXY rule, the validated ACKs would be rejected. For instance:");
+        log_fatal("  iptables -t raw -I PREROUTING -p tcp --dport <port> --syn -j CT --notrack");
+        log_fatal("  iptables -I INPUT -p tcp --dport <port> -m state --state INVALID,UNTRACKED -j SYNPROXY --mss 1460");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int read_stats(struct stats_ctx *stats, __u64 counters[SYN_PROXY_STAT_MAX]) {
+    int fd = bpf_map__fd(stats->skel->maps.syn_proxy_stats);
+    int cpus = libbpf_num_possible_cpus();
+    __u64 values[cpus];
+
+    for (__u32 key = 0; key < SYN_PROXY_STAT_MAX; key++) {
+        counters[key] = 0;
+
+        if (bpf_map_lookup_elem(fd, &key, values))
+            return -1;
+
+        for (int i = 0; i < cpus; i++)
+            counters[key] += values[i];
+    }
+
+    return 0;
+}
+
+static void render_metrics(struct stats_ctx *stats, const __u64 counters[SYN_PROXY_STAT_MAX]) {
+    struct metrics *m = stats->metrics;
+    char labels[32];
+
+    metrics_begin(m);
+    metrics_family(m, "xdp_syn_proxy_events_total", "counter", "SYN cookies sent and checked, packets passed and dropped");
+    for (int i = 0; i < SYN_PROXY_STAT_MAX; i++) {
+        snprintf(labels, sizeof(labels), "event=\"%s\"", stat_names[i]);
+        metrics_u64(m, "xdp_syn_proxy_events_total", labels, counters[i]);
+    }
+    prog_stats_render_metrics(m, &stats->progs);
+    metrics_commit(m);
+}
+
+/* Cookies sent, validated and failed per second, printed every --interval */
+static void print_stats(void *ctx, double elapsed) {
+    struct stats_ctx *stats = ctx;
+    __u64 counters[SYN_PROXY_STAT_MAX];
+    double rates[SYN_PROXY_STAT_MAX];
+    bool active = false;
+
+    if (read_stats(stats, counters)) {
+        log_error("Error while reading the SYN proxy statistics");
+        return;
+    }
+
+    for (int i = 0; i < SYN_PROXY_STAT_MAX; i++) {
+        rates[i] = (counters[i] - stats->prev[i]) / elapsed;
+        active |= counters[i] != stats->prev[i];
+        stats->prev[i] = counters[i];
+    }
+
+    if (active) {
+        log_info("Cookies: %.0f sent/s (%.2f Mpps), %.0f valid/s, %.0f failed/s; %.0f established pkt/s, "
+                 "%.0f dropped pkt/s", rates[SYN_PROXY_COOKIE_SENT], rates[SYN_PROXY_COOKIE_SENT] / 1000000,
+                 rates[SYN_PROXY_COOKIE_VALID], rates[SYN_PROXY_COOKIE_FAILED], rates[SYN_PROXY_ESTABLISHED],
+                 rates[SYN_PROXY_DROP]);
+    }
+
+    prog_stats_print(&stats->progs, elapsed);
+
+    if (metrics_enabled(stats->metrics))
+        render_metrics(stats, counters);
+}
+
+int main(int argc, const char **argv) {
+    struct syn_proxy_bpf *skel = NULL;
+    struct event_loop loop = {0};
+    struct metrics metrics = {0};
+    struct stats_ctx stats = {0};
+    float interval = 1;
+    int metrics_port = 0;
+    const char *iface = NULL;
+    const char *xdp_mode = NULL;
+    const char *ports = NULL;
+    int no_check = 0;
+    int nports;
+    int err;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_GROUP("Basic options"),
+        OPT_STRING('i', "iface", &iface, "Interface where to attach the BPF program", NULL, 0, 0),
+        OPT_STRING('p', "ports", &ports, "TCP ports to protect, e.g. 22,80,8000-8100", NULL, 0, 0),
+        OPT_STRING(0, "xdp-mode", &xdp_mode, "XDP mode: drv (default), skb or hw, falls back to the slower ones", NULL, 0, 0),
+        OPT_FLOAT('I', "interval", &interval, "Statistics interval in seconds (default 1, at least 0.01)", NULL, 0, 0),
+        OPT_INTEGER(0, "metrics-port", &metrics_port, "Serve Prometheus metrics on 127.0.0.1:<port>/metrics", NULL, 0, 0),
+        OPT_BOOLEAN(0, "no-check", &no_check, "Do not check for conntrack and a SYNPROXY rule at startup", NULL, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "\nThis software answers the SYNs to the given ports with SYN cookies from XDP",
+    "\nThe handshakes completed with a valid cookie go to a SYNPROXY rule, the known connections to the stack");
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (ports == NULL) {
+        log_fatal("No port to protect, use -p");
+        exit(1);
+    }
+
+    if (!no_check && check_synproxy())
+        exit(1);
+
+    libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
+
+    /* Set up libbpf errors and debug info callback */
+    libbpf_set_print(libbpf_print_fn);
+
+    if (xdp_attach_parse_mode(xdp_mode, &xdp_ifaces.mode) || event_loop_check_interval(interval))
+        exit(1);
+
+    if (xdp_attach_add_iface(&xdp_ifaces, iface, "veth1") < 0)
+        exit(1);
+
+    /* Open BPF application */
+    skel = syn_proxy_bpf__open();
+    if (!skel) {
+        log_fatal("Error while opening BPF skeleton");
+        exit(1);
+    }
+
+    nports = parse_ports(ports, (struct syn_proxy_cfg *)&skel->rodata->syn_proxy_cfg);
+    if (nports < 0) {
+        err = -1;
+        goto cleanup;
+    }
+
+    /* Load and verify BPF programs */
+    err = syn_proxy_bpf__load(skel);
+    if (err) {
+        log_fatal("Error while loading BPF skeleton, the cookie helpers need Linux 6.0 and CONFIG_SYN_COOKIES");
+        goto cleanup;
+    }
+
+    err = xdp_attach_all(&xdp_ifaces, bpf_program__fd(skel->progs.xdp_syn_proxy));
+    if (err) {
+        log_fatal("Error while attaching BPF programs");
+        goto cleanup;
+    }
+
+    log_info("Successfully attached! Protecting %d ports", nports);
+
+    stats.skel = skel;
+    stats.metrics = &metrics;
+    prog_stats_init(&stats.progs, skel->obj);
+
+    err = event_loop_init(&loop, interval, print_stats, &stats);
+    if (!err)
+        err = metrics_init(&metrics, &loop, metrics_port, METRICS_DEFAULT_TOP);
+    if (!err)
+        err = event_loop_run(&loop);
+
+cleanup:
+    metrics_destroy(&metrics);
+    event_loop_destroy(&loop);
+    prog_stats_destroy(&stats.progs);
+    xdp_attach_detach_all(&xdp_ifaces);
+    syn_proxy_bpf__destroy(skel);
+    log_info("Program stopped correctly");
+    return -err;
+}
@@ -18,12 +18,13 @@
 #include <signal.h>
 
 #include "log.h"
+#include "xdp_attach.h"
 
 // Include skeleton file
 #include "xdp_loader.skel.h"
 
-static int ifindex_iface1 = 0;
-static __u32 xdp_flags = 0;
+/* Attached through netlink, the program stays there when the loader exits */
+static struct xdp_attach xdp_ifaces;
 
 static const char *const usages[] = {
     "xdp_loader [options] [[--] args]",
@@ -31,28 +32,18 @@ static const char *const usages[] = {
     NULL,
 };
 
-// static void cleanup_ifaces() {
-//     __u32 curr_prog_id = 0;
-
-//     if (ifindex_iface1 != 0) {
-//         if (!bpf_xdp_query_id(ifindex_iface1, xdp_flags, &curr_prog_id)) {
-//             if (curr_prog_id) {
-//                 bpf_xdp_detach(ifindex_iface1, xdp_flags, NULL);
-//                 log_trace("Detached XDP program from interface %d", ifindex_iface1);
-//             }
-//         }
-//     }
-// }
-
 int main(int argc, const char **argv) {
     struct xdp_loader_bpf *skel = NULL;
     int err;
     const char *iface1 = NULL;
+    const char *xdp_mode = NULL;
+    enum xdp_attach_mode mode;
 
     struct argparse_option options[] = {
         OPT_HELP(),
         OPT_GROUP("Basic options"),
         OPT_STRING('i', "iface", &iface1, "Interface where to attach the BPF program", NULL, 0, 0),
+        OPT_STRING(0, "xdp-mode", &xdp_mode, "XDP mode: drv (default), skb or hw, falls back to the slower ones", NULL, 0, 0),
         OPT_END(),
     };
 
@@ -62,19 +53,12 @@ int main(int argc, const char **argv) {
     "\nIf '-p' argument is specified, the interface will be put in promiscuous mode");
     argc = argparse_parse(&argparse, argc, argv);
 
-    if (iface1 != NULL) {
-        log_info("XDP program will be attached to %s interface", iface1);
-        ifindex_iface1 = if_nametoindex(iface1);
-        if (!ifindex_iface1) {
-            log_fatal("Error while retrieving the ifindex of %s", iface1);
-            exit(1);
-        } else {
-            log_info("Got ifindex for iface: %s, which is %d", iface1, ifindex_iface1);
-        }
-    } else {
-        log_error("Error, you must specify the interface where to attach the XDP program");
+    if (xdp_attach_parse_mode(xdp_mode, &mode))
+        exit(1);
+
+    xdp_attach_init(&xdp_ifaces, mode, true);
+    if (xdp_attach_add_iface(&xdp_ifaces, iface1, NULL) < 0)
         exit(1);
-    }
 
     /* Open BPF application */
     skel = xdp_loader_bpf__open();
@@ -92,13 +76,8 @@ int main(int argc, const char **argv) {
         exit(1);
     }
 
-    xdp_flags = 0;
-    xdp_flags |= XDP_FLAGS_DRV_MODE;
-    xdp_flags |= XDP_FLAGS_UPDATE_IF_NOEXIST;
-
-    /* Attach the XDP program to the interface */
-    err = bpf_xdp_attach(ifindex_iface1, bpf_program__fd(skel->progs.xdp_pass_func), xdp_flags, NULL);
-
+    /* Attach the XDP program to the interface, unless it already has one */
+    err = xdp_attach_all(&xdp_ifaces, bpf_program__fd(skel->progs.xdp_pass_func));
     if (err) {
         log_fatal("Error while attaching XDP program to the interface");
         exit(1);
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+#include "lat_hist_types.h"
+
+/*
+ * Per-CPU log2 histogram of the driver-to-XDP latency, i.e. the time between
+ * the HW RX timestamp of a frame and the moment the XDP program runs on it.
+ * Slot i counts the frames with a latency in [2^i, 2^(i+1)) ns.
+ */
+
+/* Clock the HW timestamps are compared with, the PHC is usually in TAI */
+const volatile struct {
+   __u8 clock;
+} lat_cfg = {};
+
+struct {
+   __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+   __type(key, __u32);
+   __type(value, struct lat_hist);
+   __uint(max_entries, 1);
+} lat_hist_map SEC(".maps");
+
+static __always_inline __u64 lat_now_ns(void) {
+   if (lat_cfg.clock == LAT_CLOCK_MONO)
+      return bpf_ktime_get_ns();
+
+   return bpf_ktime_get_tai_ns();
+}
+
+static __always_inline __u32 lat_log2_u32(__u32 v) {
+   __u32 r, shift;
+
+   r = (v > 0xFFFF) << 4;
+   v >>= r;
+   shift = (v > 0xFF) << 3;
+   v >>= shift;
+   r |= shift;
+   shift = (v > 0xF) << 2;
+   v >>= shift;
+   r |= shift;
+   shift = (v > 0x3) << 1;
+   v >>= shift;
+   r |= shift;
+   r |= (v >> 1);
+
+   return r;
+}
+
+static __always_inline __u32 lat_log2_u64(__u64 v) {
+   __u32 hi = v >> 32;
+
+   if (hi)
+      return lat_log2_u32(hi) + 32;
+
+   return lat_log2_u32(v);
+}
+
+static __always_inline void lat_hist_record(__u64 now_ns, __u64 hw_ts_ns, int hw_ts_err) {
+   struct lat_hist *hist;
+   __u32 key = 0;
+   __u32 slot;
+
+   hist = bpf_map_lookup_elem(&lat_hist_map, &key);
+   if (!hist)
+      return;
+
+   if (hw_ts_err || hw_ts_ns == 0) {
+      hist->no_hw_ts++;
+      return;
+   }
+
+   if (hw_ts_ns > now_ns) {
+      hist->negative++;
+      return;
+   }
+
+   slot = lat_log2_u64(now_ns - hw_ts_ns);
+   if (slot >= LAT_HIST_SLOTS)
+      return;
+
+   hist->slots[slot]++;
+}
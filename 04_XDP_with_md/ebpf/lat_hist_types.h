@@ -0,0 +1,19 @@
+#pragma once
+
+/* Histogram of lat_hist.h, shared with xdp_with_md.c */
+#include <linux/types.h>
+
+#define LAT_HIST_SLOTS 64
+
+enum lat_clock {
+   LAT_CLOCK_TAI = 0,
+   LAT_CLOCK_MONO,
+};
+
+struct lat_hist {
+   __u64 slots[LAT_HIST_SLOTS];
+   /* Frames without a HW timestamp, not binned */
+   __u64 no_hw_ts;
+   /* Frames stamped in the future (clocks not in the same domain) */
+   __u64 negative;
+};
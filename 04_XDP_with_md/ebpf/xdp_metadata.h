@@ -1,9 +1,7 @@
 #pragma once
 
-#include <linux/bpf.h>
-#include <bpf/bpf_helpers.h>
-#include <stddef.h>
-#include <stdint.h>
+/* Metadata in front of the frames and TC types, shared with xsk_consumer.h and tc_meta.h */
+#include <linux/types.h>
 
 #ifndef ETH_P_IP
 #define ETH_P_IP 0x0800
@@ -32,6 +30,22 @@ enum xdp_meta_field {
 	XDP_META_FIELD_TS	= BIT(0),
 	XDP_META_FIELD_RSS	= BIT(1),
 	XDP_META_FIELD_VLAN_TAG	= BIT(2),
+	/* skb_mark/skb_priority hold the XDP classification for TC */
+	XDP_META_FIELD_CLASS	= BIT(3),
+};
+
+/* RSS hash types reported by bpf_xdp_metadata_rx_hash (include/net/xdp.h) */
+enum xdp_rss_hash_type {
+	XDP_RSS_TYPE_NONE	= 0,
+	XDP_RSS_L3_IPV4		= BIT(0),
+	XDP_RSS_L3_IPV6		= BIT(1),
+	XDP_RSS_L3_DYNHDR	= BIT(2),
+	XDP_RSS_L4		= BIT(3),
+	XDP_RSS_L4_TCP		= BIT(4),
+	XDP_RSS_L4_UDP		= BIT(5),
+	XDP_RSS_L4_SCTP		= BIT(6),
+	XDP_RSS_L4_IPSEC	= BIT(7),
+	XDP_RSS_L4_ICMP		= BIT(8),
 };
 
 struct xdp_meta {
@@ -53,4 +67,25 @@ struct xdp_meta {
 		__s32 rx_vlan_tag_err;
 	};
 	enum xdp_meta_field hint_valid;
-};
\ No newline at end of file
+	__u32 skb_mark;
+	__u32 skb_priority;
+};
+
+/* Class of a UDP destination port, 0 leaves the skb field untouched */
+struct skb_class {
+	__u32 mark;
+	__u32 priority;
+};
+
+/* Paths of the TC program, with or without the XDP metadata */
+enum tc_path {
+	TC_PATH_META = 0,
+	TC_PATH_PARSE,
+	TC_PATH_MAX,
+};
+
+struct tc_path_stats {
+	__u64 runs;
+	__u64 ns;
+	__u64 classified;
+};
@@ -10,13 +10,36 @@
 #include <linux/udp.h>
 #include <linux/tcp.h>
 #include <linux/in.h>
+#include <linux/pkt_cls.h>
 #include <bpf/bpf_endian.h>
 #include <stdint.h>
 
 #include "xdp_metadata.h"
+#include "lat_hist.h"
+#include "jhash.h"
+#include "parsing_helpers.h"
+
+#define MAX_STEER_CPUS 128
+#define MAX_RX_QUEUES 1024
+#define FLOW_STATS_SIZE 16384
+#define MAX_CLASSES 1024
 
 extern int bpf_xdp_metadata_rx_timestamp(const struct xdp_md *ctx,
                                          __u64 *timestamp) __ksym;
+extern int bpf_xdp_metadata_rx_hash(const struct xdp_md *ctx, __u32 *hash,
+                                    enum xdp_rss_hash_type *rss_type) __ksym __weak;
+extern int bpf_xdp_metadata_rx_vlan_tag(const struct xdp_md *ctx, __be16 *vlan_proto,
+                                        __u16 *vlan_tci) __ksym __weak;
+
+/* Redirect the frames carrying xdp_meta to the AF_XDP socket of their queue */
+const volatile struct {
+    __u8 enabled;
+} xsk_cfg = {};
+
+/* Number of entries of cpus_available used for steering, 0 disables it */
+const volatile struct {
+    __u32 num_cpus;
+} steer_cfg = {};
 
 /* This is the data record stored in the map */
 struct datarec {
@@ -24,49 +47,192 @@ struct datarec {
     __u64 rx_bytes;
 };
 
+/* One entry per RX queue, indexed by ctx->rx_queue_index */
 struct {
-    __uint(type, BPF_MAP_TYPE_ARRAY);
-    __type(key, int);
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, __u32);
     __type(value, struct datarec);
-    __uint(max_entries, 1024);
+    __uint(max_entries, MAX_RX_QUEUES);
 } xdp_stats_map SEC(".maps");
 
+struct {
+    __uint(type, BPF_MAP_TYPE_XSKMAP);
+    __type(key, __u32);
+    __type(value, __u32);
+    __uint(max_entries, 64);
+} xsks_map SEC(".maps");
+
+/* UDP destination port (host order) -> skb mark and priority */
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, __u16);
+    __type(value, struct skb_class);
+    __uint(max_entries, MAX_CLASSES);
+} class_map SEC(".maps");
+
+/* Cost of the two TC paths, indexed by enum tc_path */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, __u32);
+    __type(value, struct tc_path_stats);
+    __uint(max_entries, TC_PATH_MAX);
+} tc_stats_map SEC(".maps");
+
+/* Make the TC program ignore the XDP metadata, to compare both paths */
+volatile __u8 tc_force_parse = 0;
+
+/* Per-flow counters, keyed on the RSS hash (or on the software one) */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+    __type(key, __u32);
+    __type(value, struct datarec);
+    __uint(max_entries, FLOW_STATS_SIZE);
+} flow_stats_map SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_CPUMAP);
+    __type(key, __u32);
+    __type(value, struct bpf_cpumap_val);
+    __uint(max_entries, MAX_STEER_CPUS);
+} cpu_map SEC(".maps");
+
+/* Slot -> CPU id, the flows are spread over the first steer_cfg.num_cpus slots */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __type(key, __u32);
+    __type(value, __u32);
+    __uint(max_entries, MAX_STEER_CPUS);
+} cpus_available SEC(".maps");
+
+/* Software 5-tuple hash, used only when the NIC does not report one */
+static __always_inline __u32 sw_flow_hash(void *data, void *data_end) {
+	struct ethhdr *eth = data;
+	__u32 saddr, daddr, ports = 0;
+	__u8 proto;
+	void *l4;
+
+	if ((void *)(eth + 1) > data_end)
+		return 0;
+
+	if (eth->h_proto == bpf_htons(ETH_P_IP)) {
+		struct iphdr *iph = (void *)(eth + 1);
+
+		if ((void *)(iph + 1) > data_end)
+			return 0;
+		saddr = iph->saddr;
+		daddr = iph->daddr;
+		proto = iph->protocol;
+		l4 = (void *)iph + iph->ihl * 4;
+	} else if (eth->h_proto == bpf_htons(ETH_P_IPV6)) {
+		struct ipv6hdr *ip6h = (void *)(eth + 1);
+
+		if ((void *)(ip6h + 1) > data_end)
+			return 0;
+		saddr = ip6h->saddr.in6_u.u6_addr32[0] ^ ip6h->saddr.in6_u.u6_addr32[1] ^
+			ip6h->saddr.in6_u.u6_addr32[2] ^ ip6h->saddr.in6_u.u6_addr32[3];
+		daddr = ip6h->daddr.in6_u.u6_addr32[0] ^ ip6h->daddr.in6_u.u6_addr32[1] ^
+			ip6h->daddr.in6_u.u6_addr32[2] ^ ip6h->daddr.in6_u.u6_addr32[3];
+		proto = ip6h->nexthdr;
+		l4 = ip6h + 1;
+	} else {
+		return 0;
+	}
+
+	/* Source and destination ports are the first 4 bytes of both headers */
+	if (proto == IPPROTO_TCP || proto == IPPROTO_UDP) {
+		__u32 *p = l4;
+
+		if ((void *)(p + 1) <= data_end)
+			ports = *p;
+	}
+
+	return jhash_3words(saddr, daddr, ports, proto);
+}
+
+static __always_inline void count_flow(__u32 hash, __u64 bytes) {
+    struct datarec *rec, init = {};
+
+    rec = bpf_map_lookup_elem(&flow_stats_map, &hash);
+    if (!rec) {
+        bpf_map_update_elem(&flow_stats_map, &hash, &init, BPF_NOEXIST);
+        rec = bpf_map_lookup_elem(&flow_stats_map, &hash);
+        if (!rec)
+            return;
+    }
+
+    /* Per-CPU value, no atomics needed */
+    rec->rx_packets++;
+    rec->rx_bytes += bytes;
+}
+
+/* Send the flow to one of the steering CPUs, or up the stack on this one */
+static __always_inline int steer_flow(__u32 hash) {
+    __u32 *cpu, slot;
+
+    if (steer_cfg.num_cpus == 0)
+        return XDP_PASS;
+
+    slot = hash % steer_cfg.num_cpus;
+    cpu = bpf_map_lookup_elem(&cpus_available, &slot);
+    if (!cpu)
+        return XDP_PASS;
+
+    return bpf_redirect_map(&cpu_map, *cpu, XDP_PASS);
+}
+
 SEC("xdp")
 int xdp_prog_map(struct xdp_md *ctx) {
     void *data, *data_meta, *data_end;
-	struct ipv6hdr *ip6h = NULL;
-	struct ethhdr *eth = NULL;
-	struct udphdr *udp = NULL;
-	struct iphdr *iph = NULL;
+	struct parsed_pkt pkt;
+	struct udphdr *udp;
 	struct xdp_meta *meta;
 	__u64 rx_timestamp = -1;
+	__u64 now = lat_now_ns();
+	enum xdp_rss_hash_type rss_type = XDP_RSS_TYPE_NONE;
+	__u32 rx_hash = 0;
+	int hash_err = -1;
 	int ret;
 
     struct datarec *rec;
 
+    /* Driver-to-XDP latency, only frames with a HW timestamp are binned */
+    int ts_err = bpf_xdp_metadata_rx_timestamp(ctx, &rx_timestamp);
+    lat_hist_record(now, rx_timestamp, ts_err);
+
 	data = (void *)(long)ctx->data;
 	data_end = (void *)(long)ctx->data_end;
 
     __u64 bytes = data_end - data;
-    
-	eth = data;
-	if (eth + 1 < data_end) {
-		if (eth->h_proto == bpf_htons(ETH_P_IP)) {
-			iph = (void *)(eth + 1);
-			if (iph + 1 < data_end && iph->protocol == IPPROTO_UDP)
-				udp = (void *)(iph + 1);
-		}
-		if (eth->h_proto == bpf_htons(ETH_P_IPV6)) {
-			ip6h = (void *)(eth + 1);
-			if (ip6h + 1 < data_end && ip6h->nexthdr == IPPROTO_UDP)
-				udp = (void *)(ip6h + 1);
-		}
-		if (udp && udp + 1 > data_end)
-			udp = NULL;
-	}
 
-	if (!udp)
-		return XDP_PASS;
+    /* The NIC already hashed the 5-tuple for RSS, reuse it as flow key */
+    if (bpf_ksym_exists(bpf_xdp_metadata_rx_hash))
+        hash_err = bpf_xdp_metadata_rx_hash(ctx, &rx_hash, &rss_type);
+    if (hash_err)
+        rx_hash = sw_flow_hash(data, data_end);
+
+    count_flow(rx_hash, bytes);
+
+    __u32 key = ctx->rx_queue_index;
+
+    rec = bpf_map_lookup_elem(&xdp_stats_map, &key);
+    if (!rec) {
+        bpf_printk("Failed to lookup queue %u in xdp_stats_map\n", key);
+        return XDP_ABORTED;
+    }
+
+    /* Per-CPU value, no atomics needed */
+    rec->rx_packets++;
+    rec->rx_bytes += bytes;
+
+	if (parse_pkt(data, data_end, &pkt) < 0 || pkt.l4_proto != IPPROTO_UDP)
+		return steer_flow(rx_hash);
+
+	udp = data + pkt.l4_off;
+	if ((void *)(udp + 1) > data_end)
+		return steer_flow(rx_hash);
+
+	/* Packet pointers are invalidated by bpf_xdp_adjust_meta */
+	__u16 dport = bpf_ntohs(udp->dest);
 
 	/* Reserve enough for all custom metadata. */
 
@@ -89,27 +255,104 @@ int xdp_prog_map(struct xdp_md *ctx) {
 	 * the userspace.
 	 */
 
-    int err = bpf_xdp_metadata_rx_timestamp(ctx, &rx_timestamp);
-    if (err) {
-        bpf_printk("Failed to get rx timestamp: %d\n", err);
+    meta->hint_valid = 0;
+    if (ts_err || rx_timestamp == 0)
         rx_timestamp = bpf_ktime_get_coarse_ns();
-        bpf_printk("Got rx timestamp: %llu\n", rx_timestamp);
+    else
+        meta->hint_valid |= XDP_META_FIELD_TS;
+
+    meta->rx_timestamp = rx_timestamp;
+    meta->xdp_timestamp = now;
+
+    meta->rx_hash = rx_hash;
+    if (hash_err) {
+        meta->rx_hash_err = hash_err;
     } else {
-        bpf_printk("Got rx timestamp: %llu\n", rx_timestamp);
+        meta->rx_hash_type = rss_type;
+        meta->hint_valid |= XDP_META_FIELD_RSS;
     }
 
-    int key = 0;
+    struct skb_class *cls = bpf_map_lookup_elem(&class_map, &dport);
 
-    rec = bpf_map_lookup_elem(&xdp_stats_map, &key);
-    if (!rec) {
-        bpf_printk("Failed to lookup in xdp_stats_map\n");
-        return XDP_ABORTED;
+    meta->skb_mark = cls ? cls->mark : 0;
+    meta->skb_priority = cls ? cls->priority : 0;
+    meta->hint_valid |= XDP_META_FIELD_CLASS;
+
+    ret = -1;
+    if (bpf_ksym_exists(bpf_xdp_metadata_rx_vlan_tag))
+        ret = bpf_xdp_metadata_rx_vlan_tag(ctx, &meta->rx_vlan_proto, &meta->rx_vlan_tci);
+    if (ret)
+        meta->rx_vlan_tag_err = ret;
+    else
+        meta->hint_valid |= XDP_META_FIELD_VLAN_TAG;
+
+    if (xsk_cfg.enabled)
+        return bpf_redirect_map(&xsks_map, ctx->rx_queue_index, XDP_PASS);
+
+    return steer_flow(rx_hash);
+}
+
+/* Classification of the frames that did not go through xdp_prog_map */
+static __always_inline struct skb_class *tc_parse_class(struct __sk_buff *skb) {
+	void *data = (void *)(long)skb->data;
+	void *data_end = (void *)(long)skb->data_end;
+	struct parsed_pkt pkt;
+	struct udphdr *udp;
+	__u16 dport;
+
+	if (parse_pkt(data, data_end, &pkt) < 0 || pkt.l4_proto != IPPROTO_UDP)
+		return NULL;
+
+	udp = data + pkt.l4_off;
+	if ((void *)(udp + 1) > data_end)
+		return NULL;
+
+	dport = bpf_ntohs(udp->dest);
+	return bpf_map_lookup_elem(&class_map, &dport);
+}
+
+/*
+ * TC ingress companion of xdp_prog_map: apply the class found in XDP from
+ * data_meta, and parse the packet only when there is no metadata.
+ */
+SEC("tc")
+int tc_apply_meta(struct __sk_buff *skb) {
+    __u64 start = bpf_ktime_get_ns();
+    void *data = (void *)(long)skb->data;
+    struct xdp_meta *meta = (void *)(long)skb->data_meta;
+    __u32 mark = 0, priority = 0;
+    struct tc_path_stats *stats;
+    __u32 path;
+
+    if (!tc_force_parse && (void *)(meta + 1) <= data &&
+        (meta->hint_valid & XDP_META_FIELD_CLASS)) {
+        path = TC_PATH_META;
+        mark = meta->skb_mark;
+        priority = meta->skb_priority;
+    } else {
+        struct skb_class *cls = tc_parse_class(skb);
+
+        path = TC_PATH_PARSE;
+        if (cls) {
+            mark = cls->mark;
+            priority = cls->priority;
+        }
     }
 
-    __sync_fetch_and_add(&rec->rx_packets, 1);
-    __sync_fetch_and_add(&rec->rx_bytes, bytes);
+    if (mark)
+        skb->mark = mark;
+    if (priority)
+        skb->priority = priority;
+
+    stats = bpf_map_lookup_elem(&tc_stats_map, &path);
+    if (stats) {
+        stats->runs++;
+        stats->ns += bpf_ktime_get_ns() - start;
+        if (mark || priority)
+            stats->classified++;
+    }
 
-    return XDP_PASS;
+    return TC_ACT_OK;
 }
 
 char LICENSE[] SEC("license") = "Dual BSD/GPL";
\ No newline at end of file
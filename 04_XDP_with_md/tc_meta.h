@@ -0,0 +1,156 @@
+#ifndef TC_META_H_
+#define TC_META_H_
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "ebpf/xdp_metadata.h"
+
+static const char *const tc_path_names[TC_PATH_MAX] = {"metadata", "parse"};
+
+/* tcx link when the kernel has it, classic clsact filter otherwise */
+struct tc_attachment {
+    struct bpf_link *link;
+    struct bpf_tc_hook hook;
+    bool filter_attached;
+    bool hook_created;
+};
+
+#define TC_META_HANDLE 1
+#define TC_META_PRIORITY 1
+
+static int tc_meta_attach(struct tc_attachment *tc, struct bpf_program *prog, int ifindex) {
+    LIBBPF_OPTS(bpf_tc_opts, opts, .prog_fd = bpf_program__fd(prog), .handle = TC_META_HANDLE,
+                .priority = TC_META_PRIORITY);
+    int err;
+
+    memset(tc, 0, sizeof(*tc));
+
+    tc->link = bpf_program__attach_tcx(prog, ifindex, NULL);
+    if (tc->link && !libbpf_get_error(tc->link)) {
+        log_info("TC program attached to interface %d with tcx", ifindex);
+        return 0;
+    }
+    tc->link = NULL;
+
+    tc->hook.sz = sizeof(tc->hook);
+    tc->hook.ifindex = ifindex;
+    tc->hook.attach_point = BPF_TC_INGRESS;
+
+    err = bpf_tc_hook_create(&tc->hook);
+    if (err && err != -EEXIST) {
+        log_error("Error while creating the clsact qdisc: %s", strerror(-err));
+        return err;
+    }
+    /* Never remove a clsact qdisc that somebody else created */
+    tc->hook_created = !err;
+
+    err = bpf_tc_attach(&tc->hook, &opts);
+    if (err) {
+        log_error("Error while attaching the TC program: %s", strerror(-err));
+        if (tc->hook_created)
+            bpf_tc_hook_destroy(&tc->hook);
+        return err;
+    }
+    tc->filter_attached = true;
+
+    log_info("TC program attached to interface %d with a clsact filter", ifindex);
+
+    return 0;
+}
+
+static void tc_meta_detach(struct tc_attachment *tc) {
+    LIBBPF_OPTS(bpf_tc_opts, opts, .handle = TC_META_HANDLE, .priority = TC_META_PRIORITY);
+
+    if (tc->link) {
+        bpf_link__destroy(tc->link);
+        tc->link = NULL;
+    }
+
+    if (tc->filter_attached) {
+        bpf_tc_detach(&tc->hook, &opts);
+        tc->filter_attached = false;
+    }
+
+    if (tc->hook_created) {
+        bpf_tc_hook_destroy(&tc->hook);
+        tc->hook_created = false;
+    }
+}
+
+/* Parse "port:mark:priority,..." and fill class_map */
+static int tc_meta_load_classes(const char *list, struct bpf_map *class_map) {
+    char buf[1024];
+    char *saveptr;
+
+    snprintf(buf, sizeof(buf), "%s", list);
+    for (char *tok = strtok_r(buf, ",", &saveptr); tok != NULL; tok = strtok_r(NULL, ",", &saveptr)) {
+        struct skb_class cls;
+        unsigned int port;
+
+        if (sscanf(tok, "%u:%u:%u", &port, &cls.mark, &cls.priority) != 3 || port > 0xFFFF) {
+            log_error("Invalid class %s, expected port:mark:priority", tok);
+            return -1;
+        }
+
+        __u16 key = port;
+        if (bpf_map__update_elem(class_map, &key, sizeof(key), &cls, sizeof(cls), BPF_ANY)) {
+            log_error("Error while adding class for port %u: %s", port, strerror(errno));
+            return -1;
+        }
+
+        log_info("UDP port %u -> mark %u priority %u", port, cls.mark, cls.priority);
+    }
+
+    return 0;
+}
+
+static int tc_meta_read_stats(int map_fd, struct tc_path_stats stats[TC_PATH_MAX]) {
+    int cpus = libbpf_num_possible_cpus();
+    struct tc_path_stats values[cpus];
+
+    for (__u32 path = 0; path < TC_PATH_MAX; path++) {
+        memset(&stats[path], 0, sizeof(stats[path]));
+
+        if (bpf_map_lookup_elem(map_fd, &path, values))
+            return -1;
+
+        for (int i = 0; i < cpus; i++) {
+            stats[path].runs += values[i].runs;
+            stats[path].ns += values[i].ns;
+            stats[path].classified += values[i].classified;
+        }
+    }
+
+    return 0;
+}
+
+static void tc_meta_print_stats(int map_fd, struct tc_path_stats prev[TC_PATH_MAX]) {
+    struct tc_path_stats stats[TC_PATH_MAX];
+
+    if (tc_meta_read_stats(map_fd, stats)) {
+        log_error("Error while reading the TC statistics");
+        return;
+    }
+
+    for (int path = 0; path < TC_PATH_MAX; path++) {
+        __u64 runs = stats[path].runs - prev[path].runs;
+
+        if (runs == 0)
+            continue;
+
+        log_info("TC %-8s path: %10llu pkts, %.1f ns/pkt, %llu classified", tc_path_names[path],
+                 runs, (double)(stats[path].ns - prev[path].ns) / runs,
+                 stats[path].classified - prev[path].classified);
+    }
+
+    memcpy(prev, stats, sizeof(stats));
+}
+
+#endif // TC_META_H_
@@ -3,9 +3,16 @@
 #include <bpf/bpf.h>
 #include <bpf/btf.h>
 #include <bpf/libbpf.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/ethtool.h>
 #include <linux/if_link.h>
+#include <linux/sockios.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <sys/resource.h>
 #include <unistd.h>
 
@@ -18,6 +25,13 @@
 #include <signal.h>
 
 #include "log.h"
+#include "tc_meta.h"
+#include "xdp_attach.h"
+#include "xsk_consumer.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "prog_stats.h"
+#include "ebpf/lat_hist_types.h"
 
 // Include skeleton file
 #include "xdp_with_md.skel.h"
@@ -25,13 +39,19 @@
 #define ONE_MILLION 1000000.0
 #define ONE_BILLION 1000000000.0
 
+#define MAX_STEER_CPUS 128
+#define MAX_RX_QUEUES 1024
+#define CPUMAP_QSIZE 2048
+#define TOP_FLOWS 5
+
 struct datarec {
     __u64 rx_packets;
     __u64 rx_bytes;
 };
 
 static int ifindex_iface = 0;
-static __u32 xdp_flags = 0;
+static struct xdp_attach xdp_ifaces;
+static struct tc_attachment tc_attach;
 
 static const char *const usages[] = {
     "xdp_with_md [options] [[--] args]",
@@ -40,16 +60,8 @@ static const char *const usages[] = {
 };
 
 static void cleanup_ifaces() {
-    __u32 curr_prog_id = 0;
-
-    if (ifindex_iface != 0) {
-        if (!bpf_xdp_query_id(ifindex_iface, xdp_flags, &curr_prog_id)) {
-            if (curr_prog_id) {
-                bpf_xdp_detach(ifindex_iface, xdp_flags, NULL);
-                log_trace("Detached XDP program from interface %d", ifindex_iface);
-            }
-        }
-    }
+    xdp_attach_detach_all(&xdp_ifaces);
+    tc_meta_detach(&tc_attach);
 }
 
 void sigint_handler(int sig_no) {
@@ -58,61 +70,452 @@ void sigint_handler(int sig_no) {
     exit(0);
 }
 
-void poll_stats(struct xdp_with_md_bpf *skel) {
-    int map_fd = 0;
+struct flow_entry {
+    __u32 hash;
+    struct datarec rec;
+};
 
-    map_fd = bpf_map__fd(skel->maps.xdp_stats_map);
-    if (map_fd < 0) {
-        log_fatal("Error while retrieving the map file descriptor");
-        exit(1);
+/* Parse a comma separated list of CPU ids, returns the number of CPUs */
+static int parse_cpu_list(const char *list, __u32 cpus[MAX_STEER_CPUS]) {
+    int possible = libbpf_num_possible_cpus();
+    char buf[512];
+    char *saveptr;
+    int n = 0;
+
+    snprintf(buf, sizeof(buf), "%s", list);
+    for (char *tok = strtok_r(buf, ",", &saveptr); tok != NULL; tok = strtok_r(NULL, ",", &saveptr)) {
+        char *end;
+        long cpu = strtol(tok, &end, 10);
+
+        if (*end != '\0' || cpu < 0 || cpu >= possible || cpu >= MAX_STEER_CPUS) {
+            log_fatal("Invalid steering CPU %s", tok);
+            return -1;
+        }
+
+        if (n == MAX_STEER_CPUS) {
+            log_fatal("At most %d steering CPUs are supported", MAX_STEER_CPUS);
+            return -1;
+        }
+
+        cpus[n++] = cpu;
     }
 
-    __u64 prev[2] = {0};
+    return n;
+}
 
-    while (true) {
-        struct datarec value;
-        int key = 0;
-        int err = 0;
-        float bit_rate, rate;
+static int setup_steering(struct xdp_with_md_bpf *skel, const __u32 *cpus, int num_cpus) {
+    struct bpf_cpumap_val val = {.qsize = CPUMAP_QSIZE};
 
-        err = bpf_map_lookup_elem(map_fd, &key, &value);
-        if (err != 0) {
-            log_fatal("Error while retrieving the value from the map");
-            exit(1);
+    for (__u32 i = 0; i < num_cpus; i++) {
+        if (bpf_map__update_elem(skel->maps.cpu_map, &cpus[i], sizeof(cpus[i]), &val,
+                                 sizeof(val), BPF_ANY) ||
+            bpf_map__update_elem(skel->maps.cpus_available, &i, sizeof(i), &cpus[i],
+                                 sizeof(cpus[i]), BPF_ANY)) {
+            log_error("Error while adding CPU %u to the steering maps: %s", cpus[i], strerror(errno));
+            return -1;
         }
 
-        if (value.rx_packets == 0 && value.rx_bytes == 0) {
+        log_info("Steering flows to CPU %u", cpus[i]);
+    }
+
+    return 0;
+}
+
+/* Print the flows with the most packets since the program was attached */
+static void print_top_flows(int map_fd) {
+    int cpus = libbpf_num_possible_cpus();
+    struct flow_entry top[TOP_FLOWS] = {0};
+    struct datarec values[cpus];
+    __u32 key, next_key;
+    __u32 *prev_key = NULL;
+    int flows = 0;
+
+    while (bpf_map_get_next_key(map_fd, prev_key, &next_key) == 0) {
+        struct flow_entry e = {.hash = next_key};
+
+        key = next_key;
+        prev_key = &key;
+
+        if (bpf_map_lookup_elem(map_fd, &key, values))
             continue;
+
+        for (int i = 0; i < cpus; i++) {
+            e.rec.rx_packets += values[i].rx_packets;
+            e.rec.rx_bytes += values[i].rx_bytes;
         }
+        flows++;
 
-        if (value.rx_packets > prev[0]) {
-            rate = (float)(value.rx_packets - prev[0]) / (float)ONE_MILLION;
-            log_info("%10llu pkt/s (%.2f Mpps)", value.rx_packets - prev[0], rate);
+        for (int i = 0; i < TOP_FLOWS; i++) {
+            if (e.rec.rx_packets > top[i].rec.rx_packets) {
+                memmove(&top[i + 1], &top[i], (TOP_FLOWS - i - 1) * sizeof(top[0]));
+                top[i] = e;
+                break;
+            }
         }
+    }
+
+    if (flows == 0)
+        return;
+
+    log_info("%d active flows, top %d:", flows, TOP_FLOWS);
+    for (int i = 0; i < TOP_FLOWS && top[i].rec.rx_packets; i++) {
+        log_info("  flow 0x%08x: %10llu pkts %12llu bytes", top[i].hash, top[i].rec.rx_packets,
+                 top[i].rec.rx_bytes);
+    }
+}
+
+/* Sum the per-CPU histograms */
+static int read_lat_hist(int map_fd, struct lat_hist *hist) {
+    int cpus = libbpf_num_possible_cpus();
+    struct lat_hist values[cpus];
+    __u32 key = 0;
+
+    memset(hist, 0, sizeof(*hist));
+
+    if (bpf_map_lookup_elem(map_fd, &key, values))
+        return -1;
+
+    for (int i = 0; i < cpus; i++) {
+        for (int j = 0; j < LAT_HIST_SLOTS; j++)
+            hist->slots[j] += values[i].slots[j];
+        hist->no_hw_ts += values[i].no_hw_ts;
+        hist->negative += values[i].negative;
+    }
 
-        if (value.rx_bytes > prev[1]) {
-            bit_rate = (float)((value.rx_bytes - prev[1]) * 8) / (float)ONE_BILLION;
-            log_info("%10llu byte/s (%.2f Gbps)", value.rx_bytes - prev[1],
-                     bit_rate);
+    return 0;
+}
+
+/*
+ * Upper bound (in ns) of the slot holding the q-th quantile. With log2 slots
+ * the result is exact within a factor of two.
+ */
+static __u64 lat_hist_quantile(const __u64 slots[LAT_HIST_SLOTS], __u64 total, double q) {
+    __u64 target = (__u64)(q * total);
+    __u64 cum = 0;
+
+    if (target == 0)
+        target = 1;
+
+    for (int i = 0; i < LAT_HIST_SLOTS; i++) {
+        cum += slots[i];
+        if (cum >= target)
+            return i == LAT_HIST_SLOTS - 1 ? UINT64_MAX : 1ULL << (i + 1);
+    }
+
+    return UINT64_MAX;
+}
+
+static void print_lat_hist(int map_fd, struct lat_hist *prev) {
+    __u64 delta[LAT_HIST_SLOTS];
+    struct lat_hist hist;
+    __u64 total = 0;
+
+    if (read_lat_hist(map_fd, &hist)) {
+        log_error("Error while reading the latency histogram");
+        return;
+    }
+
+    for (int i = 0; i < LAT_HIST_SLOTS; i++) {
+        delta[i] = hist.slots[i] - prev->slots[i];
+        total += delta[i];
+    }
+
+    if (total != 0) {
+        log_info("Driver-to-XDP latency over %llu pkts: p50 < %.2f us, p99 < %.2f us, p999 < %.2f us",
+                 total, lat_hist_quantile(delta, total, 0.50) / 1000.0,
+                 lat_hist_quantile(delta, total, 0.99) / 1000.0,
+                 lat_hist_quantile(delta, total, 0.999) / 1000.0);
+    }
+
+    if (hist.no_hw_ts > prev->no_hw_ts || hist.negative > prev->negative) {
+        log_info("%10llu pkts without HW timestamp, %llu stamped in the future",
+                 hist.no_hw_ts - prev->no_hw_ts, hist.negative - prev->negative);
+    }
+
+    *prev = hist;
+}
+
+/* Number of RX queues of the interface, MAX_RX_QUEUES if ethtool does not know */
+static int get_num_rx_queues(int ifindex) {
+    struct ethtool_channels ch = {.cmd = ETHTOOL_GCHANNELS};
+    struct ifreq ifr = {0};
+    int fd, queues;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return MAX_RX_QUEUES;
+
+    if_indextoname(ifindex, ifr.ifr_name);
+    ifr.ifr_data = (void *)&ch;
+    if (ioctl(fd, SIOCETHTOOL, &ifr)) {
+        close(fd);
+        return MAX_RX_QUEUES;
+    }
+    close(fd);
+
+    queues = ch.combined_count + ch.rx_count;
+    if (queues <= 0 || queues > MAX_RX_QUEUES)
+        return MAX_RX_QUEUES;
+
+    return queues;
+}
+
+/*
+ * Sum the per-CPU counters of each RX queue. A single batch lookup returns the
+ * values of all the queues, one lookup per queue is only left for the kernels
+ * without batch operations on arrays.
+ */
+static int read_queue_stats(int map_fd, struct datarec *stats, int num_queues, __u32 *keys,
+                            struct datarec *values) {
+    LIBBPF_OPTS(bpf_map_batch_opts, opts);
+    int cpus = libbpf_num_possible_cpus();
+    __u32 n = num_queues;
+    __u32 batch;
+
+    /* ENOENT: the end of the map was reached, when every queue is read */
+    if (bpf_map_lookup_batch(map_fd, NULL, &batch, keys, values, &n, &opts) && errno != ENOENT) {
+        if (errno != EINVAL && errno != ENOTSUP && errno != EOPNOTSUPP)
+            return -1;
+
+        for (__u32 q = 0; q < num_queues; q++) {
+            if (bpf_map_lookup_elem(map_fd, &q, &values[q * cpus]))
+                return -1;
+            keys[q] = q;
         }
+        n = num_queues;
+    }
+
+    if (n != (__u32)num_queues)
+        return -1;
 
-        prev[0] = value.rx_packets;
-        prev[1] = value.rx_bytes;
+    for (__u32 k = 0; k < n; k++) {
+        struct datarec *q = &stats[keys[k]];
 
-        sleep(1);
+        q->rx_packets = 0;
+        q->rx_bytes = 0;
+        for (int i = 0; i < cpus; i++) {
+            q->rx_packets += values[k * cpus + i].rx_packets;
+            q->rx_bytes += values[k * cpus + i].rx_bytes;
+        }
     }
+
+    return 0;
+}
+
+/*
+ * Print the total and per-queue rates. The imbalance is the busiest queue over
+ * the mean of all the queues, 1.0 means that RSS spreads the load evenly.
+ */
+static void print_queue_stats(struct datarec *curr, struct datarec *prev, int num_queues,
+                              double elapsed) {
+    __u64 total_pkts = 0, total_bytes = 0;
+    __u64 max_pkts = 0, min_pkts = UINT64_MAX;
+    int max_queue = 0, active = 0;
+
+    for (int q = 0; q < num_queues; q++) {
+        __u64 pkts = curr[q].rx_packets - prev[q].rx_packets;
+
+        total_pkts += pkts;
+        total_bytes += curr[q].rx_bytes - prev[q].rx_bytes;
+        if (pkts > max_pkts) {
+            max_pkts = pkts;
+            max_queue = q;
+        }
+        if (pkts < min_pkts)
+            min_pkts = pkts;
+        if (pkts)
+            active++;
+    }
+
+    if (total_pkts == 0)
+        return;
+
+    log_info("%10.0f pkt/s (%.2f Mpps)", total_pkts / elapsed,
+             total_pkts / elapsed / ONE_MILLION);
+    log_info("%10.0f byte/s (%.2f Gbps)", total_bytes / elapsed,
+             (total_bytes * 8) / elapsed / ONE_BILLION);
+
+    for (int q = 0; q < num_queues; q++) {
+        __u64 pkts = curr[q].rx_packets - prev[q].rx_packets;
+        __u64 bytes = curr[q].rx_bytes - prev[q].rx_bytes;
+
+        if (pkts == 0)
+            continue;
+
+        log_info("  queue %4d: %10.0f pkt/s (%5.1f%%) %.2f Gbps", q, pkts / elapsed,
+                 100.0 * pkts / total_pkts, (bytes * 8) / elapsed / ONE_BILLION);
+    }
+
+    if (num_queues < MAX_RX_QUEUES) {
+        log_info("  %d/%d queues active, imbalance %.2f (busiest queue %d), min/max %.2f",
+                 active, num_queues, (double)max_pkts * num_queues / total_pkts, max_queue,
+                 (double)min_pkts / max_pkts);
+    } else {
+        log_info("  %d queues active, busiest queue %d", active, max_queue);
+    }
+}
+
+struct stats_ctx {
+    struct xdp_with_md_bpf *skel;
+    bool tc;
+    int num_queues;
+    struct tc_path_stats prev_tc[TC_PATH_MAX];
+    struct datarec prev[MAX_RX_QUEUES];
+    /* Keys and per-CPU values of the batch lookup of read_queue_stats */
+    __u32 *keys;
+    struct datarec *values;
+    struct lat_hist prev_hist;
+    struct metrics *metrics;
+    struct prog_stats progs;
+};
+
+static int stats_init(struct stats_ctx *stats, struct xdp_with_md_bpf *skel, bool tc,
+                      struct metrics *metrics) {
+    memset(stats, 0, sizeof(*stats));
+    stats->skel = skel;
+    stats->tc = tc;
+    stats->metrics = metrics;
+    stats->num_queues = get_num_rx_queues(ifindex_iface);
+    prog_stats_init(&stats->progs, skel->obj);
+
+    if (stats->num_queues < MAX_RX_QUEUES)
+        log_info("Interface has %d RX queues", stats->num_queues);
+
+    stats->keys = calloc(stats->num_queues, sizeof(*stats->keys));
+    stats->values = calloc((size_t)stats->num_queues * libbpf_num_possible_cpus(), sizeof(*stats->values));
+    if (!stats->keys || !stats->values) {
+        log_error("Failed to allocate the RX queue counters");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void stats_destroy(struct stats_ctx *stats) {
+    prog_stats_destroy(&stats->progs);
+    free(stats->keys);
+    free(stats->values);
+}
+
+/*
+ * Per-queue counters and the latency histogram, from the values print_stats
+ * has just read. The log2 slots do not keep the sum of the latencies, so the
+ * histogram has no _sum.
+ */
+static void render_metrics(struct stats_ctx *stats) {
+    struct metrics *m = stats->metrics;
+    char labels[64];
+    __u64 cum = 0;
+
+    metrics_begin(m);
+
+    metrics_family(m, "xdp_md_rx_queue_packets_total", "counter", "Packets seen by the XDP program per RX queue");
+    for (int q = 0; q < stats->num_queues; q++) {
+        if (stats->prev[q].rx_packets == 0)
+            continue;
+        snprintf(labels, sizeof(labels), "queue=\"%d\"", q);
+        metrics_u64(m, "xdp_md_rx_queue_packets_total", labels, stats->prev[q].rx_packets);
+    }
+
+    metrics_family(m, "xdp_md_rx_queue_bytes_total", "counter", "Bytes seen by the XDP program per RX queue");
+    for (int q = 0; q < stats->num_queues; q++) {
+        if (stats->prev[q].rx_packets == 0)
+            continue;
+        snprintf(labels, sizeof(labels), "queue=\"%d\"", q);
+        metrics_u64(m, "xdp_md_rx_queue_bytes_total", labels, stats->prev[q].rx_bytes);
+    }
+
+    metrics_family(m, "xdp_md_driver_latency_seconds", "histogram",
+                   "Time between the HW RX timestamp and the XDP program");
+    for (int i = 0; i < LAT_HIST_SLOTS - 1; i++) {
+        cum += stats->prev_hist.slots[i];
+        snprintf(labels, sizeof(labels), "le=\"%g\"", (double)(1ULL << (i + 1)) / 1e9);
+        metrics_u64(m, "xdp_md_driver_latency_seconds_bucket", labels, cum);
+    }
+    cum += stats->prev_hist.slots[LAT_HIST_SLOTS - 1];
+    metrics_u64(m, "xdp_md_driver_latency_seconds_bucket", "le=\"+Inf\"", cum);
+    metrics_u64(m, "xdp_md_driver_latency_seconds_count", NULL, cum);
+
+    metrics_family(m, "xdp_md_no_hw_timestamp_total", "counter", "Packets without a HW RX timestamp");
+    metrics_u64(m, "xdp_md_no_hw_timestamp_total", NULL, stats->prev_hist.no_hw_ts);
+    prog_stats_render_metrics(m, &stats->progs);
+
+    metrics_commit(m);
+}
+
+/* Called every --interval by the event loop */
+static void print_stats(void *ctx, double elapsed) {
+    struct stats_ctx *stats = ctx;
+    struct xdp_with_md_bpf *skel = stats->skel;
+    struct datarec curr[MAX_RX_QUEUES];
+
+    if (read_queue_stats(bpf_map__fd(skel->maps.xdp_stats_map), curr, stats->num_queues, stats->keys,
+                         stats->values)) {
+        log_error("Error while retrieving the value from the map");
+        return;
+    }
+
+    print_queue_stats(curr, stats->prev, stats->num_queues, elapsed);
+    memcpy(stats->prev, curr, stats->num_queues * sizeof(curr[0]));
+    prog_stats_print(&stats->progs, elapsed);
+
+    print_lat_hist(bpf_map__fd(skel->maps.lat_hist_map), &stats->prev_hist);
+    print_top_flows(bpf_map__fd(skel->maps.flow_stats_map));
+    if (stats->tc)
+        tc_meta_print_stats(bpf_map__fd(skel->maps.tc_stats_map), stats->prev_tc);
+
+    if (metrics_enabled(stats->metrics))
+        render_metrics(stats);
 }
 
 int main(int argc, const char **argv) {
     struct xdp_with_md_bpf *skel = NULL;
+    struct event_loop loop = {0};
+    struct metrics metrics = {0};
+    /* Large (per-queue counters), keep it off the stack */
+    static struct stats_ctx stats;
+    int metrics_port = 0;
     int err;
     const char *iface = NULL;
+    const char *clock = "tai";
+    const char *steer = NULL;
+    __u32 steer_cpus[MAX_STEER_CPUS];
+    int num_steer_cpus = 0;
+    int flow_table_size = 0;
+    float interval = 1;
+    int xsk_enabled = 0;
+    int xsk_queue = 0;
+    int tc = 0;
+    const char *classes = NULL;
+    const char *xdp_mode = NULL;
+    struct xsk_consumer xsk = {.fd = -1};
 
     struct argparse_option options[] = {
         OPT_HELP(),
         OPT_GROUP("Basic options"),
         OPT_STRING('i', "iface", &iface, "Interface where to attach the BPF program",
                    NULL, 0, 0),
+        OPT_STRING(0, "xdp-mode", &xdp_mode,
+                   "XDP mode: drv (default), skb or hw, falls back to the slower ones", NULL, 0, 0),
+        OPT_FLOAT('I', "interval", &interval,
+                  "Statistics interval in seconds (default 1, at least 0.01)", NULL, 0, 0),
+        OPT_INTEGER(0, "metrics-port", &metrics_port,
+                    "Serve Prometheus metrics on 127.0.0.1:<port>/metrics", NULL, 0, 0),
+        OPT_STRING('C', "clock", &clock,
+                   "Clock domain of the HW timestamps: tai (default) or mono", NULL, 0, 0),
+        OPT_STRING('s', "steer", &steer,
+                   "Comma separated list of CPUs where flows are steered by RSS hash", NULL, 0, 0),
+        OPT_INTEGER('F', "flow-table-size", &flow_table_size,
+                    "Number of flows tracked in the per-flow counters (default 16384)", NULL, 0, 0),
+        OPT_BOOLEAN('x', "xsk", &xsk_enabled,
+                    "Redirect the frames carrying xdp_meta to an AF_XDP socket and analyze them",
+                    NULL, 0, 0),
+        OPT_INTEGER('q', "xsk-queue", &xsk_queue, "RX queue the AF_XDP socket is bound to (default 0)",
+                    NULL, 0, 0),
+        OPT_BOOLEAN('t', "tc", &tc,
+                    "Attach the TC ingress program applying the XDP classification", NULL, 0, 0),
+        OPT_STRING('k', "classes", &classes,
+                   "UDP classes as port:mark:priority, comma separated", NULL, 0, 0),
         OPT_END(),
     };
 
@@ -125,21 +528,27 @@ int main(int argc, const char **argv) {
                       "put in promiscuous mode");
     argc = argparse_parse(&argparse, argc, argv);
 
-    if (iface != NULL) {
-        log_info("XDP program will be attached to %s interface", iface);
-        ifindex_iface = if_nametoindex(iface);
-        if (!ifindex_iface) {
-            log_fatal("Error while retrieving the ifindex of %s", iface);
-            exit(1);
-        } else {
-            log_info("Got ifindex for iface: %s, which is %d", iface, ifindex_iface);
-        }
-    } else {
-        log_error("Error, you must specify the interface where to attach the XDP "
-                  "program");
+    if (xdp_attach_parse_mode(xdp_mode, &xdp_ifaces.mode))
+        exit(1);
+
+    ifindex_iface = xdp_attach_add_iface(&xdp_ifaces, iface, NULL);
+    if (ifindex_iface < 0)
+        exit(1);
+
+    if (event_loop_check_interval(interval))
+        exit(1);
+
+    if (strcmp(clock, "tai") != 0 && strcmp(clock, "mono") != 0) {
+        log_fatal("Unknown clock %s, must be tai or mono", clock);
         exit(1);
     }
 
+    if (steer != NULL) {
+        num_steer_cpus = parse_cpu_list(steer, steer_cpus);
+        if (num_steer_cpus <= 0)
+            exit(1);
+    }
+
     /* Open BPF application */
     skel = xdp_with_md_bpf__open();
     if (!skel) {
@@ -147,6 +556,13 @@ int main(int argc, const char **argv) {
         exit(1);
     }
 
+    skel->rodata->lat_cfg.clock = strcmp(clock, "mono") == 0 ? LAT_CLOCK_MONO : LAT_CLOCK_TAI;
+    skel->rodata->steer_cfg.num_cpus = num_steer_cpus;
+    skel->rodata->xsk_cfg.enabled = xsk_enabled;
+
+    if (flow_table_size > 0)
+        bpf_map__set_max_entries(skel->maps.flow_stats_map, flow_table_size);
+
     /* Set program type to XDP */
     bpf_program__set_type(skel->progs.xdp_prog_map, BPF_PROG_TYPE_XDP);
     bpf_program__set_ifindex(skel->progs.xdp_prog_map, ifindex_iface);
@@ -172,26 +588,61 @@ int main(int argc, const char **argv) {
         goto cleanup;
     }
 
-    xdp_flags = 0;
-    xdp_flags |= XDP_FLAGS_DRV_MODE;
+    if (num_steer_cpus > 0 && setup_steering(skel, steer_cpus, num_steer_cpus)) {
+        err = -1;
+        goto cleanup;
+    }
 
-    /* Attach the XDP program to the interface */
-    err = bpf_xdp_attach(ifindex_iface, bpf_program__fd(skel->progs.xdp_prog_map),
-                         xdp_flags, NULL);
+    if (classes != NULL && tc_meta_load_classes(classes, skel->maps.class_map)) {
+        err = -1;
+        goto cleanup;
+    }
+
+    if (xsk_enabled) {
+        if (xsk_consumer_create(&xsk, ifindex_iface, xsk_queue, bpf_map__fd(skel->maps.xsks_map))) {
+            err = -1;
+            goto cleanup;
+        }
+    }
 
+    /* Attach the XDP program to the interface */
+    err = xdp_attach_all(&xdp_ifaces, bpf_program__fd(skel->progs.xdp_prog_map));
     if (err) {
         log_fatal("Error while attaching the XDP program to the interface");
         goto cleanup;
     }
 
+    if (tc) {
+        err = tc_meta_attach(&tc_attach, skel->progs.tc_apply_meta, ifindex_iface);
+        if (err)
+            goto cleanup;
+    }
+
     log_info("Successfully attached!");
 
-    sleep(1);
+    /* Before the AF_XDP threads start, so that they inherit the signal mask */
+    err = stats_init(&stats, skel, tc, &metrics);
+    if (!err)
+        err = event_loop_init(&loop, interval, print_stats, &stats);
+    if (!err)
+        err = metrics_init(&metrics, &loop, metrics_port, 0);
+    if (err)
+        goto cleanup;
+
+    if (xsk_enabled && xsk_consumer_start(&xsk)) {
+        err = -1;
+        goto cleanup;
+    }
 
-    poll_stats(skel);
+    err = event_loop_run(&loop);
 
 cleanup:
+    metrics_destroy(&metrics);
+    stats_destroy(&stats);
+    event_loop_destroy(&loop);
     cleanup_ifaces();
+    if (xsk_enabled)
+        xsk_consumer_destroy(&xsk);
     xdp_with_md_bpf__destroy(skel);
     log_info("Program stopped correctly");
     return -err;
@@ -0,0 +1,391 @@
+#ifndef XSK_CONSUMER_H_
+#define XSK_CONSUMER_H_
+
+#include <bpf/bpf.h>
+#include <errno.h>
+#include <linux/if_xdp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "ebpf/xdp_metadata.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define XSK_RING_SIZE 2048
+#define XSK_NUM_FRAMES XSK_RING_SIZE
+#define XSK_FRAME_SIZE 4096
+#define XSK_RX_BATCH 64
+#define MD_RING_SIZE (1 << 16)
+/* Longest wait of the RX thread, bounds the time to stop it */
+#define XSK_POLL_TIMEOUT_MS 100
+
+/* What the consumer keeps of each frame for the analysis thread */
+struct md_record {
+    __u64 rx_timestamp;
+    __u64 xdp_timestamp;
+    __u32 rx_hash;
+    __u32 rx_hash_type;
+    __u16 rx_vlan_tci;
+    __u16 hint_valid;
+    __u32 len;
+};
+
+/*
+ * Single-producer single-consumer ring between the AF_XDP consumer and the
+ * analysis thread. head and tail live on different cache lines so that the
+ * two threads never write the same line.
+ */
+struct md_ring {
+    __u64 head __attribute__((aligned(64)));
+    __u64 tail __attribute__((aligned(64)));
+    __u64 dropped __attribute__((aligned(64)));
+    struct md_record slots[MD_RING_SIZE];
+};
+
+static inline bool md_ring_push(struct md_ring *r, const struct md_record *rec) {
+    __u64 head = r->head;
+
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == MD_RING_SIZE) {
+        r->dropped++;
+        return false;
+    }
+
+    r->slots[head & (MD_RING_SIZE - 1)] = *rec;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+static inline bool md_ring_pop(struct md_ring *r, struct md_record *rec) {
+    __u64 tail = r->tail;
+
+    if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+        return false;
+
+    *rec = r->slots[tail & (MD_RING_SIZE - 1)];
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/* Userspace view of one of the rings shared with the kernel */
+struct xsk_ring {
+    __u32 *producer;
+    __u32 *consumer;
+    __u32 *flags;
+    void *ring;
+    __u32 mask;
+    __u32 size;
+    void *map;
+    size_t map_len;
+};
+
+struct xsk_consumer {
+    int fd;
+    int ifindex;
+    __u32 queue;
+    void *umem;
+    struct xsk_ring fill;
+    struct xsk_ring comp;
+    struct xsk_ring rx;
+    struct md_ring *md;
+    bool zero_copy;
+    __u64 rx_frames;
+    /* Set to stop the threads, which are joined before anything is freed */
+    bool stop;
+    pthread_t threads[2];
+    int nthreads;
+};
+
+static int xsk_mmap_ring(int fd, struct xsk_ring *r, struct xdp_ring_offset *off, __u32 size,
+                         size_t desc_size, off_t pgoff) {
+    r->map_len = off->desc + size * desc_size;
+    r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (r->map == MAP_FAILED) {
+        r->map = NULL;
+        return -errno;
+    }
+
+    r->producer = r->map + off->producer;
+    r->consumer = r->map + off->consumer;
+    r->flags = r->map + off->flags;
+    r->ring = r->map + off->desc;
+    r->size = size;
+    r->mask = size - 1;
+
+    return 0;
+}
+
+/* Give the frames back to the kernel through the fill ring */
+static void xsk_refill(struct xsk_consumer *xsk, const __u64 *addrs, __u32 n) {
+    __u32 prod = *xsk->fill.producer;
+    __u64 *ring = xsk->fill.ring;
+
+    for (__u32 i = 0; i < n; i++)
+        ring[(prod + i) & xsk->fill.mask] = addrs[i];
+
+    __atomic_store_n(xsk->fill.producer, prod + n, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n(xsk->fill.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)
+        recvfrom(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+static void xsk_consumer_stop(struct xsk_consumer *xsk) {
+    __atomic_store_n(&xsk->stop, true, __ATOMIC_RELEASE);
+
+    for (int i = 0; i < xsk->nthreads; i++)
+        pthread_join(xsk->threads[i], NULL);
+    xsk->nthreads = 0;
+}
+
+static void xsk_consumer_destroy(struct xsk_consumer *xsk) {
+    /* The threads read the rings and the UMEM */
+    xsk_consumer_stop(xsk);
+
+    if (xsk->rx.map)
+        munmap(xsk->rx.map, xsk->rx.map_len);
+    if (xsk->comp.map)
+        munmap(xsk->comp.map, xsk->comp.map_len);
+    if (xsk->fill.map)
+        munmap(xsk->fill.map, xsk->fill.map_len);
+    if (xsk->fd >= 0)
+        close(xsk->fd);
+    if (xsk->umem)
+        munmap(xsk->umem, (size_t)XSK_NUM_FRAMES * XSK_FRAME_SIZE);
+    free(xsk->md);
+    memset(xsk, 0, sizeof(*xsk));
+    xsk->fd = -1;
+}
+
+/*
+ * Create an AF_XDP socket bound to ifindex/queue and register it in xsks_map.
+ * Zero-copy is tried first, the copy mode is used if the driver lacks it.
+ */
+static int xsk_consumer_create(struct xsk_consumer *xsk, int ifindex, __u32 queue, int xsks_map_fd) {
+    struct xdp_umem_reg mr = {0};
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    struct sockaddr_xdp sxdp = {0};
+    int ring_size = XSK_RING_SIZE;
+    __u64 addrs[XSK_RING_SIZE];
+    int err;
+
+    memset(xsk, 0, sizeof(*xsk));
+    xsk->ifindex = ifindex;
+    xsk->queue = queue;
+
+    xsk->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (xsk->fd < 0) {
+        log_error("Error while creating the AF_XDP socket: %s", strerror(errno));
+        return -1;
+    }
+
+    xsk->umem = mmap(NULL, (size_t)XSK_NUM_FRAMES * XSK_FRAME_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (xsk->umem == MAP_FAILED) {
+        xsk->umem = NULL;
+        log_error("Error while allocating the UMEM: %s", strerror(errno));
+        goto err;
+    }
+
+    mr.addr = (__u64)(unsigned long)xsk->umem;
+    mr.len = (__u64)XSK_NUM_FRAMES * XSK_FRAME_SIZE;
+    mr.chunk_size = XSK_FRAME_SIZE;
+
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size)) ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)) ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size))) {
+        log_error("Error while configuring the AF_XDP rings: %s", strerror(errno));
+        goto err;
+    }
+
+    if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen)) {
+        log_error("Error while reading the AF_XDP ring offsets: %s", strerror(errno));
+        goto err;
+    }
+
+    if (xsk_mmap_ring(xsk->fd, &xsk->fill, &off.fr, ring_size, sizeof(__u64), XDP_UMEM_PGOFF_FILL_RING) ||
+        xsk_mmap_ring(xsk->fd, &xsk->comp, &off.cr, ring_size, sizeof(__u64),
+                      XDP_UMEM_PGOFF_COMPLETION_RING) ||
+        xsk_mmap_ring(xsk->fd, &xsk->rx, &off.rx, ring_size, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING)) {
+        log_error("Error while mapping the AF_XDP rings: %s", strerror(errno));
+        goto err;
+    }
+
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = ifindex;
+    sxdp.sxdp_queue_id = queue;
+    sxdp.sxdp_flags = XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP;
+    xsk->zero_copy = true;
+
+    if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp))) {
+        log_warn("Zero-copy not supported on queue %u (%s), using copy mode", queue, strerror(errno));
+        sxdp.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+        xsk->zero_copy = false;
+        if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp))) {
+            log_error("Error while binding the AF_XDP socket: %s", strerror(errno));
+            goto err;
+        }
+    }
+
+    /* Every frame starts in the fill ring */
+    for (int i = 0; i < XSK_RING_SIZE; i++)
+        addrs[i] = (__u64)i * XSK_FRAME_SIZE;
+    xsk_refill(xsk, addrs, XSK_RING_SIZE);
+
+    xsk->md = aligned_alloc(64, sizeof(*xsk->md));
+    if (!xsk->md) {
+        log_error("Error while allocating the metadata ring");
+        goto err;
+    }
+    memset(xsk->md, 0, sizeof(*xsk->md));
+
+    err = bpf_map_update_elem(xsks_map_fd, &queue, &xsk->fd, BPF_ANY);
+    if (err) {
+        log_error("Error while adding the AF_XDP socket to xsks_map: %s", strerror(errno));
+        goto err;
+    }
+
+    log_info("AF_XDP socket bound to queue %u in %s mode", queue, xsk->zero_copy ? "zero-copy" : "copy");
+
+    return 0;
+
+err:
+    xsk_consumer_destroy(xsk);
+    return -1;
+}
+
+/*
+ * RX loop: the XDP program put struct xdp_meta right in front of each frame,
+ * so it is read in place from the UMEM and handed to the analysis thread.
+ */
+static void *xsk_consumer_thread(void *arg) {
+    struct xsk_consumer *xsk = arg;
+    struct pollfd pfd = {.fd = xsk->fd, .events = POLLIN};
+    struct xdp_desc *descs = xsk->rx.ring;
+    __u64 addrs[XSK_RX_BATCH];
+
+    while (!__atomic_load_n(&xsk->stop, __ATOMIC_ACQUIRE)) {
+        __u32 cons = *xsk->rx.consumer;
+        __u32 avail = __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE) - cons;
+        __u32 n = avail < XSK_RX_BATCH ? avail : XSK_RX_BATCH;
+
+        if (n == 0) {
+            poll(&pfd, 1, XSK_POLL_TIMEOUT_MS);
+            continue;
+        }
+
+        for (__u32 i = 0; i < n; i++) {
+            const struct xdp_desc *desc = &descs[(cons + i) & xsk->rx.mask];
+            const struct xdp_meta *meta = xsk->umem + desc->addr - sizeof(struct xdp_meta);
+            struct md_record rec = {
+                .rx_timestamp = meta->rx_timestamp,
+                .xdp_timestamp = meta->xdp_timestamp,
+                .rx_hash = meta->rx_hash,
+                .rx_hash_type = meta->rx_hash_type,
+                .rx_vlan_tci = meta->rx_vlan_tci,
+                .hint_valid = meta->hint_valid,
+                .len = desc->len,
+            };
+
+            md_ring_push(xsk->md, &rec);
+            addrs[i] = desc->addr & ~((__u64)XSK_FRAME_SIZE - 1);
+        }
+
+        __atomic_store_n(xsk->rx.consumer, cons + n, __ATOMIC_RELEASE);
+        xsk_refill(xsk, addrs, n);
+        xsk->rx_frames += n;
+    }
+
+    return NULL;
+}
+
+struct md_stats {
+    __u64 records;
+    __u64 bytes;
+    __u64 with_ts;
+    __u64 with_hash;
+    __u64 with_vlan;
+    __u64 lat_sum_ns;
+    __u64 lat_max_ns;
+};
+
+/* Analysis side: drain the metadata ring and print a summary every interval */
+static void *md_analysis_thread(void *arg) {
+    struct xsk_consumer *xsk = arg;
+    struct md_stats stats = {0};
+    struct md_record rec;
+    __u64 last = 0;
+
+    while (!__atomic_load_n(&xsk->stop, __ATOMIC_ACQUIRE)) {
+        struct timespec ts;
+        __u64 now;
+
+        while (md_ring_pop(xsk->md, &rec)) {
+            stats.records++;
+            stats.bytes += rec.len;
+            if (rec.hint_valid & XDP_META_FIELD_RSS)
+                stats.with_hash++;
+            if (rec.hint_valid & XDP_META_FIELD_VLAN_TAG)
+                stats.with_vlan++;
+            if ((rec.hint_valid & XDP_META_FIELD_TS) && rec.xdp_timestamp > rec.rx_timestamp) {
+                __u64 lat = rec.xdp_timestamp - rec.rx_timestamp;
+
+                stats.with_ts++;
+                stats.lat_sum_ns += lat;
+                if (lat > stats.lat_max_ns)
+                    stats.lat_max_ns = lat;
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        now = ts.tv_sec;
+        if (now != last && stats.records != 0) {
+            log_info("AF_XDP queue %u: %llu frames (%llu bytes), %llu with HW ts "
+                     "(avg %.2f us, max %.2f us), %llu with RSS hash, %llu VLAN tagged, %llu dropped",
+                     xsk->queue, stats.records, stats.bytes, stats.with_ts,
+                     stats.with_ts ? stats.lat_sum_ns / 1000.0 / stats.with_ts : 0.0,
+                     stats.lat_max_ns / 1000.0, stats.with_hash, stats.with_vlan,
+                     __atomic_load_n(&xsk->md->dropped, __ATOMIC_RELAXED));
+            memset(&stats, 0, sizeof(stats));
+        }
+        last = now;
+
+        usleep(1000);
+    }
+
+    return NULL;
+}
+
+static int xsk_consumer_start(struct xsk_consumer *xsk) {
+    void *(*const fns[])(void *) = {xsk_consumer_thread, md_analysis_thread};
+
+    xsk->stop = false;
+    for (int i = 0; i < sizeof(fns) / sizeof(fns[0]); i++) {
+        if (pthread_create(&xsk->threads[i], NULL, fns[i], xsk)) {
+            log_error("Error while starting the AF_XDP threads");
+            xsk_consumer_stop(xsk);
+            return -1;
+        }
+        xsk->nthreads++;
+    }
+
+    return 0;
+}
+
+#endif // XSK_CONSUMER_H_
@@ -0,0 +1,649 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <bpf/bpf.h>
+#include <bpf/btf.h>
+#include <bpf/libbpf.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <linux/if_link.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <argparse.h>
+#include <net/if.h>
+
+#ifndef __USE_POSIX
+#define __USE_POSIX
+#endif
+#include <signal.h>
+
+#include "log.h"
+#include "dispatcher.h"
+#include "event_loop.h"
+#include "prog_stats.h"
+#include "ebpf/map_values.h"
+
+static const char *const usages[] = {
+    "dispatcher [options] [[--] args]",
+    "dispatcher [options]",
+    NULL,
+};
+
+static int load_stage_rules(struct stage *st, const char *rules_file) {
+    struct rules *rules;
+    cyaml_err_t err;
+    int ret = 0;
+
+    if (st->type == STAGE_COUNTER) {
+        return 0;
+    }
+
+    if (rules_file == NULL) {
+        log_warn("No rules given for stage %s, its maps are left empty", st->name);
+        return 0;
+    }
+
+    err = cyaml_load_file(rules_file, &config, &rules_schema, (void **)&rules, NULL);
+    if (err != CYAML_OK) {
+        log_error("Error while loading %s: %s", rules_file, cyaml_strerror(err));
+        return -1;
+    }
+
+    for (int i = 0; i < rules->ips_count; i++) {
+        struct in_addr addr;
+
+        if (inet_pton(AF_INET, rules->ips[i].ip, &addr) != 1) {
+            log_error("Failed to convert IP %s to integer", rules->ips[i].ip);
+            ret = -1;
+            break;
+        }
+
+        if (st->type == STAGE_DROP_IP) {
+            struct datarec value = {0};
+
+            ret = bpf_map__update_elem(st->skel.drop_ip->maps.xdp_stats_map, &addr.s_addr,
+                                       sizeof(addr.s_addr), &value, sizeof(value), BPF_ANY);
+        } else {
+            struct value_t value = {
+                .threshold = rules->ips[i].threshold,
+                .packets_rcvd = 0,
+            };
+            __u32 port = rules->ips[i].port;
+
+            ret = bpf_map__update_elem(st->skel.hhd_v1->maps.threshold_map, &addr.s_addr,
+                                       sizeof(addr.s_addr), &value, sizeof(value), BPF_ANY);
+            if (ret == 0) {
+                ret = bpf_map__update_elem(st->skel.hhd_v1->maps.ip_to_port, &addr.s_addr,
+                                           sizeof(addr.s_addr), &port, sizeof(port), BPF_ANY);
+            }
+        }
+
+        if (ret != 0) {
+            log_error("Failed to update the maps of stage %s: %s", st->name, strerror(errno));
+            break;
+        }
+    }
+
+    log_info("Loaded %llu rules in stage %s", rules->ips_count, st->name);
+    cyaml_free(&config, &rules_schema, rules, 0);
+
+    return ret;
+}
+
+static void unload_stage(struct stage *st) {
+    bpf_link__destroy(st->link);
+    st->link = NULL;
+
+    switch (st->type) {
+        case STAGE_COUNTER:
+            counting_with_maps_bpf__destroy(st->skel.counter);
+            break;
+        case STAGE_DROP_IP:
+            drop_ip_bpf__destroy(st->skel.drop_ip);
+            break;
+        case STAGE_HHD_V1:
+            hhd_v1_bpf__destroy(st->skel.hhd_v1);
+            break;
+    }
+
+    memset(st, 0, sizeof(*st));
+}
+
+/*
+ * Open the stage skeleton, turn its XDP program into an EXT program targeting
+ * the given dispatcher slot and attach it with freplace.
+ */
+static int load_stage(struct dispatcher_bpf *skel, __u32 slot, struct stage *st,
+                      const char *rules_file) {
+    int dispatcher_fd = bpf_program__fd(skel->progs.xdp_dispatcher);
+    struct bpf_program *prog = NULL;
+    char slot_func[16];
+    int err = 0;
+
+    snprintf(slot_func, sizeof(slot_func), "stage_%u", slot);
+
+    switch (st->type) {
+        case STAGE_COUNTER:
+            st->skel.counter = counting_with_maps_bpf__open();
+            if (!st->skel.counter)
+                goto err_open;
+            prog = st->skel.counter->progs.xdp_prog_map;
+            break;
+        case STAGE_DROP_IP:
+            if (st->n_ifaces < 1) {
+                log_error("Stage %s needs the interface where to redirect clean traffic", st->name);
+                return -1;
+            }
+            st->skel.drop_ip = drop_ip_bpf__open();
+            if (!st->skel.drop_ip)
+                goto err_open;
+            st->skel.drop_ip->rodata->drop_ip_cfg.ifindex_if1 = ifindex_iface;
+            st->skel.drop_ip->rodata->drop_ip_cfg.ifindex_if2 = st->ifindex[0];
+            bpf_map__set_max_entries(st->skel.drop_ip->maps.flow_cache, 1);
+            bpf_map__set_max_entries(st->skel.drop_ip->maps.conntrack, 1);
+            prog = st->skel.drop_ip->progs.xdp_drop_by_ip;
+            break;
+        case STAGE_HHD_V1:
+            if (st->n_ifaces < 4) {
+                log_error("Stage %s needs 4 interfaces", st->name);
+                return -1;
+            }
+            st->skel.hhd_v1 = hhd_v1_bpf__open();
+            if (!st->skel.hhd_v1)
+                goto err_open;
+            st->skel.hhd_v1->rodata->hhdv1_cfg.ifindex_if1 = st->ifindex[0];
+            st->skel.hhd_v1->rodata->hhdv1_cfg.ifindex_if2 = st->ifindex[1];
+            st->skel.hhd_v1->rodata->hhdv1_cfg.ifindex_if3 = st->ifindex[2];
+            st->skel.hhd_v1->rodata->hhdv1_cfg.ifindex_if4 = st->ifindex[3];
+            bpf_map__set_max_entries(st->skel.hhd_v1->maps.flow_cache, 1);
+            prog = st->skel.hhd_v1->progs.xdp_hhdv1;
+            break;
+    }
+
+    bpf_program__set_type(prog, BPF_PROG_TYPE_EXT);
+    err = bpf_program__set_attach_target(prog, dispatcher_fd, slot_func);
+    if (err) {
+        log_error("Error while setting the attach target of stage %s", st->name);
+        goto err_unload;
+    }
+
+    switch (st->type) {
+        case STAGE_COUNTER:
+            err = counting_with_maps_bpf__load(st->skel.counter);
+            break;
+        case STAGE_DROP_IP:
+            err = drop_ip_bpf__load(st->skel.drop_ip);
+            break;
+        case STAGE_HHD_V1:
+            err = hhd_v1_bpf__load(st->skel.hhd_v1);
+            break;
+    }
+
+    if (err) {
+        log_error("Error while loading stage %s", st->name);
+        goto err_unload;
+    }
+
+    err = load_stage_rules(st, rules_file);
+    if (err) {
+        goto err_unload;
+    }
+
+    st->link = bpf_program__attach_freplace(prog, dispatcher_fd, slot_func);
+    if (!st->link) {
+        err = -errno;
+        log_error("Error while attaching stage %s to %s: %s", st->name, slot_func, strerror(errno));
+        goto err_unload;
+    }
+
+    st->used = true;
+    log_info("Stage %s (%s) attached to %s", st->name, stage_type_names[st->type], slot_func);
+
+    return 0;
+
+err_open:
+    log_error("Error while opening the skeleton of stage %s", st->name);
+    return -1;
+
+err_unload:
+    unload_stage(st);
+    return err ? err : -1;
+}
+
+/*
+ * Outer map-in-map used to wait for the datapath: the kernel runs
+ * synchronize_rcu() after each update of an outer map from userspace, and the
+ * XDP programs run under rcu_read_lock(), so no packet still holds a pointer
+ * obtained before the update once it returns.
+ */
+static int rcu_sync_fd = -1;
+static int rcu_sync_inner_fd = -1;
+
+static int rcu_sync_init(void) {
+    LIBBPF_OPTS(bpf_map_create_opts, opts);
+
+    rcu_sync_inner_fd = bpf_map_create(BPF_MAP_TYPE_ARRAY, "rcu_sync_inner", sizeof(__u32), sizeof(__u32), 1, NULL);
+    if (rcu_sync_inner_fd < 0) {
+        log_error("Error while creating the RCU sync map: %s", strerror(errno));
+        return -1;
+    }
+
+    opts.inner_map_fd = rcu_sync_inner_fd;
+    rcu_sync_fd = bpf_map_create(BPF_MAP_TYPE_ARRAY_OF_MAPS, "rcu_sync", sizeof(__u32), sizeof(__u32), 1, &opts);
+    if (rcu_sync_fd < 0) {
+        log_error("Error while creating the RCU sync map: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int wait_for_datapath(void) {
+    __u32 key = 0;
+
+    if (bpf_map_update_elem(rcu_sync_fd, &key, &rcu_sync_inner_fd, BPF_ANY)) {
+        log_error("Error while waiting for the datapath to leave the old chain: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void close_rcu_sync(void) {
+    if (rcu_sync_fd >= 0)
+        close(rcu_sync_fd);
+    if (rcu_sync_inner_fd >= 0)
+        close(rcu_sync_inner_fd);
+}
+
+/*
+ * Write the chain ordered by priority into the unused configuration entry and
+ * flip the active one, so the datapath switches to the new chain at once.
+ * The packets already in the dispatcher may still read the old entry, it is
+ * only handed back as the unused one once they are gone: the next commit can
+ * rewrite it and del_stage can unload the stage it just removed.
+ */
+static int commit_chain(struct dispatcher_bpf *skel) {
+    struct dispatcher_cfg cfg = {0};
+    __u32 next = (skel->bss->active_cfg + 1) & 1;
+    int err;
+
+    for (;;) {
+        int best = -1;
+
+        for (int i = 0; i < DISPATCHER_MAX_STAGES; i++) {
+            bool queued = false;
+
+            if (!stages[i].used)
+                continue;
+
+            for (int j = 0; j < cfg.num_stages; j++) {
+                if (cfg.slot[j] == i)
+                    queued = true;
+            }
+
+            if (!queued && (best < 0 || stages[i].priority < stages[best].priority))
+                best = i;
+        }
+
+        if (best < 0)
+            break;
+
+        cfg.slot[cfg.num_stages] = best;
+        cfg.chain_on[cfg.num_stages] = stages[best].chain_on;
+        cfg.num_stages++;
+    }
+
+    err = bpf_map__update_elem(skel->maps.dispatcher_cfg_map, &next, sizeof(next), &cfg,
+                               sizeof(cfg), BPF_ANY);
+    if (err) {
+        log_error("Error while updating the dispatcher configuration: %s", strerror(errno));
+        return err;
+    }
+
+    __atomic_store_n(&skel->bss->active_cfg, next, __ATOMIC_SEQ_CST);
+
+    return wait_for_datapath();
+}
+
+static struct stage *find_stage(const char *name) {
+    for (int i = 0; i < DISPATCHER_MAX_STAGES; i++) {
+        if (stages[i].used && strcmp(stages[i].name, name) == 0)
+            return &stages[i];
+    }
+
+    return NULL;
+}
+
+static int add_stage(struct dispatcher_bpf *skel, const char *name, const char *type,
+                     int priority, const char *chain_on, const char *rules_file,
+                     const char **ifaces, int n_ifaces) {
+    struct stage *st = NULL;
+    __u32 slot;
+    int err;
+
+    if (find_stage(name) != NULL) {
+        log_error("Stage %s already exists", name);
+        return -1;
+    }
+
+    for (slot = 0; slot < DISPATCHER_MAX_STAGES; slot++) {
+        if (!stages[slot].used) {
+            st = &stages[slot];
+            break;
+        }
+    }
+
+    if (st == NULL) {
+        log_error("No free dispatcher slot for stage %s", name);
+        return -1;
+    }
+
+    memset(st, 0, sizeof(*st));
+    snprintf(st->name, sizeof(st->name), "%s", name);
+    st->priority = priority;
+
+    if (parse_stage_type(type, &st->type) || parse_chain_on(chain_on, &st->chain_on)) {
+        return -1;
+    }
+
+    if (n_ifaces > MAX_STAGE_IFACES) {
+        log_error("Too many interfaces for stage %s", name);
+        return -1;
+    }
+
+    for (int i = 0; i < n_ifaces; i++) {
+        st->ifindex[i] = if_nametoindex(ifaces[i]);
+        if (!st->ifindex[i]) {
+            log_error("Error while retrieving the ifindex of %s", ifaces[i]);
+            return -1;
+        }
+    }
+    st->n_ifaces = n_ifaces;
+
+    err = load_stage(skel, slot, st, rules_file);
+    if (err) {
+        return err;
+    }
+
+    /* The stage is attached to its slot, now make it part of the chain */
+    return commit_chain(skel);
+}
+
+static int del_stage(struct dispatcher_bpf *skel, const char *name) {
+    struct stage *st = find_stage(name);
+    int err;
+
+    if (st == NULL) {
+        log_error("Stage %s does not exist", name);
+        return -1;
+    }
+
+    /* Remove the stage from the chain before detaching it from its slot */
+    st->used = false;
+    err = commit_chain(skel);
+    if (err) {
+        st->used = true;
+        return err;
+    }
+
+    unload_stage(st);
+    log_info("Stage %s removed", name);
+
+    return 0;
+}
+
+static int load_dispatcher_config(const char *config_file, struct dispatcher_bpf *skel) {
+    struct dispatcher_config *cfg;
+    cyaml_err_t err;
+    int ret = 0;
+
+    err = cyaml_load_file(config_file, &config, &dispatcher_schema, (void **)&cfg, NULL);
+    if (err != CYAML_OK) {
+        fprintf(stderr, "ERROR: %s\n", cyaml_strerror(err));
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < cfg->stages_count; i++) {
+        struct stage_config *sc = &cfg->stages[i];
+
+        ret = add_stage(skel, sc->name, sc->type, sc->priority, sc->chain_on, sc->config,
+                        sc->ifaces, sc->ifaces_count);
+        if (ret) {
+            log_error("Error while adding stage %s", sc->name);
+            break;
+        }
+    }
+
+    cyaml_free(&config, &dispatcher_schema, cfg, 0);
+
+    return ret;
+}
+
+static void list_stages(struct dispatcher_bpf *skel) {
+    for (int i = 0; i < DISPATCHER_MAX_STAGES; i++) {
+        if (!stages[i].used)
+            continue;
+
+        log_info("slot %d: %s (%s), priority %d, chain on 0x%x", i, stages[i].name,
+                 stage_type_names[stages[i].type], stages[i].priority, stages[i].chain_on);
+    }
+}
+
+/*
+ * Runtime commands, one per line on stdin or on the --ctrl socket:
+ *   add <name> <type> <priority> <chain_on> <rules|-> [iface...]
+ *   del <name>
+ *   list
+ */
+static void handle_command(struct dispatcher_bpf *skel, char *line) {
+    const char *argv[6 + MAX_STAGE_IFACES] = {0};
+    char *saveptr;
+    int argc = 0;
+
+    for (char *tok = strtok_r(line, " \t\n", &saveptr); tok != NULL && argc < 6 + MAX_STAGE_IFACES;
+         tok = strtok_r(NULL, " \t\n", &saveptr)) {
+        argv[argc++] = tok;
+    }
+
+    if (argc == 0) {
+        return;
+    }
+
+    if (strcmp(argv[0], "add") == 0 && argc >= 6) {
+        const char *rules_file = strcmp(argv[5], "-") == 0 ? NULL : argv[5];
+
+        add_stage(skel, argv[1], argv[2], atoi(argv[3]), argv[4], rules_file, &argv[6], argc - 6);
+    } else if (strcmp(argv[0], "del") == 0 && argc == 2) {
+        del_stage(skel, argv[1]);
+    } else if (strcmp(argv[0], "list") == 0) {
+        list_stages(skel);
+    } else {
+        log_error("Usage: add <name> <type> <priority> <chain_on> <rules|-> [iface...] | del <name> | list");
+    }
+}
+
+static void print_stage_stats(struct dispatcher_bpf *skel, struct stage_stats *prev, double elapsed) {
+    int map_fd = bpf_map__fd(skel->maps.stage_stats_map);
+    int cpus = libbpf_num_possible_cpus();
+    struct stage_stats values[cpus];
+
+    for (__u32 slot = 0; slot < DISPATCHER_MAX_STAGES; slot++) {
+        struct stage_stats tot = {0};
+        __u64 pkts, ns;
+
+        if (bpf_map_lookup_elem(map_fd, &slot, values)) {
+            log_error("Error while retrieving the statistics of slot %u", slot);
+            return;
+        }
+
+        for (int i = 0; i < cpus; i++) {
+            tot.run_cnt += values[i].run_cnt;
+            tot.run_ns += values[i].run_ns;
+            for (int v = 0; v <= XDP_REDIRECT; v++)
+                tot.verdicts[v] += values[i].verdicts[v];
+        }
+
+        pkts = tot.run_cnt - prev[slot].run_cnt;
+        ns = tot.run_ns - prev[slot].run_ns;
+
+        if (stages[slot].used && pkts != 0) {
+            log_info("%-16s %10.0f pkt/s %8.1f ns/pkt | drop %llu pass %llu tx %llu redirect %llu aborted %llu",
+                     stages[slot].name, pkts / elapsed, (double)ns / pkts,
+                     tot.verdicts[XDP_DROP] - prev[slot].verdicts[XDP_DROP],
+                     tot.verdicts[XDP_PASS] - prev[slot].verdicts[XDP_PASS],
+                     tot.verdicts[XDP_TX] - prev[slot].verdicts[XDP_TX],
+                     tot.verdicts[XDP_REDIRECT] - prev[slot].verdicts[XDP_REDIRECT],
+                     tot.verdicts[XDP_ABORTED] - prev[slot].verdicts[XDP_ABORTED]);
+        }
+
+        prev[slot] = tot;
+    }
+}
+
+struct loop_ctx {
+    struct dispatcher_bpf *skel;
+    struct stage_stats prev[DISPATCHER_MAX_STAGES];
+    /* Whole dispatcher, stages included, as measured by the kernel */
+    struct prog_stats progs;
+};
+
+static void on_tick(void *ctx, double elapsed) {
+    struct loop_ctx *lc = ctx;
+
+    prog_stats_print(&lc->progs, elapsed);
+    print_stage_stats(lc->skel, lc->prev, elapsed);
+}
+
+static void on_command(void *ctx, char *line) {
+    struct loop_ctx *lc = ctx;
+
+    handle_command(lc->skel, line);
+}
+
+int main(int argc, const char **argv) {
+    struct dispatcher_bpf *skel = NULL;
+    struct event_loop loop = {0};
+    struct loop_ctx lc = {0};
+    float interval = 1;
+    const char *ctrl_path = NULL;
+    int err;
+    const char *config_file = NULL;
+    const char *iface = NULL;
+    int no_timing = 0;
+    const char *xdp_mode = NULL;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_GROUP("Basic options"),
+        OPT_STRING('c', "config", &config_file, "Path to the YAML file with the list of stages", NULL, 0, 0),
+        OPT_STRING('i', "iface", &iface, "Interface where to attach the dispatcher", NULL, 0, 0),
+        OPT_STRING(0, "xdp-mode", &xdp_mode, "XDP mode: drv (default), skb or hw, falls back to the slower ones", NULL, 0, 0),
+        OPT_BOOLEAN('T', "no-timing", &no_timing, "Do not measure the ns/packet of each stage", NULL, 0, 0),
+        OPT_FLOAT('I', "interval", &interval, "Statistics interval in seconds (default 1, at least 0.01)", NULL, 0, 0),
+        OPT_STRING(0, "ctrl", &ctrl_path, "Unix socket where the runtime commands are also accepted", NULL, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "\n[Exercise 7] This software attaches an XDP dispatcher that chains several XDP programs on the same interface",
+    "\nStages can be added and removed at runtime by writing 'add', 'del' or 'list' commands on stdin or on the --ctrl socket");
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (config_file == NULL) {
+        log_warn("Use default configuration file: %s", "config.yaml");
+        config_file = "config.yaml";
+    }
+
+    /* Check if file exists */
+    if (access(config_file, F_OK) == -1) {
+        log_fatal("Configuration file %s does not exist", config_file);
+        exit(1);
+    }
+
+    if (xdp_attach_parse_mode(xdp_mode, &xdp_ifaces.mode) || event_loop_check_interval(interval))
+        exit(1);
+
+    ifindex_iface = xdp_attach_add_iface(&xdp_ifaces, iface, NULL);
+    if (ifindex_iface < 0)
+        exit(1);
+
+    /* Open BPF application */
+    skel = dispatcher_bpf__open();
+    if (!skel) {
+        log_fatal("Error while opening BPF skeleton");
+        exit(1);
+    }
+
+    skel->rodata->dispatcher_ro.stage_timing = !no_timing;
+
+    /* Set program type to XDP */
+    bpf_program__set_type(skel->progs.xdp_dispatcher, BPF_PROG_TYPE_XDP);
+
+    /* Load and verify BPF programs */
+    if (dispatcher_bpf__load(skel)) {
+        log_fatal("Error while loading BPF skeleton");
+        exit(1);
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &sigint_handler;
+
+    if (sigaction(SIGINT, &action, NULL) == -1) {
+        log_error("sigation failed");
+        goto cleanup;
+    }
+
+    if (sigaction(SIGTERM, &action, NULL) == -1) {
+        log_error("sigation failed");
+        goto cleanup;
+    }
+
+    err = rcu_sync_init();
+    if (err)
+        goto cleanup;
+
+    /* Stages are attached to the dispatcher before it goes live */
+    err = load_dispatcher_config(config_file, skel);
+    if (err) {
+        log_fatal("Error while loading the dispatcher stages");
+        goto cleanup;
+    }
+
+    /* Attach the XDP program to the interface */
+    err = xdp_attach_all(&xdp_ifaces, bpf_program__fd(skel->progs.xdp_dispatcher));
+    if (err) {
+        log_fatal("Error while attaching the XDP dispatcher to the interface");
+        goto cleanup;
+    }
+
+    log_info("Successfully attached!");
+    list_stages(skel);
+
+    lc.skel = skel;
+    prog_stats_init(&lc.progs, skel->obj);
+    err = event_loop_init(&loop, interval, on_tick, &lc);
+    if (!err)
+        err = event_loop_add_commands(&loop, on_command, ctrl_path);
+    if (!err)
+        err = event_loop_run(&loop);
+
+cleanup:
+    prog_stats_destroy(&lc.progs);
+    event_loop_destroy(&loop);
+    xdp_attach_detach_all(&xdp_ifaces);
+    for (int i = 0; i < DISPATCHER_MAX_STAGES; i++) {
+        if (stages[i].used)
+            unload_stage(&stages[i]);
+    }
+    close_rcu_sync();
+    dispatcher_bpf__destroy(skel);
+    log_info("Program stopped correctly");
+    return -err;
+}
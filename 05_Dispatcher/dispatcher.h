@@ -0,0 +1,208 @@
+#ifndef DISPATCHER_H_
+#define DISPATCHER_H_
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <bpf/bpf.h>
+#include <bpf/btf.h>
+#include <bpf/libbpf.h>
+#include <fcntl.h>
+#include <assert.h>
+
+#include <cyaml/cyaml.h>
+#include <sys/types.h>
+#include <linux/if_link.h>
+#include <net/if.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "xdp_attach.h"
+#include "ebpf/dispatcher_cfg.h"
+
+// Include skeleton files
+#include "dispatcher.skel.h"
+#include "counting_with_maps.skel.h"
+#include "drop_ip.skel.h"
+#include "hhd_v1.skel.h"
+
+#define MAX_STAGE_IFACES 4
+#define STAGE_NAME_LEN 32
+
+static int ifindex_iface = 0;
+static struct xdp_attach xdp_ifaces;
+
+enum stage_type {
+    STAGE_COUNTER = 0,
+    STAGE_DROP_IP,
+    STAGE_HHD_V1,
+};
+
+struct stage {
+    bool used;
+    char name[STAGE_NAME_LEN];
+    enum stage_type type;
+    int priority;
+    __u32 chain_on;
+    int ifindex[MAX_STAGE_IFACES];
+    int n_ifaces;
+    union {
+        struct counting_with_maps_bpf *counter;
+        struct drop_ip_bpf *drop_ip;
+        struct hhd_v1_bpf *hhd_v1;
+    } skel;
+    struct bpf_link *link;
+};
+
+/* Stages are indexed by the dispatcher slot they are attached to */
+static struct stage stages[DISPATCHER_MAX_STAGES];
+
+/* Dispatcher configuration file (list of stages) */
+struct stage_config {
+    const char *name;
+    const char *type;
+    int priority;
+    const char *chain_on;
+    const char *config;
+    const char **ifaces;
+    unsigned ifaces_count;
+};
+
+struct dispatcher_config {
+    struct stage_config *stages;
+    unsigned stages_count;
+};
+
+static const cyaml_schema_value_t iface_entry_schema = {
+    CYAML_VALUE_STRING(CYAML_FLAG_POINTER, char, 0, CYAML_UNLIMITED),
+};
+
+static const cyaml_schema_field_t stage_field_schema[] = {
+    CYAML_FIELD_STRING_PTR("name", CYAML_FLAG_POINTER, struct stage_config, name, 1, STAGE_NAME_LEN - 1),
+    CYAML_FIELD_STRING_PTR("type", CYAML_FLAG_POINTER, struct stage_config, type, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_INT("priority", CYAML_FLAG_OPTIONAL, struct stage_config, priority),
+    CYAML_FIELD_STRING_PTR("chain_on", CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL, struct stage_config, chain_on, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_STRING_PTR("config", CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL, struct stage_config, config, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_SEQUENCE("ifaces", CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL, struct stage_config, ifaces, &iface_entry_schema, 0, MAX_STAGE_IFACES),
+    CYAML_FIELD_END
+};
+
+static const cyaml_schema_value_t stage_schema = {
+	CYAML_VALUE_MAPPING(CYAML_FLAG_DEFAULT, struct stage_config, stage_field_schema),
+};
+
+static const cyaml_schema_field_t dispatcher_field_schema[] = {
+    CYAML_FIELD_SEQUENCE("stages", CYAML_FLAG_POINTER, struct dispatcher_config, stages, &stage_schema, 0, DISPATCHER_MAX_STAGES),
+    CYAML_FIELD_END
+};
+
+static const cyaml_schema_value_t dispatcher_schema = {
+    CYAML_VALUE_MAPPING(CYAML_FLAG_POINTER, struct dispatcher_config, dispatcher_field_schema),
+};
+
+/* Rule files of the stages: same format as the DropByIP and HHDv1 ones, the
+ * threshold and port fields are only used by HHDv1.
+ */
+struct rule {
+    const char *ip;
+    uint64_t threshold;
+    uint32_t port;
+};
+
+struct rules {
+    struct rule *ips;
+    uint64_t ips_count;
+};
+
+static const cyaml_schema_field_t rule_field_schema[] = {
+    CYAML_FIELD_STRING_PTR("ip", CYAML_FLAG_POINTER, struct rule, ip, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_UINT("threshold", CYAML_FLAG_OPTIONAL, struct rule, threshold),
+    CYAML_FIELD_UINT("port", CYAML_FLAG_OPTIONAL, struct rule, port),
+    CYAML_FIELD_END
+};
+
+static const cyaml_schema_value_t rule_schema = {
+	CYAML_VALUE_MAPPING(CYAML_FLAG_DEFAULT, struct rule, rule_field_schema),
+};
+
+static const cyaml_schema_field_t rules_field_schema[] = {
+    CYAML_FIELD_SEQUENCE("ips", CYAML_FLAG_POINTER, struct rules, ips, &rule_schema, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_END
+};
+
+static const cyaml_schema_value_t rules_schema = {
+    CYAML_VALUE_MAPPING(CYAML_FLAG_POINTER, struct rules, rules_field_schema),
+};
+
+static const cyaml_config_t config = {
+	.log_fn = cyaml_log,            /* Use the default logging function. */
+	.mem_fn = cyaml_mem,            /* Use the default memory allocator. */
+	.log_level = CYAML_LOG_WARNING, /* Logging errors and warnings only. */
+};
+
+static const char *const verdict_names[] = {
+    [XDP_ABORTED] = "aborted",
+    [XDP_DROP] = "drop",
+    [XDP_PASS] = "pass",
+    [XDP_TX] = "tx",
+    [XDP_REDIRECT] = "redirect",
+};
+
+static const char *const stage_type_names[] = {
+    [STAGE_COUNTER] = "counter",
+    [STAGE_DROP_IP] = "drop_ip",
+    [STAGE_HHD_V1] = "hhd_v1",
+};
+
+/* Parse a comma separated list of verdicts (e.g. "pass,redirect") */
+static int parse_chain_on(const char *str, __u32 *mask) {
+    char buf[64];
+    char *tok, *saveptr;
+
+    *mask = 0;
+    if (str == NULL || strcmp(str, "none") == 0) {
+        return 0;
+    }
+
+    snprintf(buf, sizeof(buf), "%s", str);
+    for (tok = strtok_r(buf, ",", &saveptr); tok != NULL; tok = strtok_r(NULL, ",", &saveptr)) {
+        int v;
+
+        for (v = 0; v <= XDP_REDIRECT; v++) {
+            if (strcmp(tok, verdict_names[v]) == 0) {
+                *mask |= 1U << v;
+                break;
+            }
+        }
+
+        if (v > XDP_REDIRECT) {
+            log_error("Unknown verdict %s in chain policy", tok);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int parse_stage_type(const char *str, enum stage_type *type) {
+    for (int i = 0; i <= STAGE_HHD_V1; i++) {
+        if (strcmp(str, stage_type_names[i]) == 0) {
+            *type = i;
+            return 0;
+        }
+    }
+
+    log_error("Unknown stage type %s", str);
+    return -1;
+}
+
+void sigint_handler(int sig_no) {
+    log_debug("Closing program...");
+    xdp_attach_detach_all(&xdp_ifaces);
+    exit(0);
+}
+
+#endif //DISPATCHER_H_
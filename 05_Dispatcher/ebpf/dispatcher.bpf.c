@@ -0,0 +1,114 @@
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dispatcher_cfg.h"
+
+const volatile struct {
+   __u8 stage_timing;
+} dispatcher_ro = {};
+
+/* Index of the dispatcher_cfg_map entry currently used by the datapath */
+volatile __u32 active_cfg = 0;
+
+/* Double-buffered chain configuration: userspace always writes the entry that
+ * is not in use and then flips active_cfg, so a packet never sees a
+ * half-written chain.
+ */
+struct {
+   __uint(type, BPF_MAP_TYPE_ARRAY);
+   __type(key, __u32);
+   __type(value, struct dispatcher_cfg);
+   __uint(max_entries, 2);
+} dispatcher_cfg_map SEC(".maps");
+
+struct {
+   __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+   __type(key, __u32);
+   __type(value, struct stage_stats);
+   __uint(max_entries, DISPATCHER_MAX_STAGES);
+} stage_stats_map SEC(".maps");
+
+/* Stage slots, replaced at runtime by the stage programs through freplace.
+ * They must be global and noinline so that each one gets its own BTF func
+ * the EXT programs can attach to. An empty slot behaves like XDP_PASS.
+ */
+#define STAGE_SLOT(n)                               \
+   __attribute__((noinline)) int stage_##n(struct xdp_md *ctx) { \
+      volatile int ret = XDP_PASS;                  \
+                                                    \
+      if (!ctx)                                     \
+         return XDP_ABORTED;                        \
+      return ret;                                   \
+   }
+
+STAGE_SLOT(0)
+STAGE_SLOT(1)
+STAGE_SLOT(2)
+STAGE_SLOT(3)
+STAGE_SLOT(4)
+STAGE_SLOT(5)
+STAGE_SLOT(6)
+STAGE_SLOT(7)
+
+static __always_inline int run_stage(__u32 slot, struct xdp_md *ctx) {
+   switch (slot) {
+      case 0: return stage_0(ctx);
+      case 1: return stage_1(ctx);
+      case 2: return stage_2(ctx);
+      case 3: return stage_3(ctx);
+      case 4: return stage_4(ctx);
+      case 5: return stage_5(ctx);
+      case 6: return stage_6(ctx);
+      case 7: return stage_7(ctx);
+      default: return XDP_ABORTED;
+   }
+}
+
+static __always_inline void account_stage(__u32 slot, int verdict, __u64 elapsed_ns) {
+   struct stage_stats *stats = bpf_map_lookup_elem(&stage_stats_map, &slot);
+
+   if (!stats)
+      return;
+
+   /* Per-CPU entry, no need for atomics */
+   stats->run_cnt++;
+   stats->run_ns += elapsed_ns;
+   if (verdict >= 0 && verdict <= XDP_REDIRECT)
+      stats->verdicts[verdict]++;
+}
+
+SEC("xdp")
+int xdp_dispatcher(struct xdp_md *ctx) {
+   __u32 key = active_cfg & 1;
+   struct dispatcher_cfg *cfg;
+   int verdict = XDP_PASS;
+   __u64 start = 0;
+
+   cfg = bpf_map_lookup_elem(&dispatcher_cfg_map, &key);
+   if (!cfg)
+      return XDP_ABORTED;
+
+   for (int i = 0; i < DISPATCHER_MAX_STAGES; i++) {
+      if (i >= cfg->num_stages)
+         break;
+
+      __u32 slot = cfg->slot[i];
+
+      if (dispatcher_ro.stage_timing)
+         start = bpf_ktime_get_ns();
+
+      verdict = run_stage(slot, ctx);
+
+      account_stage(slot, verdict, dispatcher_ro.stage_timing ? bpf_ktime_get_ns() - start : 0);
+
+      /* Go on with the next stage only if the policy allows this verdict */
+      if (verdict < 0 || verdict > XDP_REDIRECT || !(cfg->chain_on[i] & (1U << verdict)))
+         break;
+   }
+
+   return verdict;
+}
+
+char LICENSE[] SEC("license") = "Dual BSD/GPL";
@@ -0,0 +1,21 @@
+#pragma once
+
+/* Shared between the dispatcher program and its loader */
+#include <linux/types.h>
+#include <linux/bpf.h>
+
+#define DISPATCHER_MAX_STAGES 8
+
+/* Chain configuration, slot[i] is the i-th stage to run */
+struct dispatcher_cfg {
+   __u32 num_stages;
+   __u32 slot[DISPATCHER_MAX_STAGES];
+   /* Bitmask of the XDP verdicts (1 << XDP_*) that continue the chain */
+   __u32 chain_on[DISPATCHER_MAX_STAGES];
+};
+
+struct stage_stats {
+   __u64 run_cnt;
+   __u64 run_ns;
+   __u64 verdicts[XDP_REDIRECT + 1];
+};
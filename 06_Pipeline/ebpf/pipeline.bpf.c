@@ -0,0 +1,226 @@
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+#include <stddef.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <linux/tcp.h>
+#include <linux/in.h>
+#include <bpf/bpf_endian.h>
+#include <stdint.h>
+
+#include "parsing_helpers.h"
+#include "pipeline_md.h"
+#include "map_values.h"
+
+/* Returned by a stage when the packet has to go on to the next one */
+#define STAGE_NEXT -1
+
+const volatile struct {
+   int ifindex_if1;
+   int ifindex_if2;
+   int ifindex_if3;
+   int ifindex_if4;
+} pipeline_cfg = {};
+
+struct {
+   __uint(type, BPF_MAP_TYPE_PROG_ARRAY);
+   __type(key, __u32);
+   __type(value, __u32);
+   __uint(max_entries, PIPELINE_MAX_STAGES);
+} pipeline_progs SEC(".maps");
+
+struct {
+   __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+   __type(key, __u32);
+   __type(value, struct pkt_md);
+   __uint(max_entries, 1);
+} scratch SEC(".maps");
+
+struct {
+   __uint(type, BPF_MAP_TYPE_HASH);
+   __type(key, __u32);
+   __type(value, __u8);
+   __uint(max_entries, 1024);
+} blocklist SEC(".maps");
+
+struct {
+   __uint(type, BPF_MAP_TYPE_HASH);
+   __type(key, __u32);
+   __type(value, struct value_t);
+   __uint(max_entries, 1024);
+} threshold_map SEC(".maps");
+
+struct {
+   __uint(type, BPF_MAP_TYPE_HASH);
+   __type(key, __u32);
+   __type(value, __u32);
+   __uint(max_entries, 16);
+} ip_to_port SEC(".maps");
+
+/*
+ * Stage bodies, shared by the staged programs and the monolithic one so that
+ * both variants run exactly the same logic.
+ */
+static __always_inline int do_parse(struct xdp_md *ctx, struct pkt_md *md) {
+   void *data_end = (void *)(long)ctx->data_end;
+   void *data = (void *)(long)ctx->data;
+   struct ethhdr *eth;
+   struct iphdr *ip;
+   __u16 *ports;
+   __u16 off = 0;
+
+   if (parse_ethhdr(data, data_end, &off, &eth) != bpf_htons(ETH_P_IP))
+      return XDP_DROP;
+
+   md->l3_off = off;
+   if (parse_iphdr(data, data_end, &off, &ip) < 0)
+      return XDP_DROP;
+
+   md->l4_off = off;
+   md->saddr = ip->saddr;
+   md->daddr = ip->daddr;
+   md->proto = ip->protocol;
+   md->sport = 0;
+   md->dport = 0;
+
+   ports = data + off;
+   if ((md->proto == IPPROTO_TCP || md->proto == IPPROTO_UDP) && (void *)(ports + 2) <= data_end) {
+      md->sport = ports[0];
+      md->dport = ports[1];
+   }
+
+   return STAGE_NEXT;
+}
+
+static __always_inline int do_classify_blocklist(struct xdp_md *ctx, struct pkt_md *md) {
+   if (ctx->ingress_ifindex == pipeline_cfg.ifindex_if4) {
+      md->class = PKT_CLASS_RETURN;
+      return STAGE_NEXT;
+   }
+
+   if (bpf_map_lookup_elem(&blocklist, &md->saddr))
+      return XDP_DROP;
+
+   md->class = PKT_CLASS_METERED;
+   return STAGE_NEXT;
+}
+
+static __always_inline int do_classify_direction(struct xdp_md *ctx, struct pkt_md *md) {
+   md->class = ctx->ingress_ifindex == pipeline_cfg.ifindex_if4 ? PKT_CLASS_RETURN
+                                                                 : PKT_CLASS_METERED;
+   return STAGE_NEXT;
+}
+
+static __always_inline int do_police_threshold(struct xdp_md *ctx, struct pkt_md *md) {
+   struct value_t *val;
+
+   if (md->class != PKT_CLASS_METERED)
+      return STAGE_NEXT;
+
+   val = bpf_map_lookup_elem(&threshold_map, &md->saddr);
+   if (!val)
+      return XDP_DROP;
+
+   __sync_fetch_and_add(&val->packets_rcvd, 1);
+   if (val->packets_rcvd > val->threshold)
+      return XDP_DROP;
+
+   return STAGE_NEXT;
+}
+
+static __always_inline int do_forward(struct xdp_md *ctx, struct pkt_md *md) {
+   __u32 *port;
+
+   if (md->class == PKT_CLASS_METERED)
+      return bpf_redirect(pipeline_cfg.ifindex_if4, 0);
+
+   port = bpf_map_lookup_elem(&ip_to_port, &md->daddr);
+   if (!port)
+      return XDP_DROP;
+
+   switch (*port) {
+      case 1:
+         return bpf_redirect(pipeline_cfg.ifindex_if1, 0);
+      case 2:
+         return bpf_redirect(pipeline_cfg.ifindex_if2, 0);
+      case 3:
+         return bpf_redirect(pipeline_cfg.ifindex_if3, 0);
+      default:
+         return XDP_DROP;
+   }
+}
+
+static __always_inline struct pkt_md *get_scratch(void) {
+   __u32 key = 0;
+
+   return bpf_map_lookup_elem(&scratch, &key);
+}
+
+/* Jump to the next stage; if its slot is empty the packet is passed up */
+static __always_inline int next_stage(struct xdp_md *ctx, __u32 stage) {
+   bpf_tail_call(ctx, &pipeline_progs, stage);
+   return XDP_PASS;
+}
+
+#define PIPELINE_STAGE(name, body, next)                 \
+   SEC("xdp")                                            \
+   int name(struct xdp_md *ctx) {                        \
+      struct pkt_md *md = get_scratch();                 \
+      int ret;                                           \
+                                                         \
+      if (!md)                                           \
+         return XDP_ABORTED;                             \
+                                                         \
+      ret = body(ctx, md);                               \
+      if (ret != STAGE_NEXT)                             \
+         return ret;                                     \
+                                                         \
+      return next_stage(ctx, next);                      \
+   }
+
+/* Entry point of the staged pipeline, attached to the interfaces */
+PIPELINE_STAGE(xdp_parse, do_parse, PIPELINE_CLASSIFY)
+
+/* Alternative implementations of each stage, swappable at runtime */
+PIPELINE_STAGE(xdp_classify_blocklist, do_classify_blocklist, PIPELINE_POLICE)
+PIPELINE_STAGE(xdp_classify_direction, do_classify_direction, PIPELINE_POLICE)
+PIPELINE_STAGE(xdp_police_threshold, do_police_threshold, PIPELINE_FORWARD)
+
+SEC("xdp")
+int xdp_police_none(struct xdp_md *ctx) {
+   return next_stage(ctx, PIPELINE_FORWARD);
+}
+
+SEC("xdp")
+int xdp_forward(struct xdp_md *ctx) {
+   struct pkt_md *md = get_scratch();
+
+   if (!md)
+      return XDP_ABORTED;
+
+   return do_forward(ctx, md);
+}
+
+/* Same logic as the default pipeline in a single program, used as baseline */
+SEC("xdp")
+int xdp_monolithic(struct xdp_md *ctx) {
+   struct pkt_md md = {};
+   int ret;
+
+   ret = do_parse(ctx, &md);
+   if (ret != STAGE_NEXT)
+      return ret;
+
+   ret = do_classify_blocklist(ctx, &md);
+   if (ret != STAGE_NEXT)
+      return ret;
+
+   ret = do_police_threshold(ctx, &md);
+   if (ret != STAGE_NEXT)
+      return ret;
+
+   return do_forward(ctx, &md);
+}
+
+char LICENSE[] SEC("license") = "Dual BSD/GPL";
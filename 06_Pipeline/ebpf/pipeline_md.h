@@ -0,0 +1,33 @@
+#pragma once
+
+/* Shared between the pipeline programs and their loader */
+#include <linux/types.h>
+
+enum pipeline_stage {
+   PIPELINE_PARSE = 0,
+   PIPELINE_CLASSIFY,
+   PIPELINE_POLICE,
+   PIPELINE_FORWARD,
+   PIPELINE_MAX_STAGES,
+};
+
+enum pkt_class {
+   PKT_CLASS_METERED = 0, /* From the hosts, metered and sent to interface 4 */
+   PKT_CLASS_RETURN,      /* From interface 4, forwarded by destination IP */
+};
+
+/* Parse results, stored in the per-CPU scratch map by the parse stage so that
+ * the following stages never look at the headers again. Only offsets are
+ * kept, packet pointers cannot be stored in a map.
+ */
+struct pkt_md {
+   __u16 l3_off;
+   __u16 l4_off;
+   __u32 saddr;
+   __u32 daddr;
+   __u16 sport;
+   __u16 dport;
+   __u8 proto;
+   __u8 class;
+   __u16 pad;
+};
@@ -0,0 +1,320 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <bpf/bpf.h>
+#include <bpf/btf.h>
+#include <bpf/libbpf.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <linux/if_link.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <argparse.h>
+#include <net/if.h>
+
+#ifndef __USE_POSIX
+#define __USE_POSIX
+#endif
+#include <signal.h>
+
+#include "log.h"
+#include "pipeline.h"
+#include "event_loop.h"
+#include "ebpf/map_values.h"
+
+static const char *const usages[] = {
+    "pipeline [options] [[--] args]",
+    "pipeline [options]",
+    NULL,
+};
+
+int load_maps_config(const char *config_file, struct pipeline_bpf *skel) {
+    struct ips *ips;
+    cyaml_err_t err;
+    int ret = EXIT_SUCCESS;
+
+    /* Load input file. */
+	err = cyaml_load_file(config_file, &config, &ips_schema, (void **) &ips, NULL);
+	if (err != CYAML_OK) {
+		fprintf(stderr, "ERROR: %s\n", cyaml_strerror(err));
+		return EXIT_FAILURE;
+	}
+
+    log_info("Loaded %d IPs and %d blocked IPs", ips->ips_count, ips->blocklist_count);
+
+    for (int i = 0; i < ips->ips_count; i++) {
+        struct in_addr addr;
+
+        if (inet_pton(AF_INET, ips->ips[i].ip, &addr) != 1) {
+            log_error("Failed to convert IP %s to integer", ips->ips[i].ip);
+            ret = EXIT_FAILURE;
+            goto cleanup_yaml;
+        }
+
+        struct value_t value = {
+            .threshold = ips->ips[i].threshold,
+            .packets_rcvd = 0,
+        };
+        __u32 port = ips->ips[i].port;
+
+        if (bpf_map__update_elem(skel->maps.threshold_map, &addr.s_addr, sizeof(addr.s_addr),
+                                 &value, sizeof(value), BPF_ANY) ||
+            bpf_map__update_elem(skel->maps.ip_to_port, &addr.s_addr, sizeof(addr.s_addr),
+                                 &port, sizeof(port), BPF_ANY)) {
+            log_error("Failed to update BPF map: %s", strerror(errno));
+            ret = EXIT_FAILURE;
+            goto cleanup_yaml;
+        }
+    }
+
+    for (int i = 0; i < ips->blocklist_count; i++) {
+        struct in_addr addr;
+        __u8 blocked = 1;
+
+        if (inet_pton(AF_INET, ips->blocklist[i], &addr) != 1) {
+            log_error("Failed to convert IP %s to integer", ips->blocklist[i]);
+            ret = EXIT_FAILURE;
+            goto cleanup_yaml;
+        }
+
+        if (bpf_map__update_elem(skel->maps.blocklist, &addr.s_addr, sizeof(addr.s_addr),
+                                 &blocked, sizeof(blocked), BPF_ANY)) {
+            log_error("Failed to update BPF map: %s", strerror(errno));
+            ret = EXIT_FAILURE;
+            goto cleanup_yaml;
+        }
+    }
+
+cleanup_yaml:
+    /* Free the data */
+	cyaml_free(&config, &ips_schema, ips, 0);
+
+    return ret;
+}
+
+/* Plug the given program in its pipeline slot, the change is atomic */
+static int set_stage(struct pipeline_bpf *skel, const struct stage_variant *v) {
+    struct bpf_program *prog = bpf_object__find_program_by_name(skel->obj, v->prog_name);
+    int prog_fd, err;
+    __u32 key = v->slot;
+
+    if (!prog) {
+        log_error("Program %s not found", v->prog_name);
+        return -1;
+    }
+
+    prog_fd = bpf_program__fd(prog);
+    err = bpf_map__update_elem(skel->maps.pipeline_progs, &key, sizeof(key), &prog_fd,
+                               sizeof(prog_fd), BPF_ANY);
+    if (err) {
+        log_error("Error while setting stage %s to %s: %s", v->stage, v->variant, strerror(errno));
+        return err;
+    }
+
+    log_info("Stage %s is now %s", v->stage, v->variant);
+
+    return 0;
+}
+
+static int set_stage_by_name(struct pipeline_bpf *skel, const char *stage, const char *variant) {
+    for (int i = 0; i < NUM_STAGE_VARIANTS; i++) {
+        if (strcmp(stage_variants[i].stage, stage) == 0 &&
+            strcmp(stage_variants[i].variant, variant) == 0) {
+            return set_stage(skel, &stage_variants[i]);
+        }
+    }
+
+    log_error("Unknown variant %s for stage %s", variant, stage);
+    return -1;
+}
+
+static int set_default_stages(struct pipeline_bpf *skel) {
+    for (int i = 0; i < NUM_STAGE_VARIANTS; i++) {
+        if (stage_variants[i].is_default && set_stage(skel, &stage_variants[i]))
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Swap the program attached to the interfaces, without detaching them */
+static int set_entry(struct pipeline_bpf *skel, const char *name) {
+    struct bpf_program *entry;
+
+    if (strcmp(name, "monolithic") == 0) {
+        entry = skel->progs.xdp_monolithic;
+    } else if (strcmp(name, "pipeline") == 0) {
+        entry = skel->progs.xdp_parse;
+    } else {
+        log_error("Unknown entry %s, expected pipeline or monolithic", name);
+        return -1;
+    }
+
+    if (xdp_attach_replace_all(&xdp_ifaces, bpf_program__fd(entry)))
+        return -1;
+
+    log_info("Interfaces now run the %s program", name);
+    return 0;
+}
+
+/*
+ * Runtime commands, one per line on stdin or on the --ctrl socket:
+ *   set <stage> <variant>
+ *   entry pipeline|monolithic
+ *   list
+ */
+static void handle_command(struct pipeline_bpf *skel, char *line) {
+    char *argv[3] = {0};
+    char *saveptr;
+    int argc = 0;
+
+    for (char *tok = strtok_r(line, " \t\n", &saveptr); tok != NULL && argc < 3;
+         tok = strtok_r(NULL, " \t\n", &saveptr)) {
+        argv[argc++] = tok;
+    }
+
+    if (argc == 3 && strcmp(argv[0], "set") == 0) {
+        set_stage_by_name(skel, argv[1], argv[2]);
+    } else if (argc == 2 && strcmp(argv[0], "entry") == 0) {
+        set_entry(skel, argv[1]);
+    } else if (argc == 1 && strcmp(argv[0], "list") == 0) {
+        for (int i = 0; i < NUM_STAGE_VARIANTS; i++)
+            log_info("%s %s", stage_variants[i].stage, stage_variants[i].variant);
+    } else if (argc != 0) {
+        log_error("Usage: set <stage> <variant> | entry pipeline|monolithic | list");
+    }
+}
+
+static void on_command(void *ctx, char *line) {
+    handle_command(ctx, line);
+}
+
+int main(int argc, const char **argv) {
+    struct pipeline_bpf *skel = NULL;
+    struct event_loop loop = {0};
+    const char *ctrl_path = NULL;
+    struct bpf_program *entry;
+    int err;
+    const char *config_file = NULL;
+    const char *iface1 = NULL;
+    const char *iface2 = NULL;
+    const char *iface3 = NULL;
+    const char *iface4 = NULL;
+    int monolithic = 0;
+    const char *xdp_mode = NULL;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_GROUP("Basic options"),
+        OPT_STRING('c', "config", &config_file, "Path to the YAML configuration file", NULL, 0, 0),
+        OPT_STRING('1', "iface1", &iface1, "1st interface where to attach the BPF program", NULL, 0, 0),
+        OPT_STRING('2', "iface2", &iface2, "2nd interface where to attach the BPF program", NULL, 0, 0),
+        OPT_STRING('3', "iface3", &iface3, "3rd interface where to attach the BPF program", NULL, 0, 0),
+        OPT_STRING('4', "iface4", &iface4, "4th interface where to attach the BPF program", NULL, 0, 0),
+        OPT_STRING(0, "xdp-mode", &xdp_mode, "XDP mode: drv (default), skb or hw, falls back to the slower ones", NULL, 0, 0),
+        OPT_BOOLEAN('m', "monolithic", &monolithic, "Attach the single-program version instead of the tail-call pipeline", NULL, 0, 0),
+        OPT_STRING(0, "ctrl", &ctrl_path, "Unix socket where the runtime commands are also accepted", NULL, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "\n[Exercise 8] This software attaches a parse/classify/police/forward XDP pipeline built with tail calls",
+    "\nStages can be swapped at runtime by writing 'set <stage> <variant>' on stdin or on the --ctrl socket,"
+    " and the attached program with 'entry pipeline|monolithic'");
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (config_file == NULL) {
+        log_warn("Use default configuration file: %s", "config.yaml");
+        config_file = "config.yaml";
+    }
+
+    /* Check if file exists */
+    if (access(config_file, F_OK) == -1) {
+        log_fatal("Configuration file %s does not exist", config_file);
+        exit(1);
+    }
+
+    if (xdp_attach_parse_mode(xdp_mode, &xdp_ifaces.mode))
+        exit(1);
+
+    if (xdp_attach_add_iface(&xdp_ifaces, iface1, "veth1") < 0 ||
+        xdp_attach_add_iface(&xdp_ifaces, iface2, "veth2") < 0 ||
+        xdp_attach_add_iface(&xdp_ifaces, iface3, "veth3") < 0 ||
+        xdp_attach_add_iface(&xdp_ifaces, iface4, "veth4") < 0)
+        exit(1);
+
+    /* Open BPF application */
+    skel = pipeline_bpf__open();
+    if (!skel) {
+        log_fatal("Error while opening BPF skeleton");
+        exit(1);
+    }
+
+    /* Add iface configuration to pipeline_cfg */
+    skel->rodata->pipeline_cfg.ifindex_if1 = xdp_ifaces.ifaces[0].ifindex;
+    skel->rodata->pipeline_cfg.ifindex_if2 = xdp_ifaces.ifaces[1].ifindex;
+    skel->rodata->pipeline_cfg.ifindex_if3 = xdp_ifaces.ifaces[2].ifindex;
+    skel->rodata->pipeline_cfg.ifindex_if4 = xdp_ifaces.ifaces[3].ifindex;
+
+    /* Load and verify BPF programs */
+    if (pipeline_bpf__load(skel)) {
+        log_fatal("Error while loading BPF skeleton");
+        exit(1);
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &sigint_handler;
+
+    if (sigaction(SIGINT, &action, NULL) == -1) {
+        log_error("sigation failed");
+        goto cleanup;
+    }
+
+    if (sigaction(SIGTERM, &action, NULL) == -1) {
+        log_error("sigation failed");
+        goto cleanup;
+    }
+
+    /* Before attaching the program, we can load the map configuration */
+    err = load_maps_config(config_file, skel);
+    if (err) {
+        log_fatal("Error while loading map configuration");
+        goto cleanup;
+    }
+
+    err = set_default_stages(skel);
+    if (err) {
+        log_fatal("Error while populating the pipeline");
+        goto cleanup;
+    }
+
+    entry = monolithic ? skel->progs.xdp_monolithic : skel->progs.xdp_parse;
+
+    err = xdp_attach_all(&xdp_ifaces, bpf_program__fd(entry));
+    if (err) {
+        log_fatal("Error while attaching BPF programs");
+        goto cleanup;
+    }
+
+    log_info("Successfully attached %s!", monolithic ? "monolithic program" : "pipeline");
+
+    /* No statistics, the loop only waits for commands and signals */
+    err = event_loop_init(&loop, 0, NULL, skel);
+    if (!err)
+        err = event_loop_add_commands(&loop, on_command, ctrl_path);
+    if (!err)
+        err = event_loop_run(&loop);
+
+cleanup:
+    event_loop_destroy(&loop);
+    xdp_attach_detach_all(&xdp_ifaces);
+    pipeline_bpf__destroy(skel);
+    log_info("Program stopped correctly");
+    return -err;
+}
@@ -0,0 +1,98 @@
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <bpf/bpf.h>
+#include <bpf/btf.h>
+#include <bpf/libbpf.h>
+#include <fcntl.h>
+#include <assert.h>
+
+#include <cyaml/cyaml.h>
+#include <sys/types.h>
+#include <linux/if_link.h>
+#include <net/if.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "log.h"
+#include "xdp_attach.h"
+#include "ebpf/pipeline_md.h"
+
+// Include skeleton file
+#include "pipeline.skel.h"
+
+static struct xdp_attach xdp_ifaces;
+
+struct ip {
+    const char *ip;
+    uint64_t threshold;
+    uint32_t port;
+};
+
+struct ips {
+    struct ip *ips;
+    uint64_t ips_count;
+    const char **blocklist;
+    uint64_t blocklist_count;
+};
+
+static const cyaml_schema_field_t ip_field_schema[] = {
+    CYAML_FIELD_STRING_PTR("ip", CYAML_FLAG_POINTER, struct ip, ip, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_UINT("threshold", CYAML_FLAG_DEFAULT, struct ip, threshold),
+    CYAML_FIELD_UINT("port", CYAML_FLAG_DEFAULT, struct ip, port),
+    CYAML_FIELD_END
+};
+
+static const cyaml_schema_value_t ip_schema = {
+	CYAML_VALUE_MAPPING(CYAML_FLAG_DEFAULT, struct ip, ip_field_schema),
+};
+
+static const cyaml_schema_value_t blocked_ip_schema = {
+    CYAML_VALUE_STRING(CYAML_FLAG_POINTER, char, 0, CYAML_UNLIMITED),
+};
+
+static const cyaml_schema_field_t ips_field_schema[] = {
+    CYAML_FIELD_SEQUENCE("ips", CYAML_FLAG_POINTER, struct ips, ips, &ip_schema, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_SEQUENCE("blocklist", CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL, struct ips, blocklist, &blocked_ip_schema, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_END
+};
+
+static const cyaml_schema_value_t ips_schema = {
+    CYAML_VALUE_MAPPING(CYAML_FLAG_POINTER, struct ips, ips_field_schema),
+};
+
+static const cyaml_config_t config = {
+	.log_fn = cyaml_log,            /* Use the default logging function. */
+	.mem_fn = cyaml_mem,            /* Use the default memory allocator. */
+	.log_level = CYAML_LOG_WARNING, /* Logging errors and warnings only. */
+};
+
+/* Programs that can be plugged in each slot of the pipeline */
+struct stage_variant {
+    const char *stage;
+    const char *variant;
+    const char *prog_name;
+    enum pipeline_stage slot;
+    int is_default;
+};
+
+static const struct stage_variant stage_variants[] = {
+    {"classify", "blocklist", "xdp_classify_blocklist", PIPELINE_CLASSIFY, 1},
+    {"classify", "direction", "xdp_classify_direction", PIPELINE_CLASSIFY, 0},
+    {"police", "threshold", "xdp_police_threshold", PIPELINE_POLICE, 1},
+    {"police", "none", "xdp_police_none", PIPELINE_POLICE, 0},
+    {"forward", "port", "xdp_forward", PIPELINE_FORWARD, 1},
+};
+
+#define NUM_STAGE_VARIANTS (sizeof(stage_variants) / sizeof(stage_variants[0]))
+
+void sigint_handler(int sig_no) {
+    log_debug("Closing program...");
+    xdp_attach_detach_all(&xdp_ifaces);
+    exit(0);
+}
+
+#endif //PIPELINE_H_
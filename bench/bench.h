@@ -0,0 +1,176 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <linux/tcp.h>
+#include <linux/in.h>
+
+#include "log.h"
+
+#define BENCH_PKT_SIZE 64
+#define BENCH_DEFAULT_REPEAT 1000000
+
+static const char *const xdp_verdict_names[] = {
+    "XDP_ABORTED", "XDP_DROP", "XDP_PASS", "XDP_TX", "XDP_REDIRECT",
+};
+
+static inline const char *xdp_verdict_str(__u32 verdict) {
+    return verdict <= XDP_REDIRECT ? xdp_verdict_names[verdict] : "UNKNOWN";
+}
+
+static inline __u64 bench_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline __u16 bench_ip_csum(struct iphdr *ip) {
+    __u16 *p = (__u16 *)ip;
+    __u32 sum = 0;
+
+    ip->check = 0;
+    for (int i = 0; i < sizeof(*ip) / 2; i++)
+        sum += p[i];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return ~sum;
+}
+
+/*
+ * Build an Ethernet/IPv4/UDP (or TCP) frame of pkt_len bytes in buf.
+ * Addresses and ports are in host byte order.
+ */
+static inline int bench_build_pkt(void *buf, int pkt_len, __u8 proto, __u32 saddr, __u32 daddr,
+                                  __u16 sport, __u16 dport) {
+    struct ethhdr *eth = buf;
+    struct iphdr *ip = (void *)(eth + 1);
+    int l4_len = proto == IPPROTO_TCP ? sizeof(struct tcphdr) : sizeof(struct udphdr);
+    int min_len = sizeof(*eth) + sizeof(*ip) + l4_len;
+
+    if (pkt_len < min_len)
+        pkt_len = min_len;
+
+    memset(buf, 0, pkt_len);
+    memcpy(eth->h_dest, "\x02\x00\x00\x00\x00\x02", ETH_ALEN);
+    memcpy(eth->h_source, "\x02\x00\x00\x00\x00\x01", ETH_ALEN);
+    eth->h_proto = htons(ETH_P_IP);
+
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->ttl = 64;
+    ip->protocol = proto;
+    ip->tot_len = htons(pkt_len - sizeof(*eth));
+    ip->saddr = htonl(saddr);
+    ip->daddr = htonl(daddr);
+    ip->check = bench_ip_csum(ip);
+
+    if (proto == IPPROTO_TCP) {
+        struct tcphdr *tcp = (void *)(ip + 1);
+
+        tcp->source = htons(sport);
+        tcp->dest = htons(dport);
+        tcp->doff = sizeof(*tcp) / 4;
+        tcp->ack = 1;
+    } else {
+        struct udphdr *udp = (void *)(ip + 1);
+
+        udp->source = htons(sport);
+        udp->dest = htons(dport);
+        udp->len = htons(pkt_len - sizeof(*eth) - sizeof(*ip));
+    }
+
+    return pkt_len;
+}
+
+/*
+ * Run the program repeat times on the same frame with BPF_PROG_TEST_RUN.
+ * The kernel measures the run time, so the syscall cost is not included.
+ */
+static inline int bench_run_xdp(int prog_fd, void *pkt, int pkt_len, int repeat,
+                                double *ns_per_pkt, __u32 *retval) {
+    LIBBPF_OPTS(bpf_test_run_opts, opts,
+        .data_in = pkt,
+        .data_size_in = pkt_len,
+        .repeat = repeat,
+    );
+    int err;
+
+    err = bpf_prog_test_run_opts(prog_fd, &opts);
+    if (err) {
+        log_error("BPF_PROG_TEST_RUN failed: %s", strerror(errno));
+        return err;
+    }
+
+    /* opts.duration is the average run time in ns */
+    *ns_per_pkt = opts.duration;
+    if (retval)
+        *retval = opts.retval;
+
+    return 0;
+}
+
+/* Minimal JSON writer for the benchmark results: one array of flat objects */
+struct bench_json {
+    FILE *out;
+    int records;
+    bool in_record;
+    int fields;
+};
+
+static inline int bench_json_open(struct bench_json *j, const char *path) {
+    memset(j, 0, sizeof(*j));
+    j->out = path ? fopen(path, "w") : stdout;
+    if (!j->out) {
+        log_error("Error while opening %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(j->out, "[\n");
+    return 0;
+}
+
+static inline void bench_json_begin(struct bench_json *j) {
+    fprintf(j->out, "%s  {", j->records++ ? ",\n" : "");
+    j->in_record = true;
+    j->fields = 0;
+}
+
+static inline void bench_json_str(struct bench_json *j, const char *key, const char *val) {
+    fprintf(j->out, "%s\"%s\": \"%s\"", j->fields++ ? ", " : "", key, val);
+}
+
+static inline void bench_json_u64(struct bench_json *j, const char *key, __u64 val) {
+    fprintf(j->out, "%s\"%s\": %llu", j->fields++ ? ", " : "", key, val);
+}
+
+static inline void bench_json_double(struct bench_json *j, const char *key, double val) {
+    fprintf(j->out, "%s\"%s\": %.2f", j->fields++ ? ", " : "", key, val);
+}
+
+static inline void bench_json_end(struct bench_json *j) {
+    fprintf(j->out, "}");
+    j->in_record = false;
+    fflush(j->out);
+}
+
+static inline void bench_json_close(struct bench_json *j) {
+    fprintf(j->out, "\n]\n");
+    if (j->out != stdout)
+        fclose(j->out);
+}
+
+#endif // BENCH_H_
@@ -0,0 +1,316 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include <argparse.h>
+
+#include "log.h"
+#include "bench.h"
+#include "config_load.h"
+#include "xdp_attach.h"
+
+// Include skeleton files
+#include "hhd_v1.skel.h"
+#include "drop_ip.skel.h"
+
+#define CTL_MAX_SIZES 16
+/* Rules are 1.0.0.0 + i */
+#define CTL_ADDR_BASE 0x01000000
+#define CTL_MAX_ENTRIES (1 << 24)
+
+static const char *const usages[] = {
+    "ctl_bench [options]",
+    NULL,
+};
+
+/* Filled by the child process of each configuration size */
+struct ctl_result {
+    int err;
+    double parse_ms;
+    double load_ms;
+    double populate_ms;
+    double attach_ms;
+    /* Peak RSS at the end of each phase, in KiB */
+    long parse_rss;
+    long load_rss;
+    long populate_rss;
+    long attach_rss;
+};
+
+static double ctl_elapsed_ms(__u64 start) {
+    return (bench_now_ns() - start) / 1e6;
+}
+
+static long ctl_peak_rss(void) {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/* Write a configuration of the given program with entries IPs */
+static int write_config(const char *path, bool hhd, __u32 entries) {
+    FILE *f = fopen(path, "w");
+
+    if (!f) {
+        log_error("Error while opening %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "ips:\n");
+    for (__u32 i = 0; i < entries; i++) {
+        __u32 addr = CTL_ADDR_BASE + i;
+
+        fprintf(f, "  - ip: %u.%u.%u.%u\n", addr >> 24, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+        if (hhd)
+            fprintf(f, "    threshold: %u\n    port: %u\n", 1000 + i % 1000, 1 + i % 3);
+    }
+
+    if (fclose(f)) {
+        log_error("Error while writing %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Grow the map to entries when it is smaller, the loaders' sizes are for small configurations */
+static void ctl_size_map(struct bpf_map *map, __u32 entries) {
+    if (bpf_map__max_entries(map) < entries)
+        bpf_map__set_max_entries(map, entries);
+}
+
+/*
+ * The steps of the loaders from the configuration file to the attached
+ * program, each one timed: parse the YAML, open and load the skeleton, fill
+ * the maps and attach to the interfaces. Runs in its own process so that the
+ * peak RSS is the one of this configuration.
+ */
+static void run_steps(const char *path, bool hhd, __u32 entries, struct xdp_attach *xa, struct ctl_result *res) {
+    struct hhd_v1_bpf *hhd_skel = NULL;
+    struct drop_ip_bpf *drop_skel = NULL;
+    struct bpf_program *prog;
+    const cyaml_schema_value_t *schema = hhd ? &config_hhd_schema : &config_drop_schema;
+    struct config_maps maps = {0};
+    struct config_rules *rules;
+    __u64 start;
+
+    start = bench_now_ns();
+    res->err = config_parse(path, schema, &rules);
+    res->parse_ms = ctl_elapsed_ms(start);
+    res->parse_rss = ctl_peak_rss();
+    if (res->err)
+        return;
+
+    start = bench_now_ns();
+    if (hhd) {
+        hhd_skel = hhd_v1_bpf__open();
+        if (!hhd_skel) {
+            res->err = -1;
+            goto out;
+        }
+        hhd_skel->rodata->hhdv1_cfg.ifindex_if1 = xa->ifaces[0].ifindex;
+        hhd_skel->rodata->hhdv1_cfg.ifindex_if2 = xa->ifaces[1].ifindex;
+        hhd_skel->rodata->hhdv1_cfg.ifindex_if3 = xa->ifaces[2].ifindex;
+        hhd_skel->rodata->hhdv1_cfg.ifindex_if4 = xa->ifaces[3].ifindex;
+        bpf_map__set_max_entries(hhd_skel->maps.flow_cache, 1);
+        ctl_size_map(hhd_skel->maps.threshold_map, entries);
+        ctl_size_map(hhd_skel->maps.ip_to_port, entries);
+        res->err = hhd_v1_bpf__load(hhd_skel);
+        prog = hhd_skel->progs.xdp_hhdv1;
+        maps.threshold_map = hhd_skel->maps.threshold_map;
+        maps.ip_to_port = hhd_skel->maps.ip_to_port;
+        maps.vlan_policy = hhd_skel->maps.vlan_policy;
+    } else {
+        drop_skel = drop_ip_bpf__open();
+        if (!drop_skel) {
+            res->err = -1;
+            goto out;
+        }
+        drop_skel->rodata->drop_ip_cfg.ifindex_if1 = xa->ifaces[0].ifindex;
+        drop_skel->rodata->drop_ip_cfg.ifindex_if2 = xa->ifaces[1].ifindex;
+        bpf_map__set_max_entries(drop_skel->maps.flow_cache, 1);
+        bpf_map__set_max_entries(drop_skel->maps.conntrack, 1);
+        ctl_size_map(drop_skel->maps.xdp_stats_map, entries);
+        res->err = drop_ip_bpf__load(drop_skel);
+        prog = drop_skel->progs.xdp_drop_by_ip;
+        maps.stats_map = drop_skel->maps.xdp_stats_map;
+        maps.vlan_policy = drop_skel->maps.vlan_policy;
+    }
+    res->load_ms = ctl_elapsed_ms(start);
+    res->load_rss = ctl_peak_rss();
+    if (res->err) {
+        log_error("Error while loading BPF skeleton");
+        goto out;
+    }
+
+    /* What load_maps_config runs after the parsing */
+    start = bench_now_ns();
+    res->err = config_populate(rules, &maps, false);
+    res->populate_ms = ctl_elapsed_ms(start);
+    res->populate_rss = ctl_peak_rss();
+    if (res->err)
+        goto out;
+
+    start = bench_now_ns();
+    res->err = xdp_attach_all(xa, bpf_program__fd(prog));
+    res->attach_ms = ctl_elapsed_ms(start);
+    res->attach_rss = ctl_peak_rss();
+    xdp_attach_detach_all(xa);
+
+out:
+    config_free(rules, schema);
+    hhd_v1_bpf__destroy(hhd_skel);
+    drop_ip_bpf__destroy(drop_skel);
+}
+
+static int parse_sizes(const char *str, __u32 *sizes) {
+    char buf[256];
+    char *tok, *save;
+    int count = 0;
+
+    snprintf(buf, sizeof(buf), "%s", str);
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        unsigned long n = strtoul(tok, NULL, 0);
+
+        if (count == CTL_MAX_SIZES || n == 0 || n > CTL_MAX_ENTRIES) {
+            log_error("Entry counts must be between 1 and %d, at most %d of them", CTL_MAX_ENTRIES, CTL_MAX_SIZES);
+            return -1;
+        }
+        sizes[count++] = n;
+    }
+
+    return count;
+}
+
+int main(int argc, const char **argv) {
+    const char *program = "hhd_v1";
+    const char *size_list = "10,100,1000,10000,100000,1000000,10000000";
+    const char *iface_list = NULL;
+    const char *xdp_mode = NULL;
+    const char *dir = "/tmp";
+    const char *output = NULL;
+    struct xdp_attach xa;
+    enum xdp_attach_mode mode;
+    __u32 sizes[CTL_MAX_SIZES];
+    int sizes_count;
+    struct ctl_result *res;
+    struct bench_json json;
+    bool hhd;
+    int err = 0;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_GROUP("Basic options"),
+        OPT_STRING('P', "program", &program, "Program to load: hhd_v1 (default) or drop_ip", NULL, 0, 0),
+        OPT_STRING('n', "entries", &size_list, "Numbers of IPs in the generated configurations (default 10,...,10000000)", NULL, 0, 0),
+        OPT_STRING('i', "ifaces", &iface_list, "Comma-separated interfaces to attach to, none to skip the attach", NULL, 0, 0),
+        OPT_STRING(0, "xdp-mode", &xdp_mode, "XDP mode: drv (default), skb or hw, falls back to the slower ones", NULL, 0, 0),
+        OPT_STRING('d', "dir", &dir, "Directory of the generated configurations (default /tmp)", NULL, 0, 0),
+        OPT_STRING('o', "output", &output, "JSON output file (default stdout)", NULL, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "\nTime the YAML parsing, skeleton load, map population and attach of "
+                      "02_HHDv1 or 03_DropByIP for configurations of increasing size", "");
+    argc = argparse_parse(&argparse, argc, argv);
+
+    hhd = strcmp(program, "hhd_v1") == 0;
+    if (!hhd && strcmp(program, "drop_ip") != 0) {
+        log_fatal("Unknown program %s, expected hhd_v1 or drop_ip", program);
+        exit(1);
+    }
+
+    if ((sizes_count = parse_sizes(size_list, sizes)) <= 0 || xdp_attach_parse_mode(xdp_mode, &mode))
+        exit(1);
+
+    xdp_attach_init(&xa, mode, false);
+    if (iface_list) {
+        char buf[512];
+        char *tok, *save;
+
+        snprintf(buf, sizeof(buf), "%s", iface_list);
+        for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+            if (xdp_attach_add_iface(&xa, tok, NULL) < 0)
+                exit(1);
+        }
+    }
+
+    /* Shared with the children */
+    res = mmap(NULL, sizeof(*res), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (res == MAP_FAILED) {
+        log_fatal("Failed to map the results: %s", strerror(errno));
+        exit(1);
+    }
+
+    if (bench_json_open(&json, output))
+        exit(1);
+
+    for (int i = 0; i < sizes_count; i++) {
+        char path[PATH_MAX];
+        double ready_ms;
+        int status;
+        pid_t pid;
+
+        snprintf(path, sizeof(path), "%s/ctl_bench_%s_%u.yaml", dir, program, sizes[i]);
+        if (write_config(path, hhd, sizes[i])) {
+            err = 1;
+            break;
+        }
+
+        memset(res, 0, sizeof(*res));
+        pid = fork();
+        if (pid < 0) {
+            log_fatal("fork failed: %s", strerror(errno));
+            err = 1;
+            break;
+        }
+        if (pid == 0) {
+            run_steps(path, hhd, sizes[i], &xa, res);
+            _exit(res->err ? 1 : 0);
+        }
+
+        waitpid(pid, &status, 0);
+        unlink(path);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            log_fatal("Failed with %u entries", sizes[i]);
+            err = 1;
+            break;
+        }
+
+        ready_ms = res->parse_ms + res->load_ms + res->populate_ms + res->attach_ms;
+        log_info("%8u entries: parse %.1f ms (%.0f/s), load %.1f ms, maps %.1f ms (%.0f/s), attach %.1f ms on %d ifaces, "
+                 "ready in %.1f ms, peak RSS %ld KiB", sizes[i], res->parse_ms, sizes[i] * 1e3 / res->parse_ms,
+                 res->load_ms, res->populate_ms, sizes[i] * 1e3 / res->populate_ms, res->attach_ms, xa.count, ready_ms,
+                 res->attach_rss);
+
+        bench_json_begin(&json);
+        bench_json_str(&json, "bench", "ctl");
+        bench_json_str(&json, "program", program);
+        bench_json_u64(&json, "entries", sizes[i]);
+        bench_json_u64(&json, "ifaces", xa.count);
+        bench_json_double(&json, "parse_ms", res->parse_ms);
+        bench_json_double(&json, "parse_entries_per_s", sizes[i] * 1e3 / res->parse_ms);
+        bench_json_double(&json, "load_ms", res->load_ms);
+        bench_json_double(&json, "populate_ms", res->populate_ms);
+        bench_json_double(&json, "populate_entries_per_s", sizes[i] * 1e3 / res->populate_ms);
+        bench_json_double(&json, "attach_ms", res->attach_ms);
+        bench_json_double(&json, "ready_ms", ready_ms);
+        bench_json_u64(&json, "parse_peak_rss_kb", res->parse_rss);
+        bench_json_u64(&json, "load_peak_rss_kb", res->load_rss);
+        bench_json_u64(&json, "populate_peak_rss_kb", res->populate_rss);
+        bench_json_u64(&json, "peak_rss_kb", res->attach_rss);
+        bench_json_end(&json);
+    }
+
+    bench_json_close(&json);
+    munmap(res, sizeof(*res));
+    return err;
+}
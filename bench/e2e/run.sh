@@ -0,0 +1,267 @@
+#!/bin/bash
+# End-to-end throughput benchmark on a local veth/netns topology.
+#
+# The program under test is attached to the root-namespace side of the veth
+# pairs created by create_veth (libs/helpers.bash), the generator sends from
+# ns1 and the other namespaces are the sinks. The generator is the kernel
+# pktgen, or bench/xdp_gen with -g xdp_gen (faster, Linux 5.18 or later).
+# Like the other benchmarks of bench/, the result is a JSON array with one
+# record per run, on stdout or in the -o file:
+#
+#   mpps          packets processed by the XDP program (kernel run-time stats)
+#   ns_per_pkt    average run time of the XDP program
+#   tx_pps        packets sent by the generator
+#   delivered_pps packets that reached a sink namespace
+#   drop_rate     1 - delivered / sent
+#   cpu_util      busy share of all the CPUs, softirq_util the softirq part
+#
+# veth numbers are far below those of a real NIC and depend on the machine;
+# compare runs of the same machine only.
+#
+# Usage: sudo ./run.sh [-d seconds] [-s pkt_size] [-r runs] [-t threads]
+#                      [-m drv|skb] [-g pktgen|xdp_gen] [-o file] [program...]
+# Programs: simple_drop simple_redirect hhd_v1 drop_ip (default: all of them).
+# The programs, 02_HHDv1/xdp_loader and bench/xdp_gen must be built first.
+
+DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+ROOT="$(cd "$DIR/../.." && pwd)"
+
+source "$ROOT/libs/helpers.bash"
+
+DURATION=10
+PKT_SIZE=64
+RUNS=3
+THREADS=1
+XDP_MODE=drv
+GENERATOR=pktgen
+OUTPUT=
+METRICS_PORT=9464
+ALL_PROGRAMS="simple_drop simple_redirect hhd_v1 drop_ip"
+
+# Topology of each program: number of veth pairs, generator source range,
+# destination, sinks and command line (run from the root of the repo)
+function scenario {
+  case $1 in
+  simple_drop)
+    NVETH=1; SRC_MIN=10.0.0.1; SRC_MAX=10.0.0.1; DST=10.0.0.254; SINKS=""
+    DUT="01_SimpleDrop/counting_with_maps -i veth1"
+    ;;
+  simple_redirect)
+    NVETH=2; SRC_MIN=10.0.0.1; SRC_MAX=10.0.0.1; DST=10.0.0.2; SINKS="2"
+    DUT="01_SimpleRedirect/redirect -i veth1 -r veth2"
+    ;;
+  hhd_v1)
+    # The sources of 02_HHDv1/config.yaml, spread over the three other ports
+    NVETH=4; SRC_MIN=10.0.0.1; SRC_MAX=10.0.0.3; DST=10.0.0.4; SINKS="2 3 4"
+    DUT="02_HHDv1/hhd_v1 -c 02_HHDv1/config.yaml -1 veth1 -2 veth2 -3 veth3 -4 veth4"
+    ;;
+  drop_ip)
+    # Half of the sources are listed in 03_DropByIP/config.yaml
+    NVETH=2; SRC_MIN=10.0.0.1; SRC_MAX=10.0.0.6; DST=10.0.0.2; SINKS="2"
+    DUT="03_DropByIP/drop_ip -c 03_DropByIP/config.yaml -1 veth1 -2 veth2"
+    ;;
+  *)
+    echo "Unknown program $1, expected one of: $ALL_PROGRAMS" >&2
+    return 1
+    ;;
+  esac
+}
+
+function usage {
+  sed -n '/^# Usage/,/^# The programs/p' "${BASH_SOURCE[0]}" | sed 's/^# \{0,1\}//'
+  exit 1
+}
+
+while getopts "d:s:r:t:m:g:o:h" opt; do
+  case $opt in
+  d) DURATION=$OPTARG ;;
+  s) PKT_SIZE=$OPTARG ;;
+  r) RUNS=$OPTARG ;;
+  t) THREADS=$OPTARG ;;
+  m) XDP_MODE=$OPTARG ;;
+  g) GENERATOR=$OPTARG ;;
+  o) OUTPUT=$OPTARG ;;
+  *) usage ;;
+  esac
+done
+shift $((OPTIND - 1))
+PROGRAMS=${*:-$ALL_PROGRAMS}
+
+if [ "$EUID" -ne 0 ]; then
+  echo "Run as root: the benchmark creates namespaces and attaches XDP programs" >&2
+  exit 1
+fi
+
+case $GENERATOR in
+pktgen) modprobe pktgen || exit 1 ;;
+xdp_gen) ;;
+*) usage ;;
+esac
+
+RECORDS=()
+
+DUT_PID=
+
+function cleanup {
+  if [ -n "$DUT_PID" ]; then
+    kill -INT "$DUT_PID" 2>/dev/null
+    wait "$DUT_PID" 2>/dev/null
+    DUT_PID=
+  fi
+  delete_veth 4
+}
+trap cleanup EXIT
+
+function ns_counter {
+  ip netns exec "$1" cat /sys/class/net/"$2"/statistics/"$3"
+}
+
+# busy and softirq jiffies, then total, of all the CPUs
+function cpu_jiffies {
+  awk '/^cpu / { total = 0; for (i = 2; i <= NF; i++) total += $i;
+                 print total - $5 - $6, $8, total }' /proc/stat
+}
+
+# Sum of a family of the metrics endpoint of the program under test
+function scrape {
+  curl -s "http://127.0.0.1:$METRICS_PORT/metrics" |
+    awk -v name="$1" '$1 == name || index($1, name "{") == 1 { sum += $2 } END { printf "%.0f\n", sum }'
+}
+
+# Configure pktgen in ns1: THREADS pktgen devices on veth1_, sending UDP to
+# the root-namespace side of the pair. Nothing to do for xdp_gen, which takes
+# its configuration on the command line.
+function pktgen_setup {
+  local dst_mac
+  dst_mac=$(iface_mac veth1)
+
+  [ "$GENERATOR" = pktgen ] || return 0
+
+  ip netns exec ns1 bash -s <<EOF
+set -e
+for t in \$(seq 0 $((THREADS - 1))); do
+  echo "rem_device_all" > /proc/net/pktgen/kpktgend_\$t
+  echo "add_device veth1_@\$t" > /proc/net/pktgen/kpktgend_\$t
+  dev=/proc/net/pktgen/veth1_@\$t
+  echo "count 0" > \$dev
+  # veth does not support shared skbs
+  echo "clone_skb 0" > \$dev
+  echo "pkt_size $PKT_SIZE" > \$dev
+  echo "delay 0" > \$dev
+  echo "dst_mac $dst_mac" > \$dev
+  echo "src_min $SRC_MIN" > \$dev
+  echo "src_max $SRC_MAX" > \$dev
+  echo "dst $DST" > \$dev
+  echo "udp_src_min 1024" > \$dev
+  echo "udp_src_max 65535" > \$dev
+  echo "flag UDPSRC_RND" > \$dev
+  echo "flag IPSRC_RND" > \$dev
+done
+EOF
+}
+
+function run_once {
+  local prog=$1 run=$2
+  local tx0 tx1 rx0 rx1 runs0 runs1 time0 time1 cpu0 cpu1 start end
+
+  tx0=$(ns_counter ns1 veth1_ tx_packets)
+  rx0=0
+  for s in $SINKS; do rx0=$((rx0 + $(ns_counter ns$s veth${s}_ rx_packets))); done
+  runs0=$(scrape bpf_prog_runs_total)
+  time0=$(scrape bpf_prog_run_time_ns_total)
+  read -r -a cpu0 <<< "$(cpu_jiffies)"
+  start=$(date +%s.%N)
+
+  if [ "$GENERATOR" = xdp_gen ]; then
+    ip netns exec ns1 "$ROOT/bench/xdp_gen" -i veth1_ -s "$SRC_MIN-$SRC_MAX" -d "$DST" -z "$PKT_SIZE" \
+      -t "$DURATION" -m "$(iface_mac veth1)" -o /tmp/e2e_xdp_gen.json > /dev/null 2>&1
+  else
+    # pktgen runs until the writer of "start" is interrupted
+    ip netns exec ns1 timeout -s INT "$DURATION" bash -c 'echo start > /proc/net/pktgen/pgctrl'
+  fi
+
+  end=$(date +%s.%N)
+  read -r -a cpu1 <<< "$(cpu_jiffies)"
+  # Let the statistics tick publish the last counters
+  sleep 1.2
+  # Frames sent with XDP_TX do not show in the counters of veth1_
+  if [ "$GENERATOR" = xdp_gen ]; then
+    tx0=0
+    tx1=$(sed -n 's/.*"packets": \([0-9]*\).*/\1/p' /tmp/e2e_xdp_gen.json)
+  else
+    tx1=$(ns_counter ns1 veth1_ tx_packets)
+  fi
+  rx1=0
+  for s in $SINKS; do rx1=$((rx1 + $(ns_counter ns$s veth${s}_ rx_packets))); done
+  runs1=$(scrape bpf_prog_runs_total)
+  time1=$(scrape bpf_prog_run_time_ns_total)
+
+  awk -v prog="$prog" -v run="$run" -v size="$PKT_SIZE" -v mode="$XDP_MODE" -v gen="$GENERATOR" -v threads="$THREADS" \
+      -v start="$start" -v end="$end" -v tx=$((tx1 - tx0)) -v rx=$((rx1 - rx0)) \
+      -v runs=$((runs1 - runs0)) -v ns=$((time1 - time0)) \
+      -v busy=$((cpu1[0] - cpu0[0])) -v softirq=$((cpu1[1] - cpu0[1])) -v total=$((cpu1[2] - cpu0[2])) \
+      'BEGIN {
+         t = end - start;
+         printf "{\"bench\": \"e2e\", \"program\": \"%s\", \"run\": %d, \"xdp_mode\": \"%s\", ", prog, run, mode;
+         printf "\"generator\": \"%s\", ", gen;
+         printf "\"pkt_size\": %d, \"threads\": %d, \"duration_s\": %.2f, ", size, threads, t;
+         printf "\"mpps\": %.3f, \"ns_per_pkt\": %.1f, ", runs / t / 1e6, runs ? ns / runs : 0;
+         printf "\"tx_pps\": %.0f, \"delivered_pps\": %.0f, \"drop_rate\": %.4f, ", tx / t, rx / t, tx ? 1 - rx / tx : 0;
+         printf "\"cpu_util\": %.3f, \"softirq_util\": %.3f}", total ? busy / total : 0, total ? softirq / total : 0;
+       }'
+}
+
+function bench_program {
+  local prog=$1
+
+  scenario "$prog" || return 1
+  delete_veth 4
+  create_veth "$NVETH" > /dev/null || return 1
+
+  # The sinks need an XDP program on their side to receive redirected frames
+  for s in $SINKS; do
+    ip netns exec ns$s "$ROOT/02_HHDv1/xdp_loader" -i veth${s}_ --xdp-mode "$XDP_MODE" > /dev/null 2>&1 || return 1
+  done
+
+  (cd "$ROOT" && exec $DUT --xdp-mode "$XDP_MODE" --metrics-port "$METRICS_PORT" < /dev/null) \
+    > "/tmp/e2e_$prog.log" 2>&1 &
+  DUT_PID=$!
+  # Wait for the first metrics snapshot
+  sleep 2
+  if ! kill -0 "$DUT_PID" 2>/dev/null; then
+    echo "$prog failed to start, see /tmp/e2e_$prog.log" >&2
+    DUT_PID=
+    return 1
+  fi
+
+  pktgen_setup || return 1
+  for run in $(seq 1 "$RUNS"); do
+    RECORDS+=("$(run_once "$prog" "$run")")
+    echo "${RECORDS[-1]}" >&2
+  done
+
+  kill -INT "$DUT_PID"
+  wait "$DUT_PID" 2>/dev/null
+  DUT_PID=
+}
+
+for prog in $PROGRAMS; do
+  bench_program "$prog" || echo "Benchmark of $prog failed" >&2
+done
+
+function print_records {
+  local sep=
+
+  echo "["
+  for r in "${RECORDS[@]}"; do
+    printf '%s  %s' "$sep" "$r"
+    sep=$',\n'
+  done
+  printf '\n]\n'
+}
+
+if [ -n "$OUTPUT" ]; then
+  print_records > "$OUTPUT"
+else
+  print_records
+fi
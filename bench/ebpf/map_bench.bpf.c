@@ -0,0 +1,137 @@
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+#include "map_bench.h"
+/* The values are struct datarec of 03_DropByIP, struct value_t has the same layout */
+#include "map_values.h"
+
+/*
+ * One program per map type, all doing the operation of map_bench_cfg on a
+ * random key: the verifier drops the branches of the other operations.
+ * xdp_map_none only draws the key and gives the cost to subtract. The sizes
+ * are set by the loader.
+ */
+
+const volatile struct map_bench_cfg map_bench_cfg = {};
+
+#define BENCH_MAP(_name, _type)                 \
+   struct {                                     \
+      __uint(type, _type);                      \
+      __type(key, __u32);                       \
+      __type(value, struct datarec);            \
+      __uint(max_entries, 1);                   \
+   } _name SEC(".maps")
+
+BENCH_MAP(hash, BPF_MAP_TYPE_HASH);
+BENCH_MAP(percpu_hash, BPF_MAP_TYPE_PERCPU_HASH);
+BENCH_MAP(lru_hash, BPF_MAP_TYPE_LRU_HASH);
+BENCH_MAP(lru_percpu_hash, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+BENCH_MAP(array, BPF_MAP_TYPE_ARRAY);
+
+struct {
+   __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+   __type(key, struct lpm_key);
+   __type(value, struct datarec);
+   __uint(max_entries, 1);
+   __uint(map_flags, BPF_F_NO_PREALLOC);
+} lpm_trie SEC(".maps");
+
+struct {
+   __uint(type, BPF_MAP_TYPE_BLOOM_FILTER);
+   __type(value, __u32);
+   __uint(max_entries, 1);
+   /* Number of hash functions */
+   __uint(map_extra, 3);
+} bloom_filter SEC(".maps");
+
+static __always_inline __u32 bench_key(void) {
+   return bpf_get_prandom_u32() % map_bench_cfg.keys;
+}
+
+static __always_inline int bench_op(void *map, void *key, int percpu) {
+   struct datarec *val;
+
+   switch (map_bench_cfg.op) {
+      case MAP_BENCH_LOOKUP:
+         val = bpf_map_lookup_elem(map, key);
+         return val ? XDP_PASS : XDP_DROP;
+      case MAP_BENCH_UPDATE: {
+         struct datarec new = {.rx_packets = 1, .rx_bytes = 64};
+
+         return bpf_map_update_elem(map, key, &new, BPF_ANY) ? XDP_DROP : XDP_PASS;
+      }
+      default:
+         val = bpf_map_lookup_elem(map, key);
+         if (!val)
+            return XDP_DROP;
+         if (percpu) {
+            val->rx_packets++;
+            val->rx_bytes += 64;
+         } else {
+            __sync_fetch_and_add(&val->rx_packets, 1);
+            __sync_fetch_and_add(&val->rx_bytes, 64);
+         }
+         return XDP_PASS;
+   }
+}
+
+SEC("xdp")
+int xdp_map_none(struct xdp_md *ctx) {
+   return bench_key() < map_bench_cfg.keys ? XDP_PASS : XDP_DROP;
+}
+
+SEC("xdp")
+int xdp_map_hash(struct xdp_md *ctx) {
+   __u32 key = bench_key();
+
+   return bench_op(&hash, &key, 0);
+}
+
+SEC("xdp")
+int xdp_map_percpu_hash(struct xdp_md *ctx) {
+   __u32 key = bench_key();
+
+   return bench_op(&percpu_hash, &key, 1);
+}
+
+SEC("xdp")
+int xdp_map_lru_hash(struct xdp_md *ctx) {
+   __u32 key = bench_key();
+
+   return bench_op(&lru_hash, &key, 0);
+}
+
+SEC("xdp")
+int xdp_map_lru_percpu_hash(struct xdp_md *ctx) {
+   __u32 key = bench_key();
+
+   return bench_op(&lru_percpu_hash, &key, 1);
+}
+
+SEC("xdp")
+int xdp_map_array(struct xdp_md *ctx) {
+   __u32 key = bench_key();
+
+   return bench_op(&array, &key, 0);
+}
+
+/* /32 prefixes, the loader inserts one per key */
+SEC("xdp")
+int xdp_map_lpm_trie(struct xdp_md *ctx) {
+   struct lpm_key key = {.prefixlen = 32, .addr = bench_key()};
+
+   return bench_op(&lpm_trie, &key, 0);
+}
+
+/* No increment: a bloom filter has no values */
+SEC("xdp")
+int xdp_map_bloom_filter(struct xdp_md *ctx) {
+   __u32 key = bench_key();
+
+   if (map_bench_cfg.op == MAP_BENCH_UPDATE)
+      return bpf_map_push_elem(&bloom_filter, &key, BPF_ANY) ? XDP_DROP : XDP_PASS;
+
+   return bpf_map_peek_elem(&bloom_filter, &key) ? XDP_DROP : XDP_PASS;
+}
+
+char LICENSE[] SEC("license") = "Dual BSD/GPL";
@@ -0,0 +1,23 @@
+#pragma once
+
+/* Shared between the map_bench programs and their loader */
+#include <linux/types.h>
+
+enum map_bench_op {
+   MAP_BENCH_LOOKUP = 0,
+   MAP_BENCH_UPDATE,
+   /* Lookup and increment of both counters, atomic unless per-CPU */
+   MAP_BENCH_INCREMENT,
+   MAP_BENCH_OPS,
+};
+
+struct map_bench_cfg {
+   __u32 op;
+   /* Keys are drawn from [0, keys), the loader inserts them all */
+   __u32 keys;
+};
+
+struct lpm_key {
+   __u32 prefixlen;
+   __u32 addr;
+};
@@ -0,0 +1,64 @@
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <bpf/bpf_helpers.h>
+
+#include "map_workload.h"
+
+/*
+ * Feeder of the map workloads, run by BPF_PROG_TEST_RUN with a large repeat
+ * count: each run writes the next key of the stream into the frame and tail
+ * calls the program under test, so a single test run goes through the whole
+ * key distribution instead of looking up the same key every time. With an
+ * empty workload_target the tail call fails and the feeder returns
+ * XDP_PASS, which gives the cost of the feeder alone on the same stream.
+ *
+ * The frame built by the loader is Ethernet/IPv4 without VLAN tags.
+ */
+
+const volatile struct workload_cfg workload_cfg = {};
+
+/* Keys in network byte order, resized by the loader */
+struct {
+   __uint(type, BPF_MAP_TYPE_ARRAY);
+   __type(key, __u32);
+   __type(value, __u32);
+   __uint(max_entries, 1);
+} stream SEC(".maps");
+
+struct {
+   __uint(type, BPF_MAP_TYPE_PROG_ARRAY);
+   __uint(key_size, sizeof(__u32));
+   __uint(value_size, sizeof(__u32));
+   __uint(max_entries, 1);
+} workload_target SEC(".maps");
+
+/* Position in the stream, test runs are single-threaded */
+__u32 pos = 0;
+
+SEC("xdp")
+int xdp_workload_feed(struct xdp_md *ctx) {
+   void *data_end = (void *)(long)ctx->data_end;
+   void *data = (void *)(long)ctx->data;
+   struct iphdr *ip = data + sizeof(struct ethhdr);
+   __u32 idx = pos++ & workload_cfg.stream_mask;
+   __u32 *key;
+
+   if ((void *)(ip + 1) > data_end)
+      return XDP_ABORTED;
+
+   key = bpf_map_lookup_elem(&stream, &idx);
+   if (!key)
+      return XDP_ABORTED;
+
+   if (workload_cfg.field == WORKLOAD_DADDR)
+      ip->daddr = *key;
+   else
+      ip->saddr = *key;
+
+   bpf_tail_call(ctx, &workload_target, 0);
+
+   return XDP_PASS;
+}
+
+char LICENSE[] SEC("license") = "Dual BSD/GPL";
@@ -0,0 +1,16 @@
+#pragma once
+
+/* Shared between the map_workload feeder program and its loader */
+#include <linux/types.h>
+
+/* Header field the feeder writes the keys of the stream to */
+enum workload_field {
+   WORKLOAD_SADDR = 0,
+   WORKLOAD_DADDR,
+};
+
+struct workload_cfg {
+   __u32 field;
+   /* Length of the key stream minus one, the length is a power of 2 */
+   __u32 stream_mask;
+};
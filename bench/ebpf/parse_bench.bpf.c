@@ -0,0 +1,31 @@
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "parsing_helpers.h"
+
+/*
+ * Parse the frame with the shared helpers and nothing else. The verdict tells
+ * how far the parsing went: XDP_PASS when the L4 header was reached,
+ * XDP_DROP when a protocol on the way is disabled or unknown, XDP_ABORTED
+ * for truncated frames.
+ */
+
+/* Keeps the compiler from dropping the parsing of the unused fields */
+volatile __u64 parsed_bytes;
+
+SEC("xdp")
+int xdp_parse_bench(struct xdp_md *ctx) {
+   void *data_end = (void *)(long)ctx->data_end;
+   void *data = (void *)(long)ctx->data;
+   struct parsed_pkt pkt;
+
+   if (parse_pkt(data, data_end, &pkt) < 0)
+      return XDP_ABORTED;
+
+   parsed_bytes += pkt.payload_off;
+
+   return pkt.l4_proto ? XDP_PASS : XDP_DROP;
+}
+
+char LICENSE[] SEC("license") = "Dual BSD/GPL";
@@ -0,0 +1,28 @@
+#include <linux/bpf.h>
+#include <linux/types.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+
+/*
+ * BPF_PROG_TEST_RUN returns the verdict of an XDP program but not where
+ * XDP_REDIRECT would have sent the frame: bpf_redirect() only stores the
+ * target, the redirect itself never happens in a test run. This fentry
+ * program records the last target given to bpf_redirect() by the replaying
+ * process, so pcap_replay can read it after each run.
+ */
+
+const volatile __u32 replay_tgid = 0;
+
+/* ifindex of the last bpf_redirect() call, 0 when there was none */
+__u64 last_redirect = 0;
+
+SEC("fentry/bpf_redirect")
+int BPF_PROG(replay_on_redirect, __u64 ifindex, __u64 flags) {
+   if (bpf_get_current_pid_tgid() >> 32 != replay_tgid)
+      return 0;
+
+   last_redirect = ifindex;
+   return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual BSD/GPL";
@@ -0,0 +1,160 @@
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/in.h>
+#include <linux/udp.h>
+#include <linux/tcp.h>
+#include <linux/icmp.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "xdp_gen.h"
+
+/*
+ * Packet generator, run by BPF_PROG_TEST_RUN in BPF_F_TEST_XDP_LIVE_FRAMES
+ * mode: the kernel runs it on frames initialized from the template of the
+ * loader and transmits the ones it returns XDP_TX for on the interface given
+ * as ingress_ifindex.
+ *
+ * The frames come from a page pool and are recycled without being
+ * initialized again, so every field that differs between two frames is
+ * written on each run. The template is as large as the largest size, smaller
+ * frames are cut with bpf_xdp_adjust_tail (the length is reset on each run).
+ */
+
+const volatile struct gen_cfg gen_cfg = {};
+
+/* Frames generated so far, the generator runs on a single CPU */
+__u64 seq = 0;
+
+static __always_inline __u16 csum_fold(__u32 sum) {
+   sum = (sum & 0xffff) + (sum >> 16);
+   sum = (sum & 0xffff) + (sum >> 16);
+
+   return ~sum;
+}
+
+static __always_inline __u16 ip_csum(struct iphdr *ip) {
+   __u16 *p = (__u16 *)ip;
+   __u32 sum = 0;
+
+   ip->check = 0;
+#pragma unroll
+   for (int i = 0; i < sizeof(*ip) / 2; i++)
+      sum += p[i];
+
+   return csum_fold(sum);
+}
+
+/*
+ * The L4 checksums only cover the header (and the TCP pseudo-header): the
+ * payload after it is the zeroed template of the loader, which is never
+ * written, and zeros do not change the sum.
+ */
+static __always_inline __u16 tcp_csum(struct iphdr *ip, struct tcphdr *tcp, __u16 len) {
+   __u16 *p = (__u16 *)tcp;
+   __u32 sum = (ip->saddr & 0xffff) + (ip->saddr >> 16) + (ip->daddr & 0xffff) + (ip->daddr >> 16) +
+               bpf_htons(IPPROTO_TCP) + bpf_htons(len);
+
+   tcp->check = 0;
+#pragma unroll
+   for (int i = 0; i < sizeof(*tcp) / 2; i++)
+      sum += p[i];
+
+   return csum_fold(sum);
+}
+
+static __always_inline __u16 icmp_csum(struct icmphdr *icmp) {
+   __u16 *p = (__u16 *)icmp;
+   __u32 sum = 0;
+
+   icmp->checksum = 0;
+#pragma unroll
+   for (int i = 0; i < sizeof(*icmp) / 2; i++)
+      sum += p[i];
+
+   return csum_fold(sum);
+}
+
+SEC("xdp")
+int xdp_gen(struct xdp_md *ctx) {
+   __u64 n = seq++;
+   __u32 flow = n % gen_cfg.flows;
+   __u32 addrs = gen_cfg.src_count * gen_cfg.dst_count;
+   __u32 size = gen_cfg.size[(n / GEN_TABLE_SLOTS) & (GEN_TABLE_SLOTS - 1)];
+   __u8 proto = gen_cfg.proto[n & (GEN_TABLE_SLOTS - 1)];
+   int len = ctx->data_end - ctx->data;
+   void *data, *data_end;
+   struct ethhdr *eth;
+   struct iphdr *ip;
+   __u16 sport;
+
+   if (size < len && bpf_xdp_adjust_tail(ctx, (int)size - len))
+      return XDP_ABORTED;
+
+   data = (void *)(long)ctx->data;
+   data_end = (void *)(long)ctx->data_end;
+   eth = data;
+   ip = (void *)(eth + 1);
+
+   /* The largest L4 header, the loader never builds smaller frames */
+   if ((void *)(ip + 1) + sizeof(struct tcphdr) > data_end)
+      return XDP_ABORTED;
+
+   sport = gen_cfg.sport_min + flow / addrs;
+   ip->saddr = bpf_htonl(gen_cfg.src_min + flow % gen_cfg.src_count);
+   ip->daddr = bpf_htonl(gen_cfg.dst_min + (flow / gen_cfg.src_count) % gen_cfg.dst_count);
+   ip->tot_len = bpf_htons(data_end - (void *)ip);
+
+   /* Clear what the previous protocol of this frame left after the header */
+   __builtin_memset(ip + 1, 0, sizeof(struct tcphdr));
+
+   switch (proto) {
+      case GEN_PROTO_TCP:
+      case GEN_PROTO_SYN: {
+         struct tcphdr *tcp = (void *)(ip + 1);
+
+         ip->protocol = IPPROTO_TCP;
+         tcp->source = bpf_htons(sport);
+         tcp->dest = bpf_htons(gen_cfg.dport);
+         tcp->seq = bpf_htonl((__u32)n);
+         tcp->doff = sizeof(*tcp) / 4;
+         tcp->window = bpf_htons(65535);
+         if (proto == GEN_PROTO_SYN) {
+            tcp->syn = 1;
+         } else {
+            tcp->ack = 1;
+            tcp->ack_seq = bpf_htonl(1);
+         }
+         tcp->check = tcp_csum(ip, tcp, data_end - (void *)tcp);
+         break;
+      }
+      case GEN_PROTO_ICMP: {
+         struct icmphdr *icmp = (void *)(ip + 1);
+
+         ip->protocol = IPPROTO_ICMP;
+         icmp->type = ICMP_ECHO;
+         icmp->un.echo.id = bpf_htons(sport);
+         icmp->un.echo.sequence = bpf_htons((__u16)n);
+         icmp->checksum = icmp_csum(icmp);
+         break;
+      }
+      default: {
+         struct udphdr *udp = (void *)(ip + 1);
+
+         ip->protocol = IPPROTO_UDP;
+         udp->source = bpf_htons(sport);
+         udp->dest = bpf_htons(gen_cfg.dport);
+         udp->len = bpf_htons(data_end - (void *)udp);
+         /* No checksum, allowed for UDP over IPv4 */
+         udp->check = 0;
+         break;
+      }
+   }
+
+   ip->check = ip_csum(ip);
+
+   return XDP_TX;
+}
+
+char LICENSE[] SEC("license") = "Dual BSD/GPL";
@@ -0,0 +1,39 @@
+#pragma once
+
+/* Shared between the xdp_gen program and its loader */
+#include <linux/types.h>
+
+/* Weighted choices are drawn from tables of this many slots, power of 2 */
+#define GEN_TABLE_SLOTS 64
+#define GEN_MAX_FRAME 1514
+
+enum gen_proto {
+   GEN_PROTO_UDP = 0,
+   GEN_PROTO_TCP,
+   /* TCP SYN, for the SYN flood tests */
+   GEN_PROTO_SYN,
+   GEN_PROTO_ICMP,
+   GEN_PROTO_MAX,
+};
+
+/*
+ * Frame n belongs to flow n % flows. A flow is a source, a destination and a
+ * source port: the sources vary first, then the destinations, then the ports.
+ * Addresses are in host byte order.
+ */
+struct gen_cfg {
+   __u32 src_min;
+   __u32 src_count;
+   __u32 dst_min;
+   __u32 dst_count;
+   __u32 flows;
+   __u16 sport_min;
+   __u16 dport;
+   /*
+    * Protocol of frame n is proto[n % slots] and its size
+    * size[(n / slots) % slots]: every combination shows up once every
+    * slots * slots frames.
+    */
+   __u16 size[GEN_TABLE_SLOTS];
+   __u8 proto[GEN_TABLE_SLOTS];
+};
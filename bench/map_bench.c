@@ -0,0 +1,296 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include <argparse.h>
+
+#include "log.h"
+#include "bench.h"
+#include "ebpf/map_bench.h"
+#include "ebpf/map_values.h"
+
+// Include skeleton file
+#include "map_bench.skel.h"
+
+#define MAP_BENCH_MAX_CPUS 256
+
+static const char *const usages[] = {
+    "map_bench [options]",
+    NULL,
+};
+
+/* "none" only draws the random key, the cost included in all the others */
+static const char *const map_names[] = {
+    "none", "hash", "percpu_hash", "lru_hash", "lru_percpu_hash", "array", "lpm_trie", "bloom_filter",
+};
+
+#define MAP_BENCH_MAPS (sizeof(map_names) / sizeof(map_names[0]))
+
+static const char *const op_names[] = {"lookup", "update", "increment"};
+
+struct bench_thread {
+    pthread_t tid;
+    int cpu;
+    int prog_fd;
+    int repeat;
+    pthread_barrier_t *start;
+    double ns_per_op;
+    int err;
+};
+
+/* Insert the keys [0, keys) in the map of the given name */
+static int fill_map(struct map_bench_bpf *skel, const char *name, __u32 keys) {
+    struct bpf_map *map = bpf_object__find_map_by_name(skel->obj, name);
+    int nr_cpus = libbpf_num_possible_cpus();
+    struct datarec *values;
+    int fd, err = 0;
+
+    if (!map)
+        return 0;
+
+    fd = bpf_map__fd(map);
+    values = calloc(nr_cpus, sizeof(*values));
+    if (!values)
+        return -1;
+
+    for (__u32 i = 0; i < keys && !err; i++) {
+        struct lpm_key lpm = {.prefixlen = 32, .addr = i};
+
+        if (strcmp(name, "bloom_filter") == 0)
+            err = bpf_map_update_elem(fd, NULL, &i, BPF_ANY);
+        else if (strcmp(name, "lpm_trie") == 0)
+            err = bpf_map_update_elem(fd, &lpm, values, BPF_ANY);
+        else
+            err = bpf_map_update_elem(fd, &i, values, BPF_ANY);
+    }
+
+    if (err)
+        log_error("Failed to fill %s: %s", name, strerror(errno));
+
+    free(values);
+    return err;
+}
+
+static struct map_bench_bpf *load_op(enum map_bench_op op, __u32 keys) {
+    struct map_bench_bpf *skel;
+    struct bpf_map *map;
+
+    skel = map_bench_bpf__open();
+    if (!skel) {
+        log_fatal("Error while opening BPF skeleton");
+        return NULL;
+    }
+
+    skel->rodata->map_bench_cfg.op = op;
+    skel->rodata->map_bench_cfg.keys = keys;
+    bpf_object__for_each_map(map, skel->obj) {
+        if (bpf_map__type(map) != BPF_MAP_TYPE_ARRAY || strcmp(bpf_map__name(map), "array") == 0)
+            bpf_map__set_max_entries(map, keys);
+    }
+
+    if (map_bench_bpf__load(skel)) {
+        log_fatal("Error while loading BPF skeleton");
+        map_bench_bpf__destroy(skel);
+        return NULL;
+    }
+
+    return skel;
+}
+
+static void *bench_thread_fn(void *arg) {
+    struct bench_thread *t = arg;
+    char pkt[BENCH_PKT_SIZE];
+    int pkt_len;
+    cpu_set_t set;
+
+    /* The program runs on the CPU of the thread calling BPF_PROG_TEST_RUN */
+    CPU_ZERO(&set);
+    CPU_SET(t->cpu, &set);
+    t->err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (t->err)
+        log_error("Failed to pin the thread to CPU %d", t->cpu);
+
+    pkt_len = bench_build_pkt(pkt, sizeof(pkt), IPPROTO_UDP, 0x0a000001, 0x0a000004, 1234, 5678);
+
+    pthread_barrier_wait(t->start);
+    if (!t->err)
+        t->err = bench_run_xdp(t->prog_fd, pkt, pkt_len, t->repeat, &t->ns_per_op, NULL);
+
+    return NULL;
+}
+
+/* Run the program on the first ncpus CPUs at the same time */
+static int run_concurrent(int prog_fd, const int *cpus, int ncpus, int repeat, double *ns_per_op, double *mops) {
+    struct bench_thread threads[MAP_BENCH_MAX_CPUS] = {0};
+    pthread_barrier_t start;
+    int err = 0;
+
+    pthread_barrier_init(&start, NULL, ncpus);
+    for (int i = 0; i < ncpus; i++) {
+        threads[i].cpu = cpus[i];
+        threads[i].prog_fd = prog_fd;
+        threads[i].repeat = repeat;
+        threads[i].start = &start;
+        if (pthread_create(&threads[i].tid, NULL, bench_thread_fn, &threads[i])) {
+            log_fatal("Failed to create the benchmark threads");
+            exit(1);
+        }
+    }
+
+    *ns_per_op = 0;
+    *mops = 0;
+    for (int i = 0; i < ncpus; i++) {
+        pthread_join(threads[i].tid, NULL);
+        if (threads[i].err)
+            err = -1;
+        *ns_per_op += threads[i].ns_per_op / ncpus;
+        if (threads[i].ns_per_op > 0)
+            *mops += 1000.0 / threads[i].ns_per_op;
+    }
+    pthread_barrier_destroy(&start);
+
+    return err;
+}
+
+static int parse_names(const char *str, const char *const *names, int count, bool *selected) {
+    char buf[256];
+    char *tok, *save;
+
+    snprintf(buf, sizeof(buf), "%s", str);
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        int i;
+
+        for (i = 0; i < count && strcmp(tok, names[i]) != 0; i++)
+            ;
+        if (i == count) {
+            log_error("Unknown name %s", tok);
+            return -1;
+        }
+        selected[i] = true;
+    }
+
+    return 0;
+}
+
+int main(int argc, const char **argv) {
+    const char *map_list = "none,hash,percpu_hash,lru_hash,lru_percpu_hash,array,lpm_trie,bloom_filter";
+    const char *op_list = "lookup,update,increment";
+    const char *output = NULL;
+    bool map_selected[MAP_BENCH_MAPS] = {0};
+    bool op_selected[MAP_BENCH_OPS] = {0};
+    int cpus[MAP_BENCH_MAX_CPUS];
+    int ncpus = 0, max_cpus = 0;
+    int keys = 65536;
+    int repeat = BENCH_DEFAULT_REPEAT;
+    struct bench_json json;
+    cpu_set_t set;
+    int err = 0;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_GROUP("Basic options"),
+        OPT_STRING('m', "maps", &map_list, "Map types to measure (default all)", NULL, 0, 0),
+        OPT_STRING('O', "ops", &op_list, "Operations: lookup, update, increment (default all)", NULL, 0, 0),
+        OPT_INTEGER('k', "keys", &keys, "Number of keys in the maps (default 65536)", NULL, 0, 0),
+        OPT_INTEGER('c', "cpus", &max_cpus, "Up to this many concurrent CPUs (default all the allowed ones)", NULL, 0, 0),
+        OPT_INTEGER('r', "repeat", &repeat, "Number of runs per CPU and measurement", NULL, 0, 0),
+        OPT_STRING('o', "output", &output, "JSON output file (default stdout)", NULL, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "\nMeasure lookup, update and increment of each BPF map type on 1 to N CPUs, "
+                      "each thread pinned to its CPU", "");
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (parse_names(map_list, map_names, MAP_BENCH_MAPS, map_selected) ||
+        parse_names(op_list, op_names, MAP_BENCH_OPS, op_selected) || keys <= 0 || repeat <= 0) {
+        argparse_usage(&argparse);
+        exit(1);
+    }
+
+    /* The CPUs allowed by taskset/cgroups, in order */
+    if (sched_getaffinity(0, sizeof(set), &set)) {
+        log_fatal("Failed to get the CPU affinity: %s", strerror(errno));
+        exit(1);
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE && ncpus < MAP_BENCH_MAX_CPUS; cpu++) {
+        if (CPU_ISSET(cpu, &set))
+            cpus[ncpus++] = cpu;
+    }
+    if (max_cpus > 0 && max_cpus < ncpus)
+        ncpus = max_cpus;
+
+    if (bench_json_open(&json, output))
+        exit(1);
+
+    for (int op = 0; op < MAP_BENCH_OPS; op++) {
+        struct map_bench_bpf *skel;
+
+        if (!op_selected[op])
+            continue;
+
+        skel = load_op(op, keys);
+        if (!skel) {
+            err = 1;
+            goto out;
+        }
+
+        for (int m = 0; m < MAP_BENCH_MAPS; m++) {
+            char prog_name[64];
+            struct bpf_program *prog;
+
+            if (!map_selected[m] || (op == MAP_BENCH_INCREMENT && strcmp(map_names[m], "bloom_filter") == 0))
+                continue;
+
+            if (fill_map(skel, map_names[m], keys)) {
+                err = 1;
+                break;
+            }
+
+            snprintf(prog_name, sizeof(prog_name), "xdp_map_%s", map_names[m]);
+            prog = bpf_object__find_program_by_name(skel->obj, prog_name);
+
+            /* 1, 2, 4, ... CPUs, and all of them */
+            for (int n = 1; n <= ncpus; n = (n < ncpus && n * 2 > ncpus) ? ncpus : n * 2) {
+                double ns_per_op, mops;
+
+                if (run_concurrent(bpf_program__fd(prog), cpus, n, repeat, &ns_per_op, &mops)) {
+                    err = 1;
+                    break;
+                }
+
+                log_info("%-16s %-9s %3d CPUs %8.2f ns/op %8.2f Mops/s", map_names[m], op_names[op], n,
+                         ns_per_op, mops);
+
+                bench_json_begin(&json);
+                bench_json_str(&json, "bench", "map");
+                bench_json_str(&json, "map", map_names[m]);
+                bench_json_str(&json, "op", op_names[op]);
+                bench_json_u64(&json, "keys", keys);
+                bench_json_u64(&json, "cpus", n);
+                bench_json_u64(&json, "repeat", repeat);
+                bench_json_double(&json, "ns_per_op", ns_per_op);
+                bench_json_double(&json, "mops", mops);
+                bench_json_end(&json);
+            }
+
+            if (err)
+                break;
+        }
+
+        map_bench_bpf__destroy(skel);
+        if (err)
+            goto out;
+    }
+
+out:
+    bench_json_close(&json);
+    return err;
+}
@@ -0,0 +1,570 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#include <stdio.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <arpa/inet.h>
+
+#include <argparse.h>
+
+#include "log.h"
+#include "bench.h"
+#include "conntrack_user.h"
+#include "ebpf/map_workload.h"
+
+// Include skeleton files
+#include "hhd_v1.skel.h"
+#include "drop_ip.skel.h"
+#include "map_workload.skel.h"
+
+/* Keys of the maps are KEY_BASE + i, the attack keys are outside of that range */
+#define WORKLOAD_KEY_BASE 0x01000000
+#define WORKLOAD_MAX_KEYS (1 << 24)
+#define WORKLOAD_ATTACK_BASE 0x80000000
+#define WORKLOAD_MAX_SIZES 16
+/* 5-tuple of the frame, the feeder only rewrites one of the addresses */
+#define WORKLOAD_SADDR_DEFAULT 0x0a000001
+#define WORKLOAD_DADDR_DEFAULT 0x0a000004
+#define WORKLOAD_SPORT 1234
+#define WORKLOAD_DPORT 5678
+/* Ports that are not the ingress one, never used outside of the test runs */
+#define WORKLOAD_FAKE_IFINDEX 100000
+#define WORKLOAD_BATCH 65536
+
+static const char *const usages[] = {
+    "map_workload [options]",
+    NULL,
+};
+
+/* Map under test, the program that looks it up and the field used as key */
+struct workload_map {
+    const char *name;
+    const char *program;
+    enum workload_field field;
+};
+
+static const struct workload_map maps[] = {
+    {"threshold_map", "hhd_v1", WORKLOAD_SADDR},
+    {"ip_to_port", "hhd_v1", WORKLOAD_DADDR},
+    {"xdp_stats_map", "drop_ip", WORKLOAD_SADDR},
+    /* Replies from the outside to flows started by 10.0.0.4 */
+    {"conntrack", "drop_ip", WORKLOAD_SADDR},
+};
+
+enum workload_shape {
+    WORKLOAD_ZIPF = 0,
+    WORKLOAD_UNIFORM,
+    /* Keys that are never in the map, e.g. a flood of spoofed sources */
+    WORKLOAD_ATTACK,
+    WORKLOAD_SHAPES,
+};
+
+static const char *const shape_names[] = {"zipf", "uniform", "attack"};
+
+struct workload_target {
+    bool hhd;
+    union {
+        struct hhd_v1_bpf *hhd_v1;
+        struct drop_ip_bpf *drop_ip;
+    } skel;
+    struct bpf_object *obj;
+    struct bpf_program *prog;
+};
+
+/*
+ * Zipf ranks in [0, n) with P(rank k) proportional to 1 / (k + 1)^theta,
+ * 0 < theta < 1, from Gray et al., "Quickly Generating Billion-Record
+ * Synthetic Databases" (the generator of YCSB).
+ */
+struct zipf {
+    __u32 n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+};
+
+static void zipf_init(struct zipf *z, __u32 n, double theta) {
+    double zeta2 = 1.0 + pow(0.5, theta);
+
+    z->n = n;
+    z->theta = theta;
+    z->zetan = 0;
+    for (__u32 i = 1; i <= n; i++)
+        z->zetan += 1.0 / pow(i, theta);
+    z->alpha = 1.0 / (1.0 - theta);
+    z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+static __u32 zipf_next(const struct zipf *z) {
+    double u = drand48();
+    double uz = u * z->zetan;
+    __u32 rank;
+
+    if (uz < 1.0)
+        return 0;
+    if (uz < 1.0 + pow(0.5, z->theta))
+        return 1;
+
+    rank = z->n * pow(z->eta * u - z->eta + 1.0, z->alpha);
+    return rank < z->n ? rank : z->n - 1;
+}
+
+/* Batch updates need Linux 5.6 (5.7 for arrays), fall back to one syscall per key */
+static int update_keys(int map_fd, void *keys, void *values, __u32 count, __u32 key_size, __u32 value_size) {
+    __u32 n = count;
+
+    if (bpf_map_update_batch(map_fd, keys, values, &n, NULL) == 0)
+        return 0;
+
+    for (__u32 i = 0; i < count; i++) {
+        if (bpf_map_update_elem(map_fd, keys + i * key_size, values + i * value_size, BPF_ANY)) {
+            log_error("Failed to update the map: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Insert the keys [KEY_BASE, KEY_BASE + count) with values that keep the
+ * programs on their usual path: no threshold is exceeded and every
+ * destination has a valid port.
+ */
+static int fill_map(struct bpf_map *map, __u32 count) {
+    __u32 value_size = bpf_map__value_size(map);
+    __u32 *keys = calloc(WORKLOAD_BATCH, sizeof(*keys));
+    void *values = calloc(WORKLOAD_BATCH, value_size);
+    bool ports = strcmp(bpf_map__name(map), "ip_to_port") == 0;
+    bool thresholds = strcmp(bpf_map__name(map), "threshold_map") == 0;
+    int err = 0;
+
+    if (!keys || !values) {
+        err = -1;
+        goto out;
+    }
+
+    for (__u32 i = 0; i < WORKLOAD_BATCH; i++) {
+        if (ports)
+            *(__u32 *)(values + i * value_size) = 1 + i % 3;
+        if (thresholds)
+            *(__u64 *)(values + i * value_size) = UINT64_MAX;
+    }
+
+    for (__u32 done = 0; done < count && !err; done += WORKLOAD_BATCH) {
+        __u32 n = count - done < WORKLOAD_BATCH ? count - done : WORKLOAD_BATCH;
+
+        for (__u32 i = 0; i < n; i++)
+            keys[i] = htonl(WORKLOAD_KEY_BASE + done + i);
+        err = update_keys(bpf_map__fd(map), keys, values, n, sizeof(*keys), value_size);
+    }
+
+out:
+    free(keys);
+    free(values);
+    return err;
+}
+
+/*
+ * Insert the flows of 10.0.0.4 to the hosts [KEY_BASE, KEY_BASE + count),
+ * whose replies are the frames with these hosts as source.
+ */
+static int fill_conntrack(struct bpf_map *map, __u32 count) {
+    struct ct_key *keys = calloc(WORKLOAD_BATCH, sizeof(*keys));
+    struct ct_entry *values = calloc(WORKLOAD_BATCH, sizeof(*values));
+    int err = 0;
+
+    if (!keys || !values) {
+        err = -1;
+        goto out;
+    }
+
+    for (__u32 i = 0; i < WORKLOAD_BATCH; i++) {
+        keys[i].saddr = htonl(WORKLOAD_DADDR_DEFAULT);
+        keys[i].sport = htons(WORKLOAD_DPORT);
+        keys[i].dport = htons(WORKLOAD_SPORT);
+        keys[i].proto = IPPROTO_UDP;
+        values[i].state = CT_OTHER;
+    }
+
+    for (__u32 done = 0; done < count && !err; done += WORKLOAD_BATCH) {
+        __u32 n = count - done < WORKLOAD_BATCH ? count - done : WORKLOAD_BATCH;
+
+        for (__u32 i = 0; i < n; i++)
+            keys[i].daddr = htonl(WORKLOAD_KEY_BASE + done + i);
+        err = update_keys(bpf_map__fd(map), keys, values, n, sizeof(*keys), sizeof(*values));
+    }
+
+out:
+    free(keys);
+    free(values);
+    return err;
+}
+
+/* Draw the stream of keys of the given shape and write it to the feeder */
+static int fill_stream(struct map_workload_bpf *feeder, enum workload_shape shape, __u32 keys_count,
+                       __u32 len, double skew) {
+    __u32 *idx = calloc(len, sizeof(*idx));
+    __u32 *keys = calloc(len, sizeof(*keys));
+    struct zipf z;
+    int err;
+
+    if (!idx || !keys) {
+        free(idx);
+        free(keys);
+        return -1;
+    }
+
+    srand48(1);
+    if (shape == WORKLOAD_ZIPF)
+        zipf_init(&z, keys_count, skew);
+
+    for (__u32 i = 0; i < len; i++) {
+        idx[i] = i;
+        switch (shape) {
+            case WORKLOAD_ZIPF:
+                keys[i] = htonl(WORKLOAD_KEY_BASE + zipf_next(&z));
+                break;
+            case WORKLOAD_UNIFORM:
+                keys[i] = htonl(WORKLOAD_KEY_BASE + (__u32)(drand48() * keys_count));
+                break;
+            default:
+                keys[i] = htonl(WORKLOAD_ATTACK_BASE + (__u32)(drand48() * WORKLOAD_MAX_KEYS));
+                break;
+        }
+    }
+
+    err = update_keys(bpf_map__fd(feeder->maps.stream), idx, keys, len, sizeof(*idx), sizeof(*keys));
+    free(idx);
+    free(keys);
+    return err;
+}
+
+/* Open the program of m with the map under test sized for keys entries */
+static int load_target(struct workload_target *t, const struct workload_map *m, __u32 keys) {
+    struct bpf_map *map;
+
+    t->hhd = strcmp(m->program, "hhd_v1") == 0;
+    if (t->hhd) {
+        t->skel.hhd_v1 = hhd_v1_bpf__open();
+        if (!t->skel.hhd_v1)
+            return -1;
+        t->obj = t->skel.hhd_v1->obj;
+        t->prog = t->skel.hhd_v1->progs.xdp_hhdv1;
+        /* Test runs arrive on the loopback: port 4 for the ip_to_port lookups */
+        t->skel.hhd_v1->rodata->hhdv1_cfg.ifindex_if1 = WORKLOAD_FAKE_IFINDEX + 1;
+        t->skel.hhd_v1->rodata->hhdv1_cfg.ifindex_if2 = WORKLOAD_FAKE_IFINDEX + 2;
+        t->skel.hhd_v1->rodata->hhdv1_cfg.ifindex_if3 = WORKLOAD_FAKE_IFINDEX + 3;
+        t->skel.hhd_v1->rodata->hhdv1_cfg.ifindex_if4 = m->field == WORKLOAD_DADDR ? 1 : WORKLOAD_FAKE_IFINDEX + 4;
+        bpf_map__set_max_entries(t->skel.hhd_v1->maps.flow_cache, 1);
+    } else {
+        t->skel.drop_ip = drop_ip_bpf__open();
+        if (!t->skel.drop_ip)
+            return -1;
+        t->obj = t->skel.drop_ip->obj;
+        t->prog = t->skel.drop_ip->progs.xdp_drop_by_ip;
+        t->skel.drop_ip->rodata->drop_ip_cfg.ifindex_if1 = 1;
+        t->skel.drop_ip->rodata->drop_ip_cfg.ifindex_if2 = WORKLOAD_FAKE_IFINDEX + 2;
+        bpf_map__set_max_entries(t->skel.drop_ip->maps.flow_cache, 1);
+        if (strcmp(m->name, "conntrack") == 0) {
+            t->skel.drop_ip->rodata->conntrack_cfg.enabled = 1;
+            /* The flows never expire during the runs */
+            for (int i = 0; i < CT_STATE_MAX; i++)
+                t->skel.drop_ip->rodata->conntrack_cfg.timeout_ns[i] = UINT64_MAX;
+        } else {
+            bpf_map__set_max_entries(t->skel.drop_ip->maps.conntrack, 1);
+        }
+    }
+
+    map = bpf_object__find_map_by_name(t->obj, m->name);
+    if (!map || bpf_map__set_max_entries(map, keys))
+        return -1;
+
+    if (bpf_object__load(t->obj))
+        return -1;
+
+    if (strcmp(m->name, "conntrack") == 0)
+        return fill_conntrack(map, keys);
+    return fill_map(map, keys);
+}
+
+static void destroy_target(struct workload_target *t) {
+    if (t->hhd)
+        hhd_v1_bpf__destroy(t->skel.hhd_v1);
+    else
+        drop_ip_bpf__destroy(t->skel.drop_ip);
+}
+
+/* Memory charged to the map, from the memlock field of its fdinfo */
+static __u64 map_memlock(int map_fd) {
+    char path[64], line[128];
+    __u64 memlock = 0;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", map_fd);
+    f = fopen(path, "r");
+    if (!f)
+        return 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "memlock: %llu", &memlock) == 1)
+            break;
+    }
+
+    fclose(f);
+    return memlock;
+}
+
+/*
+ * Hardware cache misses of this thread, kernel included since the programs
+ * run in the test run syscall. Generic events map to the last level cache
+ * on most CPUs, so this is a proxy for the LLC misses of the lookups.
+ */
+static int open_cache_misses(void) {
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = PERF_COUNT_HW_CACHE_MISSES,
+        .disabled = 1,
+        .exclude_hv = 1,
+    };
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int run_workload(int prog_fd, void *pkt, int pkt_len, int repeat, int misses_fd,
+                        double *ns_per_pkt, double *misses_per_pkt, __u32 *retval) {
+    __u64 misses = 0;
+    int err;
+
+    if (misses_fd >= 0) {
+        ioctl(misses_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(misses_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    err = bench_run_xdp(prog_fd, pkt, pkt_len, repeat, ns_per_pkt, retval);
+
+    if (misses_fd >= 0) {
+        ioctl(misses_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(misses_fd, &misses, sizeof(misses)) != sizeof(misses))
+            misses = 0;
+    }
+    *misses_per_pkt = (double)misses / repeat;
+
+    return err;
+}
+
+static int parse_names(const char *str, const char *const *names, int count, bool *selected) {
+    char buf[256];
+    char *tok, *save;
+
+    snprintf(buf, sizeof(buf), "%s", str);
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        int i;
+
+        for (i = 0; i < count && strcmp(tok, names[i]) != 0; i++)
+            ;
+        if (i == count) {
+            log_error("Unknown name %s", tok);
+            return -1;
+        }
+        selected[i] = true;
+    }
+
+    return 0;
+}
+
+static int parse_sizes(const char *str, __u32 *sizes) {
+    char buf[256];
+    char *tok, *save;
+    int count = 0;
+
+    snprintf(buf, sizeof(buf), "%s", str);
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        unsigned long n = strtoul(tok, NULL, 0);
+
+        if (count == WORKLOAD_MAX_SIZES || n == 0 || n > WORKLOAD_MAX_KEYS) {
+            log_error("Key counts must be between 1 and %d, at most %d of them", WORKLOAD_MAX_KEYS,
+                      WORKLOAD_MAX_SIZES);
+            return -1;
+        }
+        sizes[count++] = n;
+    }
+
+    return count;
+}
+
+int main(int argc, const char **argv) {
+    const char *map_list = "threshold_map,ip_to_port,xdp_stats_map,conntrack";
+    const char *key_list = "1000,10000,100000,1000000,10000000";
+    const char *shape_list = "zipf,uniform,attack";
+    const char *output = NULL;
+    const char *map_names[sizeof(maps) / sizeof(maps[0])];
+    bool map_selected[sizeof(maps) / sizeof(maps[0])] = {0};
+    bool shape_selected[WORKLOAD_SHAPES] = {0};
+    __u32 sizes[WORKLOAD_MAX_SIZES];
+    int sizes_count;
+    int stream_len = 1 << 20;
+    int repeat = 1 << 22;
+    float skew = 0.99;
+    struct bench_json json;
+    int misses_fd;
+    char pkt[BENCH_PKT_SIZE];
+    int pkt_len;
+    int err = 0;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_GROUP("Basic options"),
+        OPT_STRING('m', "maps", &map_list, "Maps to measure (default threshold_map,ip_to_port,xdp_stats_map,conntrack)", NULL, 0, 0),
+        OPT_STRING('k', "keys", &key_list, "Key counts to fill the maps with (default 1000,...,10000000)", NULL, 0, 0),
+        OPT_STRING('w', "workloads", &shape_list, "Key distributions: zipf, uniform, attack (all-miss)", NULL, 0, 0),
+        OPT_FLOAT('s', "skew", &skew, "Zipf exponent, between 0 and 1 (default 0.99)", NULL, 0, 0),
+        OPT_INTEGER('n', "stream", &stream_len, "Length of the key stream, power of 2 (default 1M)", NULL, 0, 0),
+        OPT_INTEGER('r', "repeat", &repeat, "Number of runs per measurement (default 4M)", NULL, 0, 0),
+        OPT_STRING('o', "output", &output, "JSON output file (default stdout)", NULL, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "\nMeasure the ns/packet, cache misses and memory of the lookups of "
+                      "02_HHDv1 and 03_DropByIP for different key counts and distributions", "");
+    argc = argparse_parse(&argparse, argc, argv);
+
+    for (int i = 0; i < sizeof(maps) / sizeof(maps[0]); i++)
+        map_names[i] = maps[i].name;
+
+    if (parse_names(map_list, map_names, sizeof(maps) / sizeof(maps[0]), map_selected) ||
+        parse_names(shape_list, shape_names, WORKLOAD_SHAPES, shape_selected) ||
+        (sizes_count = parse_sizes(key_list, sizes)) <= 0) {
+        argparse_usage(&argparse);
+        exit(1);
+    }
+
+    if (skew <= 0 || skew >= 1) {
+        log_fatal("The Zipf exponent must be between 0 and 1");
+        exit(1);
+    }
+
+    if (stream_len <= 0 || (stream_len & (stream_len - 1)) || repeat <= 0) {
+        log_fatal("The stream length must be a power of 2 and the repeat count positive");
+        exit(1);
+    }
+
+    misses_fd = open_cache_misses();
+    if (misses_fd < 0)
+        log_warn("Cache miss counter not available (%s), reporting 0 misses", strerror(errno));
+
+    if (bench_json_open(&json, output))
+        exit(1);
+
+    pkt_len = bench_build_pkt(pkt, sizeof(pkt), IPPROTO_UDP, WORKLOAD_SADDR_DEFAULT, WORKLOAD_DADDR_DEFAULT,
+                              WORKLOAD_SPORT, WORKLOAD_DPORT);
+
+    for (int i = 0; i < sizeof(maps) / sizeof(maps[0]); i++) {
+        const struct workload_map *m = &maps[i];
+
+        if (!map_selected[i])
+            continue;
+
+        for (int j = 0; j < sizes_count; j++) {
+            struct workload_target target = {0};
+            struct map_workload_bpf *feeder;
+            int target_fd, slot = 0;
+            __u64 memlock;
+
+            if (load_target(&target, m, sizes[j])) {
+                log_fatal("Error while loading %s with %u keys in %s", m->program, sizes[j], m->name);
+                destroy_target(&target);
+                err = 1;
+                goto out;
+            }
+            memlock = map_memlock(bpf_map__fd(bpf_object__find_map_by_name(target.obj, m->name)));
+            target_fd = bpf_program__fd(target.prog);
+
+            feeder = map_workload_bpf__open();
+            if (!feeder) {
+                log_fatal("Error while opening BPF skeleton");
+                destroy_target(&target);
+                err = 1;
+                goto out;
+            }
+            feeder->rodata->workload_cfg.field = m->field;
+            feeder->rodata->workload_cfg.stream_mask = stream_len - 1;
+            bpf_map__set_max_entries(feeder->maps.stream, stream_len);
+            if (map_workload_bpf__load(feeder)) {
+                log_fatal("Error while loading BPF skeleton");
+                map_workload_bpf__destroy(feeder);
+                destroy_target(&target);
+                err = 1;
+                goto out;
+            }
+
+            for (int s = 0; s < WORKLOAD_SHAPES && !err; s++) {
+                int feeder_fd = bpf_program__fd(feeder->progs.xdp_workload_feed);
+                int target_map_fd = bpf_map__fd(feeder->maps.workload_target);
+                double base_ns, base_misses, ns, misses;
+                __u32 retval;
+
+                if (!shape_selected[s])
+                    continue;
+
+                err = fill_stream(feeder, s, sizes[j], stream_len, skew);
+
+                /* Feeder alone, then with the program under test */
+                bpf_map_delete_elem(target_map_fd, &slot);
+                if (!err)
+                    err = run_workload(feeder_fd, pkt, pkt_len, repeat, misses_fd, &base_ns, &base_misses, NULL);
+                if (!err)
+                    err = bpf_map_update_elem(target_map_fd, &slot, &target_fd, BPF_ANY);
+                if (!err)
+                    err = run_workload(feeder_fd, pkt, pkt_len, repeat, misses_fd, &ns, &misses, &retval);
+                if (err) {
+                    log_error("Error while running %s on %s", shape_names[s], m->name);
+                    break;
+                }
+
+                log_info("%-13s %8u keys %-7s %8.2f ns/pkt %7.3f misses/pkt %10.1f KiB (%s)", m->name, sizes[j],
+                         shape_names[s], ns - base_ns, misses - base_misses, memlock / 1024.0,
+                         xdp_verdict_str(retval));
+
+                bench_json_begin(&json);
+                bench_json_str(&json, "bench", "map_workload");
+                bench_json_str(&json, "program", m->program);
+                bench_json_str(&json, "map", m->name);
+                bench_json_u64(&json, "keys", sizes[j]);
+                bench_json_str(&json, "workload", shape_names[s]);
+                if (s == WORKLOAD_ZIPF)
+                    bench_json_double(&json, "skew", skew);
+                bench_json_u64(&json, "stream", stream_len);
+                bench_json_u64(&json, "repeat", repeat);
+                bench_json_double(&json, "ns_per_pkt", ns - base_ns);
+                bench_json_double(&json, "feeder_ns_per_pkt", base_ns);
+                bench_json_double(&json, "llc_miss_per_pkt", misses - base_misses);
+                bench_json_double(&json, "feeder_llc_miss_per_pkt", base_misses);
+                bench_json_u64(&json, "map_memlock", memlock);
+                bench_json_str(&json, "verdict", xdp_verdict_str(retval));
+                bench_json_end(&json);
+            }
+
+            map_workload_bpf__destroy(feeder);
+            destroy_target(&target);
+            if (err) {
+                err = 1;
+                goto out;
+            }
+        }
+    }
+
+out:
+    if (misses_fd >= 0)
+        close(misses_fd);
+    bench_json_close(&json);
+    return err;
+}
@@ -0,0 +1,277 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#include <stdio.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <arpa/inet.h>
+#include <linux/ipv6.h>
+#include <linux/icmp.h>
+
+#include <argparse.h>
+
+#include "log.h"
+#include "bench.h"
+#include "ebpf/parsing_flags.h"
+
+// Include skeleton file
+#include "parse_bench.skel.h"
+
+struct pkt_mix {
+    const char *name;
+    int vlans;    /* Number of 802.1Q/802.1ad tags */
+    bool ipv6;
+    int ip_opts;  /* IPv4 option bytes, multiple of 4 */
+    int ext_hdrs; /* IPv6 extension headers, at most 3 */
+    __u8 proto;
+};
+
+static const struct pkt_mix mixes[] = {
+    {"ipv4-udp", 0, false, 0, 0, IPPROTO_UDP},
+    {"ipv4-tcp", 0, false, 0, 0, IPPROTO_TCP},
+    {"ipv4-opts-udp", 0, false, 12, 0, IPPROTO_UDP},
+    {"ipv4-icmp", 0, false, 0, 0, IPPROTO_ICMP},
+    {"vlan-ipv4-udp", 1, false, 0, 0, IPPROTO_UDP},
+    {"qinq-ipv4-udp", 2, false, 0, 0, IPPROTO_UDP},
+    {"ipv6-udp", 0, true, 0, 0, IPPROTO_UDP},
+    {"ipv6-ext-udp", 0, true, 0, 3, IPPROTO_UDP},
+};
+
+/* Protocols turned off through parse_cfg.disabled before loading */
+struct parse_variant {
+    const char *name;
+    __u32 disabled;
+};
+
+static const struct parse_variant variants[] = {
+    {"all", 0},
+    {"ipv4-only", PARSE_F_VLAN | PARSE_F_IPV6 | PARSE_F_ICMP},
+};
+
+static const char *const usages[] = {
+    "parse_bench [options]",
+    NULL,
+};
+
+static __u16 ip_csum(void *hdr, int len) {
+    __u16 *p = hdr;
+    __u32 sum = 0;
+
+    for (int i = 0; i < len / 2; i++)
+        sum += p[i];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return ~sum;
+}
+
+/*
+ * Build the frame described by m in the zeroed buf, padded to at least
+ * pkt_len bytes.
+ */
+static int build_mix(void *buf, int pkt_len, const struct pkt_mix *m) {
+    static const __u8 ext_types[] = {NEXTHDR_HOP, NEXTHDR_DEST, NEXTHDR_FRAGMENT};
+    struct ethhdr *eth = buf;
+    __be16 *h_proto = buf + offsetof(struct ethhdr, h_proto);
+    int off = sizeof(*eth);
+    __u8 *nexthdr = NULL;
+    int l3_off, l4_len;
+
+    memcpy(eth->h_dest, "\x02\x00\x00\x00\x00\x02", ETH_ALEN);
+    memcpy(eth->h_source, "\x02\x00\x00\x00\x00\x01", ETH_ALEN);
+
+    for (int i = 0; i < m->vlans; i++) {
+        __be16 *tag = buf + off;
+
+        *h_proto = htons(i == 0 && m->vlans > 1 ? ETH_P_8021AD : ETH_P_8021Q);
+        tag[0] = htons(100 + i); /* TCI */
+        h_proto = &tag[1];
+        off += 4;
+    }
+
+    l3_off = off;
+    if (m->ipv6) {
+        struct ipv6hdr *ip6h = buf + off;
+
+        *h_proto = htons(ETH_P_IPV6);
+        ip6h->version = 6;
+        ip6h->hop_limit = 64;
+        ip6h->saddr.s6_addr[15] = 1;
+        ip6h->daddr.s6_addr[15] = 2;
+        nexthdr = &ip6h->nexthdr;
+        off += sizeof(*ip6h);
+
+        /* 8-byte extension headers, padded with a PadN option */
+        for (int i = 0; i < m->ext_hdrs && i < sizeof(ext_types); i++) {
+            __u8 *ext = buf + off;
+
+            *nexthdr = ext_types[i];
+            if (ext_types[i] != NEXTHDR_FRAGMENT) {
+                ext[2] = 1;
+                ext[3] = 4;
+            }
+            nexthdr = &ext[0];
+            off += 8;
+        }
+        *nexthdr = m->proto;
+    } else {
+        struct iphdr *ip = buf + off;
+        int hdr_size = sizeof(*ip) + m->ip_opts;
+
+        *h_proto = htons(ETH_P_IP);
+        ip->version = 4;
+        ip->ihl = hdr_size / 4;
+        ip->ttl = 64;
+        ip->protocol = m->proto;
+        ip->saddr = htonl(0x0a000001);
+        ip->daddr = htonl(0x0a000004);
+        /* NOP options */
+        memset(ip + 1, 1, m->ip_opts);
+        off += hdr_size;
+    }
+
+    switch (m->proto) {
+        case IPPROTO_TCP: {
+            struct tcphdr *tcp = buf + off;
+
+            tcp->source = htons(1234);
+            tcp->dest = htons(5678);
+            tcp->doff = sizeof(*tcp) / 4;
+            tcp->ack = 1;
+            l4_len = sizeof(*tcp);
+            break;
+        }
+        case IPPROTO_ICMP: {
+            struct icmphdr *icmp = buf + off;
+
+            icmp->type = ICMP_ECHO;
+            l4_len = sizeof(*icmp);
+            break;
+        }
+        default: {
+            struct udphdr *udp = buf + off;
+
+            udp->source = htons(1234);
+            udp->dest = htons(5678);
+            l4_len = sizeof(*udp);
+            break;
+        }
+    }
+
+    if (pkt_len < off + l4_len)
+        pkt_len = off + l4_len;
+
+    if (m->ipv6) {
+        struct ipv6hdr *ip6h = buf + l3_off;
+
+        ip6h->payload_len = htons(pkt_len - l3_off - sizeof(*ip6h));
+    } else {
+        struct iphdr *ip = buf + l3_off;
+
+        ip->tot_len = htons(pkt_len - l3_off);
+        ip->check = ip_csum(ip, ip->ihl * 4);
+    }
+
+    return pkt_len;
+}
+
+static struct parse_bench_bpf *load_variant(const struct parse_variant *v) {
+    struct parse_bench_bpf *skel;
+
+    skel = parse_bench_bpf__open();
+    if (!skel) {
+        log_fatal("Error while opening BPF skeleton");
+        return NULL;
+    }
+
+    /* The verifier prunes the branches of the disabled protocols */
+    skel->rodata->parse_cfg.disabled = v->disabled;
+
+    if (parse_bench_bpf__load(skel)) {
+        log_fatal("Error while loading BPF skeleton");
+        parse_bench_bpf__destroy(skel);
+        return NULL;
+    }
+
+    return skel;
+}
+
+int main(int argc, const char **argv) {
+    const char *output = NULL;
+    int repeat = BENCH_DEFAULT_REPEAT;
+    int pkt_size = BENCH_PKT_SIZE;
+    struct bench_json json;
+    char pkt[2048];
+    int err = 0;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_GROUP("Basic options"),
+        OPT_INTEGER('r', "repeat", &repeat, "Number of runs per measurement", NULL, 0, 0),
+        OPT_INTEGER('s', "size", &pkt_size, "Frame size in bytes", NULL, 0, 0),
+        OPT_STRING('o', "output", &output, "JSON output file (default stdout)", NULL, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "\nMeasure the ns/packet of the shared packet parsers on different protocol mixes", "");
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (pkt_size > sizeof(pkt)) {
+        log_fatal("Frame size must be at most %zu bytes", sizeof(pkt));
+        exit(1);
+    }
+
+    if (bench_json_open(&json, output))
+        exit(1);
+
+    for (int i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+        const struct parse_variant *v = &variants[i];
+        struct parse_bench_bpf *skel = load_variant(v);
+        int prog_fd;
+
+        if (!skel) {
+            err = 1;
+            goto out;
+        }
+
+        prog_fd = bpf_program__fd(skel->progs.xdp_parse_bench);
+
+        for (int j = 0; j < sizeof(mixes) / sizeof(mixes[0]); j++) {
+            const struct pkt_mix *m = &mixes[j];
+            double ns_per_pkt;
+            __u32 retval;
+            int pkt_len;
+
+            memset(pkt, 0, sizeof(pkt));
+            pkt_len = build_mix(pkt, pkt_size, m);
+
+            err = bench_run_xdp(prog_fd, pkt, pkt_len, repeat, &ns_per_pkt, &retval);
+            if (err) {
+                parse_bench_bpf__destroy(skel);
+                goto out;
+            }
+
+            /* XDP_PASS: parsed down to L4, XDP_DROP: stopped at a disabled protocol */
+            log_info("%-10s %-14s %8.2f ns/pkt (%s)", v->name, m->name, ns_per_pkt,
+                     xdp_verdict_str(retval));
+
+            bench_json_begin(&json);
+            bench_json_str(&json, "bench", "parse");
+            bench_json_str(&json, "variant", v->name);
+            bench_json_str(&json, "mix", m->name);
+            bench_json_u64(&json, "pkt_size", pkt_len);
+            bench_json_u64(&json, "repeat", repeat);
+            bench_json_double(&json, "ns_per_pkt", ns_per_pkt);
+            bench_json_str(&json, "verdict", xdp_verdict_str(retval));
+            bench_json_end(&json);
+        }
+
+        parse_bench_bpf__destroy(skel);
+    }
+
+out:
+    bench_json_close(&json);
+    return err;
+}
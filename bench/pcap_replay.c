@@ -0,0 +1,367 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#include <stdio.h>
+#include <unistd.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <arpa/inet.h>
+#include <pcap/pcap.h>
+
+#include <argparse.h>
+
+#include "log.h"
+#include "bench.h"
+#include "config_load.h"
+
+// Include skeleton files
+#include "hhd_v1.skel.h"
+#include "drop_ip.skel.h"
+#include "replay_trace.skel.h"
+
+#define REPLAY_MAX_PORTS 4
+/* Test runs see the loopback device as ingress, the other ports get fake ifindexes */
+#define REPLAY_LOOPBACK_IFINDEX 1
+#define REPLAY_FAKE_IFINDEX 100000
+#define REPLAY_MAX_MISMATCHES 20
+
+static const char *const usages[] = {
+    "pcap_replay -P <hhd_v1|drop_ip> -c <config> -r <trace> [options]",
+    NULL,
+};
+
+enum replay_type {
+    REPLAY_HHD_V1 = 0,
+    REPLAY_DROP_IP,
+};
+
+static const int replay_type_ports[] = {4, 2};
+
+struct replay_target {
+    enum replay_type type;
+    union {
+        struct hhd_v1_bpf *hhd_v1;
+        struct drop_ip_bpf *drop_ip;
+    } skel;
+    struct bpf_program *prog;
+    /* ifindex given to the program for each port, 1-based */
+    int port_ifindex[REPLAY_MAX_PORTS + 1];
+};
+
+/* Verdict of one frame, target is the port of XDP_REDIRECT (0: unknown) */
+struct replay_verdict {
+    __u32 action;
+    int target;
+};
+
+/* The configuration file of the program, YAML or snapshot, loaded as the program does */
+static int load_rules(struct replay_target *t, const char *config_file) {
+    struct config_maps maps = {0};
+
+    if (t->type == REPLAY_DROP_IP) {
+        maps.stats_map = t->skel.drop_ip->maps.xdp_stats_map;
+        maps.vlan_policy = t->skel.drop_ip->maps.vlan_policy;
+        return config_load(config_file, &config_drop_schema, &maps, false);
+    }
+
+    maps.threshold_map = t->skel.hhd_v1->maps.threshold_map;
+    maps.ip_to_port = t->skel.hhd_v1->maps.ip_to_port;
+    maps.vlan_policy = t->skel.hhd_v1->maps.vlan_policy;
+    return config_load(config_file, &config_hhd_schema, &maps, false);
+}
+
+/*
+ * Open and load the program with the frames arriving on ingress_port. The
+ * program only compares the ifindexes and passes them to bpf_redirect(), so
+ * the other ports do not need to exist.
+ */
+static int load_target(struct replay_target *t, int ingress_port, bool flow_cache) {
+    for (int p = 1; p <= REPLAY_MAX_PORTS; p++)
+        t->port_ifindex[p] = p == ingress_port ? REPLAY_LOOPBACK_IFINDEX : REPLAY_FAKE_IFINDEX + p;
+
+    switch (t->type) {
+        case REPLAY_HHD_V1:
+            t->skel.hhd_v1 = hhd_v1_bpf__open();
+            if (!t->skel.hhd_v1)
+                return -1;
+            t->skel.hhd_v1->rodata->hhdv1_cfg.ifindex_if1 = t->port_ifindex[1];
+            t->skel.hhd_v1->rodata->hhdv1_cfg.ifindex_if2 = t->port_ifindex[2];
+            t->skel.hhd_v1->rodata->hhdv1_cfg.ifindex_if3 = t->port_ifindex[3];
+            t->skel.hhd_v1->rodata->hhdv1_cfg.ifindex_if4 = t->port_ifindex[4];
+            t->skel.hhd_v1->rodata->flow_cache_cfg.enabled = flow_cache;
+            t->skel.hhd_v1->rodata->flow_cache_cfg.ttl_ns = 1000000000ULL;
+            if (!flow_cache)
+                bpf_map__set_max_entries(t->skel.hhd_v1->maps.flow_cache, 1);
+            t->prog = t->skel.hhd_v1->progs.xdp_hhdv1;
+            return hhd_v1_bpf__load(t->skel.hhd_v1);
+        case REPLAY_DROP_IP:
+            t->skel.drop_ip = drop_ip_bpf__open();
+            if (!t->skel.drop_ip)
+                return -1;
+            t->skel.drop_ip->rodata->drop_ip_cfg.ifindex_if1 = t->port_ifindex[1];
+            t->skel.drop_ip->rodata->drop_ip_cfg.ifindex_if2 = t->port_ifindex[2];
+            t->skel.drop_ip->rodata->flow_cache_cfg.enabled = flow_cache;
+            t->skel.drop_ip->rodata->flow_cache_cfg.ttl_ns = 1000000000ULL;
+            if (!flow_cache)
+                bpf_map__set_max_entries(t->skel.drop_ip->maps.flow_cache, 1);
+            bpf_map__set_max_entries(t->skel.drop_ip->maps.conntrack, 1);
+            t->prog = t->skel.drop_ip->progs.xdp_drop_by_ip;
+            return drop_ip_bpf__load(t->skel.drop_ip);
+    }
+
+    return -1;
+}
+
+static void destroy_target(struct replay_target *t) {
+    switch (t->type) {
+        case REPLAY_HHD_V1:
+            hhd_v1_bpf__destroy(t->skel.hhd_v1);
+            break;
+        case REPLAY_DROP_IP:
+            drop_ip_bpf__destroy(t->skel.drop_ip);
+            break;
+    }
+}
+
+static int ifindex_to_port(const struct replay_target *t, __u64 ifindex) {
+    for (int p = 1; p <= REPLAY_MAX_PORTS; p++) {
+        if (t->port_ifindex[p] == ifindex)
+            return p;
+    }
+
+    return 0;
+}
+
+static void format_verdict(const struct replay_verdict *v, char *buf, size_t len) {
+    if (v->action == XDP_REDIRECT && v->target)
+        snprintf(buf, len, "%s %d", xdp_verdict_str(v->action), v->target);
+    else
+        snprintf(buf, len, "%s", xdp_verdict_str(v->action));
+}
+
+/*
+ * Golden verdict file: one line per frame of the trace, "XDP_DROP", "XDP_PASS",
+ * ... or "XDP_REDIRECT <port>". Lines starting with # are comments.
+ */
+static int read_golden_line(FILE *f, char *buf, size_t len) {
+    while (fgets(buf, len, f)) {
+        buf[strcspn(buf, "\r\n")] = '\0';
+        if (buf[0] != '#' && buf[0] != '\0')
+            return 0;
+    }
+
+    return -1;
+}
+
+/* XDP_REDIRECT without a port matches any target, the targets are not always recorded */
+static bool verdict_matches(const char *expected, const char *got) {
+    size_t n = strlen(expected);
+
+    return strcmp(expected, got) == 0 ||
+           (strcmp(expected, "XDP_REDIRECT") == 0 && strncmp(got, expected, n) == 0);
+}
+
+int main(int argc, const char **argv) {
+    struct replay_target target = {0};
+    struct replay_trace_bpf *trace = NULL;
+    const char *program = NULL;
+    const char *config_file = NULL;
+    const char *trace_file = NULL;
+    const char *golden_file = NULL;
+    const char *write_file = NULL;
+    const char *output = NULL;
+    int ingress_port = 1;
+    int flow_cache = 0;
+    char errbuf[PCAP_ERRBUF_SIZE];
+    pcap_t *pcap = NULL;
+    FILE *golden = NULL, *out = NULL;
+    struct pcap_pkthdr *hdr;
+    const u_char *data;
+    char tail[32];
+    __u64 packets = 0, skipped = 0, mismatches = 0, total_ns = 0;
+    __u64 verdicts[XDP_REDIRECT + 1] = {0};
+    __u64 start, elapsed;
+    struct bench_json json;
+    int prog_fd, ret, err = 0;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_GROUP("Basic options"),
+        OPT_STRING('P', "program", &program, "Program to replay the trace through: hhd_v1 or drop_ip", NULL, 0, 0),
+        OPT_STRING('c', "config", &config_file, "YAML configuration of the program, as in 02_HHDv1 and 03_DropByIP", NULL, 0, 0),
+        OPT_STRING('r', "read", &trace_file, "pcap or pcapng trace (Ethernet)", NULL, 0, 0),
+        OPT_INTEGER('p', "ingress-port", &ingress_port, "Port of the program the frames arrive on (default 1)", NULL, 0, 0),
+        OPT_BOOLEAN('f', "flow-cache", &flow_cache, "Replay with the flow verdict cache enabled", NULL, 0, 0),
+        OPT_STRING('g', "golden", &golden_file, "Compare the verdicts with this golden file", NULL, 0, 0),
+        OPT_STRING('w', "write-golden", &write_file, "Write the verdicts to this golden file", NULL, 0, 0),
+        OPT_STRING('o', "output", &output, "JSON output file (default stdout)", NULL, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "\nReplay a trace through HHDv1 or DropByIP with BPF_PROG_TEST_RUN, "
+                      "compare the verdicts with a golden file and report the ns/packet", "");
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (!program || !config_file || !trace_file) {
+        argparse_usage(&argparse);
+        exit(1);
+    }
+
+    if (strcmp(program, "hhd_v1") == 0) {
+        target.type = REPLAY_HHD_V1;
+    } else if (strcmp(program, "drop_ip") == 0) {
+        target.type = REPLAY_DROP_IP;
+    } else {
+        log_fatal("Unknown program %s, expected hhd_v1 or drop_ip", program);
+        exit(1);
+    }
+
+    if (ingress_port < 1 || ingress_port > replay_type_ports[target.type]) {
+        log_fatal("%s has ports 1 to %d", program, replay_type_ports[target.type]);
+        exit(1);
+    }
+
+    pcap = pcap_open_offline(trace_file, errbuf);
+    if (!pcap) {
+        log_fatal("Error while opening %s: %s", trace_file, errbuf);
+        exit(1);
+    }
+
+    if (pcap_datalink(pcap) != DLT_EN10MB) {
+        log_fatal("%s is not an Ethernet trace", trace_file);
+        err = 1;
+        goto out;
+    }
+
+    if (load_target(&target, ingress_port, flow_cache) || load_rules(&target, config_file)) {
+        log_fatal("Error while loading %s", program);
+        err = 1;
+        goto out;
+    }
+    prog_fd = bpf_program__fd(target.prog);
+
+    /* Without the redirect targets the verdicts can still be compared */
+    trace = replay_trace_bpf__open();
+    if (trace) {
+        trace->rodata->replay_tgid = getpid();
+        if (replay_trace_bpf__load(trace) || replay_trace_bpf__attach(trace)) {
+            replay_trace_bpf__destroy(trace);
+            trace = NULL;
+        }
+    }
+    if (!trace)
+        log_warn("Could not attach to bpf_redirect(), the redirect targets are not recorded");
+
+    if (golden_file && !(golden = fopen(golden_file, "r"))) {
+        log_fatal("Error while opening %s: %s", golden_file, strerror(errno));
+        err = 1;
+        goto out;
+    }
+
+    if (write_file) {
+        out = fopen(write_file, "w");
+        if (!out) {
+            log_fatal("Error while opening %s: %s", write_file, strerror(errno));
+            err = 1;
+            goto out;
+        }
+        fprintf(out, "# %s %s, ingress port %d, %s\n", program, trace_file, ingress_port,
+                flow_cache ? "flow cache" : "no flow cache");
+    }
+
+    start = bench_now_ns();
+    while ((ret = pcap_next_ex(pcap, &hdr, &data)) == 1) {
+        LIBBPF_OPTS(bpf_test_run_opts, opts,
+            .data_in = data,
+            .data_size_in = hdr->caplen,
+            .repeat = 1,
+        );
+        struct replay_verdict v = {0};
+        char got[32], expected[32];
+
+        /* Truncated captures are replayed as captured, too short frames are skipped */
+        if (hdr->caplen < ETH_HLEN) {
+            skipped++;
+            continue;
+        }
+
+        if (trace)
+            trace->bss->last_redirect = 0;
+
+        if (bpf_prog_test_run_opts(prog_fd, &opts)) {
+            log_warn("Frame %llu: BPF_PROG_TEST_RUN failed: %s", packets + skipped + 1, strerror(errno));
+            skipped++;
+            continue;
+        }
+
+        packets++;
+        total_ns += opts.duration;
+
+        v.action = opts.retval;
+        if (v.action <= XDP_REDIRECT)
+            verdicts[v.action]++;
+        if (v.action == XDP_REDIRECT && trace)
+            v.target = ifindex_to_port(&target, trace->bss->last_redirect);
+
+        format_verdict(&v, got, sizeof(got));
+        if (out)
+            fprintf(out, "%s\n", got);
+
+        if (golden) {
+            if (read_golden_line(golden, expected, sizeof(expected))) {
+                log_error("Golden file %s ends before the trace", golden_file);
+                fclose(golden);
+                golden = NULL;
+                mismatches++;
+            } else if (!verdict_matches(expected, got)) {
+                if (mismatches < REPLAY_MAX_MISMATCHES)
+                    log_error("Frame %llu: expected %s, got %s", packets + skipped, expected, got);
+                mismatches++;
+            }
+        }
+    }
+    elapsed = bench_now_ns() - start;
+
+    if (ret == -1)
+        log_error("Error while reading %s: %s", trace_file, pcap_geterr(pcap));
+
+    if (golden && read_golden_line(golden, tail, sizeof(tail)) == 0) {
+        log_error("Golden file %s has more verdicts than the trace has frames", golden_file);
+        mismatches++;
+    }
+
+    log_info("%llu frames (%llu skipped), %.2f ns/pkt in the program, %.2f Mpps replayed",
+             packets, skipped, packets ? (double)total_ns / packets : 0, elapsed ? (double)packets * 1000 / elapsed : 0);
+    for (int i = 0; i <= XDP_REDIRECT; i++)
+        log_info("%s: %llu", xdp_verdict_str(i), verdicts[i]);
+    if (golden_file)
+        log_info("%llu verdicts differ from %s", mismatches, golden_file);
+
+    if (bench_json_open(&json, output) == 0) {
+        bench_json_begin(&json);
+        bench_json_str(&json, "bench", "pcap_replay");
+        bench_json_str(&json, "program", program);
+        bench_json_str(&json, "trace", trace_file);
+        bench_json_u64(&json, "packets", packets);
+        bench_json_u64(&json, "skipped", skipped);
+        bench_json_double(&json, "ns_per_pkt", packets ? (double)total_ns / packets : 0);
+        for (int i = 0; i <= XDP_REDIRECT; i++)
+            bench_json_u64(&json, xdp_verdict_str(i), verdicts[i]);
+        if (golden_file)
+            bench_json_u64(&json, "mismatches", mismatches);
+        bench_json_end(&json);
+        bench_json_close(&json);
+    }
+
+    err = mismatches ? 1 : 0;
+
+out:
+    if (golden)
+        fclose(golden);
+    if (out)
+        fclose(out);
+    replay_trace_bpf__destroy(trace);
+    destroy_target(&target);
+    pcap_close(pcap);
+    return err;
+}
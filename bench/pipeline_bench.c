@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#include <stdio.h>
+#include <unistd.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <arpa/inet.h>
+
+#include <argparse.h>
+
+#include "log.h"
+#include "bench.h"
+#include "../06_Pipeline/ebpf/pipeline_md.h"
+#include "ebpf/map_values.h"
+
+// Include skeleton file
+#include "pipeline.skel.h"
+
+/* Fake egress ifindex: redirects are not executed by BPF_PROG_TEST_RUN */
+#define BENCH_OUT_IFINDEX 1000
+
+struct pipeline_variant {
+    const char *name;
+    const char *entry;
+    const char *classify;
+    const char *police;
+    /* Work done on a packet, only the variants with the same stages compare */
+    const char *stages;
+};
+
+/*
+ * staged runs the same logic as monolithic. staged-lite does not: it skips
+ * the blocklist lookup and the threshold policing, and only bounds from below
+ * the cost of the tail calls.
+ */
+static const struct pipeline_variant variants[] = {
+    {"monolithic", "xdp_monolithic", NULL, NULL, "parse,blocklist,threshold,forward"},
+    {"staged", "xdp_parse", "xdp_classify_blocklist", "xdp_police_threshold", "parse,blocklist,threshold,forward"},
+    {"staged-lite", "xdp_parse", "xdp_classify_direction", "xdp_police_none", "parse,direction,forward"},
+};
+
+static const char *const usages[] = {
+    "pipeline_bench [options]",
+    NULL,
+};
+
+static int set_slot(struct pipeline_bpf *skel, __u32 slot, const char *prog_name) {
+    struct bpf_program *prog = bpf_object__find_program_by_name(skel->obj, prog_name);
+    int prog_fd;
+
+    if (!prog)
+        return -1;
+
+    prog_fd = bpf_program__fd(prog);
+    return bpf_map__update_elem(skel->maps.pipeline_progs, &slot, sizeof(slot), &prog_fd,
+                                sizeof(prog_fd), BPF_ANY);
+}
+
+/*
+ * Load a fresh pipeline. Without ctx_in, test runs see the loopback device as
+ * ingress, so it plays the role of interface 4 for the return path and of
+ * interface 1 for the metered one.
+ */
+static struct pipeline_bpf *load_pipeline(bool return_path, __u32 saddr, __u32 daddr) {
+    struct value_t value = {.threshold = UINT64_MAX};
+    struct pipeline_bpf *skel;
+    __u32 port = 1;
+    __u32 key;
+
+    skel = pipeline_bpf__open();
+    if (!skel) {
+        log_fatal("Error while opening BPF skeleton");
+        return NULL;
+    }
+
+    skel->rodata->pipeline_cfg.ifindex_if1 = return_path ? BENCH_OUT_IFINDEX : 1;
+    skel->rodata->pipeline_cfg.ifindex_if2 = BENCH_OUT_IFINDEX;
+    skel->rodata->pipeline_cfg.ifindex_if3 = BENCH_OUT_IFINDEX;
+    skel->rodata->pipeline_cfg.ifindex_if4 = return_path ? 1 : BENCH_OUT_IFINDEX;
+
+    if (pipeline_bpf__load(skel)) {
+        log_fatal("Error while loading BPF skeleton");
+        pipeline_bpf__destroy(skel);
+        return NULL;
+    }
+
+    key = htonl(saddr);
+    bpf_map__update_elem(skel->maps.threshold_map, &key, sizeof(key), &value, sizeof(value), BPF_ANY);
+    key = htonl(daddr);
+    bpf_map__update_elem(skel->maps.ip_to_port, &key, sizeof(key), &port, sizeof(port), BPF_ANY);
+
+    set_slot(skel, PIPELINE_FORWARD, "xdp_forward");
+
+    return skel;
+}
+
+int main(int argc, const char **argv) {
+    const char *output = NULL;
+    int repeat = BENCH_DEFAULT_REPEAT;
+    int pkt_size = BENCH_PKT_SIZE;
+    __u32 saddr = 0x0a000001; /* 10.0.0.1 */
+    __u32 daddr = 0x0a000004; /* 10.0.0.4 */
+    struct bench_json json;
+    char pkt[2048];
+    int pkt_len;
+    int err = 0;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_GROUP("Basic options"),
+        OPT_INTEGER('r', "repeat", &repeat, "Number of runs per measurement", NULL, 0, 0),
+        OPT_INTEGER('s', "size", &pkt_size, "Frame size in bytes", NULL, 0, 0),
+        OPT_STRING('o', "output", &output, "JSON output file (default stdout)", NULL, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "\nCompare the ns/packet of the monolithic and of the tail-call versions of 06_Pipeline", "");
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (pkt_size > sizeof(pkt)) {
+        log_fatal("Frame size must be at most %zu bytes", sizeof(pkt));
+        exit(1);
+    }
+
+    pkt_len = bench_build_pkt(pkt, pkt_size, IPPROTO_UDP, saddr, daddr, 1234, 5678);
+
+    if (bench_json_open(&json, output))
+        exit(1);
+
+    for (int path = 0; path < 2; path++) {
+        for (int i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+            const struct pipeline_variant *v = &variants[i];
+            struct pipeline_bpf *skel = load_pipeline(path, saddr, daddr);
+            struct bpf_program *entry;
+            double ns_per_pkt;
+            __u32 retval;
+
+            if (!skel) {
+                err = 1;
+                goto out;
+            }
+
+            if (v->classify)
+                set_slot(skel, PIPELINE_CLASSIFY, v->classify);
+            if (v->police)
+                set_slot(skel, PIPELINE_POLICE, v->police);
+
+            entry = bpf_object__find_program_by_name(skel->obj, v->entry);
+            err = bench_run_xdp(bpf_program__fd(entry), pkt, pkt_len, repeat, &ns_per_pkt, &retval);
+            pipeline_bpf__destroy(skel);
+            if (err)
+                goto out;
+
+            log_info("%-12s %-8s %8.2f ns/pkt (%s), stages %s", v->name, path ? "return" : "metered",
+                     ns_per_pkt, xdp_verdict_str(retval), v->stages);
+
+            bench_json_begin(&json);
+            bench_json_str(&json, "bench", "pipeline");
+            bench_json_str(&json, "variant", v->name);
+            bench_json_str(&json, "path", path ? "return" : "metered");
+            bench_json_str(&json, "stages", v->stages);
+            bench_json_u64(&json, "pkt_size", pkt_len);
+            bench_json_u64(&json, "repeat", repeat);
+            bench_json_double(&json, "ns_per_pkt", ns_per_pkt);
+            bench_json_str(&json, "verdict", xdp_verdict_str(retval));
+            bench_json_end(&json);
+        }
+    }
+
+out:
+    bench_json_close(&json);
+    return err;
+}
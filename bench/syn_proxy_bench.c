@@ -0,0 +1,339 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#include <stdio.h>
+#include <unistd.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <arpa/inet.h>
+#include <linux/ipv6.h>
+
+#include <argparse.h>
+
+#include "log.h"
+#include "bench.h"
+#include "../03_DropByIP/ebpf/syn_proxy.h"
+
+// Include skeleton file
+#include "syn_proxy.skel.h"
+
+#define SERVER_PORT 8080
+#define CLIENT_PORT 40000
+#define CLIENT_ISN 0x12345678
+#define CLIENT_MSS 1460
+#define CLIENT_MAC "\x02\x00\x00\x00\x00\x01"
+#define SERVER_MAC "\x02\x00\x00\x00\x00\x02"
+
+/* TCP header and the MSS option of the SYN-ACK, as in syn_proxy.bpf.c */
+#define SYN_ACK_TCP_LEN (sizeof(struct tcphdr) + 4)
+#define TCPOPT_NOP 1
+#define TCPOPT_MSS 2
+
+struct syn_case {
+    const char *name;
+    bool ipv6;
+    int opt_words; /* TCP options of the SYN, in 32-bit words */
+};
+
+/* Without options the program grows the frame to a full TCP header, with 40 bytes it has one already */
+static const struct syn_case cases[] = {
+    {"ipv4", false, 0},
+    {"ipv4-options", false, 10},
+    {"ipv6", true, 0},
+    {"ipv6-options", true, 10},
+};
+
+static const char *const usages[] = {
+    "syn_proxy_bench [options]",
+    NULL,
+};
+
+static int l3_len(bool ipv6) {
+    return ipv6 ? sizeof(struct ipv6hdr) : sizeof(struct iphdr);
+}
+
+/* Sum of the 16-bit words of buf, len is even */
+static __u32 csum_add(__u32 sum, const void *buf, int len) {
+    const __u16 *p = buf;
+
+    for (int i = 0; i < len / 2; i++)
+        sum += p[i];
+    return sum;
+}
+
+static __u16 csum_fold(__u32 sum) {
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+/* TCP checksum of the frame, 0 when the one in the header is right */
+static __u16 tcp_csum(void *buf, bool ipv6, int tcp_len) {
+    void *tcp = buf + ETH_HLEN + l3_len(ipv6);
+    __u32 sum;
+
+    if (ipv6) {
+        struct ipv6hdr *ip6 = buf + ETH_HLEN;
+
+        sum = csum_add(0, &ip6->saddr, 2 * sizeof(ip6->saddr));
+    } else {
+        struct iphdr *ip = buf + ETH_HLEN;
+
+        sum = csum_add(0, &ip->saddr, 2 * sizeof(ip->saddr));
+    }
+
+    sum += htons(IPPROTO_TCP) + htons(tcp_len);
+    return csum_fold(csum_add(sum, tcp, tcp_len));
+}
+
+/*
+ * Build the SYN of the client, with opt_words of options (MSS then NOPs), or
+ * its ACK of the SYN-ACK carrying the given cookie.
+ */
+static int build_pkt(void *buf, bool ipv6, int opt_words, bool syn, __u32 cookie) {
+    struct ethhdr *eth = buf;
+    struct tcphdr *tcp = buf + ETH_HLEN + l3_len(ipv6);
+    __u8 *opt = (void *)(tcp + 1);
+    int tcp_len = sizeof(*tcp) + opt_words * 4;
+
+    memset(buf, 0, ETH_HLEN + l3_len(ipv6) + tcp_len);
+    memcpy(eth->h_dest, SERVER_MAC, ETH_ALEN);
+    memcpy(eth->h_source, CLIENT_MAC, ETH_ALEN);
+
+    if (ipv6) {
+        struct ipv6hdr *ip6 = buf + ETH_HLEN;
+
+        eth->h_proto = htons(ETH_P_IPV6);
+        ip6->version = 6;
+        ip6->nexthdr = IPPROTO_TCP;
+        ip6->hop_limit = 64;
+        ip6->payload_len = htons(tcp_len);
+        inet_pton(AF_INET6, "fd00::1", &ip6->saddr);
+        inet_pton(AF_INET6, "fd00::2", &ip6->daddr);
+    } else {
+        struct iphdr *ip = buf + ETH_HLEN;
+
+        eth->h_proto = htons(ETH_P_IP);
+        ip->version = 4;
+        ip->ihl = 5;
+        ip->ttl = 64;
+        ip->protocol = IPPROTO_TCP;
+        ip->tot_len = htons(sizeof(*ip) + tcp_len);
+        ip->saddr = htonl(0x0a000001);
+        ip->daddr = htonl(0x0a000002);
+        ip->check = bench_ip_csum(ip);
+    }
+
+    tcp->source = htons(CLIENT_PORT);
+    tcp->dest = htons(SERVER_PORT);
+    tcp->doff = tcp_len / 4;
+    tcp->window = htons(64240);
+    if (syn) {
+        tcp->seq = htonl(CLIENT_ISN);
+        tcp->syn = 1;
+    } else {
+        tcp->seq = htonl(CLIENT_ISN + 1);
+        tcp->ack_seq = htonl(cookie + 1);
+        tcp->ack = 1;
+    }
+
+    if (opt_words) {
+        opt[0] = TCPOPT_MSS;
+        opt[1] = 4;
+        *(__be16 *)(opt + 2) = htons(CLIENT_MSS);
+        memset(opt + 4, TCPOPT_NOP, opt_words * 4 - 4);
+    }
+
+    tcp->check = tcp_csum(buf, ipv6, tcp_len);
+    return ETH_HLEN + l3_len(ipv6) + tcp_len;
+}
+
+/* One run of the program on pkt, the frame it returns goes to out */
+static int run_once(int prog_fd, void *pkt, int len, void *out, __u32 *out_len, __u32 *retval, __u64 *ns) {
+    LIBBPF_OPTS(bpf_test_run_opts, opts,
+        .data_in = pkt,
+        .data_size_in = len,
+        .data_out = out,
+        .data_size_out = *out_len,
+        .repeat = 1,
+    );
+
+    if (bpf_prog_test_run_opts(prog_fd, &opts)) {
+        log_error("BPF_PROG_TEST_RUN failed: %s", strerror(errno));
+        return -1;
+    }
+
+    *out_len = opts.data_size_out;
+    *retval = opts.retval;
+    if (ns)
+        *ns = opts.duration;
+
+    return 0;
+}
+
+/* Check the SYN-ACK bounced back to the client and return its cookie */
+static int check_synack(void *pkt, __u32 len, const struct syn_case *c, __u32 *cookie) {
+    struct ethhdr *eth = pkt;
+    struct tcphdr *tcp = pkt + ETH_HLEN + l3_len(c->ipv6);
+    __u8 *opt = (void *)(tcp + 1);
+    bool ok;
+
+    if (len != ETH_HLEN + l3_len(c->ipv6) + SYN_ACK_TCP_LEN) {
+        log_error("%s: SYN-ACK of %u bytes, expected %zu", c->name, len,
+                  ETH_HLEN + l3_len(c->ipv6) + SYN_ACK_TCP_LEN);
+        return -1;
+    }
+
+    ok = !memcmp(eth->h_dest, CLIENT_MAC, ETH_ALEN) && !memcmp(eth->h_source, SERVER_MAC, ETH_ALEN);
+
+    if (c->ipv6) {
+        struct ipv6hdr *ip6 = pkt + ETH_HLEN;
+        struct in6_addr client;
+
+        inet_pton(AF_INET6, "fd00::1", &client);
+        ok &= !memcmp(&ip6->daddr, &client, sizeof(client)) && ntohs(ip6->payload_len) == SYN_ACK_TCP_LEN;
+    } else {
+        struct iphdr *ip = pkt + ETH_HLEN;
+        __u16 check = ip->check;
+
+        ok &= ip->daddr == htonl(0x0a000001) && ntohs(ip->tot_len) == sizeof(*ip) + SYN_ACK_TCP_LEN;
+        ok &= bench_ip_csum(ip) == check;
+        ip->check = check;
+    }
+
+    ok &= tcp->syn && tcp->ack && !tcp->rst && tcp->source == htons(SERVER_PORT) &&
+          tcp->dest == htons(CLIENT_PORT) && ntohl(tcp->ack_seq) == CLIENT_ISN + 1 && opt[0] == TCPOPT_MSS &&
+          tcp_csum(pkt, c->ipv6, SYN_ACK_TCP_LEN) == 0;
+
+    if (!ok) {
+        log_error("%s: wrong SYN-ACK (addresses, ports, flags, ack number or checksums)", c->name);
+        return -1;
+    }
+
+    *cookie = ntohl(tcp->seq);
+    return 0;
+}
+
+static void json_record(struct bench_json *json, const struct syn_case *c, const char *path, int pkt_len,
+                        int repeat, double ns_per_pkt, __u32 retval) {
+    bench_json_begin(json);
+    bench_json_str(json, "bench", "syn_proxy");
+    bench_json_str(json, "case", c->name);
+    bench_json_str(json, "path", path);
+    bench_json_u64(json, "pkt_size", pkt_len);
+    bench_json_u64(json, "repeat", repeat);
+    bench_json_double(json, "ns_per_pkt", ns_per_pkt);
+    bench_json_str(json, "verdict", xdp_verdict_str(retval));
+    bench_json_end(json);
+}
+
+/*
+ * The SYN is rewritten in place into the SYN-ACK and BPF_PROG_TEST_RUN
+ * repeats on the rewritten frame, so each SYN is a run of its own and only
+ * the run time measured by the kernel is summed.
+ */
+static int bench_case(int prog_fd, const struct syn_case *c, int repeat, struct bench_json *json) {
+    char pkt[256], out[256];
+    __u32 out_len, retval, cookie;
+    __u64 ns, total = 0;
+    double ns_per_pkt;
+    int len;
+
+    len = build_pkt(pkt, c->ipv6, c->opt_words, true, 0);
+    for (int i = 0; i < repeat; i++) {
+        out_len = sizeof(out);
+        if (run_once(prog_fd, pkt, len, out, &out_len, &retval, &ns))
+            return -1;
+        if (retval != XDP_TX) {
+            log_error("%s: SYN got %s, expected XDP_TX", c->name, xdp_verdict_str(retval));
+            return -1;
+        }
+        total += ns;
+    }
+
+    if (check_synack(out, out_len, c, &cookie))
+        return -1;
+
+    log_info("%-13s SYN %8.2f ns/pkt", c->name, (double)total / repeat);
+    json_record(json, c, "syn", len, repeat, (double)total / repeat, retval);
+
+    /* The ACK is left as is, the kernel repeats it */
+    len = build_pkt(pkt, c->ipv6, 0, false, cookie);
+    if (bench_run_xdp(prog_fd, pkt, len, repeat, &ns_per_pkt, &retval))
+        return -1;
+    if (retval != XDP_PASS) {
+        log_error("%s: ACK with a valid cookie got %s, expected XDP_PASS", c->name, xdp_verdict_str(retval));
+        return -1;
+    }
+
+    log_info("%-13s ACK %8.2f ns/pkt", c->name, ns_per_pkt);
+    json_record(json, c, "ack", len, repeat, ns_per_pkt, retval);
+
+    len = build_pkt(pkt, c->ipv6, 0, false, cookie ^ 0xffffff);
+    out_len = sizeof(out);
+    if (run_once(prog_fd, pkt, len, out, &out_len, &retval, NULL))
+        return -1;
+    if (retval != XDP_DROP) {
+        log_error("%s: ACK with a wrong cookie got %s, expected XDP_DROP", c->name, xdp_verdict_str(retval));
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, const char **argv) {
+    struct syn_proxy_bpf *skel;
+    struct syn_proxy_cfg *cfg;
+    const char *output = NULL;
+    int repeat = 100000;
+    struct bench_json json;
+    int prog_fd;
+    int err = 0;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_GROUP("Basic options"),
+        OPT_INTEGER('r', "repeat", &repeat, "Number of runs per measurement (default 100000)", NULL, 0, 0),
+        OPT_STRING('o', "output", &output, "JSON output file (default stdout)", NULL, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "\nLoad 03_DropByIP/syn_proxy and measure the ns/packet of the SYN and ACK paths",
+                      "\nThe SYN-ACKs and the cookie checks are verified too, any failure exits with 1");
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (repeat < 1) {
+        log_fatal("The number of runs must be at least 1");
+        exit(1);
+    }
+
+    skel = syn_proxy_bpf__open();
+    if (!skel) {
+        log_fatal("Error while opening BPF skeleton");
+        exit(1);
+    }
+
+    cfg = (struct syn_proxy_cfg *)&skel->rodata->syn_proxy_cfg;
+    cfg->ports[SERVER_PORT / 64] |= 1ULL << (SERVER_PORT % 64);
+
+    /* Fails when the verifier rejects the program */
+    if (syn_proxy_bpf__load(skel)) {
+        log_fatal("Error while loading BPF skeleton, the cookie helpers need Linux 6.0 and CONFIG_SYN_COOKIES");
+        syn_proxy_bpf__destroy(skel);
+        exit(1);
+    }
+
+    prog_fd = bpf_program__fd(skel->progs.xdp_syn_proxy);
+
+    if (bench_json_open(&json, output)) {
+        syn_proxy_bpf__destroy(skel);
+        exit(1);
+    }
+
+    for (int i = 0; i < sizeof(cases) / sizeof(cases[0]) && !err; i++)
+        err = bench_case(prog_fd, &cases[i], repeat, &json) ? 1 : 0;
+
+    bench_json_close(&json);
+    syn_proxy_bpf__destroy(skel);
+    return err;
+}
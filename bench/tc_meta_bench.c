@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#include <stdio.h>
+#include <unistd.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <linux/if_link.h>
+#include <net/if.h>
+
+#include <argparse.h>
+
+#ifndef __USE_POSIX
+#define __USE_POSIX
+#endif
+#include <signal.h>
+
+#include "log.h"
+#include "bench.h"
+#include "../04_XDP_with_md/tc_meta.h"
+
+// Include skeleton file
+#include "xdp_with_md.skel.h"
+
+static int ifindex_iface = 0;
+static struct tc_attachment tc_attach;
+
+static const char *const usages[] = {
+    "tc_meta_bench [options]",
+    NULL,
+};
+
+static void cleanup_iface() {
+    if (ifindex_iface != 0)
+        bpf_xdp_detach(ifindex_iface, XDP_FLAGS_DRV_MODE, NULL);
+    tc_meta_detach(&tc_attach);
+}
+
+static void sigint_handler(int sig_no) {
+    cleanup_iface();
+    exit(0);
+}
+
+/*
+ * Let the traffic flow for duration seconds and return the TC cost of the
+ * given path. Traffic must be generated from outside (e.g. bench/e2e).
+ */
+static int measure_path(struct xdp_with_md_bpf *skel, enum tc_path path, int duration,
+                        struct tc_path_stats *result) {
+    int map_fd = bpf_map__fd(skel->maps.tc_stats_map);
+    struct tc_path_stats before[TC_PATH_MAX], after[TC_PATH_MAX];
+
+    skel->bss->tc_force_parse = path == TC_PATH_PARSE;
+
+    /* Let the frames already in flight go through with the new setting */
+    sleep(1);
+
+    if (tc_meta_read_stats(map_fd, before))
+        return -1;
+    sleep(duration);
+    if (tc_meta_read_stats(map_fd, after))
+        return -1;
+
+    result->runs = after[path].runs - before[path].runs;
+    result->ns = after[path].ns - before[path].ns;
+    result->classified = after[path].classified - before[path].classified;
+
+    return 0;
+}
+
+int main(int argc, const char **argv) {
+    struct xdp_with_md_bpf *skel = NULL;
+    const char *iface = NULL;
+    const char *classes = "5201:1:6";
+    const char *output = NULL;
+    int duration = 5;
+    struct tc_path_stats results[TC_PATH_MAX];
+    struct bench_json json;
+    int err = 0;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_GROUP("Basic options"),
+        OPT_STRING('i', "iface", &iface, "Interface receiving the test traffic", NULL, 0, 0),
+        OPT_STRING('k', "classes", &classes, "UDP classes as port:mark:priority (default 5201:1:6)", NULL, 0, 0),
+        OPT_INTEGER('d', "duration", &duration, "Seconds of traffic per path (default 5)", NULL, 0, 0),
+        OPT_STRING('o', "output", &output, "JSON output file (default stdout)", NULL, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "\nMeasure the ns/packet of the TC companion of 04_XDP_with_md when it "
+                      "reads the XDP metadata and when it parses the packet again", "");
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (iface == NULL || !(ifindex_iface = if_nametoindex(iface))) {
+        log_fatal("A valid interface must be specified with -i");
+        exit(1);
+    }
+
+    skel = xdp_with_md_bpf__open();
+    if (!skel) {
+        log_fatal("Error while opening BPF skeleton");
+        exit(1);
+    }
+
+    bpf_program__set_ifindex(skel->progs.xdp_prog_map, ifindex_iface);
+    bpf_program__set_flags(skel->progs.xdp_prog_map, BPF_F_XDP_DEV_BOUND_ONLY);
+
+    if (xdp_with_md_bpf__load(skel)) {
+        log_fatal("Error while loading BPF skeleton");
+        err = 1;
+        goto out;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &sigint_handler;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if (tc_meta_load_classes(classes, skel->maps.class_map) ||
+        bpf_xdp_attach(ifindex_iface, bpf_program__fd(skel->progs.xdp_prog_map), XDP_FLAGS_DRV_MODE, NULL) ||
+        tc_meta_attach(&tc_attach, skel->progs.tc_apply_meta, ifindex_iface)) {
+        log_fatal("Error while attaching the programs");
+        err = 1;
+        goto out;
+    }
+
+    for (int path = 0; path < TC_PATH_MAX; path++) {
+        if (measure_path(skel, path, duration, &results[path])) {
+            log_fatal("Error while reading the TC statistics");
+            err = 1;
+            goto out;
+        }
+    }
+
+    if (bench_json_open(&json, output)) {
+        err = 1;
+        goto out;
+    }
+
+    for (int path = 0; path < TC_PATH_MAX; path++) {
+        double ns_per_pkt = results[path].runs ? (double)results[path].ns / results[path].runs : 0;
+
+        log_info("%-8s path: %10llu pkts %8.2f ns/pkt", tc_path_names[path], results[path].runs, ns_per_pkt);
+
+        bench_json_begin(&json);
+        bench_json_str(&json, "bench", "tc_meta");
+        bench_json_str(&json, "path", tc_path_names[path]);
+        bench_json_u64(&json, "packets", results[path].runs);
+        bench_json_u64(&json, "classified", results[path].classified);
+        bench_json_double(&json, "ns_per_pkt", ns_per_pkt);
+        bench_json_end(&json);
+    }
+
+    if (results[TC_PATH_META].runs == 0 || results[TC_PATH_PARSE].runs == 0)
+        log_warn("No traffic on one of the paths, is the generator running?");
+
+    bench_json_close(&json);
+
+out:
+    cleanup_iface();
+    xdp_with_md_bpf__destroy(skel);
+    return err;
+}
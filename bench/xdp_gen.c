@@ -0,0 +1,351 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <sched.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/ether.h>
+#include <signal.h>
+
+#include <argparse.h>
+
+#include "log.h"
+#include "bench.h"
+#include "ebpf/xdp_gen.h"
+
+// Include skeleton file
+#include "xdp_gen.skel.h"
+
+/* Frames per BPF_PROG_TEST_RUN call, the duration is checked in between */
+#define GEN_CHUNK (1 << 18)
+#define GEN_MIN_FRAME 60
+
+static const char *const proto_names[GEN_PROTO_MAX] = {"udp", "tcp", "syn", "icmp"};
+
+static const char *const usages[] = {
+    "xdp_gen -i <iface> [options]",
+    NULL,
+};
+
+static volatile bool stop = false;
+
+static void sigint_handler(int sig_no) {
+    stop = true;
+}
+
+/* "a.b.c.d" or "a.b.c.d-e.f.g.h", in host byte order. A full range has 2^32 addresses */
+static int parse_range(const char *str, __u32 *min, __u64 *count) {
+    char buf[64];
+    char *dash;
+    struct in_addr lo, hi;
+
+    snprintf(buf, sizeof(buf), "%s", str);
+    dash = strchr(buf, '-');
+    if (dash)
+        *dash++ = '\0';
+
+    if (inet_pton(AF_INET, buf, &lo) != 1 || (dash && inet_pton(AF_INET, dash, &hi) != 1))
+        return -1;
+    if (!dash)
+        hi = lo;
+    if (ntohl(hi.s_addr) < ntohl(lo.s_addr))
+        return -1;
+
+    *min = ntohl(lo.s_addr);
+    *count = (__u64)ntohl(hi.s_addr) - *min + 1;
+    return 0;
+}
+
+/*
+ * Fill a GEN_TABLE_SLOTS table from "value[:weight],..." (weight 1 by
+ * default): each value gets a share of the slots proportional to its weight.
+ * parse_value turns a value into its table entry.
+ */
+static int parse_weighted(const char *str, int (*parse_value)(const char *, __u16 *), __u16 table[GEN_TABLE_SLOTS]) {
+    __u16 values[GEN_TABLE_SLOTS];
+    unsigned int weights[GEN_TABLE_SLOTS];
+    unsigned int total = 0, cum = 0;
+    int count = 0, item = 0;
+    char buf[256];
+    char *tok, *save;
+
+    snprintf(buf, sizeof(buf), "%s", str);
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *colon = strchr(tok, ':');
+
+        if (count == GEN_TABLE_SLOTS)
+            return -1;
+        if (colon)
+            *colon++ = '\0';
+        if (parse_value(tok, &values[count]))
+            return -1;
+
+        weights[count] = colon ? atoi(colon) : 1;
+        if (weights[count] == 0)
+            return -1;
+        total += weights[count++];
+    }
+
+    if (count == 0)
+        return -1;
+
+    /* Slot s goes to the value whose share contains the middle of the slot */
+    for (int s = 0; s < GEN_TABLE_SLOTS; s++) {
+        double pos = (s + 0.5) * total / GEN_TABLE_SLOTS;
+
+        while (item < count - 1 && pos >= cum + weights[item])
+            cum += weights[item++];
+        table[s] = values[item];
+    }
+
+    return 0;
+}
+
+static int parse_size(const char *str, __u16 *size) {
+    int v = atoi(str);
+
+    if (v < GEN_MIN_FRAME || v > GEN_MAX_FRAME) {
+        log_error("Frame size %s out of range [%d, %d]", str, GEN_MIN_FRAME, GEN_MAX_FRAME);
+        return -1;
+    }
+
+    *size = v;
+    return 0;
+}
+
+static int parse_proto(const char *str, __u16 *proto) {
+    for (int i = 0; i < GEN_PROTO_MAX; i++) {
+        if (strcmp(str, proto_names[i]) == 0) {
+            *proto = i;
+            return 0;
+        }
+    }
+
+    log_error("Unknown protocol %s, expected udp, tcp, syn or icmp", str);
+    return -1;
+}
+
+static int read_mac(const char *iface, __u8 mac[ETH_ALEN]) {
+    char path[128], buf[32];
+    struct ether_addr *addr;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/address", iface);
+    f = fopen(path, "r");
+    if (!f || !fgets(buf, sizeof(buf), f)) {
+        if (f)
+            fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    addr = ether_aton(buf);
+    if (!addr)
+        return -1;
+    memcpy(mac, addr, ETH_ALEN);
+    return 0;
+}
+
+int main(int argc, const char **argv) {
+    struct xdp_gen_bpf *skel = NULL;
+    const char *iface = NULL;
+    const char *src = "10.0.0.1";
+    const char *dst = "10.0.0.2";
+    const char *sizes = "64";
+    const char *protos = "udp";
+    const char *dst_mac = "02:00:00:00:00:02";
+    const char *output = NULL;
+    int flows = 0;
+    int dport = 9;
+    int duration = 10;
+    int count = 0;
+    int batch = 0;
+    int cpu = -1;
+    struct gen_cfg cfg = {0};
+    __u64 src_count, dst_count;
+    __u16 table[GEN_TABLE_SLOTS];
+    struct bench_json json;
+    char pkt[GEN_MAX_FRAME];
+    int pkt_len = 0;
+    __u64 sent = 0, last_sent = 0;
+    __u64 start, last, now;
+    int ifindex, err = 0;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_GROUP("Basic options"),
+        OPT_STRING('i', "iface", &iface, "Interface where the frames are sent", NULL, 0, 0),
+        OPT_STRING('s', "src", &src, "Source addresses, a.b.c.d[-e.f.g.h] (default 10.0.0.1)", NULL, 0, 0),
+        OPT_STRING('d', "dst", &dst, "Destination addresses, a.b.c.d[-e.f.g.h] (default 10.0.0.2)", NULL, 0, 0),
+        OPT_INTEGER('f', "flows", &flows, "Number of flows (default one per source/destination pair)", NULL, 0, 0),
+        OPT_INTEGER('P', "dport", &dport, "Destination port (default 9)", NULL, 0, 0),
+        OPT_STRING('z', "sizes", &sizes, "Frame sizes as size[:weight],... e.g. 64:7,594:4,1514:1 (default 64)", NULL, 0, 0),
+        OPT_STRING('p', "protos", &protos, "Protocol mix as proto[:weight],... of udp, tcp, syn, icmp (default udp)", NULL, 0, 0),
+        OPT_STRING('m', "dst-mac", &dst_mac, "Destination MAC address (default 02:00:00:00:00:02)", NULL, 0, 0),
+        OPT_INTEGER('t', "duration", &duration, "Seconds of traffic (default 10)", NULL, 0, 0),
+        OPT_INTEGER('n', "count", &count, "Stop after this many frames (default: --duration only)", NULL, 0, 0),
+        OPT_INTEGER('b', "batch", &batch, "Frames per batch in the kernel (default 64)", NULL, 0, 0),
+        OPT_INTEGER('c', "cpu", &cpu, "CPU where the frames are generated (default: current)", NULL, 0, 0),
+        OPT_STRING('o', "output", &output, "JSON output file (default stdout)", NULL, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "\nSend templated frames out of an interface from one CPU with "
+                      "BPF_PROG_TEST_RUN in live frames mode (Linux 5.18 or later)", "");
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (iface == NULL || !(ifindex = if_nametoindex(iface))) {
+        log_fatal("A valid interface must be specified with -i");
+        exit(1);
+    }
+
+    if (parse_range(src, &cfg.src_min, &src_count) || parse_range(dst, &cfg.dst_min, &dst_count)) {
+        log_fatal("Invalid address range, expected a.b.c.d[-e.f.g.h]");
+        exit(1);
+    }
+
+    /* The program computes the number of address pairs in 32 bits */
+    if (src_count > UINT32_MAX || dst_count > UINT32_MAX || src_count * dst_count == 0 ||
+        src_count * dst_count > UINT32_MAX) {
+        log_fatal("Too many source/destination pairs, at most %u", UINT32_MAX);
+        exit(1);
+    }
+    cfg.src_count = src_count;
+    cfg.dst_count = dst_count;
+
+    cfg.flows = flows > 0 ? flows : cfg.src_count * cfg.dst_count;
+    cfg.sport_min = 1024;
+    cfg.dport = dport;
+    if (cfg.flows / (cfg.src_count * cfg.dst_count) > 65536 - cfg.sport_min) {
+        log_fatal("Too many flows for the address ranges");
+        exit(1);
+    }
+
+    if (parse_weighted(sizes, parse_size, table)) {
+        log_fatal("Invalid frame sizes %s", sizes);
+        exit(1);
+    }
+    for (int i = 0; i < GEN_TABLE_SLOTS; i++) {
+        cfg.size[i] = table[i];
+        if (table[i] > pkt_len)
+            pkt_len = table[i];
+    }
+
+    if (parse_weighted(protos, parse_proto, table)) {
+        log_fatal("Invalid protocol mix %s", protos);
+        exit(1);
+    }
+    for (int i = 0; i < GEN_TABLE_SLOTS; i++)
+        cfg.proto[i] = table[i];
+
+    /* Template of the largest frame, the program rewrites the varying fields */
+    pkt_len = bench_build_pkt(pkt, pkt_len, IPPROTO_UDP, cfg.src_min, cfg.dst_min, cfg.sport_min, cfg.dport);
+    if (read_mac(iface, (__u8 *)pkt + ETH_ALEN) || !ether_aton(dst_mac)) {
+        log_fatal("Error while reading the MAC address of %s or parsing --dst-mac", iface);
+        exit(1);
+    }
+    memcpy(pkt, ether_aton(dst_mac), ETH_ALEN);
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set)) {
+            log_fatal("Error while moving to CPU %d: %s", cpu, strerror(errno));
+            exit(1);
+        }
+    }
+
+    skel = xdp_gen_bpf__open();
+    if (!skel) {
+        log_fatal("Error while opening BPF skeleton");
+        exit(1);
+    }
+
+    skel->rodata->gen_cfg = cfg;
+
+    if (xdp_gen_bpf__load(skel)) {
+        log_fatal("Error while loading BPF skeleton");
+        err = 1;
+        goto out;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &sigint_handler;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if (bench_json_open(&json, output)) {
+        err = 1;
+        goto out;
+    }
+
+    log_info("Sending %s frames (%s) from %s to %s, %u flows, on %s", sizes, protos, src, dst, cfg.flows, iface);
+
+    start = last = bench_now_ns();
+    while (!stop) {
+        struct xdp_md ctx_in = {
+            .data_end = pkt_len,
+            .ingress_ifindex = ifindex,
+        };
+        LIBBPF_OPTS(bpf_test_run_opts, opts,
+            .data_in = pkt,
+            .data_size_in = pkt_len,
+            .ctx_in = &ctx_in,
+            .ctx_size_in = sizeof(ctx_in),
+            .repeat = GEN_CHUNK,
+            .flags = BPF_F_TEST_XDP_LIVE_FRAMES,
+            .batch_size = batch,
+        );
+
+        if (count > 0 && sent + opts.repeat > (__u64)count)
+            opts.repeat = count - sent;
+
+        if (bpf_prog_test_run_opts(bpf_program__fd(skel->progs.xdp_gen), &opts)) {
+            /* A signal interrupts the run, the frames of the chunk are not counted */
+            if (errno != EINTR) {
+                log_error("BPF_PROG_TEST_RUN failed: %s", strerror(errno));
+                err = 1;
+            }
+            break;
+        }
+
+        sent += opts.repeat;
+        now = bench_now_ns();
+
+        if (now - last >= 1000000000ULL) {
+            log_info("%8.2f Mpps", (double)(sent - last_sent) * 1000 / (now - last));
+            last = now;
+            last_sent = sent;
+        }
+
+        if ((count > 0 && sent >= (__u64)count) || now - start >= duration * 1000000000ULL)
+            break;
+    }
+
+    now = bench_now_ns();
+    log_info("Sent %llu frames in %.2f s, %.2f Mpps", sent, (now - start) / 1e9,
+             (double)sent * 1000 / (now - start));
+
+    bench_json_begin(&json);
+    bench_json_str(&json, "bench", "xdp_gen");
+    bench_json_str(&json, "sizes", sizes);
+    bench_json_str(&json, "protos", protos);
+    bench_json_u64(&json, "flows", cfg.flows);
+    bench_json_u64(&json, "packets", sent);
+    bench_json_double(&json, "duration_s", (now - start) / 1e9);
+    bench_json_double(&json, "mpps", (double)sent * 1000 / (now - start));
+    bench_json_end(&json);
+    bench_json_close(&json);
+
+out:
+    xdp_gen_bpf__destroy(skel);
+    return err;
+}
@@ -0,0 +1,304 @@
+#ifndef CONFIG_LOAD_H_
+#define CONFIG_LOAD_H_
+
+#include <arpa/inet.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <cyaml/cyaml.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "pin.h"
+#include "vlan_user.h"
+#include "config_snapshot.h"
+
+/*
+ * Configuration of 02_HHDv1 and 03_DropByIP: the IPs to monitor or to drop
+ * and the optional per-VLAN policy, given as the YAML file or as a snapshot
+ * compiled from it (config_snapshot.h). The loaders and the benchmarks go
+ * through the same functions, so the benchmarks time the code that runs.
+ */
+
+/* threshold and port are only used by 02_HHDv1 */
+struct config_rule {
+    const char *ip;
+    uint64_t threshold;
+    uint32_t port;
+};
+
+struct config_rules {
+    struct config_rule *ips;
+    uint64_t ips_count;
+    struct vlan_rule *vlans;
+    uint64_t vlans_count;
+};
+
+/* Maps filled from the configuration, NULL for the ones the program does not have */
+struct config_maps {
+    struct bpf_map *threshold_map; /* 02_HHDv1 */
+    struct bpf_map *ip_to_port;    /* 02_HHDv1 */
+    struct bpf_map *stats_map;     /* xdp_stats_map of 03_DropByIP */
+    struct bpf_map *vlan_policy;
+};
+
+static const cyaml_schema_field_t config_hhd_rule_field_schema[] = {
+    CYAML_FIELD_STRING_PTR("ip", CYAML_FLAG_POINTER, struct config_rule, ip, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_UINT("threshold", CYAML_FLAG_DEFAULT, struct config_rule, threshold),
+    CYAML_FIELD_UINT("port", CYAML_FLAG_DEFAULT, struct config_rule, port),
+    CYAML_FIELD_END
+};
+
+static const cyaml_schema_field_t config_drop_rule_field_schema[] = {
+    CYAML_FIELD_STRING_PTR("ip", CYAML_FLAG_POINTER, struct config_rule, ip, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_END
+};
+
+static const cyaml_schema_value_t config_hhd_rule_schema = {
+    CYAML_VALUE_MAPPING(CYAML_FLAG_DEFAULT, struct config_rule, config_hhd_rule_field_schema),
+};
+
+static const cyaml_schema_value_t config_drop_rule_schema = {
+    CYAML_VALUE_MAPPING(CYAML_FLAG_DEFAULT, struct config_rule, config_drop_rule_field_schema),
+};
+
+static const cyaml_schema_field_t config_hhd_field_schema[] = {
+    CYAML_FIELD_SEQUENCE("ips", CYAML_FLAG_POINTER, struct config_rules, ips, &config_hhd_rule_schema, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_SEQUENCE("vlans", CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL, struct config_rules, vlans, &vlan_rule_schema, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_END
+};
+
+static const cyaml_schema_field_t config_drop_field_schema[] = {
+    CYAML_FIELD_SEQUENCE("ips", CYAML_FLAG_POINTER, struct config_rules, ips, &config_drop_rule_schema, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_SEQUENCE("vlans", CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL, struct config_rules, vlans, &vlan_rule_schema, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_END
+};
+
+/* Schema of the configuration of each program, for config_parse */
+static const cyaml_schema_value_t config_hhd_schema = {
+    CYAML_VALUE_MAPPING(CYAML_FLAG_POINTER, struct config_rules, config_hhd_field_schema),
+};
+
+static const cyaml_schema_value_t config_drop_schema = {
+    CYAML_VALUE_MAPPING(CYAML_FLAG_POINTER, struct config_rules, config_drop_field_schema),
+};
+
+static const cyaml_config_t config_cyaml = {
+    .log_fn = cyaml_log,            /* Use the default logging function. */
+    .mem_fn = cyaml_mem,            /* Use the default memory allocator. */
+    .log_level = CYAML_LOG_WARNING, /* Logging errors and warnings only. */
+};
+
+static int config_parse(const char *path, const cyaml_schema_value_t *schema, struct config_rules **rules) {
+    cyaml_err_t err;
+
+    err = cyaml_load_file(path, &config_cyaml, schema, (void **)rules, NULL);
+    if (err != CYAML_OK) {
+        log_error("Error while loading %s: %s", path, cyaml_strerror(err));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void config_free(struct config_rules *rules, const cyaml_schema_value_t *schema) {
+    cyaml_free(&config_cyaml, schema, rules, 0);
+}
+
+/*
+ * Fill the maps with the parsed configuration. When the maps are reused from a
+ * previous run (warm), the counters are kept and the IPs and VLAN rules that
+ * are no longer in the configuration are removed.
+ */
+static int config_populate(const struct config_rules *rules, const struct config_maps *maps, bool warm) {
+    struct pin_u32_set addrs = {0};
+    void *zero = NULL;
+    int ret = -1;
+
+    addrs.keys = calloc(rules->ips_count, sizeof(__u32));
+    if (rules->ips_count && !addrs.keys) {
+        log_error("Failed to allocate the IP set");
+        return -1;
+    }
+
+    if (maps->stats_map) {
+        zero = calloc(1, bpf_map__value_size(maps->stats_map));
+        if (!zero) {
+            log_error("Failed to allocate the counters");
+            goto cleanup;
+        }
+    }
+
+    for (uint64_t i = 0; i < rules->ips_count; i++) {
+        const struct config_rule *rule = &rules->ips[i];
+        struct in_addr addr;
+        int err = 0;
+
+        log_debug("Loading IP %s (threshold %llu, port %u)", rule->ip, rule->threshold, rule->port);
+
+        if (inet_pton(AF_INET, rule->ip, &addr) != 1) {
+            log_error("Failed to convert IP %s to integer", rule->ip);
+            goto cleanup;
+        }
+
+        addrs.keys[addrs.count++] = addr.s_addr;
+
+        if (maps->threshold_map) {
+            struct value_t value = {.threshold = rule->threshold};
+            struct value_t old;
+
+            /* Keep the counter of a source already in a reused map */
+            if (warm && bpf_map__lookup_elem(maps->threshold_map, &addr.s_addr, sizeof(addr.s_addr), &old,
+                                             sizeof(old), 0) == 0)
+                value.packets_rcvd = old.packets_rcvd;
+
+            err = bpf_map__update_elem(maps->threshold_map, &addr.s_addr, sizeof(addr.s_addr), &value, sizeof(value),
+                                       BPF_ANY);
+        }
+
+        if (maps->ip_to_port && !err) {
+            __u32 port = rule->port;
+
+            err = bpf_map__update_elem(maps->ip_to_port, &addr.s_addr, sizeof(addr.s_addr), &port, sizeof(port),
+                                       BPF_ANY);
+        }
+
+        /* Keep the counters of an IP already in a reused map */
+        if (maps->stats_map && !err) {
+            err = bpf_map__update_elem(maps->stats_map, &addr.s_addr, sizeof(addr.s_addr), zero,
+                                       bpf_map__value_size(maps->stats_map), BPF_NOEXIST);
+            if (err && errno == EEXIST)
+                err = 0;
+        }
+
+        if (err) {
+            log_error("Failed to update BPF map: %s", strerror(errno));
+            goto cleanup;
+        }
+    }
+
+    if (vlan_load_rules(maps->vlan_policy, rules->vlans, rules->vlans_count))
+        goto cleanup;
+
+    if (warm) {
+        pin_u32_set_sort(&addrs);
+        if ((maps->threshold_map && pin_prune_map(maps->threshold_map, pin_u32_set_has, &addrs)) ||
+            (maps->ip_to_port && pin_prune_map(maps->ip_to_port, pin_u32_set_has, &addrs)) ||
+            (maps->stats_map && pin_prune_map(maps->stats_map, pin_u32_set_has, &addrs)) ||
+            vlan_prune_rules(maps->vlan_policy, rules->vlans, rules->vlans_count))
+            goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    free(zero);
+    free(addrs.keys);
+    return ret;
+}
+
+/*
+ * Load a snapshot: the sections of the mapped file go straight to batch
+ * updates with zeroed counters. A warm restart inserts the addresses one by
+ * one instead, to keep the counters.
+ */
+static int config_load_snapshot(const char *path, const struct config_maps *maps, bool warm) {
+    struct config_snapshot snap;
+    struct pin_u32_set addrs;
+    void *zero = NULL;
+    int ret = -1;
+
+    if (config_snapshot_open(path, &snap))
+        return -1;
+
+    log_info("Loaded %llu IPs from the snapshot %s", snap.ips_count, path);
+
+    if (maps->threshold_map && !warm) {
+        if (config_snapshot_update(maps->threshold_map, snap.addrs, snap.values, snap.ips_count))
+            goto cleanup;
+    } else if (maps->threshold_map) {
+        for (__u64 i = 0; i < snap.ips_count; i++) {
+            struct value_t value = {.threshold = snap.values[i].threshold};
+            struct value_t old;
+
+            if (bpf_map__lookup_elem(maps->threshold_map, &snap.addrs[i], sizeof(__u32), &old, sizeof(old), 0) == 0)
+                value.packets_rcvd = old.packets_rcvd;
+
+            if (bpf_map__update_elem(maps->threshold_map, &snap.addrs[i], sizeof(__u32), &value, sizeof(value),
+                                     BPF_ANY)) {
+                log_error("Failed to update BPF map: %s", strerror(errno));
+                goto cleanup;
+            }
+        }
+    }
+
+    if (maps->ip_to_port && config_snapshot_update(maps->ip_to_port, snap.addrs, snap.ports, snap.ips_count))
+        goto cleanup;
+
+    if (maps->stats_map) {
+        __u32 value_size = bpf_map__value_size(maps->stats_map);
+
+        /* Large zeroed allocations are mapped lazily to the zero page */
+        zero = calloc(warm ? 1 : snap.ips_count, value_size);
+        if (!zero && (warm || snap.ips_count)) {
+            log_error("Failed to allocate the counters");
+            goto cleanup;
+        }
+
+        if (!warm) {
+            if (config_snapshot_update(maps->stats_map, snap.addrs, zero, snap.ips_count))
+                goto cleanup;
+        } else {
+            for (__u64 i = 0; i < snap.ips_count; i++) {
+                if (bpf_map__update_elem(maps->stats_map, &snap.addrs[i], sizeof(__u32), zero, value_size,
+                                         BPF_NOEXIST) && errno != EEXIST) {
+                    log_error("Failed to update BPF map: %s", strerror(errno));
+                    goto cleanup;
+                }
+            }
+        }
+    }
+
+    if (config_snapshot_load_vlans(&snap, maps->vlan_policy))
+        goto cleanup;
+
+    if (warm) {
+        addrs = config_snapshot_addr_set(&snap);
+        if ((maps->threshold_map && pin_prune_map(maps->threshold_map, pin_u32_set_has, &addrs)) ||
+            (maps->ip_to_port && pin_prune_map(maps->ip_to_port, pin_u32_set_has, &addrs)) ||
+            (maps->stats_map && pin_prune_map(maps->stats_map, pin_u32_set_has, &addrs)) ||
+            pin_prune_map(maps->vlan_policy, config_snapshot_has_vlan, &snap))
+            goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    free(zero);
+    config_snapshot_close(&snap);
+    return ret;
+}
+
+/* Load the configuration file, YAML or snapshot, in the maps */
+static int config_load(const char *path, const cyaml_schema_value_t *schema, const struct config_maps *maps,
+                       bool warm) {
+    struct config_rules *rules;
+    int ret;
+
+    if (config_snapshot_is(path))
+        return config_load_snapshot(path, maps, warm);
+
+    if (config_parse(path, schema, &rules))
+        return -1;
+
+    log_info("Loaded %llu IPs and %llu VLAN rules from %s", rules->ips_count, rules->vlans_count, path);
+    ret = config_populate(rules, maps, warm);
+    config_free(rules, schema);
+
+    return ret;
+}
+
+#endif // CONFIG_LOAD_H_
@@ -0,0 +1,389 @@
+#ifndef CONFIG_SNAPSHOT_H_
+#define CONFIG_SNAPSHOT_H_
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "log.h"
+#include "pin.h"
+#include "vlan_user.h"
+#include "ebpf/map_values.h"
+
+/*
+ * Binary snapshot of a YAML configuration, written by the "compile"
+ * subcommand of the loaders and given to them with -c instead of the YAML
+ * file. The YAML stays the source of truth: the snapshot only skips the
+ * parsing and the inet_pton of every entry at startup.
+ *
+ * The file is mapped read-only and its sections are handed as they are to
+ * the batch map updates:
+ *
+ *   struct config_snapshot_hdr
+ *   __u32 addrs[ips_count]                        network byte order, sorted
+ *   struct value_t values[ips_count]              threshold_map values
+ *   __u32 ports[ips_count]                        ip_to_port values
+ *   struct config_snapshot_vlan vlans[vlans_count]
+ *
+ * Each section starts on an 8-byte boundary. The addresses are sorted by
+ * their __u32 value (pin_u32_cmp), so they also are the pin_u32_set of a
+ * warm restart, and each one appears once. Integers are in host byte order:
+ * a snapshot is compiled on the machine, or the architecture, that loads it.
+ * The CRC32 covers everything after the header.
+ */
+
+#define CONFIG_SNAPSHOT_MAGIC 0x50534358 /* "XCSP" */
+#define CONFIG_SNAPSHOT_VERSION 1
+/* Entries per bpf_map_update_batch call */
+#define CONFIG_SNAPSHOT_BATCH 65536
+
+struct config_snapshot_hdr {
+    __u32 magic;
+    __u16 version;
+    __u16 hdr_size;
+    __u64 ips_count;
+    __u64 vlans_count;
+    __u32 crc32;
+    __u32 reserved;
+};
+
+/* Key and value of the vlan_policy map */
+struct config_snapshot_vlan {
+    struct vlan_key key;
+    __u32 action;
+};
+
+/* An entry of the configuration, for config_snapshot_write */
+struct config_snapshot_entry {
+    __u32 addr;
+    __u32 port;
+    __u64 threshold;
+    /* Position in the configuration, set by config_snapshot_write */
+    __u64 pos;
+};
+
+struct config_snapshot {
+    void *base;
+    size_t size;
+    __u64 ips_count;
+    __u64 vlans_count;
+    const __u32 *addrs;
+    const struct value_t *values;
+    const __u32 *ports;
+    const struct config_snapshot_vlan *vlans;
+};
+
+static size_t config_snapshot_align(size_t off) {
+    return (off + 7) & ~(size_t)7;
+}
+
+/* Offsets of the sections, returns the size of the file */
+static size_t config_snapshot_layout(__u64 ips, __u64 vlans, size_t *addrs, size_t *values, size_t *ports,
+                                     size_t *vlan_rules) {
+    *addrs = config_snapshot_align(sizeof(struct config_snapshot_hdr));
+    *values = config_snapshot_align(*addrs + ips * sizeof(__u32));
+    *ports = config_snapshot_align(*values + ips * sizeof(struct value_t));
+    *vlan_rules = config_snapshot_align(*ports + ips * sizeof(__u32));
+
+    return *vlan_rules + vlans * sizeof(struct config_snapshot_vlan);
+}
+
+/* True when path starts with the snapshot magic, i.e. is not a YAML file */
+static bool config_snapshot_is(const char *path) {
+    __u32 magic = 0;
+    FILE *f = fopen(path, "r");
+
+    if (!f)
+        return false;
+    if (fread(&magic, sizeof(magic), 1, f) != 1)
+        magic = 0;
+    fclose(f);
+
+    return magic == CONFIG_SNAPSHOT_MAGIC;
+}
+
+static int config_snapshot_entry_cmp(const void *a, const void *b) {
+    const struct config_snapshot_entry *x = a, *y = b;
+    int cmp = pin_u32_cmp(&x->addr, &y->addr);
+
+    return cmp ? cmp : (x->pos < y->pos ? -1 : x->pos > y->pos);
+}
+
+/*
+ * Write the snapshot of entries (sorted in place, the last of duplicated
+ * addresses wins like in the maps) and of the VLAN rules to path. The file
+ * is written next to path and renamed, so a loader never maps half a
+ * snapshot.
+ */
+static int config_snapshot_write(const char *path, struct config_snapshot_entry *entries, __u64 count,
+                                 const struct vlan_rule *rules, __u64 vlans_count) {
+    size_t addrs_off, values_off, ports_off, vlans_off, size;
+    struct config_snapshot_hdr *hdr;
+    char tmp[PATH_MAX];
+    __u64 n = 0;
+    void *buf;
+    int err = 0;
+    FILE *f;
+
+    for (__u64 i = 0; i < count; i++)
+        entries[i].pos = i;
+    qsort(entries, count, sizeof(*entries), config_snapshot_entry_cmp);
+
+    for (__u64 i = 0; i < count; i++) {
+        if (n > 0 && entries[n - 1].addr == entries[i].addr)
+            n--;
+        entries[n++] = entries[i];
+    }
+
+    size = config_snapshot_layout(n, vlans_count, &addrs_off, &values_off, &ports_off, &vlans_off);
+    buf = calloc(1, size);
+    if (!buf) {
+        log_error("Failed to allocate the snapshot");
+        return -1;
+    }
+
+    for (__u64 i = 0; i < n; i++) {
+        ((__u32 *)(buf + addrs_off))[i] = entries[i].addr;
+        ((struct value_t *)(buf + values_off))[i].threshold = entries[i].threshold;
+        ((__u32 *)(buf + ports_off))[i] = entries[i].port;
+    }
+
+    for (__u64 i = 0; i < vlans_count; i++) {
+        struct config_snapshot_vlan *v = (struct config_snapshot_vlan *)(buf + vlans_off) + i;
+        __u32 action;
+
+        for (action = 0; action < sizeof(vlan_action_names) / sizeof(vlan_action_names[0]); action++) {
+            if (strcmp(rules[i].action, vlan_action_names[action]) == 0)
+                break;
+        }
+
+        if (action == sizeof(vlan_action_names) / sizeof(vlan_action_names[0]) ||
+            rules[i].outer > 4095 || rules[i].inner > 4095) {
+            log_error("Invalid VLAN rule %u/%u %s", rules[i].outer, rules[i].inner, rules[i].action);
+            free(buf);
+            return -1;
+        }
+
+        v->key.outer_vid = rules[i].outer;
+        v->key.inner_vid = rules[i].inner;
+        v->action = action;
+    }
+
+    hdr = buf;
+    hdr->magic = CONFIG_SNAPSHOT_MAGIC;
+    hdr->version = CONFIG_SNAPSHOT_VERSION;
+    hdr->hdr_size = sizeof(*hdr);
+    hdr->ips_count = n;
+    hdr->vlans_count = vlans_count;
+    hdr->crc32 = crc32(0, buf + sizeof(*hdr), size - sizeof(*hdr));
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (!f) {
+        log_error("Error while opening %s: %s", tmp, strerror(errno));
+        free(buf);
+        return -1;
+    }
+
+    if (fwrite(buf, size, 1, f) != 1)
+        err = -1;
+    if (fclose(f))
+        err = -1;
+    if (!err && rename(tmp, path))
+        err = -1;
+    if (err) {
+        log_error("Error while writing %s: %s", path, strerror(errno));
+        unlink(tmp);
+    }
+
+    free(buf);
+    return err;
+}
+
+/* Map the snapshot at path and check it */
+static int config_snapshot_open(const char *path, struct config_snapshot *snap) {
+    size_t addrs_off, values_off, ports_off, vlans_off;
+    const struct config_snapshot_hdr *hdr;
+    struct stat st;
+    int fd;
+
+    memset(snap, 0, sizeof(*snap));
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st)) {
+        log_error("Error while opening %s: %s", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    if (st.st_size < sizeof(*hdr)) {
+        log_error("%s is not a configuration snapshot", path);
+        close(fd);
+        return -1;
+    }
+
+    snap->size = st.st_size;
+    snap->base = mmap(NULL, snap->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (snap->base == MAP_FAILED) {
+        log_error("Failed to map %s: %s", path, strerror(errno));
+        snap->base = NULL;
+        return -1;
+    }
+
+    hdr = snap->base;
+    if (hdr->magic != CONFIG_SNAPSHOT_MAGIC || hdr->hdr_size != sizeof(*hdr)) {
+        log_error("%s is not a configuration snapshot", path);
+        goto err;
+    }
+
+    if (hdr->version != CONFIG_SNAPSHOT_VERSION) {
+        log_error("%s has version %u, expected %u: compile it again", path, hdr->version, CONFIG_SNAPSHOT_VERSION);
+        goto err;
+    }
+
+    if (hdr->ips_count > snap->size || hdr->vlans_count > snap->size ||
+        config_snapshot_layout(hdr->ips_count, hdr->vlans_count, &addrs_off, &values_off, &ports_off, &vlans_off) !=
+            snap->size) {
+        log_error("%s is truncated", path);
+        goto err;
+    }
+
+    if (crc32(0, snap->base + sizeof(*hdr), snap->size - sizeof(*hdr)) != hdr->crc32) {
+        log_error("%s is corrupted (bad checksum)", path);
+        goto err;
+    }
+
+    snap->ips_count = hdr->ips_count;
+    snap->vlans_count = hdr->vlans_count;
+    snap->addrs = snap->base + addrs_off;
+    snap->values = snap->base + values_off;
+    snap->ports = snap->base + ports_off;
+    snap->vlans = snap->base + vlans_off;
+
+    return 0;
+
+err:
+    munmap(snap->base, snap->size);
+    snap->base = NULL;
+    return -1;
+}
+
+/*
+ * Grow the maps filled from the snapshot at path to its counts, before the
+ * load: the sizes in the BPF programs fit a hand-written configuration, not
+ * a compiled list. ips_maps is NULL terminated. Only the header is read, the
+ * snapshot is checked when it is opened. A pinned map reused with another
+ * size makes the load fail, like any other change of its definition.
+ */
+static int config_snapshot_size_maps(const char *path, struct bpf_map *const *ips_maps, struct bpf_map *vlans_map) {
+    struct config_snapshot_hdr hdr;
+    FILE *f = fopen(path, "r");
+
+    if (!f || fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != CONFIG_SNAPSHOT_MAGIC) {
+        log_error("%s is not a configuration snapshot", path);
+        if (f)
+            fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    if (hdr.ips_count > UINT32_MAX || hdr.vlans_count > UINT32_MAX) {
+        log_error("%s has more entries than a map can hold", path);
+        return -1;
+    }
+
+    for (int i = 0; ips_maps[i]; i++) {
+        if (hdr.ips_count > bpf_map__max_entries(ips_maps[i]) &&
+            bpf_map__set_max_entries(ips_maps[i], hdr.ips_count))
+            return -1;
+    }
+
+    if (hdr.vlans_count > bpf_map__max_entries(vlans_map) && bpf_map__set_max_entries(vlans_map, hdr.vlans_count))
+        return -1;
+
+    return 0;
+}
+
+static void config_snapshot_close(struct config_snapshot *snap) {
+    if (snap->base)
+        munmap(snap->base, snap->size);
+    snap->base = NULL;
+}
+
+/*
+ * Insert count keys and values in the map with batch updates (Linux 5.6),
+ * one update per entry on older kernels.
+ */
+static int config_snapshot_update(struct bpf_map *map, const void *keys, const void *values, __u64 count) {
+    __u32 key_size = bpf_map__key_size(map), value_size = bpf_map__value_size(map);
+    int fd = bpf_map__fd(map);
+
+    for (__u64 done = 0; done < count;) {
+        __u32 n = count - done < CONFIG_SNAPSHOT_BATCH ? count - done : CONFIG_SNAPSHOT_BATCH;
+
+        if (bpf_map_update_batch(fd, keys + done * key_size, values + done * value_size, &n, NULL) == 0) {
+            done += n;
+            continue;
+        }
+
+        if (errno != EINVAL && errno != ENOTSUP && errno != EOPNOTSUPP) {
+            log_error("Failed to update the map %s: %s", bpf_map__name(map), strerror(errno));
+            return -1;
+        }
+
+        for (; done < count; done++) {
+            if (bpf_map_update_elem(fd, keys + done * key_size, values + done * value_size, BPF_ANY)) {
+                log_error("Failed to update the map %s: %s", bpf_map__name(map), strerror(errno));
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int config_snapshot_load_vlans(const struct config_snapshot *snap, struct bpf_map *policy) {
+    for (__u64 i = 0; i < snap->vlans_count; i++) {
+        const struct config_snapshot_vlan *v = &snap->vlans[i];
+
+        if (bpf_map__update_elem(policy, &v->key, sizeof(v->key), &v->action, sizeof(v->action), BPF_ANY)) {
+            log_error("Failed to update the VLAN policy map: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static bool config_snapshot_has_vlan(const void *key, void *ctx) {
+    const struct vlan_key *k = key;
+    const struct config_snapshot *snap = ctx;
+
+    for (__u64 i = 0; i < snap->vlans_count; i++) {
+        if (snap->vlans[i].key.outer_vid == k->outer_vid && snap->vlans[i].key.inner_vid == k->inner_vid)
+            return true;
+    }
+
+    return false;
+}
+
+/* The addresses of the snapshot as a pin_u32_set, for pin_prune_map */
+static struct pin_u32_set config_snapshot_addr_set(const struct config_snapshot *snap) {
+    struct pin_u32_set set = {.keys = (__u32 *)snap->addrs, .count = snap->ips_count};
+
+    return set;
+}
+
+#endif // CONFIG_SNAPSHOT_H_
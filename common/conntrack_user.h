@@ -0,0 +1,171 @@
+#ifndef CONNTRACK_USER_H_
+#define CONNTRACK_USER_H_
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "ebpf/conntrack_types.h"
+
+/* Idle timeouts in seconds, the established one is set with --conntrack-timeout */
+#define CONNTRACK_SYN_TIMEOUT_S 30
+#define CONNTRACK_DEFAULT_ESTABLISHED_TIMEOUT_S 3600
+#define CONNTRACK_FIN_TIMEOUT_S 30
+#define CONNTRACK_OTHER_TIMEOUT_S 60
+
+/* Keys read per batch lookup when counting the flows */
+#define CONNTRACK_COUNT_BATCH 4096
+/* Least time between two walks of the table, the statistics interval can be 10 ms */
+#define CONNTRACK_COUNT_INTERVAL_S 1.0
+
+struct conntrack_stats {
+    __u64 counters[CT_STAT_MAX];
+    __u64 flows;
+    __u64 max_flows;
+    /* Inserts that neither stayed in the table nor were removed by the program */
+    __u64 evicted;
+    double evictions_rate;
+    /* Counters when the flows were last counted, and the time since then */
+    __u64 counted[CT_STAT_MAX];
+    double since_count;
+};
+
+static inline void conntrack_set_timeouts(__u64 timeout_ns[CT_STATE_MAX], int established_s) {
+    timeout_ns[CT_SYN_SENT] = CONNTRACK_SYN_TIMEOUT_S * 1000000000ULL;
+    timeout_ns[CT_ESTABLISHED] = established_s * 1000000000ULL;
+    timeout_ns[CT_FIN_WAIT] = CONNTRACK_FIN_TIMEOUT_S * 1000000000ULL;
+    timeout_ns[CT_OTHER] = CONNTRACK_OTHER_TIMEOUT_S * 1000000000ULL;
+}
+
+/*
+ * Number of flows in the table. The kernel does not expose the count of a
+ * hash map, so the keys are walked with batch lookups, a few hundred
+ * syscalls for a million flows.
+ */
+static int conntrack_count_flows(int map_fd, __u64 *flows) {
+    LIBBPF_OPTS(bpf_map_batch_opts, opts);
+    struct ct_key *keys = calloc(CONNTRACK_COUNT_BATCH, sizeof(*keys));
+    struct ct_entry *values = calloc(CONNTRACK_COUNT_BATCH, sizeof(*values));
+    __u64 batch;
+    int err = 0;
+
+    *flows = 0;
+    if (!keys || !values) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    for (bool first = true;; first = false) {
+        __u32 n = CONNTRACK_COUNT_BATCH;
+
+        err = bpf_map_lookup_batch(map_fd, first ? NULL : &batch, &batch, keys, values, &n, &opts);
+        *flows += n;
+        if (err) {
+            /* ENOENT: the end of the map was reached */
+            err = errno == ENOENT ? 0 : -errno;
+            break;
+        }
+    }
+
+out:
+    free(keys);
+    free(values);
+    return err;
+}
+
+static int conntrack_read_counters(int stats_fd, __u64 counters[CT_STAT_MAX]) {
+    int cpus = libbpf_num_possible_cpus();
+    __u64 values[cpus];
+
+    for (__u32 key = 0; key < CT_STAT_MAX; key++) {
+        counters[key] = 0;
+
+        if (bpf_map_lookup_elem(stats_fd, &key, values))
+            return -1;
+
+        for (int i = 0; i < cpus; i++)
+            counters[key] += values[i];
+    }
+
+    return 0;
+}
+
+/* Counters and flows at startup, the baseline of conntrack_print_stats */
+static int conntrack_read_stats(int stats_fd, int map_fd, struct conntrack_stats *stats) {
+    if (conntrack_read_counters(stats_fd, stats->counters))
+        return -1;
+
+    memcpy(stats->counted, stats->counters, sizeof(stats->counted));
+    stats->since_count = 0;
+    return conntrack_count_flows(map_fd, &stats->flows);
+}
+
+/*
+ * Occupancy, events and evictions since the previous call, kept in prev. The
+ * events are read every call, the flows are counted at most every
+ * CONNTRACK_COUNT_INTERVAL_S since that walks the whole table.
+ */
+static void conntrack_print_stats(struct bpf_map *table, int stats_fd, struct conntrack_stats *prev, double elapsed) {
+    struct conntrack_stats stats = *prev;
+    __u64 delta[CT_STAT_MAX];
+    __s64 evicted;
+
+    stats.max_flows = bpf_map__max_entries(table);
+    stats.since_count += elapsed;
+    if (conntrack_read_counters(stats_fd, stats.counters) ||
+        (stats.since_count >= CONNTRACK_COUNT_INTERVAL_S && conntrack_count_flows(bpf_map__fd(table), &stats.flows))) {
+        log_error("Error while reading the connection tracking statistics");
+        return;
+    }
+
+    if (stats.since_count >= CONNTRACK_COUNT_INTERVAL_S) {
+        /* The LRU evicts silently: every new flow that is neither in the table nor removed was evicted */
+        evicted = (__s64)(stats.counters[CT_NEW] - stats.counted[CT_NEW]) -
+                  (__s64)(stats.counters[CT_EXPIRED] - stats.counted[CT_EXPIRED]) -
+                  (__s64)(stats.counters[CT_CLOSED] - stats.counted[CT_CLOSED]) - ((__s64)stats.flows - prev->flows);
+        if (evicted < 0)
+            evicted = 0;
+        stats.evicted += evicted;
+        stats.evictions_rate = evicted / stats.since_count;
+        memcpy(stats.counted, stats.counters, sizeof(stats.counted));
+        stats.since_count = 0;
+    }
+
+    for (int i = 0; i < CT_STAT_MAX; i++)
+        delta[i] = stats.counters[i] - prev->counters[i];
+
+    if (delta[CT_NEW] || delta[CT_REPLY] || delta[CT_MISS] || stats.flows != prev->flows) {
+        log_info("Conntrack: %llu flows (%.1f%% full), %llu new, %llu replies, %llu misses, %llu expired, "
+                 "%llu closed, %.0f evictions/s", stats.flows, 100.0 * stats.flows / stats.max_flows,
+                 delta[CT_NEW], delta[CT_REPLY], delta[CT_MISS], delta[CT_EXPIRED], delta[CT_CLOSED],
+                 stats.evictions_rate);
+    }
+
+    *prev = stats;
+}
+
+/* Render the statistics last read by conntrack_print_stats */
+static void conntrack_render_metrics(struct metrics *m, const struct conntrack_stats *stats) {
+    static const char *const events[CT_STAT_MAX] = {"new", "reply", "miss", "expired", "closed"};
+    char labels[32];
+
+    metrics_family(m, "xdp_conntrack_flows", "gauge", "Flows in the connection tracking table");
+    metrics_u64(m, "xdp_conntrack_flows", NULL, stats->flows);
+    metrics_family(m, "xdp_conntrack_max_flows", "gauge", "Size of the connection tracking table");
+    metrics_u64(m, "xdp_conntrack_max_flows", NULL, stats->max_flows);
+
+    metrics_family(m, "xdp_conntrack_events_total", "counter", "Connection tracking events, evictions included");
+    for (int i = 0; i < CT_STAT_MAX; i++) {
+        snprintf(labels, sizeof(labels), "event=\"%s\"", events[i]);
+        metrics_u64(m, "xdp_conntrack_events_total", labels, stats->counters[i]);
+    }
+    metrics_u64(m, "xdp_conntrack_events_total", "event=\"evicted\"", stats->evicted);
+}
+
+#endif // CONNTRACK_USER_H_
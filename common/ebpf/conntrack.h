@@ -0,0 +1,197 @@
+#pragma once
+
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <stdbool.h>
+
+#include "conntrack_types.h"
+
+/*
+ * Connection tracking for a program that sits between an inside and an
+ * outside interface.
+ *
+ * Packets from the inside create or refresh a flow in an LRU_HASH keyed on
+ * the 5-tuple as seen from the inside; packets from the outside look up the
+ * reversed tuple, so the replies of the connections started from the inside
+ * are recognized. The table is shared by all the CPUs: the two directions of
+ * a flow arrive on different interfaces and are rarely steered to the same
+ * CPU, which rules out a per-CPU map, and BPF_F_NO_COMMON_LRU would split
+ * the capacity among the CPUs.
+ *
+ * TCP flows go from SYN_SENT to ESTABLISHED with the SYN-ACK of the reply,
+ * to FIN_WAIT with a FIN in either direction, and are removed by a RST. A
+ * flow picked up in the middle (e.g. after a restart) starts as
+ * ESTABLISHED. Other protocols only have the OTHER state. Each state has
+ * its idle timeout in conntrack_cfg.timeout_ns; an idle flow is removed when
+ * it is looked up, or evicted by the LRU when the table is full.
+ */
+
+#ifndef CONNTRACK_SIZE
+#define CONNTRACK_SIZE 65536
+#endif
+
+#ifndef IP_MF
+#define IP_MF 0x2000
+#endif
+#ifndef IP_OFFSET
+#define IP_OFFSET 0x1fff
+#endif
+
+const volatile struct {
+    __u8 enabled;
+    __u64 timeout_ns[CT_STATE_MAX];
+} conntrack_cfg = {};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, struct ct_key);
+    __type(value, struct ct_entry);
+    __uint(max_entries, CONNTRACK_SIZE);
+} conntrack SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, __u32);
+    __type(value, __u64);
+    __uint(max_entries, CT_STAT_MAX);
+} conntrack_stats SEC(".maps");
+
+static __always_inline void conntrack_count(__u32 stat) {
+    __u64 *cnt = bpf_map_lookup_elem(&conntrack_stats, &stat);
+
+    /* Per-CPU counter, no need for atomics */
+    if (cnt)
+        *cnt += 1;
+}
+
+/*
+ * Key of the flow of the packet, reversed for the packets from the outside.
+ * Only the first fragment of a datagram carries the L4 header, so all the
+ * fragments are keyed on the addresses and the protocol alone, without TCP
+ * state: a port read from a later fragment would be payload.
+ */
+static __always_inline struct tcphdr *conntrack_key(struct iphdr *ip, void *l4, void *data_end, bool reply,
+                                                    struct ct_key *key) {
+    bool frag = ip->frag_off & bpf_htons(IP_MF | IP_OFFSET);
+    struct tcphdr *tcp = NULL;
+    __u16 *ports = l4;
+    __u16 sport = 0, dport = 0;
+
+    /* TCP and UDP both start with the 16-bit source and destination ports */
+    if (!frag && (ip->protocol == IPPROTO_TCP || ip->protocol == IPPROTO_UDP) && (void *)(ports + 2) <= data_end) {
+        sport = ports[0];
+        dport = ports[1];
+    }
+    if (!frag && ip->protocol == IPPROTO_TCP && l4 + sizeof(*tcp) <= data_end)
+        tcp = l4;
+
+    key->proto = ip->protocol;
+    if (reply) {
+        key->saddr = ip->daddr;
+        key->daddr = ip->saddr;
+        key->sport = dport;
+        key->dport = sport;
+    } else {
+        key->saddr = ip->saddr;
+        key->daddr = ip->daddr;
+        key->sport = sport;
+        key->dport = dport;
+    }
+
+    return tcp;
+}
+
+/*
+ * The flow is gone once idle for longer than the timeout of its state. Another
+ * CPU may have stored a later timestamp than now, which is not idle time.
+ */
+static __always_inline bool conntrack_expired(struct ct_key *key, struct ct_entry *e, __u64 now) {
+    __u64 last_seen = e->last_seen_ns;
+    __u32 state = e->state;
+
+    if (state >= CT_STATE_MAX || now <= last_seen || now - last_seen <= conntrack_cfg.timeout_ns[state])
+        return false;
+
+    bpf_map_delete_elem(&conntrack, key);
+    conntrack_count(CT_EXPIRED);
+    return true;
+}
+
+/* Move the TCP state and refresh the flow, false if the flow is closed */
+static __always_inline bool conntrack_update(struct ct_key *key, struct ct_entry *e, struct tcphdr *tcp,
+                                             bool reply, __u64 now) {
+    if (tcp) {
+        if (tcp->rst) {
+            bpf_map_delete_elem(&conntrack, key);
+            conntrack_count(CT_CLOSED);
+            return false;
+        }
+
+        if (tcp->fin)
+            e->state = CT_FIN_WAIT;
+        else if (e->state == CT_SYN_SENT && reply && tcp->syn && tcp->ack)
+            e->state = CT_ESTABLISHED;
+    }
+
+    /* The coarse clock ticks every few ms, skip the stores that change nothing */
+    if (e->last_seen_ns != now)
+        e->last_seen_ns = now;
+
+    return true;
+}
+
+/* Packet from the inside: create or refresh its flow */
+static __always_inline void conntrack_outbound(struct iphdr *ip, void *l4, void *data_end) {
+    __u64 now = bpf_ktime_get_coarse_ns();
+    struct ct_key key = {};
+    struct tcphdr *tcp;
+    struct ct_entry *e;
+
+    tcp = conntrack_key(ip, l4, data_end, false, &key);
+
+    e = bpf_map_lookup_elem(&conntrack, &key);
+    if (e && !conntrack_expired(&key, e, now)) {
+        conntrack_update(&key, e, tcp, false, now);
+        return;
+    }
+
+    /* Nothing to track for a RST that closes an unknown flow */
+    if (tcp && tcp->rst)
+        return;
+
+    struct ct_entry new = {
+        .last_seen_ns = now,
+        .state = !tcp ? CT_OTHER : (tcp->syn && !tcp->ack) ? CT_SYN_SENT : CT_ESTABLISHED,
+    };
+
+    if (bpf_map_update_elem(&conntrack, &key, &new, BPF_NOEXIST) == 0)
+        conntrack_count(CT_NEW);
+}
+
+/* Packet from the outside: true if it is a reply of a tracked flow */
+static __always_inline bool conntrack_inbound(struct iphdr *ip, void *l4, void *data_end) {
+    __u64 now = bpf_ktime_get_coarse_ns();
+    struct ct_key key = {};
+    struct tcphdr *tcp;
+    struct ct_entry *e;
+
+    tcp = conntrack_key(ip, l4, data_end, true, &key);
+
+    e = bpf_map_lookup_elem(&conntrack, &key);
+    if (!e) {
+        conntrack_count(CT_MISS);
+        return false;
+    }
+
+    if (conntrack_expired(&key, e, now))
+        return false;
+
+    /* The RST that closes the flow is a reply too */
+    conntrack_update(&key, e, tcp, true, now);
+    conntrack_count(CT_REPLY);
+    return true;
+}
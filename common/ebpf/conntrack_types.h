@@ -0,0 +1,37 @@
+#pragma once
+
+/* Flow table and counters of conntrack.h, shared with its loaders (conntrack_user.h) */
+#include <linux/types.h>
+
+struct ct_key {
+    /* Inside host first */
+    __u32 saddr;
+    __u32 daddr;
+    __u16 sport;
+    __u16 dport;
+    __u8 proto;
+    __u8 pad[3];
+};
+
+enum ct_state {
+    CT_SYN_SENT = 0,
+    CT_ESTABLISHED,
+    CT_FIN_WAIT,
+    CT_OTHER,
+    CT_STATE_MAX,
+};
+
+struct ct_entry {
+    __u64 last_seen_ns;
+    __u32 state;
+    __u32 pad;
+};
+
+enum conntrack_stat {
+    CT_NEW = 0,
+    CT_REPLY,
+    CT_MISS,
+    CT_EXPIRED,
+    CT_CLOSED,
+    CT_STAT_MAX,
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+
+#include "flow_cache_types.h"
+
+/*
+ * Per-CPU flow verdict cache.
+ *
+ * The final verdict of a flow (action + egress ifindex) is stored in an
+ * LRU_PERCPU_HASH keyed on the ingress ifindex and the 5-tuple, so that the
+ * following packets of the same flow skip the whole lookup chain.
+ * Entries expire after flow_cache_cfg.ttl_ns and are invalidated as soon as
+ * userspace bumps flow_cache_gen after changing the rule maps.
+ */
+
+#ifndef FLOW_CACHE_SIZE
+#define FLOW_CACHE_SIZE 65536
+#endif
+
+const volatile struct {
+    __u8 enabled;
+    __u64 ttl_ns;
+} flow_cache_cfg = {};
+
+/* Generation of the rule maps, bumped by userspace on every change */
+volatile __u32 flow_cache_gen = 0;
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+    __type(key, struct flow_key);
+    __type(value, struct flow_verdict);
+    __uint(max_entries, FLOW_CACHE_SIZE);
+} flow_cache SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, __u32);
+    __type(value, __u64);
+    __uint(max_entries, FLOW_CACHE_STAT_MAX);
+} flow_cache_stats SEC(".maps");
+
+static __always_inline void flow_cache_count(__u32 stat) {
+    __u64 *cnt = bpf_map_lookup_elem(&flow_cache_stats, &stat);
+
+    /* Per-CPU counter, no need for atomics */
+    if (cnt)
+        *cnt += 1;
+}
+
+static __always_inline void flow_cache_key(struct xdp_md *ctx, struct iphdr *ip, void *l4,
+                                           void *data_end, struct flow_key *key) {
+    __u16 *ports = l4;
+
+    key->ifindex = ctx->ingress_ifindex;
+    key->saddr = ip->saddr;
+    key->daddr = ip->daddr;
+    key->proto = ip->protocol;
+
+    /* TCP and UDP both start with the 16-bit source and destination ports */
+    if ((ip->protocol == IPPROTO_TCP || ip->protocol == IPPROTO_UDP) &&
+        (void *)(ports + 2) <= data_end) {
+        key->sport = ports[0];
+        key->dport = ports[1];
+    }
+}
+
+static __always_inline struct flow_verdict *flow_cache_lookup(struct flow_key *key) {
+    struct flow_verdict *v;
+
+    v = bpf_map_lookup_elem(&flow_cache, key);
+    if (!v) {
+        flow_cache_count(FLOW_CACHE_MISS);
+        return NULL;
+    }
+
+    if (v->gen != flow_cache_gen || v->expires_ns < bpf_ktime_get_coarse_ns()) {
+        flow_cache_count(FLOW_CACHE_STALE);
+        return NULL;
+    }
+
+    flow_cache_count(FLOW_CACHE_HIT);
+    return v;
+}
+
+static __always_inline void flow_cache_insert(struct flow_key *key, __u32 action,
+                                              __u32 ifindex) {
+    struct flow_verdict v = {
+        .action = action,
+        .ifindex = ifindex,
+        .gen = flow_cache_gen,
+        .expires_ns = bpf_ktime_get_coarse_ns() + flow_cache_cfg.ttl_ns,
+    };
+
+    bpf_map_update_elem(&flow_cache, key, &v, BPF_ANY);
+    flow_cache_count(FLOW_CACHE_INSERT);
+}
+
+static __always_inline int flow_cache_apply(struct flow_verdict *v) {
+    if (v->action == XDP_REDIRECT)
+        return bpf_redirect(v->ifindex, 0);
+
+    return v->action;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+/* Entries and counters of flow_cache.h, shared with its loaders (flow_cache_user.h) */
+#include <linux/types.h>
+
+struct flow_key {
+    __u32 ifindex;
+    __u32 saddr;
+    __u32 daddr;
+    __u16 sport;
+    __u16 dport;
+    __u8 proto;
+    __u8 pad;
+    /* Outer VLAN id, the same 5-tuple may live in different VLANs */
+    __u16 vlan_id;
+};
+
+struct flow_verdict {
+    __u32 action;
+    __u32 ifindex;
+    __u32 gen;
+    __u32 pad;
+    __u64 expires_ns;
+};
+
+enum flow_cache_stat {
+    FLOW_CACHE_HIT = 0,
+    FLOW_CACHE_MISS,
+    FLOW_CACHE_STALE,
+    FLOW_CACHE_INSERT,
+    FLOW_CACHE_STAT_MAX,
+};
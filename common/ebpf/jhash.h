@@ -0,0 +1,36 @@
+#pragma once
+
+#include <linux/types.h>
+
+/*
+ * Subset of the kernel jhash (include/linux/jhash.h), used as software flow
+ * hash when the NIC does not provide one.
+ */
+
+#define JHASH_INITVAL 0xdeadbeef
+
+static __always_inline __u32 jhash_rol32(__u32 word, unsigned int shift) {
+   return (word << shift) | (word >> ((-shift) & 31));
+}
+
+#define __jhash_final(a, b, c)           \
+   {                                     \
+      c ^= b; c -= jhash_rol32(b, 14);   \
+      a ^= c; a -= jhash_rol32(c, 11);   \
+      b ^= a; b -= jhash_rol32(a, 25);   \
+      c ^= b; c -= jhash_rol32(b, 16);   \
+      a ^= c; a -= jhash_rol32(c, 4);    \
+      b ^= a; b -= jhash_rol32(a, 14);   \
+      c ^= b; c -= jhash_rol32(b, 24);   \
+   }
+
+static __always_inline __u32 jhash_3words(__u32 a, __u32 b, __u32 c, __u32 initval) {
+   initval += JHASH_INITVAL + (3 << 2);
+   a += initval;
+   b += initval;
+   c += initval;
+
+   __jhash_final(a, b, c);
+
+   return c;
+}
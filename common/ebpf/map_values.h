@@ -0,0 +1,22 @@
+#pragma once
+
+/* Keys and values of the per-IP maps, shared by the programs, their loaders and the benchmarks */
+#include <linux/types.h>
+
+/* xdp_stats_map and feed_stats of 03_DropByIP */
+struct datarec {
+    __u64 rx_packets;
+    __u64 rx_bytes;
+};
+
+/* threshold_map of 02_HHDv1 and 06_Pipeline, also the values section of a config snapshot */
+struct value_t {
+    __u64 threshold;
+    __u64 packets_rcvd;
+};
+
+/* Key of feed_prefixes of 03_DropByIP, an LPM trie */
+struct feed_prefix {
+    __u32 prefixlen;
+    __u32 addr;
+};
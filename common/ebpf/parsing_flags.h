@@ -0,0 +1,22 @@
+#pragma once
+
+/*
+ * Protocol flags of parse_cfg.disabled and PARSE_PROTOS, and the IPv6 next
+ * header numbers of parsing_helpers.h, shared with the loaders and benchmarks.
+ */
+
+#define PARSE_F_VLAN (1 << 0)
+#define PARSE_F_IPV4 (1 << 1)
+#define PARSE_F_IPV6 (1 << 2)
+#define PARSE_F_TCP (1 << 3)
+#define PARSE_F_UDP (1 << 4)
+#define PARSE_F_ICMP (1 << 5)
+#define PARSE_F_ALL (PARSE_F_VLAN | PARSE_F_IPV4 | PARSE_F_IPV6 | PARSE_F_TCP | PARSE_F_UDP | PARSE_F_ICMP)
+
+#ifndef NEXTHDR_HOP
+#define NEXTHDR_HOP 0
+#define NEXTHDR_ROUTING 43
+#define NEXTHDR_FRAGMENT 44
+#define NEXTHDR_AUTH 51
+#define NEXTHDR_DEST 60
+#endif
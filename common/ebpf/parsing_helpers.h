@@ -0,0 +1,333 @@
+#pragma once
+
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/icmp.h>
+#include <linux/icmpv6.h>
+#include <linux/udp.h>
+#include <linux/tcp.h>
+#include <linux/in.h>
+
+#include "parsing_flags.h"
+
+/*
+ * Packet parsers shared by all the programs.
+ *
+ * Every parser takes the offset of its header in nh_off, checks the header
+ * against data_end once, advances nh_off past it and returns the next
+ * protocol (or the header length for L4), or -1 if the packet is truncated.
+ *
+ * The protocols a program cares about are selected with PARSE_PROTOS at
+ * compile time and can be narrowed at load time with parse_cfg.disabled.
+ * Both are constants for the compiler/verifier, so the branches of the
+ * disabled protocols are removed from the program.
+ */
+
+#ifndef PARSE_PROTOS
+#define PARSE_PROTOS PARSE_F_ALL
+#endif
+
+#ifndef VLAN_MAX_DEPTH
+#define VLAN_MAX_DEPTH 2
+#endif
+
+#ifndef IPV6_EXT_MAX_CHAIN
+#define IPV6_EXT_MAX_CHAIN 6
+#endif
+
+#define VLAN_VID_MASK 0x0fff
+
+#ifndef IP_OFFSET
+#define IP_OFFSET 0x1fff
+#endif
+
+/* Fragment offset in the frag_off field of the IPv6 fragment header */
+#define IP6_OFFSET 0xfff8
+
+const volatile struct {
+   __u32 disabled;
+} parse_cfg = {};
+
+#define parse_enabled(f) ((PARSE_PROTOS & (f)) && !(parse_cfg.disabled & (f)))
+
+struct vlan_hdr {
+   __be16 h_vlan_TCI;
+   __be16 h_vlan_encapsulated_proto;
+};
+
+struct ipv6_opt_hdr_generic {
+   __u8 nexthdr;
+   __u8 hdrlen;
+};
+
+struct ipv6_frag_hdr {
+   __u8 nexthdr;
+   __u8 reserved;
+   __be16 frag_off;
+   __be32 identification;
+};
+
+/* Summary of a parsed packet, offsets are from the start of the frame */
+struct parsed_pkt {
+   __be16 l3_proto;
+   __u8 l4_proto;
+   __u8 vlan_depth;
+   __u16 l3_off;
+   __u16 l4_off;
+   __u16 payload_off;
+   __u16 vids[VLAN_MAX_DEPTH];
+};
+
+static __always_inline int parse_ethhdr(void *data, void *data_end, __u16 *nh_off, struct ethhdr **ethhdr) {
+   struct ethhdr *eth = data;
+
+   if ((void *)(eth + 1) > data_end)
+      return -1;
+
+   *nh_off += sizeof(*eth);
+   *ethhdr = eth;
+
+   return eth->h_proto; /* network-byte-order */
+}
+
+static __always_inline int proto_is_vlan(__u16 h_proto) {
+   return h_proto == bpf_htons(ETH_P_8021Q) || h_proto == bpf_htons(ETH_P_8021AD);
+}
+
+/*
+ * Skip up to VLAN_MAX_DEPTH tags, storing their VIDs (outer first) in vids.
+ * Returns the encapsulated protocol.
+ */
+static __always_inline int parse_vlanhdrs(void *data, void *data_end, __u16 *nh_off, int h_proto,
+                                          __u16 *vids, __u8 *depth) {
+   *depth = 0;
+
+   if (!parse_enabled(PARSE_F_VLAN))
+      return h_proto;
+
+#pragma unroll
+   for (int i = 0; i < VLAN_MAX_DEPTH; i++) {
+      struct vlan_hdr *vh = data + *nh_off;
+
+      if (!proto_is_vlan(h_proto))
+         break;
+
+      if ((void *)(vh + 1) > data_end)
+         return -1;
+
+      vids[i] = bpf_ntohs(vh->h_vlan_TCI) & VLAN_VID_MASK;
+      *depth = i + 1;
+      h_proto = vh->h_vlan_encapsulated_proto;
+      *nh_off += sizeof(*vh);
+   }
+
+   return h_proto;
+}
+
+/* IPv4 header, options included */
+static __always_inline int parse_iphdr(void *data, void *data_end, __u16 *nh_off, struct iphdr **iphdr) {
+   struct iphdr *ip = data + *nh_off;
+   int hdr_size;
+
+   if ((void *)(ip + 1) > data_end)
+      return -1;
+
+   hdr_size = ip->ihl * 4;
+   if (hdr_size < sizeof(*ip))
+      return -1;
+
+   /* Variable-length IPv4 header, need to use byte-based arithmetic */
+   if ((void *)ip + hdr_size > data_end)
+      return -1;
+
+   *nh_off += hdr_size;
+   *iphdr = ip;
+
+   return ip->protocol;
+}
+
+/*
+ * IPv6 header, followed by at most IPV6_EXT_MAX_CHAIN extension headers. Only
+ * the first fragment of a packet holds the L4 header: the others stop at their
+ * fragment header and return NEXTHDR_FRAGMENT.
+ */
+static __always_inline int parse_ip6hdr(void *data, void *data_end, __u16 *nh_off, struct ipv6hdr **ip6hdr) {
+   struct ipv6hdr *ip6h = data + *nh_off;
+   __u8 nexthdr;
+
+   if ((void *)(ip6h + 1) > data_end)
+      return -1;
+
+   *nh_off += sizeof(*ip6h);
+   *ip6hdr = ip6h;
+   nexthdr = ip6h->nexthdr;
+
+#pragma unroll
+   for (int i = 0; i < IPV6_EXT_MAX_CHAIN; i++) {
+      struct ipv6_opt_hdr_generic *opt = data + *nh_off;
+
+      if (nexthdr != NEXTHDR_HOP && nexthdr != NEXTHDR_ROUTING && nexthdr != NEXTHDR_FRAGMENT &&
+          nexthdr != NEXTHDR_AUTH && nexthdr != NEXTHDR_DEST)
+         break;
+
+      if ((void *)(opt + 1) > data_end)
+         return -1;
+
+      switch (nexthdr) {
+         case NEXTHDR_FRAGMENT: {
+            struct ipv6_frag_hdr *frag = data + *nh_off;
+
+            if ((void *)(frag + 1) > data_end)
+               return -1;
+            if (frag->frag_off & bpf_htons(IP6_OFFSET))
+               return NEXTHDR_FRAGMENT;
+            *nh_off += sizeof(*frag);
+            break;
+         }
+         case NEXTHDR_AUTH:
+            *nh_off += (opt->hdrlen + 2) * 4;
+            break;
+         default:
+            *nh_off += (opt->hdrlen + 1) * 8;
+            break;
+      }
+
+      nexthdr = opt->nexthdr;
+   }
+
+   return nexthdr;
+}
+
+/* Returns the TCP header length, options included */
+static __always_inline int parse_tcphdr(void *data, void *data_end, __u16 *nh_off, struct tcphdr **tcphdr) {
+   struct tcphdr *tcp = data + *nh_off;
+   int hdr_size;
+
+   if ((void *)(tcp + 1) > data_end)
+      return -1;
+
+   hdr_size = tcp->doff * 4;
+   if (hdr_size < sizeof(*tcp))
+      return -1;
+
+   if ((void *)tcp + hdr_size > data_end)
+      return -1;
+
+   *nh_off += hdr_size;
+   *tcphdr = tcp;
+
+   return hdr_size;
+}
+
+static __always_inline int parse_udphdr(void *data, void *data_end, __u16 *nh_off, struct udphdr **udphdr) {
+   struct udphdr *udp = data + *nh_off;
+
+   if ((void *)(udp + 1) > data_end)
+      return -1;
+
+   *nh_off += sizeof(*udp);
+   *udphdr = udp;
+
+   return sizeof(*udp);
+}
+
+/* ICMP and ICMPv6 share the type/code/checksum layout of the first 4 bytes */
+static __always_inline int parse_icmphdr(void *data, void *data_end, __u16 *nh_off, struct icmphdr **icmphdr) {
+   struct icmphdr *icmp = data + *nh_off;
+
+   if ((void *)(icmp + 1) > data_end)
+      return -1;
+
+   *nh_off += sizeof(*icmp);
+   *icmphdr = icmp;
+
+   return sizeof(*icmp);
+}
+
+static __always_inline int parse_icmp6hdr(void *data, void *data_end, __u16 *nh_off, struct icmp6hdr **icmp6hdr) {
+   struct icmp6hdr *icmp6 = data + *nh_off;
+
+   if ((void *)(icmp6 + 1) > data_end)
+      return -1;
+
+   *nh_off += sizeof(*icmp6);
+   *icmp6hdr = icmp6;
+
+   return sizeof(*icmp6);
+}
+
+/*
+ * Parse the whole frame down to L4. Protocols that are disabled, or unknown,
+ * stop the parsing there: l4_proto is 0 and l4_off/payload_off are left
+ * where the parsing stopped. So do the fragments after the first one, which
+ * have no L4 header, and ICMP/ICMPv6 numbers found under the other IP
+ * version. Returns -1 only for truncated packets.
+ */
+static __always_inline int parse_pkt(void *data, void *data_end, struct parsed_pkt *pkt) {
+   struct ethhdr *eth;
+   struct iphdr *ip;
+   struct ipv6hdr *ip6h;
+   struct tcphdr *tcp;
+   struct udphdr *udp;
+   struct icmphdr *icmp;
+   struct icmp6hdr *icmp6;
+   __u16 off = 0;
+   int proto;
+
+   pkt->l4_proto = 0;
+
+   proto = parse_ethhdr(data, data_end, &off, &eth);
+   if (proto < 0)
+      return -1;
+
+   proto = parse_vlanhdrs(data, data_end, &off, proto, pkt->vids, &pkt->vlan_depth);
+   if (proto < 0)
+      return -1;
+
+   pkt->l3_proto = proto;
+   pkt->l3_off = off;
+
+   if (proto == bpf_htons(ETH_P_IP) && parse_enabled(PARSE_F_IPV4)) {
+      proto = parse_iphdr(data, data_end, &off, &ip);
+      if (proto >= 0 && (ip->frag_off & bpf_htons(IP_OFFSET))) {
+         pkt->l4_off = pkt->payload_off = off;
+         return 0;
+      }
+   } else if (proto == bpf_htons(ETH_P_IPV6) && parse_enabled(PARSE_F_IPV6)) {
+      proto = parse_ip6hdr(data, data_end, &off, &ip6h);
+   } else {
+      pkt->l4_off = pkt->payload_off = off;
+      return 0;
+   }
+
+   if (proto < 0)
+      return -1;
+
+   pkt->l4_off = off;
+
+   if (proto == IPPROTO_TCP && parse_enabled(PARSE_F_TCP)) {
+      if (parse_tcphdr(data, data_end, &off, &tcp) < 0)
+         return -1;
+   } else if (proto == IPPROTO_UDP && parse_enabled(PARSE_F_UDP)) {
+      if (parse_udphdr(data, data_end, &off, &udp) < 0)
+         return -1;
+   } else if (proto == IPPROTO_ICMP && pkt->l3_proto == bpf_htons(ETH_P_IP) && parse_enabled(PARSE_F_ICMP)) {
+      if (parse_icmphdr(data, data_end, &off, &icmp) < 0)
+         return -1;
+   } else if (proto == IPPROTO_ICMPV6 && pkt->l3_proto == bpf_htons(ETH_P_IPV6) && parse_enabled(PARSE_F_ICMP)) {
+      if (parse_icmp6hdr(data, data_end, &off, &icmp6) < 0)
+         return -1;
+   } else {
+      pkt->payload_off = off;
+      return 0;
+   }
+
+   pkt->l4_proto = proto;
+   pkt->payload_off = off;
+
+   return 0;
+}
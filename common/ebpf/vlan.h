@@ -0,0 +1,134 @@
+#pragma once
+
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+#include <linux/if_ether.h>
+
+#include "parsing_helpers.h"
+#include "vlan_types.h"
+
+/*
+ * 802.1Q / 802.1ad (QinQ) parsing, per-VLAN counters and per-VLAN policy.
+ *
+ * The tags in the packet are walked with parse_vlanhdrs, up to
+ * VLAN_MAX_DEPTH of them. When the NIC stripped the outer tag, it can be read
+ * back with the bpf_xdp_metadata_rx_vlan_tag kfunc, but the verifier rejects
+ * any program that calls it without being loaded dev-bound
+ * (BPF_F_XDP_DEV_BOUND_ONLY), even on a path that never runs. So the kfunc is
+ * only compiled in with -DVLAN_DEV_BOUND, whose loader must bind the program
+ * to the device, and then used if vlan_cfg.use_hint is set.
+ */
+
+#define VLAN_STATS_SIZE 4096
+
+struct vlan_info {
+   struct vlan_key key;
+   __u8 depth;
+   __u8 from_hint;
+};
+
+#ifdef VLAN_DEV_BOUND
+const volatile struct {
+   __u8 use_hint;
+} vlan_cfg = {};
+
+extern int bpf_xdp_metadata_rx_vlan_tag(const struct xdp_md *ctx, __be16 *vlan_proto,
+                                        __u16 *vlan_tci) __ksym __weak;
+#endif
+
+struct {
+   __uint(type, BPF_MAP_TYPE_HASH);
+   __type(key, struct vlan_key);
+   __type(value, __u32);
+   __uint(max_entries, VLAN_STATS_SIZE);
+} vlan_policy SEC(".maps");
+
+struct {
+   __uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+   __type(key, struct vlan_key);
+   __type(value, struct vlan_stats);
+   __uint(max_entries, VLAN_STATS_SIZE);
+} vlan_stats SEC(".maps");
+
+static __always_inline void vlan_push_vid(struct vlan_info *vi, __u16 vid) {
+   if (vi->depth == 0)
+      vi->key.outer_vid = vid;
+   else if (vi->depth == 1)
+      vi->key.inner_vid = vid;
+   vi->depth++;
+}
+
+/*
+ * Called right after parse_ethhdr with its return value. Skips the VLAN
+ * tags, fills vi and returns the encapsulated protocol (network byte order),
+ * or -1 if the packet is truncated.
+ */
+static __always_inline int parse_vlan(struct xdp_md *ctx, void *data, void *data_end,
+                                      __u16 *nh_off, int h_proto, struct vlan_info *vi) {
+   __u16 vids[VLAN_MAX_DEPTH];
+   __u8 depth;
+
+   vi->key.outer_vid = 0;
+   vi->key.inner_vid = 0;
+   vi->depth = 0;
+   vi->from_hint = 0;
+
+   if (h_proto < 0)
+      return h_proto;
+
+#ifdef VLAN_DEV_BOUND
+   if (vlan_cfg.use_hint && bpf_ksym_exists(bpf_xdp_metadata_rx_vlan_tag)) {
+      __be16 proto;
+      __u16 tci;
+
+      if (!bpf_xdp_metadata_rx_vlan_tag(ctx, &proto, &tci)) {
+         vlan_push_vid(vi, tci & VLAN_VID_MASK);
+         vi->from_hint = 1;
+      }
+   }
+#endif
+
+   h_proto = parse_vlanhdrs(data, data_end, nh_off, h_proto, vids, &depth);
+
+#pragma unroll
+   for (int i = 0; i < VLAN_MAX_DEPTH; i++) {
+      if (i < depth)
+         vlan_push_vid(vi, vids[i]);
+   }
+
+   return h_proto;
+}
+
+/*
+ * Count the frame in its VLAN and return the action configured for it.
+ * Untagged frames skip the VLAN maps altogether.
+ */
+static __always_inline enum vlan_action vlan_account(struct vlan_info *vi, __u64 bytes) {
+   struct vlan_stats *st, init = {};
+   __u32 *action;
+   enum vlan_action ret = VLAN_ACTION_PROCESS;
+
+   if (vi->depth == 0)
+      return ret;
+
+   action = bpf_map_lookup_elem(&vlan_policy, &vi->key);
+   if (action)
+      ret = *action;
+
+   st = bpf_map_lookup_elem(&vlan_stats, &vi->key);
+   if (!st) {
+      bpf_map_update_elem(&vlan_stats, &vi->key, &init, BPF_NOEXIST);
+      st = bpf_map_lookup_elem(&vlan_stats, &vi->key);
+      if (!st)
+         return ret;
+   }
+
+   /* Per-CPU value, no atomics needed */
+   st->rx_packets++;
+   st->rx_bytes += bytes;
+   if (ret == VLAN_ACTION_DROP)
+      st->dropped++;
+
+   return ret;
+}
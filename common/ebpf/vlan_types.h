@@ -0,0 +1,23 @@
+#pragma once
+
+/* Keys and values of the VLAN maps of vlan.h, shared with vlan_user.h */
+#include <linux/types.h>
+
+/* A vid of 0 means untagged (or priority tagged) */
+struct vlan_key {
+   __u16 outer_vid;
+   __u16 inner_vid;
+};
+
+struct vlan_stats {
+   __u64 rx_packets;
+   __u64 rx_bytes;
+   __u64 dropped;
+};
+
+enum vlan_action {
+   /* Go on with the normal processing of the program */
+   VLAN_ACTION_PROCESS = 0,
+   VLAN_ACTION_DROP,
+   VLAN_ACTION_PASS,
+};
@@ -0,0 +1,409 @@
+#ifndef EVENT_LOOP_H_
+#define EVENT_LOOP_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/*
+ * Event loop shared by the userspace programs. Statistics ticks (a timerfd on
+ * CLOCK_MONOTONIC), SIGINT/SIGTERM (a signalfd) and the runtime commands, read
+ * line by line from stdin and from an optional unix control socket, are all
+ * waited for on one epoll instance: the process sleeps until something
+ * happens.
+ *
+ * The tick callback gets the time actually elapsed since the previous tick,
+ * read from CLOCK_MONOTONIC, so the rates stay right when a tick is late.
+ * While a command received on the control socket runs, the log messages are
+ * also sent back to the client.
+ */
+
+#define EVENT_LOOP_MIN_INTERVAL 0.01 /* Seconds */
+#define EVENT_LOOP_MAX_CONNS 8       /* stdin and the control socket clients */
+#define EVENT_LOOP_LINE_MAX 256
+#define EVENT_LOOP_MAX_HANDLERS 16   /* Other fds, e.g. the metrics server */
+
+/*
+ * epoll tokens, the connections use EVENT_TOKEN_CONN + their slot and the
+ * other fds EVENT_TOKEN_HANDLER + theirs
+ */
+enum event_token {
+    EVENT_TOKEN_TIMER = 0,
+    EVENT_TOKEN_SIGNAL,
+    EVENT_TOKEN_CTRL,
+    EVENT_TOKEN_CONN,
+    EVENT_TOKEN_HANDLER = EVENT_TOKEN_CONN + EVENT_LOOP_MAX_CONNS,
+};
+
+typedef void (*event_tick_fn)(void *ctx, double elapsed);
+typedef void (*event_command_fn)(void *ctx, char *line);
+typedef void (*event_fd_fn)(void *ctx, int fd);
+
+struct event_handler {
+    int fd;
+    event_fd_fn fn;
+    void *ctx;
+};
+
+struct event_conn {
+    int fd;
+    size_t len;
+    char buf[EVENT_LOOP_LINE_MAX];
+};
+
+struct event_loop {
+    int epoll_fd;
+    int timer_fd;
+    int signal_fd;
+    int ctrl_fd;
+    char ctrl_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    struct timespec last_tick;
+    event_tick_fn on_tick;
+    event_command_fn on_command;
+    void *ctx;
+    /* Slot 0 is stdin */
+    struct event_conn conns[EVENT_LOOP_MAX_CONNS];
+    /* Control socket client the log messages are copied to, -1 if none */
+    int reply_fd;
+    struct event_handler handlers[EVENT_LOOP_MAX_HANDLERS];
+};
+
+static double event_loop_elapsed(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static int event_loop_check_interval(double interval) {
+    if (interval < EVENT_LOOP_MIN_INTERVAL) {
+        log_fatal("The statistics interval must be at least %.2f s", EVENT_LOOP_MIN_INTERVAL);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int event_loop_add_fd(struct event_loop *el, int fd, __u32 token) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.u32 = token};
+
+    return epoll_ctl(el->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/*
+ * Set up the loop: on_tick is called every interval seconds (no ticks when
+ * interval is 0). SIGINT and SIGTERM are blocked in the calling thread, and in
+ * the threads it creates afterwards, and make event_loop_run return. Call it
+ * before starting the other threads of the program.
+ */
+static int event_loop_init(struct event_loop *el, double interval, event_tick_fn on_tick, void *ctx) {
+    sigset_t mask;
+
+    memset(el, 0, sizeof(*el));
+    el->timer_fd = el->signal_fd = el->ctrl_fd = el->reply_fd = -1;
+    for (int i = 0; i < EVENT_LOOP_MAX_CONNS; i++)
+        el->conns[i].fd = -1;
+    for (int i = 0; i < EVENT_LOOP_MAX_HANDLERS; i++)
+        el->handlers[i].fd = -1;
+    el->on_tick = on_tick;
+    el->ctx = ctx;
+
+    el->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (el->epoll_fd < 0) {
+        log_error("Error while creating the epoll instance: %s", strerror(errno));
+        return -1;
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    el->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (el->signal_fd < 0 || event_loop_add_fd(el, el->signal_fd, EVENT_TOKEN_SIGNAL)) {
+        log_error("Error while creating the signalfd: %s", strerror(errno));
+        return -1;
+    }
+
+    if (interval > 0) {
+        struct itimerspec its = {};
+
+        its.it_interval.tv_sec = (time_t)interval;
+        its.it_interval.tv_nsec = (long)((interval - its.it_interval.tv_sec) * 1e9);
+        its.it_value = its.it_interval;
+
+        el->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (el->timer_fd < 0 || timerfd_settime(el->timer_fd, 0, &its, NULL) ||
+            event_loop_add_fd(el, el->timer_fd, EVENT_TOKEN_TIMER)) {
+            log_error("Error while creating the statistics timer: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &el->last_tick);
+    return 0;
+}
+
+static void event_loop_log_reply(log_Event *ev) {
+    int fd = *(int *)ev->udata;
+    char msg[EVENT_LOOP_LINE_MAX * 4];
+    int len;
+
+    if (fd < 0)
+        return;
+
+    len = vsnprintf(msg, sizeof(msg) - 1, ev->fmt, ev->ap);
+    if (len < 0)
+        return;
+    if (len > sizeof(msg) - 2)
+        len = sizeof(msg) - 2;
+    msg[len++] = '\n';
+
+    /* The client may be gone already, that must not raise SIGPIPE */
+    send(fd, msg, len, MSG_NOSIGNAL);
+}
+
+/*
+ * Read commands from stdin and, when ctrl_path is not NULL, from a unix stream
+ * socket bound there; on_command is called once per line.
+ */
+static int event_loop_add_commands(struct event_loop *el, event_command_fn on_command, const char *ctrl_path) {
+    el->on_command = on_command;
+
+    /* stdin may be a file or /dev/null, which epoll does not support */
+    el->conns[0].fd = STDIN_FILENO;
+    if (event_loop_add_fd(el, STDIN_FILENO, EVENT_TOKEN_CONN)) {
+        log_debug("Not reading commands from stdin: %s", strerror(errno));
+        el->conns[0].fd = -1;
+    }
+
+    if (ctrl_path != NULL) {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+        if (strlen(ctrl_path) >= sizeof(addr.sun_path)) {
+            log_error("Control socket path %s is too long", ctrl_path);
+            return -1;
+        }
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", ctrl_path);
+
+        el->ctrl_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (el->ctrl_fd < 0) {
+            log_error("Error while creating the control socket: %s", strerror(errno));
+            return -1;
+        }
+
+        /* Left over by a previous run that did not exit cleanly */
+        unlink(ctrl_path);
+        if (bind(el->ctrl_fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(el->ctrl_fd, 4) ||
+            event_loop_add_fd(el, el->ctrl_fd, EVENT_TOKEN_CTRL)) {
+            log_error("Error while binding the control socket %s: %s", ctrl_path, strerror(errno));
+            return -1;
+        }
+
+        snprintf(el->ctrl_path, sizeof(el->ctrl_path), "%s", ctrl_path);
+        log_add_callback(event_loop_log_reply, &el->reply_fd, LOG_INFO);
+        log_info("Listening for commands on %s", ctrl_path);
+    }
+
+    return 0;
+}
+
+/* Call fn whenever fd is readable, until event_loop_del_fd */
+static int event_loop_add_handler(struct event_loop *el, int fd, event_fd_fn fn, void *ctx) {
+    for (int i = 0; i < EVENT_LOOP_MAX_HANDLERS; i++) {
+        if (el->handlers[i].fd < 0) {
+            if (event_loop_add_fd(el, fd, EVENT_TOKEN_HANDLER + i))
+                return -1;
+            el->handlers[i] = (struct event_handler){.fd = fd, .fn = fn, .ctx = ctx};
+            return 0;
+        }
+    }
+
+    errno = ENOSPC;
+    return -1;
+}
+
+/* Call the handler of fd when it is writable instead of readable (on), or the other way round */
+static int event_loop_watch_write(struct event_loop *el, int fd, bool on) {
+    for (int i = 0; i < EVENT_LOOP_MAX_HANDLERS; i++) {
+        if (el->handlers[i].fd == fd) {
+            struct epoll_event ev = {.events = on ? EPOLLOUT : EPOLLIN, .data.u32 = EVENT_TOKEN_HANDLER + i};
+
+            return epoll_ctl(el->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        }
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+/* Stop watching fd, the caller still owns it */
+static void event_loop_del_fd(struct event_loop *el, int fd) {
+    for (int i = 0; i < EVENT_LOOP_MAX_HANDLERS; i++) {
+        if (el->handlers[i].fd == fd) {
+            epoll_ctl(el->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            el->handlers[i].fd = -1;
+            return;
+        }
+    }
+}
+
+static void event_loop_close_conn(struct event_loop *el, int slot) {
+    struct event_conn *conn = &el->conns[slot];
+
+    epoll_ctl(el->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    if (slot != 0)
+        close(conn->fd);
+    conn->fd = -1;
+    conn->len = 0;
+}
+
+static void event_loop_accept(struct event_loop *el) {
+    int fd = accept(el->ctrl_fd, NULL, NULL);
+
+    if (fd < 0)
+        return;
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    for (int i = 1; i < EVENT_LOOP_MAX_CONNS; i++) {
+        if (el->conns[i].fd < 0) {
+            el->conns[i].fd = fd;
+            el->conns[i].len = 0;
+            if (event_loop_add_fd(el, fd, EVENT_TOKEN_CONN + i) == 0)
+                return;
+            el->conns[i].fd = -1;
+            break;
+        }
+    }
+
+    log_warn("Too many control connections, closing the new one");
+    close(fd);
+}
+
+/* Run on_command on every complete line received on the connection */
+static void event_loop_read_conn(struct event_loop *el, int slot) {
+    struct event_conn *conn = &el->conns[slot];
+    ssize_t n;
+    char *nl;
+
+    n = read(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - 1 - conn->len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+
+    if (n <= 0) {
+        /* Run the last command even if it has no newline */
+        if (conn->len > 0) {
+            conn->buf[conn->len] = '\0';
+            el->reply_fd = slot != 0 ? conn->fd : -1;
+            el->on_command(el->ctx, conn->buf);
+            el->reply_fd = -1;
+        }
+        event_loop_close_conn(el, slot);
+        return;
+    }
+
+    conn->len += n;
+    conn->buf[conn->len] = '\0';
+
+    while ((nl = strchr(conn->buf, '\n')) != NULL) {
+        size_t line_len = nl - conn->buf + 1;
+
+        *nl = '\0';
+        el->reply_fd = slot != 0 ? conn->fd : -1;
+        el->on_command(el->ctx, conn->buf);
+        el->reply_fd = -1;
+
+        conn->len -= line_len;
+        memmove(conn->buf, conn->buf + line_len, conn->len + 1);
+    }
+
+    if (conn->len == sizeof(conn->buf) - 1) {
+        log_error("Command too long, discarding it");
+        conn->len = 0;
+    }
+}
+
+/* Dispatch the events until SIGINT or SIGTERM; returns 0 then, -1 on error */
+static int event_loop_run(struct event_loop *el) {
+    struct epoll_event events[EVENT_TOKEN_HANDLER + EVENT_LOOP_MAX_HANDLERS];
+
+    while (true) {
+        int n = epoll_wait(el->epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            log_error("Error while waiting for events: %s", strerror(errno));
+            return -1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            __u32 token = events[i].data.u32;
+
+            if (token == EVENT_TOKEN_SIGNAL) {
+                struct signalfd_siginfo si;
+
+                if (read(el->signal_fd, &si, sizeof(si)) == sizeof(si)) {
+                    log_debug("Got signal %u, closing program...", si.ssi_signo);
+                    return 0;
+                }
+            } else if (token == EVENT_TOKEN_TIMER) {
+                struct timespec now;
+                __u64 expirations;
+
+                if (read(el->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+                    continue;
+
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                el->on_tick(el->ctx, event_loop_elapsed(&el->last_tick, &now));
+                el->last_tick = now;
+            } else if (token == EVENT_TOKEN_CTRL) {
+                event_loop_accept(el);
+            } else if (token >= EVENT_TOKEN_HANDLER) {
+                struct event_handler *h = &el->handlers[token - EVENT_TOKEN_HANDLER];
+
+                /* May have been removed by a previous event of this batch */
+                if (h->fd >= 0)
+                    h->fn(h->ctx, h->fd);
+            } else if (el->conns[token - EVENT_TOKEN_CONN].fd >= 0) {
+                event_loop_read_conn(el, token - EVENT_TOKEN_CONN);
+            }
+        }
+    }
+}
+
+static void event_loop_destroy(struct event_loop *el) {
+    /* Zeroed, event_loop_init was never called */
+    if (el->epoll_fd <= 0)
+        return;
+
+    for (int i = 1; i < EVENT_LOOP_MAX_CONNS; i++) {
+        if (el->conns[i].fd >= 0)
+            close(el->conns[i].fd);
+    }
+
+    if (el->ctrl_fd >= 0) {
+        close(el->ctrl_fd);
+        unlink(el->ctrl_path);
+    }
+    if (el->timer_fd >= 0)
+        close(el->timer_fd);
+    if (el->signal_fd >= 0)
+        close(el->signal_fd);
+    close(el->epoll_fd);
+}
+
+#endif // EVENT_LOOP_H_
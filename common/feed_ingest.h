@@ -0,0 +1,544 @@
+#ifndef FEED_INGEST_H_
+#define FEED_INGEST_H_
+
+#include <arpa/inet.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "pin.h"
+#include "config_snapshot.h"
+#include "ebpf/map_values.h"
+
+/*
+ * Ingestion of plain-text blocklists ("feeds"): one IPv4 address or CIDR
+ * prefix per line, blank lines and '#' or ';' comments allowed, also after
+ * the address ("192.0.2.0/24 ; SBL123").
+ *
+ * The file is mapped read-only and cut into FEED_CHUNK_SIZE chunks. The
+ * parsing threads take the chunks in order; a line belongs to the chunk
+ * where it starts. Each chunk is parsed in place, without copying lines or
+ * calling inet_pton, then its addresses (radix sort) and prefixes are
+ * sorted and the duplicates dropped. The parsed chunks go through a bounded
+ * queue to the updating threads, which hand them to batch map updates while
+ * the others parse. A duplicate in two different chunks is simply updated twice.
+ *
+ * Single addresses (and /32) go to a hash map keyed by the __u32 address,
+ * shorter prefixes to an LPM trie keyed by struct feed_prefix, both in
+ * network byte order with __u8 values.
+ */
+
+#define FEED_CHUNK_SIZE (4 << 20)
+/* Parsed chunks waiting in the queue, per parsing thread */
+#define FEED_QUEUE_DEPTH 2
+/* Initial capacity of the arrays of a chunk, grown as needed */
+#define FEED_BATCH_INITIAL 4096
+
+struct feed {
+    const char *data;
+    size_t size;
+    /* Upper bound of the number of entries, to size the maps */
+    __u64 lines;
+};
+
+struct feed_stats {
+    __u64 lines;
+    __u64 addrs;
+    __u64 prefixes;
+    /* Repeated in the same chunk, the others are only counted as entries */
+    __u64 duplicates;
+    __u64 invalid;
+    __u64 bytes;
+    double seconds;
+};
+
+/* A parsed chunk */
+struct feed_batch {
+    __u32 *addrs;
+    __u32 addrs_count;
+    __u32 addrs_cap;
+    struct feed_prefix *prefixes;
+    __u32 prefixes_count;
+    __u32 prefixes_cap;
+    __u64 lines;
+    __u64 duplicates;
+    __u64 invalid;
+};
+
+struct feed_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct feed_batch **slots;
+    unsigned int depth;
+    unsigned int head;
+    unsigned int count;
+    /* Parsing threads still running */
+    unsigned int producers;
+};
+
+struct feed_ingest {
+    const struct feed *feed;
+    __u64 chunks;
+    __u64 next_chunk;
+    int failed;
+    struct feed_queue queue;
+    struct bpf_map *addrs;
+    struct bpf_map *prefixes;
+    /* CONFIG_SNAPSHOT_BATCH zeroed values */
+    const void *zeros;
+};
+
+struct feed_updater {
+    pthread_t tid;
+    struct feed_ingest *ing;
+    struct feed_stats stats;
+};
+
+static int feed_open(const char *path, struct feed *feed) {
+    struct stat st;
+    int fd;
+
+    memset(feed, 0, sizeof(*feed));
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st)) {
+        log_error("Failed to open the feed %s: %s", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    feed->size = st.st_size;
+    if (feed->size > 0) {
+        feed->data = mmap(NULL, feed->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (feed->data == MAP_FAILED) {
+            log_error("Failed to map the feed %s: %s", path, strerror(errno));
+            feed->data = NULL;
+            close(fd);
+            return -1;
+        }
+        madvise((void *)feed->data, feed->size, MADV_WILLNEED);
+    }
+    close(fd);
+
+    for (const char *p = feed->data, *end = feed->data + feed->size; p && p < end;) {
+        feed->lines++;
+        p = memchr(p, '\n', end - p);
+        if (p)
+            p++;
+    }
+
+    return 0;
+}
+
+static void feed_close(struct feed *feed) {
+    if (feed->data)
+        munmap((void *)feed->data, feed->size);
+    feed->data = NULL;
+}
+
+/*
+ * Parse a dotted-quad address that ends at the first character that is not
+ * part of it. Same rules as inet_pton: four decimal octets, no leading zeros.
+ * Returns the end of the address, NULL if there is none.
+ */
+static inline const char *feed_parse_ipv4(const char *p, const char *end, __u32 *addr) {
+    __u32 ip = 0;
+
+    for (int i = 0; i < 4; i++) {
+        unsigned int octet = 0, digits = 0;
+        const char *start;
+
+        if (i > 0) {
+            if (p == end || *p != '.')
+                return NULL;
+            p++;
+        }
+
+        start = p;
+        while (digits < 3 && p < end && (unsigned char)(*p - '0') < 10) {
+            octet = octet * 10 + (*p++ - '0');
+            digits++;
+        }
+
+        if (digits == 0 || octet > 255 || (digits > 1 && *start == '0'))
+            return NULL;
+        ip = ip << 8 | octet;
+    }
+
+    *addr = htonl(ip);
+    return p;
+}
+
+static inline bool feed_is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static int feed_batch_grow(void **array, __u32 *cap, size_t size) {
+    __u32 new_cap = *cap ? *cap * 2 : FEED_BATCH_INITIAL;
+    void *new_array = realloc(*array, (size_t)new_cap * size);
+
+    if (!new_array)
+        return -1;
+    *array = new_array;
+    *cap = new_cap;
+    return 0;
+}
+
+/* Parse the line [p, end) into the batch, -1 only when out of memory */
+static int feed_parse_line(const char *p, const char *end, struct feed_batch *b) {
+    __u32 addr, prefixlen = 32;
+
+    b->lines++;
+
+    while (p < end && feed_is_space(*p))
+        p++;
+    if (p == end || *p == '#' || *p == ';')
+        return 0;
+
+    p = feed_parse_ipv4(p, end, &addr);
+    if (p && p < end && *p == '/') {
+        const char *start = ++p;
+
+        prefixlen = 0;
+        while (p < end && p - start < 2 && (unsigned char)(*p - '0') < 10)
+            prefixlen = prefixlen * 10 + (*p++ - '0');
+        if (p == start || prefixlen > 32)
+            p = NULL;
+    }
+    while (p && p < end && feed_is_space(*p))
+        p++;
+    if (!p || (p < end && *p != '#' && *p != ';')) {
+        b->invalid++;
+        return 0;
+    }
+
+    if (prefixlen == 32) {
+        if (b->addrs_count == b->addrs_cap && feed_batch_grow((void **)&b->addrs, &b->addrs_cap, sizeof(*b->addrs)))
+            return -1;
+        b->addrs[b->addrs_count++] = addr;
+    } else {
+        if (b->prefixes_count == b->prefixes_cap &&
+            feed_batch_grow((void **)&b->prefixes, &b->prefixes_cap, sizeof(*b->prefixes)))
+            return -1;
+        /* The LPM trie ignores the host bits, clear them to find the duplicates */
+        b->prefixes[b->prefixes_count].prefixlen = prefixlen;
+        b->prefixes[b->prefixes_count++].addr = addr & htonl(prefixlen ? ~0U << (32 - prefixlen) : 0);
+    }
+
+    return 0;
+}
+
+static int feed_prefix_cmp(const void *a, const void *b) {
+    const struct feed_prefix *pa = a, *pb = b;
+
+    if (pa->addr != pb->addr)
+        return pa->addr < pb->addr ? -1 : 1;
+    return pa->prefixlen < pb->prefixlen ? -1 : pa->prefixlen > pb->prefixlen;
+}
+
+/*
+ * LSD radix sort of the addresses, in the order of pin_u32_cmp, four 8-bit
+ * passes through tmp. Several times faster than qsort on a chunk.
+ */
+static void feed_sort_u32(__u32 *keys, __u32 *tmp, __u32 count) {
+    for (int shift = 0; shift < 32; shift += 8) {
+        __u32 offsets[256] = {0};
+        __u32 *swap;
+
+        for (__u32 i = 0; i < count; i++)
+            offsets[(keys[i] >> shift) & 0xff]++;
+        for (__u32 i = 0, sum = 0; i < 256; i++) {
+            __u32 c = offsets[i];
+
+            offsets[i] = sum;
+            sum += c;
+        }
+        for (__u32 i = 0; i < count; i++)
+            tmp[offsets[(keys[i] >> shift) & 0xff]++] = keys[i];
+
+        swap = keys;
+        keys = tmp;
+        tmp = swap;
+    }
+}
+
+/* Drop the duplicates of the sorted array, returns the new count */
+static __u32 feed_dedup(void *array, __u32 count, size_t size, int (*cmp)(const void *, const void *)) {
+    char *base = array;
+    __u32 n = 0;
+
+    for (__u32 i = 0; i < count; i++) {
+        if (n > 0 && cmp(base + (n - 1) * size, base + i * size) == 0)
+            continue;
+        if (n != i)
+            memcpy(base + n * size, base + i * size, size);
+        n++;
+    }
+
+    return n;
+}
+
+static void feed_batch_free(struct feed_batch *b) {
+    if (!b)
+        return;
+    free(b->addrs);
+    free(b->prefixes);
+    free(b);
+}
+
+static struct feed_batch *feed_parse_chunk(const struct feed *feed, __u64 chunk) {
+    const char *end = feed->data + feed->size;
+    const char *p = feed->data + chunk * FEED_CHUNK_SIZE;
+    const char *chunk_end = feed->size - chunk * FEED_CHUNK_SIZE > FEED_CHUNK_SIZE ? p + FEED_CHUNK_SIZE : end;
+    struct feed_batch *b = calloc(1, sizeof(*b));
+    __u32 n;
+
+    if (!b)
+        return NULL;
+
+    /* The line that crosses the start of the chunk belongs to the previous one */
+    if (chunk > 0 && p[-1] != '\n') {
+        p = memchr(p, '\n', end - p);
+        p = p ? p + 1 : end;
+    }
+
+    while (p < chunk_end) {
+        const char *eol = memchr(p, '\n', end - p);
+
+        if (!eol)
+            eol = end;
+        if (feed_parse_line(p, eol, b)) {
+            feed_batch_free(b);
+            return NULL;
+        }
+        p = eol + 1;
+    }
+
+    if (b->addrs_count > 0) {
+        __u32 *tmp = malloc((size_t)b->addrs_count * sizeof(*tmp));
+
+        if (!tmp) {
+            feed_batch_free(b);
+            return NULL;
+        }
+        feed_sort_u32(b->addrs, tmp, b->addrs_count);
+        free(tmp);
+    }
+    n = feed_dedup(b->addrs, b->addrs_count, sizeof(*b->addrs), pin_u32_cmp);
+    b->duplicates = b->addrs_count - n;
+    b->addrs_count = n;
+    qsort(b->prefixes, b->prefixes_count, sizeof(*b->prefixes), feed_prefix_cmp);
+    n = feed_dedup(b->prefixes, b->prefixes_count, sizeof(*b->prefixes), feed_prefix_cmp);
+    b->duplicates += b->prefixes_count - n;
+    b->prefixes_count = n;
+
+    return b;
+}
+
+static void feed_queue_push(struct feed_queue *q, struct feed_batch *b) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->depth)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    q->slots[(q->head + q->count++) % q->depth] = b;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* NULL once the queue is empty and all the parsing threads are done */
+static struct feed_batch *feed_queue_pop(struct feed_queue *q) {
+    struct feed_batch *b = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && q->producers > 0)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    if (q->count > 0) {
+        b = q->slots[q->head];
+        q->head = (q->head + 1) % q->depth;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return b;
+}
+
+static void *feed_worker(void *arg) {
+    struct feed_ingest *ing = arg;
+
+    for (;;) {
+        __u64 chunk = __atomic_fetch_add(&ing->next_chunk, 1, __ATOMIC_RELAXED);
+        struct feed_batch *b;
+
+        if (chunk >= ing->chunks || __atomic_load_n(&ing->failed, __ATOMIC_RELAXED))
+            break;
+
+        b = feed_parse_chunk(ing->feed, chunk);
+        if (!b) {
+            log_error("Failed to allocate the entries of the feed");
+            __atomic_store_n(&ing->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        feed_queue_push(&ing->queue, b);
+    }
+
+    pthread_mutex_lock(&ing->queue.lock);
+    /* The last one wakes all the updaters up to let them return */
+    if (--ing->queue.producers == 0)
+        pthread_cond_broadcast(&ing->queue.not_empty);
+    pthread_mutex_unlock(&ing->queue.lock);
+
+    return NULL;
+}
+
+/* Batch update of count keys, all with the zeroed value */
+static int feed_update(struct bpf_map *map, const void *keys, __u64 count, const void *zeros) {
+    __u32 key_size = bpf_map__key_size(map);
+
+    for (__u64 done = 0; done < count; done += CONFIG_SNAPSHOT_BATCH) {
+        __u64 n = count - done < CONFIG_SNAPSHOT_BATCH ? count - done : CONFIG_SNAPSHOT_BATCH;
+
+        if (config_snapshot_update(map, (const char *)keys + done * key_size, zeros, n))
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Insert the parsed chunks, keeps draining the queue after an error */
+static void *feed_updater(void *arg) {
+    struct feed_updater *u = arg;
+    struct feed_ingest *ing = u->ing;
+    struct feed_batch *b;
+
+    while ((b = feed_queue_pop(&ing->queue))) {
+        if (!__atomic_load_n(&ing->failed, __ATOMIC_RELAXED) &&
+            (feed_update(ing->addrs, b->addrs, b->addrs_count, ing->zeros) ||
+             feed_update(ing->prefixes, b->prefixes, b->prefixes_count, ing->zeros)))
+            __atomic_store_n(&ing->failed, 1, __ATOMIC_RELAXED);
+
+        u->stats.lines += b->lines;
+        u->stats.addrs += b->addrs_count;
+        u->stats.prefixes += b->prefixes_count;
+        u->stats.duplicates += b->duplicates;
+        u->stats.invalid += b->invalid;
+        feed_batch_free(b);
+    }
+
+    return NULL;
+}
+
+static double feed_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Parse the feed on the given number of threads and insert its entries in the
+ * addrs (hash) and prefixes (LPM trie) maps from as many other threads, the
+ * calling one included: the hash map takes concurrent updates. Returns -1 on
+ * the first map update or allocation error; invalid lines are only counted.
+ */
+static int feed_ingest(const struct feed *feed, int threads, struct bpf_map *addrs, struct bpf_map *prefixes,
+                       struct feed_stats *stats) {
+    struct feed_ingest ing = {.feed = feed, .addrs = addrs, .prefixes = prefixes};
+    __u32 value_size = bpf_map__value_size(addrs);
+    struct feed_updater *updaters;
+    pthread_t *parsers;
+    double start = feed_now();
+    void *zeros;
+    int parsing = 0, updating = 1;
+
+    memset(stats, 0, sizeof(*stats));
+    ing.chunks = (feed->size + FEED_CHUNK_SIZE - 1) / FEED_CHUNK_SIZE;
+    if (threads < 1)
+        threads = 1;
+    if ((__u64)threads > ing.chunks)
+        threads = ing.chunks ? ing.chunks : 1;
+
+    if (bpf_map__value_size(prefixes) > value_size)
+        value_size = bpf_map__value_size(prefixes);
+    ing.queue.depth = threads * FEED_QUEUE_DEPTH;
+    ing.queue.slots = calloc(ing.queue.depth, sizeof(*ing.queue.slots));
+    zeros = calloc(CONFIG_SNAPSHOT_BATCH, value_size);
+    parsers = calloc(threads, sizeof(*parsers));
+    updaters = calloc(threads, sizeof(*updaters));
+    if (!ing.queue.slots || !zeros || !parsers || !updaters) {
+        log_error("Failed to allocate the feed queue");
+        free(ing.queue.slots);
+        free(zeros);
+        free(parsers);
+        free(updaters);
+        return -1;
+    }
+    ing.zeros = zeros;
+
+    pthread_mutex_init(&ing.queue.lock, NULL);
+    pthread_cond_init(&ing.queue.not_empty, NULL);
+    pthread_cond_init(&ing.queue.not_full, NULL);
+
+    ing.queue.producers = threads;
+    for (; parsing < threads; parsing++) {
+        if (pthread_create(&parsers[parsing], NULL, feed_worker, &ing)) {
+            log_error("Failed to create the feed parsing threads");
+            pthread_mutex_lock(&ing.queue.lock);
+            ing.queue.producers -= threads - parsing;
+            pthread_cond_broadcast(&ing.queue.not_empty);
+            pthread_mutex_unlock(&ing.queue.lock);
+            __atomic_store_n(&ing.failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    for (int i = 0; i < threads; i++)
+        updaters[i].ing = &ing;
+    for (; updating < threads; updating++) {
+        if (pthread_create(&updaters[updating].tid, NULL, feed_updater, &updaters[updating]))
+            break;
+    }
+
+    /* The calling thread is the first updater, so the queue always drains */
+    feed_updater(&updaters[0]);
+
+    for (int i = 0; i < parsing; i++)
+        pthread_join(parsers[i], NULL);
+    for (int i = 0; i < updating; i++) {
+        if (i > 0)
+            pthread_join(updaters[i].tid, NULL);
+        stats->lines += updaters[i].stats.lines;
+        stats->addrs += updaters[i].stats.addrs;
+        stats->prefixes += updaters[i].stats.prefixes;
+        stats->duplicates += updaters[i].stats.duplicates;
+        stats->invalid += updaters[i].stats.invalid;
+    }
+
+    stats->bytes = feed->size;
+    stats->seconds = feed_now() - start;
+
+    pthread_cond_destroy(&ing.queue.not_full);
+    pthread_cond_destroy(&ing.queue.not_empty);
+    pthread_mutex_destroy(&ing.queue.lock);
+    free(ing.queue.slots);
+    free(zeros);
+    free(parsers);
+    free(updaters);
+
+    return __atomic_load_n(&ing.failed, __ATOMIC_RELAXED) ? -1 : 0;
+}
+
+#endif // FEED_INGEST_H_
@@ -0,0 +1,75 @@
+#ifndef FLOW_CACHE_USER_H_
+#define FLOW_CACHE_USER_H_
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "ebpf/flow_cache_types.h"
+
+#define FLOW_CACHE_DEFAULT_TTL_MS 1000
+
+/* Invalidate every cached verdict, must be called after each rule change */
+static inline void flow_cache_bump_gen(volatile __u32 *gen) {
+    __atomic_fetch_add(gen, 1, __ATOMIC_SEQ_CST);
+}
+
+static int flow_cache_read_stats(int map_fd, __u64 stats[FLOW_CACHE_STAT_MAX]) {
+    int cpus = libbpf_num_possible_cpus();
+    __u64 values[cpus];
+
+    for (__u32 key = 0; key < FLOW_CACHE_STAT_MAX; key++) {
+        stats[key] = 0;
+
+        if (bpf_map_lookup_elem(map_fd, &key, values))
+            return -1;
+
+        for (int i = 0; i < cpus; i++)
+            stats[key] += values[i];
+    }
+
+    return 0;
+}
+
+static void flow_cache_print_stats(int map_fd, __u64 prev[FLOW_CACHE_STAT_MAX]) {
+    __u64 stats[FLOW_CACHE_STAT_MAX];
+    __u64 hits, lookups;
+
+    if (flow_cache_read_stats(map_fd, stats)) {
+        log_error("Error while reading the flow cache statistics");
+        return;
+    }
+
+    hits = stats[FLOW_CACHE_HIT] - prev[FLOW_CACHE_HIT];
+    lookups = hits + (stats[FLOW_CACHE_MISS] - prev[FLOW_CACHE_MISS]) +
+              (stats[FLOW_CACHE_STALE] - prev[FLOW_CACHE_STALE]);
+
+    if (lookups != 0) {
+        log_info("Flow cache: %llu hits, %llu misses, %llu stale, %llu inserts (%.2f%% hit rate)",
+                 hits, stats[FLOW_CACHE_MISS] - prev[FLOW_CACHE_MISS],
+                 stats[FLOW_CACHE_STALE] - prev[FLOW_CACHE_STALE],
+                 stats[FLOW_CACHE_INSERT] - prev[FLOW_CACHE_INSERT],
+                 (100.0 * hits) / lookups);
+    }
+
+    for (int i = 0; i < FLOW_CACHE_STAT_MAX; i++)
+        prev[i] = stats[i];
+}
+
+/* Render the counters last read by flow_cache_print_stats */
+static void flow_cache_render_metrics(struct metrics *m, const __u64 stats[FLOW_CACHE_STAT_MAX]) {
+    static const char *const results[FLOW_CACHE_STAT_MAX] = {"hit", "miss", "stale", "insert"};
+    char labels[32];
+
+    metrics_family(m, "xdp_flow_cache_events_total", "counter", "Flow verdict cache lookups by result, and inserts");
+    for (int i = 0; i < FLOW_CACHE_STAT_MAX; i++) {
+        snprintf(labels, sizeof(labels), "result=\"%s\"", results[i]);
+        metrics_u64(m, "xdp_flow_cache_events_total", labels, stats[i]);
+    }
+}
+
+#endif // FLOW_CACHE_USER_H_
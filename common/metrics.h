@@ -0,0 +1,440 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <arpa/inet.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+#include "log.h"
+
+/*
+ * Prometheus exporter served on 127.0.0.1:<port>/metrics (text format 0.0.4).
+ *
+ * A scrape never reads the maps: the statistics tick renders the values it
+ * has just read in a text snapshot, and every scrape until the next tick gets
+ * that snapshot. However many scrapers there are, the maps are read once per
+ * --interval. The per-IP families only export the top --metrics-top addresses
+ * by packets and sum the others under ip="other", so the number of series
+ * stays bounded whatever the size of the maps.
+ *
+ * The clients are served from the event loop without ever blocking it: their
+ * sockets are non-blocking, the response is sent as the socket takes it, and
+ * a client that has not been fully served METRICS_CLIENT_TIMEOUT_MS after it
+ * connected is closed by a timer of the exporter.
+ */
+
+#define METRICS_DEFAULT_TOP 10
+#define METRICS_REQUEST_MAX 1024
+#define METRICS_CLIENT_TIMEOUT_MS 2000
+#define METRICS_REAP_INTERVAL_MS 500
+/* The listening socket and the timer take two more event loop handlers */
+#define METRICS_MAX_CLIENTS 8
+
+_Static_assert(METRICS_MAX_CLIENTS + 2 <= EVENT_LOOP_MAX_HANDLERS, "Not enough event loop handlers for the metrics");
+
+struct metrics_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct metrics_client {
+    int fd;
+    struct timespec deadline;
+    char request[METRICS_REQUEST_MAX];
+    size_t request_len;
+    /* Response being sent, NULL while the request is read */
+    char *resp;
+    size_t resp_len;
+    size_t resp_off;
+};
+
+struct metrics {
+    int listen_fd;
+    int reap_fd;
+    struct event_loop *el;
+    struct metrics_client clients[METRICS_MAX_CLIENTS];
+    int top_n;
+    /* Snapshot being rendered by the tick, and the one served */
+    struct metrics_buf next;
+    struct metrics_buf snap;
+};
+
+/* Counters of one IPv4 address, to use with metrics_ip_top */
+struct metrics_ip_entry {
+    __u32 addr;
+    __u64 packets;
+    __u64 bytes;
+};
+
+static bool metrics_enabled(const struct metrics *m) {
+    return m->listen_fd > 0;
+}
+
+static void metrics_appendf(struct metrics *m, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void metrics_appendf(struct metrics *m, const char *fmt, ...) {
+    struct metrics_buf *b = &m->next;
+    va_list ap;
+    int n;
+
+    while (true) {
+        va_start(ap, fmt);
+        n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+        va_end(ap);
+
+        if (n < 0)
+            return;
+        if (b->len + n < b->cap)
+            break;
+
+        size_t cap = (b->cap ? b->cap * 2 : 4096) + n;
+        char *tmp = realloc(b->data, cap);
+
+        if (!tmp)
+            return;
+        b->data = tmp;
+        b->cap = cap;
+    }
+
+    b->len += n;
+}
+
+/* Start a new snapshot, called by the tick before rendering the families */
+static void metrics_begin(struct metrics *m) {
+    m->next.len = 0;
+}
+
+static void metrics_family(struct metrics *m, const char *name, const char *type, const char *help) {
+    metrics_appendf(m, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* labels is the content of the braces, e.g. "queue=\"3\"", or NULL */
+static void metrics_u64(struct metrics *m, const char *name, const char *labels, __u64 value) {
+    if (labels)
+        metrics_appendf(m, "%s{%s} %llu\n", name, labels, (unsigned long long)value);
+    else
+        metrics_appendf(m, "%s %llu\n", name, (unsigned long long)value);
+}
+
+/* Publish the snapshot: the next scrapes get it */
+static void metrics_commit(struct metrics *m) {
+    struct metrics_buf tmp = m->snap;
+
+    m->snap = m->next;
+    m->next = tmp;
+}
+
+static int metrics_cmp_packets(const void *a, const void *b) {
+    const struct metrics_ip_entry *x = a, *y = b;
+
+    return x->packets < y->packets ? 1 : x->packets > y->packets ? -1 : 0;
+}
+
+/*
+ * Render <prefix>_packets_total and, when with_bytes, <prefix>_bytes_total
+ * for the top_n addresses by packets; the others are summed under
+ * ip="other". Sorts entries.
+ */
+static void metrics_ip_top(struct metrics *m, const char *prefix, const char *what,
+                           struct metrics_ip_entry *entries, size_t count, bool with_bytes) {
+    struct metrics_ip_entry other = {0};
+    size_t top = count < m->top_n ? count : m->top_n;
+    char name[128], help[128], labels[64];
+
+    qsort(entries, count, sizeof(*entries), metrics_cmp_packets);
+    for (size_t i = top; i < count; i++) {
+        other.packets += entries[i].packets;
+        other.bytes += entries[i].bytes;
+    }
+
+    for (int pass = 0; pass < (with_bytes ? 2 : 1); pass++) {
+        const char *unit = pass ? "bytes" : "packets";
+
+        snprintf(name, sizeof(name), "%s_%s_total", prefix, unit);
+        snprintf(help, sizeof(help), "%s of %s, top %d addresses", unit, what, m->top_n);
+        metrics_family(m, name, "counter", help);
+
+        for (size_t i = 0; i < top; i++) {
+            struct in_addr addr = {.s_addr = entries[i].addr};
+
+            snprintf(labels, sizeof(labels), "ip=\"%s\"", inet_ntoa(addr));
+            metrics_u64(m, name, labels, pass ? entries[i].bytes : entries[i].packets);
+        }
+
+        if (count > top)
+            metrics_u64(m, name, "ip=\"other\"", pass ? other.bytes : other.packets);
+    }
+}
+
+/*
+ * Read up to *count entries of a hash or array map with BPF_MAP_LOOKUP_BATCH,
+ * a few syscalls for the whole map instead of two per entry. values must hold
+ * value_size bytes per entry (per CPU for the per-CPU maps). On return *count
+ * is the number of entries read.
+ */
+static int metrics_map_dump(int map_fd, __u32 key_size, __u32 value_size, void *keys, void *values,
+                            __u32 *count) {
+    LIBBPF_OPTS(bpf_map_batch_opts, opts);
+    /* Opaque position in the map, the bucket for hash maps, a key for arrays */
+    __u64 batch[8];
+    __u32 total = 0;
+    int err = 0;
+
+    if (key_size > sizeof(batch))
+        return -EINVAL;
+
+    while (total < *count) {
+        __u32 n = *count - total;
+
+        err = bpf_map_lookup_batch(map_fd, total ? batch : NULL, batch, (char *)keys + total * key_size,
+                                   (char *)values + (size_t)total * value_size, &n, &opts);
+        total += n;
+        if (err) {
+            /* ENOENT: the end of the map was reached */
+            err = errno == ENOENT ? 0 : -errno;
+            break;
+        }
+    }
+
+    *count = total;
+    return err;
+}
+
+static void metrics_close_client(struct metrics *m, struct metrics_client *c) {
+    event_loop_del_fd(m->el, c->fd);
+    close(c->fd);
+    free(c->resp);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+/*
+ * Copy the snapshot in the response of the client: the next ticks can then
+ * publish new ones while it is being sent.
+ */
+static int metrics_build_response(struct metrics *m, struct metrics_client *c) {
+    bool found = strncmp(c->request, "GET /metrics", 12) == 0 && (c->request[12] == ' ' || c->request[12] == '?');
+    size_t body = found ? m->snap.len : 0;
+    char header[256];
+    int len;
+
+    if (found)
+        len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 200 OK\r\n"
+                       "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                       "Content-Length: %zu\r\n"
+                       "Connection: close\r\n\r\n",
+                       body);
+    else
+        len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 404 Not Found\r\n"
+                       "Content-Length: 0\r\n"
+                       "Connection: close\r\n\r\n");
+
+    c->resp = malloc(len + body);
+    if (!c->resp)
+        return -1;
+
+    memcpy(c->resp, header, len);
+    if (body)
+        memcpy(c->resp + len, m->snap.data, body);
+    c->resp_len = len + body;
+    c->resp_off = 0;
+
+    return 0;
+}
+
+/* Send what the socket takes; returns 1 once the whole response is sent */
+static int metrics_send_response(struct metrics *m, struct metrics_client *c) {
+    while (c->resp_off < c->resp_len) {
+        ssize_t n = send(c->fd, c->resp + c->resp_off, c->resp_len - c->resp_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return event_loop_watch_write(m->el, c->fd, true) ? -1 : 0;
+        if (n < 0)
+            return -1;
+
+        c->resp_off += n;
+    }
+
+    return 1;
+}
+
+/* One request per connection, answered as soon as its first line is there */
+static void metrics_on_client(void *ctx, int fd) {
+    struct metrics *m = ctx;
+    struct metrics_client *c = NULL;
+    ssize_t n;
+
+    for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        if (m->clients[i].fd == fd)
+            c = &m->clients[i];
+    }
+    if (!c)
+        return;
+
+    if (!c->resp) {
+        n = recv(fd, c->request + c->request_len, sizeof(c->request) - 1 - c->request_len, MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (n <= 0) {
+            metrics_close_client(m, c);
+            return;
+        }
+
+        c->request_len += n;
+        c->request[c->request_len] = '\0';
+        /* Partial request line, wait for the rest */
+        if (strchr(c->request, '\n') == NULL && c->request_len < sizeof(c->request) - 1)
+            return;
+
+        if (metrics_build_response(m, c)) {
+            metrics_close_client(m, c);
+            return;
+        }
+    }
+
+    if (metrics_send_response(m, c) != 0)
+        metrics_close_client(m, c);
+}
+
+static void metrics_on_accept(void *ctx, int fd) {
+    struct metrics *m = ctx;
+    struct metrics_client *c = NULL;
+    int client = accept(fd, NULL, NULL);
+
+    if (client < 0)
+        return;
+
+    /* A scraper that does not read must not stall the loop */
+    fcntl(client, F_SETFL, O_NONBLOCK);
+    fcntl(client, F_SETFD, FD_CLOEXEC);
+
+    for (int i = 0; i < METRICS_MAX_CLIENTS && !c; i++) {
+        if (m->clients[i].fd < 0)
+            c = &m->clients[i];
+    }
+
+    if (!c || event_loop_add_handler(m->el, client, metrics_on_client, m)) {
+        log_warn("Too many metrics connections, closing the new one");
+        close(client);
+        return;
+    }
+
+    c->fd = client;
+    clock_gettime(CLOCK_MONOTONIC, &c->deadline);
+    c->deadline.tv_sec += METRICS_CLIENT_TIMEOUT_MS / 1000;
+    c->deadline.tv_nsec += (METRICS_CLIENT_TIMEOUT_MS % 1000) * 1000000L;
+    if (c->deadline.tv_nsec >= 1000000000L) {
+        c->deadline.tv_sec++;
+        c->deadline.tv_nsec -= 1000000000L;
+    }
+}
+
+/* Close the clients that are still there after their deadline */
+static void metrics_on_reap(void *ctx, int fd) {
+    struct metrics *m = ctx;
+    struct timespec now;
+    __u64 expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        struct metrics_client *c = &m->clients[i];
+
+        if (c->fd >= 0 && event_loop_elapsed(&c->deadline, &now) > 0) {
+            log_debug("Closing the metrics client %d, not served in %d ms", c->fd, METRICS_CLIENT_TIMEOUT_MS);
+            metrics_close_client(m, c);
+        }
+    }
+}
+
+/* Serve 127.0.0.1:port/metrics from the event loop; port 0 disables it */
+static int metrics_init(struct metrics *m, struct event_loop *el, int port, int top_n) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int one = 1;
+
+    struct itimerspec its = {
+        .it_interval.tv_nsec = METRICS_REAP_INTERVAL_MS * 1000000L,
+        .it_value.tv_nsec = METRICS_REAP_INTERVAL_MS * 1000000L,
+    };
+
+    memset(m, 0, sizeof(*m));
+    m->listen_fd = m->reap_fd = -1;
+    for (int i = 0; i < METRICS_MAX_CLIENTS; i++)
+        m->clients[i].fd = -1;
+    m->el = el;
+    m->top_n = top_n > 0 ? top_n : METRICS_DEFAULT_TOP;
+
+    if (port == 0)
+        return 0;
+
+    if (port < 0 || port > 65535) {
+        log_error("Invalid metrics port %d", port);
+        return -1;
+    }
+
+    m->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m->listen_fd < 0) {
+        log_error("Error while creating the metrics socket: %s", strerror(errno));
+        return -1;
+    }
+
+    setsockopt(m->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(m->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(m->listen_fd, 16) ||
+        event_loop_add_handler(el, m->listen_fd, metrics_on_accept, m)) {
+        log_error("Error while listening on 127.0.0.1:%d: %s", port, strerror(errno));
+        close(m->listen_fd);
+        m->listen_fd = -1;
+        return -1;
+    }
+
+    m->reap_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (m->reap_fd < 0 || timerfd_settime(m->reap_fd, 0, &its, NULL) ||
+        event_loop_add_handler(el, m->reap_fd, metrics_on_reap, m)) {
+        log_error("Error while creating the metrics timer: %s", strerror(errno));
+        return -1;
+    }
+
+    log_info("Serving metrics on http://127.0.0.1:%d/metrics", port);
+    return 0;
+}
+
+static void metrics_destroy(struct metrics *m) {
+    for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        if (m->clients[i].fd > 0) {
+            close(m->clients[i].fd);
+            free(m->clients[i].resp);
+        }
+    }
+    if (m->reap_fd > 0)
+        close(m->reap_fd);
+    if (m->listen_fd > 0)
+        close(m->listen_fd);
+    free(m->next.data);
+    free(m->snap.data);
+}
+
+#endif // METRICS_H_
@@ -0,0 +1,143 @@
+#ifndef PIN_H_
+#define PIN_H_
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <errno.h>
+#include <limits.h>
+#include <linux/magic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/*
+ * Opt-in pinning of the maps in a bpffs directory (--pin-dir), for warm
+ * restarts.
+ *
+ * The first run creates the maps and pins them, the next ones find the pins
+ * and reuse the maps (libbpf does it at load time for the maps with a pin
+ * path), so that counters and configuration survive a restart or an upgrade.
+ * The .rodata/.bss/.data maps are never pinned: they belong to one build of
+ * the program. A pinned map whose definition changed makes the load fail;
+ * remove the directory to start from scratch.
+ */
+
+/*
+ * Set the pin path of the maps of obj, except the internal ones and the ones
+ * listed in skip (NULL terminated, may be NULL). Must be called before the
+ * load. Returns how many maps are already pinned, i.e. will be reused, or a
+ * negative value on error.
+ */
+static int pin_maps(struct bpf_object *obj, const char *dir, const char *const *skip) {
+    struct bpf_map *map;
+    struct statfs st;
+    char path[PATH_MAX];
+    int reused = 0;
+
+    if (mkdir(dir, 0700) && errno != EEXIST) {
+        log_error("Error while creating pin directory %s: %s", dir, strerror(errno));
+        return -1;
+    }
+
+    if (statfs(dir, &st) || st.f_type != BPF_FS_MAGIC) {
+        log_error("Pin directory %s is not on a bpffs mount (e.g. /sys/fs/bpf)", dir);
+        return -1;
+    }
+
+    bpf_object__for_each_map(map, obj) {
+        bool skipped = bpf_map__is_internal(map);
+
+        for (int i = 0; skip && skip[i] && !skipped; i++)
+            skipped = strcmp(bpf_map__name(map), skip[i]) == 0;
+        if (skipped)
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, bpf_map__name(map));
+        if (bpf_map__set_pin_path(map, path)) {
+            log_error("Error while setting the pin path of map %s", bpf_map__name(map));
+            return -1;
+        }
+
+        if (access(path, F_OK) == 0) {
+            log_info("Reusing pinned map %s", path);
+            reused++;
+        }
+    }
+
+    return reused;
+}
+
+/*
+ * Delete the entries of a reused map for which keep() returns false, i.e. the
+ * ones that are no longer in the configuration. The keys are collected first,
+ * deleting while walking a hash map would restart the walk.
+ */
+static int pin_prune_map(struct bpf_map *map, bool (*keep)(const void *key, void *ctx), void *ctx) {
+    __u32 key_size = bpf_map__key_size(map);
+    int fd = bpf_map__fd(map);
+    char *keys = NULL, *prev = NULL;
+    size_t count = 0, cap = 0;
+    char key[key_size], prev_key[key_size];
+    int err = 0;
+
+    while (bpf_map_get_next_key(fd, prev, key) == 0) {
+        if (!keep(key, ctx)) {
+            if (count == cap) {
+                char *tmp;
+
+                cap = cap ? cap * 2 : 64;
+                tmp = realloc(keys, cap * key_size);
+                if (!tmp) {
+                    err = -ENOMEM;
+                    goto out;
+                }
+                keys = tmp;
+            }
+            memcpy(keys + count * key_size, key, key_size);
+            count++;
+        }
+
+        memcpy(prev_key, key, key_size);
+        prev = prev_key;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        bpf_map_delete_elem(fd, keys + i * key_size);
+
+    if (count)
+        log_info("Removed %zu stale entries from map %s", count, bpf_map__name(map));
+
+out:
+    free(keys);
+    return err;
+}
+
+/* Sorted set of 32-bit keys (e.g. IPv4 addresses), to use with pin_prune_map */
+struct pin_u32_set {
+    __u32 *keys;
+    size_t count;
+};
+
+static int pin_u32_cmp(const void *a, const void *b) {
+    __u32 x = *(const __u32 *)a, y = *(const __u32 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void pin_u32_set_sort(struct pin_u32_set *set) {
+    qsort(set->keys, set->count, sizeof(__u32), pin_u32_cmp);
+}
+
+static bool pin_u32_set_has(const void *key, void *ctx) {
+    struct pin_u32_set *set = ctx;
+
+    return bsearch(key, set->keys, set->count, sizeof(__u32), pin_u32_cmp) != NULL;
+}
+
+#endif // PIN_H_
@@ -0,0 +1,132 @@
+#ifndef PROG_STATS_H_
+#define PROG_STATS_H_
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "metrics.h"
+
+/*
+ * Average cost of the loaded programs, from the run-time statistics of the
+ * kernel (run_time_ns and run_cnt of bpf_prog_info).
+ *
+ * The kernel only collects them while a BPF_ENABLE_STATS fd is open or the
+ * kernel.bpf_stats_enabled sysctl is set; collecting them adds two
+ * bpf_ktime_get_ns() per run, a few tens of ns. The fd is held from
+ * prog_stats_init to prog_stats_destroy.
+ */
+
+#define PROG_STATS_MAX_PROGS 16
+
+struct prog_stats_entry {
+    const char *name;
+    int fd;
+    __u64 run_time_ns;
+    __u64 run_cnt;
+};
+
+struct prog_stats {
+    int stats_fd;
+    int count;
+    struct prog_stats_entry progs[PROG_STATS_MAX_PROGS];
+};
+
+static int prog_stats_read(const struct prog_stats_entry *p, __u64 *run_time_ns, __u64 *run_cnt) {
+    struct bpf_prog_info info = {0};
+    __u32 len = sizeof(info);
+
+    if (bpf_prog_get_info_by_fd(p->fd, &info, &len))
+        return -errno;
+
+    *run_time_ns = info.run_time_ns;
+    *run_cnt = info.run_cnt;
+    return 0;
+}
+
+/* Track a loaded program, prog_stats_init does it for a whole object */
+static int prog_stats_add(struct prog_stats *ps, const char *name, int prog_fd) {
+    struct prog_stats_entry *p;
+
+    if (ps->count == PROG_STATS_MAX_PROGS) {
+        log_warn("Too many programs, no run-time statistics for %s", name);
+        return -1;
+    }
+
+    p = &ps->progs[ps->count];
+    p->name = name;
+    p->fd = prog_fd;
+    if (prog_stats_read(p, &p->run_time_ns, &p->run_cnt))
+        return -1;
+
+    ps->count++;
+    return 0;
+}
+
+/* Turn on the run-time statistics and track the loaded programs of obj (may be NULL) */
+static void prog_stats_init(struct prog_stats *ps, struct bpf_object *obj) {
+    struct bpf_program *prog;
+
+    memset(ps, 0, sizeof(*ps));
+
+    ps->stats_fd = bpf_enable_stats(BPF_STATS_RUN_TIME);
+    if (ps->stats_fd < 0)
+        log_warn("Could not enable the BPF run-time statistics (%s), ns/run needs kernel.bpf_stats_enabled=1",
+                 strerror(errno));
+
+    if (!obj)
+        return;
+
+    bpf_object__for_each_program(prog, obj) {
+        if (bpf_program__fd(prog) >= 0)
+            prog_stats_add(ps, bpf_program__name(prog), bpf_program__fd(prog));
+    }
+}
+
+/* Average ns per run of each program since the previous call */
+static void prog_stats_print(struct prog_stats *ps, double elapsed) {
+    for (int i = 0; i < ps->count; i++) {
+        struct prog_stats_entry *p = &ps->progs[i];
+        __u64 run_time_ns, run_cnt;
+
+        if (prog_stats_read(p, &run_time_ns, &run_cnt))
+            continue;
+
+        if (run_cnt != p->run_cnt)
+            log_info("%s: %.1f ns/run, %.0f runs/s", p->name,
+                     (double)(run_time_ns - p->run_time_ns) / (run_cnt - p->run_cnt),
+                     (run_cnt - p->run_cnt) / elapsed);
+
+        p->run_time_ns = run_time_ns;
+        p->run_cnt = run_cnt;
+    }
+}
+
+/* Render the counters last read by prog_stats_print */
+static void prog_stats_render_metrics(struct metrics *m, const struct prog_stats *ps) {
+    char labels[64];
+
+    metrics_family(m, "bpf_prog_run_time_ns_total", "counter", "Time spent in the BPF program, from the kernel run-time statistics");
+    for (int i = 0; i < ps->count; i++) {
+        snprintf(labels, sizeof(labels), "prog=\"%s\"", ps->progs[i].name);
+        metrics_u64(m, "bpf_prog_run_time_ns_total", labels, ps->progs[i].run_time_ns);
+    }
+
+    metrics_family(m, "bpf_prog_runs_total", "counter", "Runs of the BPF program, from the kernel run-time statistics");
+    for (int i = 0; i < ps->count; i++) {
+        snprintf(labels, sizeof(labels), "prog=\"%s\"", ps->progs[i].name);
+        metrics_u64(m, "bpf_prog_runs_total", labels, ps->progs[i].run_cnt);
+    }
+}
+
+static void prog_stats_destroy(struct prog_stats *ps) {
+    if (ps->stats_fd > 0)
+        close(ps->stats_fd);
+    ps->stats_fd = -1;
+}
+
+#endif // PROG_STATS_H_
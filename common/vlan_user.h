@@ -0,0 +1,292 @@
+#ifndef VLAN_USER_H_
+#define VLAN_USER_H_
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <cyaml/cyaml.h>
+#include <errno.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+#include <net/if.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "pin.h"
+#include "ebpf/vlan_types.h"
+
+static const char *const vlan_action_names[] = {"process", "drop", "pass"};
+
+/* Entry of the optional "vlans" section of the YAML configuration */
+struct vlan_rule {
+    uint32_t outer;
+    uint32_t inner;
+    const char *action;
+};
+
+static const cyaml_schema_field_t vlan_rule_field_schema[] = {
+    CYAML_FIELD_UINT("outer", CYAML_FLAG_DEFAULT, struct vlan_rule, outer),
+    CYAML_FIELD_UINT("inner", CYAML_FLAG_OPTIONAL, struct vlan_rule, inner),
+    CYAML_FIELD_STRING_PTR("action", CYAML_FLAG_POINTER, struct vlan_rule, action, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_END
+};
+
+static const cyaml_schema_value_t vlan_rule_schema = {
+    CYAML_VALUE_MAPPING(CYAML_FLAG_DEFAULT, struct vlan_rule, vlan_rule_field_schema),
+};
+
+static int vlan_load_rules(struct bpf_map *policy, const struct vlan_rule *rules, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++) {
+        struct vlan_key key = {.outer_vid = rules[i].outer, .inner_vid = rules[i].inner};
+        __u32 action;
+
+        for (action = 0; action < sizeof(vlan_action_names) / sizeof(vlan_action_names[0]); action++) {
+            if (strcmp(rules[i].action, vlan_action_names[action]) == 0)
+                break;
+        }
+
+        if (action == sizeof(vlan_action_names) / sizeof(vlan_action_names[0]) ||
+            rules[i].outer > 4095 || rules[i].inner > 4095) {
+            log_error("Invalid VLAN rule %u/%u %s", rules[i].outer, rules[i].inner, rules[i].action);
+            return -1;
+        }
+
+        if (bpf_map__update_elem(policy, &key, sizeof(key), &action, sizeof(action), BPF_ANY)) {
+            log_error("Failed to update the VLAN policy map: %s", strerror(errno));
+            return -1;
+        }
+
+        log_info("VLAN %u/%u: %s", key.outer_vid, key.inner_vid, vlan_action_names[action]);
+    }
+
+    return 0;
+}
+
+struct vlan_rules {
+    const struct vlan_rule *rules;
+    uint64_t count;
+};
+
+static bool vlan_rules_have(const void *key, void *ctx) {
+    const struct vlan_key *k = key;
+    struct vlan_rules *r = ctx;
+
+    for (uint64_t i = 0; i < r->count; i++) {
+        if (r->rules[i].outer == k->outer_vid && r->rules[i].inner == k->inner_vid)
+            return true;
+    }
+
+    return false;
+}
+
+/* Remove the rules of a reused policy map that are no longer configured */
+static int vlan_prune_rules(struct bpf_map *policy, const struct vlan_rule *rules, uint64_t count) {
+    struct vlan_rules r = {.rules = rules, .count = count};
+
+    return pin_prune_map(policy, vlan_rules_have, &r);
+}
+
+/* Counters of the previous tick sorted by key, for the rates of vlan_print_stats */
+struct vlan_stats_prev {
+    struct vlan_key *keys;
+    struct vlan_stats *stats;
+    __u32 count;
+};
+
+static int vlan_key_cmp(const void *a, const void *b) {
+    const struct vlan_key *ka = a, *kb = b;
+    __u32 va = (__u32)ka->outer_vid << 16 | ka->inner_vid;
+    __u32 vb = (__u32)kb->outer_vid << 16 | kb->inner_vid;
+
+    return va < vb ? -1 : va > vb;
+}
+
+/* Sort keys and their counters together */
+static void vlan_stats_sort(struct vlan_key *keys, struct vlan_stats *stats, __u32 count) {
+    struct {
+        struct vlan_key key;
+        struct vlan_stats stats;
+    } *pairs = calloc(count, sizeof(*pairs));
+
+    if (!pairs)
+        return;
+
+    for (__u32 i = 0; i < count; i++) {
+        pairs[i].key = keys[i];
+        pairs[i].stats = stats[i];
+    }
+    /* The key is the first member */
+    qsort(pairs, count, sizeof(*pairs), vlan_key_cmp);
+    for (__u32 i = 0; i < count; i++) {
+        keys[i] = pairs[i].key;
+        stats[i] = pairs[i].stats;
+    }
+
+    free(pairs);
+}
+
+/* Print the rates of the VLANs that had traffic since the previous tick */
+static void vlan_print_stats(struct vlan_stats_prev *prev, int map_fd, double elapsed) {
+    int cpus = libbpf_num_possible_cpus();
+    struct vlan_stats values[cpus];
+    struct vlan_key key, next_key;
+    struct vlan_key *prev_key = NULL;
+    struct vlan_key *keys = NULL;
+    struct vlan_stats *stats = NULL;
+    __u32 count = 0, cap = 0;
+
+    while (bpf_map_get_next_key(map_fd, prev_key, &next_key) == 0) {
+        struct vlan_stats sum = {0};
+
+        key = next_key;
+        prev_key = &key;
+
+        if (bpf_map_lookup_elem(map_fd, &key, values))
+            continue;
+
+        for (int i = 0; i < cpus; i++) {
+            sum.rx_packets += values[i].rx_packets;
+            sum.rx_bytes += values[i].rx_bytes;
+            sum.dropped += values[i].dropped;
+        }
+
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            keys = realloc(keys, cap * sizeof(*keys));
+            stats = realloc(stats, cap * sizeof(*stats));
+            if (!keys || !stats) {
+                log_error("Failed to allocate the VLAN counters");
+                free(keys);
+                free(stats);
+                return;
+            }
+        }
+        keys[count] = key;
+        stats[count++] = sum;
+    }
+
+    vlan_stats_sort(keys, stats, count);
+
+    for (__u32 i = 0; i < count; i++) {
+        const struct vlan_key *found = NULL;
+        struct vlan_stats last = {0};
+
+        if (prev->count)
+            found = bsearch(&keys[i], prev->keys, prev->count, sizeof(*keys), vlan_key_cmp);
+        /* A counter below the previous one belongs to a new map */
+        if (found && prev->stats[found - prev->keys].rx_packets <= stats[i].rx_packets)
+            last = prev->stats[found - prev->keys];
+
+        if (stats[i].rx_packets == last.rx_packets)
+            continue;
+
+        log_info("VLAN %4u/%-4u: %10.0f pkt/s %12.0f byte/s %10.0f dropped/s", keys[i].outer_vid,
+                 keys[i].inner_vid, (stats[i].rx_packets - last.rx_packets) / elapsed,
+                 (stats[i].rx_bytes - last.rx_bytes) / elapsed, (stats[i].dropped - last.dropped) / elapsed);
+    }
+
+    free(prev->keys);
+    free(prev->stats);
+    prev->keys = keys;
+    prev->stats = stats;
+    prev->count = count;
+}
+
+static void vlan_stats_prev_free(struct vlan_stats_prev *prev) {
+    free(prev->keys);
+    free(prev->stats);
+    memset(prev, 0, sizeof(*prev));
+}
+
+/*
+ * Whether the NIC strips the VLAN tags of ifname (rx-vlan-offload, 802.1Q or
+ * 802.1ad), from the features reported by ethtool. -1 when unknown.
+ */
+static int vlan_rx_offload(const char *ifname) {
+    static const char *const features[] = {"rx-vlan-hw-parse", "rx-vlan-stag-hw-parse"};
+    struct {
+        struct ethtool_sset_info hdr;
+        __u32 len;
+    } sset = {.hdr = {.cmd = ETHTOOL_GSSET_INFO, .sset_mask = 1ULL << ETH_SS_FEATURES}};
+    struct ethtool_gstrings *strings = NULL;
+    struct ethtool_gfeatures *gfeatures = NULL;
+    struct ifreq ifr = {0};
+    __u32 count, blocks;
+    int fd, ret = -1;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return -1;
+
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+    ifr.ifr_data = (void *)&sset;
+    if (ioctl(fd, SIOCETHTOOL, &ifr) || !sset.hdr.sset_mask)
+        goto out;
+
+    count = sset.len;
+    blocks = (count + 31) / 32;
+    strings = calloc(1, sizeof(*strings) + count * ETH_GSTRING_LEN);
+    gfeatures = calloc(1, sizeof(*gfeatures) + blocks * sizeof(gfeatures->features[0]));
+    if (!strings || !gfeatures)
+        goto out;
+
+    strings->cmd = ETHTOOL_GSTRINGS;
+    strings->string_set = ETH_SS_FEATURES;
+    strings->len = count;
+    ifr.ifr_data = (void *)strings;
+    if (ioctl(fd, SIOCETHTOOL, &ifr))
+        goto out;
+
+    gfeatures->cmd = ETHTOOL_GFEATURES;
+    gfeatures->size = blocks;
+    ifr.ifr_data = (void *)gfeatures;
+    if (ioctl(fd, SIOCETHTOOL, &ifr))
+        goto out;
+
+    ret = 0;
+    for (__u32 i = 0; i < count; i++) {
+        const char *name = (const char *)strings->data + i * ETH_GSTRING_LEN;
+
+        for (int j = 0; j < sizeof(features) / sizeof(features[0]); j++) {
+            if (strncmp(name, features[j], ETH_GSTRING_LEN) == 0 &&
+                (gfeatures->features[i / 32].active & (1U << (i % 32))))
+                ret = 1;
+        }
+    }
+
+out:
+    free(strings);
+    free(gfeatures);
+    close(fd);
+    return ret;
+}
+
+/*
+ * The programs read the tags from the frame, so a NIC that strips them hides
+ * the VLAN of its frames: they are counted as untagged and escape the
+ * per-VLAN policy. Refuse such an interface when the policy has rules, warn
+ * otherwise.
+ */
+static int vlan_check_offload(const char *ifname, struct bpf_map *policy) {
+    struct vlan_key key;
+    bool has_rules = bpf_map_get_next_key(bpf_map__fd(policy), NULL, &key) == 0;
+
+    if (vlan_rx_offload(ifname) != 1)
+        return 0;
+
+    if (has_rules) {
+        log_fatal("%s strips the VLAN tags (rx-vlan-offload), the VLAN policy would not apply to its frames. "
+                  "Turn it off with: ethtool -K %s rxvlan off", ifname, ifname);
+        return -1;
+    }
+
+    log_warn("%s strips the VLAN tags (rx-vlan-offload), its tagged frames are counted as untagged. "
+             "Turn it off with: ethtool -K %s rxvlan off", ifname, ifname);
+    return 0;
+}
+
+#endif // VLAN_USER_H_
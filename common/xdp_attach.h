@@ -0,0 +1,462 @@
+#ifndef XDP_ATTACH_H_
+#define XDP_ATTACH_H_
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <errno.h>
+#include <limits.h>
+#include <linux/if_link.h>
+#include <net/if.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/*
+ * XDP attachment shared by all the programs.
+ *
+ * Programs are attached through a bpf_link (BPF_LINK_CREATE), so that they
+ * are detached when the process exits, even if it crashes, and so that a new
+ * program can replace the running one atomically with bpf_link_update: no
+ * packet ever goes through the interface without a program. The netlink
+ * attachment is kept for the loaders that must leave the program attached
+ * after they exit; the replacement is atomic there too (XDP_FLAGS_REPLACE).
+ *
+ * The program is attached in the requested mode and, when the driver does
+ * not support it, in the next slower one: hw, then drv, then skb.
+ *
+ * With a pin directory the links are pinned there as link_<iface>: the
+ * program stays attached when the process exits, and the next run takes the
+ * pinned link back and swaps its own program in with bpf_link_update, so the
+ * interface is never left without a program across a restart. Removing the
+ * pin detaches the program.
+ */
+
+#define XDP_ATTACH_MAX_IFACES 16
+
+/* drv is the default, so that a zeroed struct xdp_attach is ready to use */
+enum xdp_attach_mode {
+    XDP_ATTACH_MODE_DRV = 0,
+    XDP_ATTACH_MODE_SKB,
+    XDP_ATTACH_MODE_HW,
+    XDP_ATTACH_MODE_MAX,
+};
+
+static const char *const xdp_attach_mode_names[XDP_ATTACH_MODE_MAX] = {"drv", "skb", "hw"};
+static const __u32 xdp_attach_mode_flags[XDP_ATTACH_MODE_MAX] = {
+    XDP_FLAGS_DRV_MODE,
+    XDP_FLAGS_SKB_MODE,
+    XDP_FLAGS_HW_MODE,
+};
+/* Mode to fall back to when one is not supported */
+static const enum xdp_attach_mode xdp_attach_mode_next[XDP_ATTACH_MODE_MAX] = {
+    XDP_ATTACH_MODE_SKB,
+    XDP_ATTACH_MODE_MAX,
+    XDP_ATTACH_MODE_DRV,
+};
+
+struct xdp_iface {
+    char name[IF_NAMESIZE];
+    int ifindex;
+    bool attached;
+    int link_fd;  /* Only for bpf_link attachments */
+    __u32 prog_id;
+    enum xdp_attach_mode mode; /* Mode actually in use */
+    /* The link was pinned by a previous run, old_prog_fd is the program it had */
+    bool reused;
+    int old_prog_fd;
+};
+
+struct xdp_attach {
+    struct xdp_iface ifaces[XDP_ATTACH_MAX_IFACES];
+    int count;
+    enum xdp_attach_mode mode;
+    /* Attach through netlink, the programs survive the process */
+    bool netlink;
+    /* bpffs directory where the links are pinned, NULL to not pin them */
+    const char *pin_dir;
+};
+
+static void xdp_attach_init(struct xdp_attach *xa, enum xdp_attach_mode mode, bool netlink) {
+    memset(xa, 0, sizeof(*xa));
+    xa->mode = mode;
+    xa->netlink = netlink;
+}
+
+/* NULL selects the default mode (drv) */
+static int xdp_attach_parse_mode(const char *str, enum xdp_attach_mode *mode) {
+    if (str == NULL) {
+        *mode = XDP_ATTACH_MODE_DRV;
+        return 0;
+    }
+
+    for (int i = 0; i < XDP_ATTACH_MODE_MAX; i++) {
+        if (strcmp(str, xdp_attach_mode_names[i]) == 0) {
+            *mode = i;
+            return 0;
+        }
+    }
+
+    log_error("Invalid XDP mode %s, expected skb, drv or hw", str);
+    return -1;
+}
+
+/*
+ * Add an interface, using default_name when name is NULL. Returns its ifindex,
+ * or a negative value on error.
+ */
+static int xdp_attach_add_iface(struct xdp_attach *xa, const char *name, const char *default_name) {
+    struct xdp_iface *iface;
+
+    if (xa->count == XDP_ATTACH_MAX_IFACES) {
+        log_error("Too many interfaces, at most %d are supported", XDP_ATTACH_MAX_IFACES);
+        return -1;
+    }
+
+    if (name == NULL) {
+        if (default_name == NULL) {
+            log_error("Error, you must specify the interface where to attach the XDP program");
+            return -1;
+        }
+        log_warn("No interface specified, using default one (%s)", default_name);
+        name = default_name;
+    }
+
+    log_info("XDP program will be attached to %s interface", name);
+
+    iface = &xa->ifaces[xa->count];
+    memset(iface, 0, sizeof(*iface));
+    snprintf(iface->name, sizeof(iface->name), "%s", name);
+    iface->ifindex = if_nametoindex(name);
+    if (!iface->ifindex) {
+        log_fatal("Error while retrieving the ifindex of %s", name);
+        return -1;
+    }
+
+    log_info("Got ifindex for iface: %s, which is %d", name, iface->ifindex);
+    xa->count++;
+
+    return iface->ifindex;
+}
+
+static __u32 xdp_attach_prog_id(int prog_fd) {
+    struct bpf_prog_info info = {};
+    __u32 len = sizeof(info);
+
+    if (bpf_prog_get_info_by_fd(prog_fd, &info, &len))
+        return 0;
+
+    return info.id;
+}
+
+static int xdp_attach_one(struct xdp_attach *xa, struct xdp_iface *iface, int prog_fd,
+                          enum xdp_attach_mode mode) {
+    __u32 flags = xdp_attach_mode_flags[mode];
+    int fd;
+
+    if (xa->netlink) {
+        /* Never overwrite a program attached by somebody else */
+        return bpf_xdp_attach(iface->ifindex, prog_fd, flags | XDP_FLAGS_UPDATE_IF_NOEXIST, NULL);
+    }
+
+    LIBBPF_OPTS(bpf_link_create_opts, opts, .flags = flags);
+    fd = bpf_link_create(prog_fd, iface->ifindex, BPF_XDP, &opts);
+    if (fd < 0)
+        return fd;
+
+    iface->link_fd = fd;
+    return 0;
+}
+
+/* Mode in which the kernel runs prog_id on ifindex */
+static int xdp_attach_query_mode(int ifindex, __u32 prog_id, enum xdp_attach_mode *mode) {
+    LIBBPF_OPTS(bpf_xdp_query_opts, opts);
+    int err;
+
+    err = bpf_xdp_query(ifindex, 0, &opts);
+    if (err)
+        return err;
+
+    if (opts.drv_prog_id == prog_id)
+        *mode = XDP_ATTACH_MODE_DRV;
+    else if (opts.skb_prog_id == prog_id)
+        *mode = XDP_ATTACH_MODE_SKB;
+    else if (opts.hw_prog_id == prog_id)
+        *mode = XDP_ATTACH_MODE_HW;
+    else
+        return -ENOENT;
+
+    return 0;
+}
+
+/* Drop the program a reused link had, once it is no longer needed to roll back */
+static void xdp_attach_release_old_prog(struct xdp_iface *iface) {
+    if (!iface->reused)
+        return;
+
+    close(iface->old_prog_fd);
+    iface->reused = false;
+}
+
+static void xdp_attach_link_path(struct xdp_attach *xa, struct xdp_iface *iface, char *path, size_t len) {
+    snprintf(path, len, "%s/link_%s", xa->pin_dir, iface->name);
+}
+
+/*
+ * Take back the link pinned by a previous run and replace its program. The
+ * previous program is held until the attachment is complete, the link being
+ * its only reference once its process is gone. Returns 1 when there is no
+ * pinned link.
+ */
+static int xdp_attach_reuse_link(struct xdp_attach *xa, struct xdp_iface *iface, int prog_fd) {
+    struct bpf_link_info info = {};
+    __u32 len = sizeof(info);
+    char path[PATH_MAX];
+    int fd, old_fd, err;
+
+    xdp_attach_link_path(xa, iface, path, sizeof(path));
+    fd = bpf_obj_get(path);
+    if (fd < 0)
+        return errno == ENOENT ? 1 : -errno;
+
+    if (bpf_link_get_info_by_fd(fd, &info, &len) || info.type != BPF_LINK_TYPE_XDP ||
+        info.xdp.ifindex != iface->ifindex) {
+        log_error("Pinned link %s does not belong to %s, remove it", path, iface->name);
+        close(fd);
+        return -EINVAL;
+    }
+
+    old_fd = bpf_prog_get_fd_by_id(info.prog_id);
+    if (old_fd < 0) {
+        err = -errno;
+        log_error("Error while getting the program of the pinned link %s: %s", path, strerror(errno));
+        close(fd);
+        return err;
+    }
+
+    err = bpf_link_update(fd, prog_fd, NULL);
+    if (err) {
+        close(old_fd);
+        close(fd);
+        return err;
+    }
+
+    iface->link_fd = fd;
+    iface->reused = true;
+    iface->old_prog_fd = old_fd;
+    iface->prog_id = xdp_attach_prog_id(prog_fd);
+
+    /* The mode was chosen by the run that created the link */
+    if (xdp_attach_query_mode(iface->ifindex, iface->prog_id, &iface->mode)) {
+        log_warn("Could not read the XDP mode of %s, assuming %s", iface->name, xdp_attach_mode_names[xa->mode]);
+        iface->mode = xa->mode;
+    }
+
+    log_info("Reusing pinned link %s, XDP program attached to %s in %s mode", path, iface->name,
+             xdp_attach_mode_names[iface->mode]);
+    return 0;
+}
+
+static int xdp_attach_pin_link(struct xdp_attach *xa, struct xdp_iface *iface) {
+    char path[PATH_MAX];
+
+    xdp_attach_link_path(xa, iface, path, sizeof(path));
+    if (bpf_obj_pin(iface->link_fd, path)) {
+        log_error("Error while pinning the link of %s to %s: %s", iface->name, path, strerror(errno));
+        return -errno;
+    }
+
+    return 0;
+}
+
+/* Attach prog_fd to the idx-th interface, falling back to the slower modes */
+static int xdp_attach_iface(struct xdp_attach *xa, int idx, int prog_fd) {
+    struct xdp_iface *iface = &xa->ifaces[idx];
+    int err = -EINVAL;
+
+    if (iface->attached) {
+        log_error("Interface %s already has a program attached", iface->name);
+        return -EBUSY;
+    }
+
+    if (xa->pin_dir && !xa->netlink) {
+        err = xdp_attach_reuse_link(xa, iface, prog_fd);
+        if (err <= 0) {
+            if (err)
+                goto err;
+            iface->attached = true;
+            return 0;
+        }
+    }
+
+    for (enum xdp_attach_mode mode = xa->mode; mode != XDP_ATTACH_MODE_MAX;
+         mode = xdp_attach_mode_next[mode]) {
+        err = xdp_attach_one(xa, iface, prog_fd, mode);
+        if (!err && xa->pin_dir && !xa->netlink) {
+            err = xdp_attach_pin_link(xa, iface);
+            if (err) {
+                close(iface->link_fd);
+                goto err;
+            }
+        }
+        if (!err) {
+            iface->attached = true;
+            iface->mode = mode;
+            iface->prog_id = xdp_attach_prog_id(prog_fd);
+            log_info("XDP program attached to %s in %s mode%s", iface->name, xdp_attach_mode_names[mode],
+                     xa->netlink ? " (netlink)" : "");
+            return 0;
+        }
+
+        /* Only an unsupported mode is worth another try */
+        if (err != -EOPNOTSUPP && err != -EINVAL)
+            break;
+
+        if (xdp_attach_mode_next[mode] != XDP_ATTACH_MODE_MAX)
+            log_warn("%s mode not supported on %s, trying %s mode", xdp_attach_mode_names[mode],
+                     iface->name, xdp_attach_mode_names[xdp_attach_mode_next[mode]]);
+    }
+
+err:
+    log_fatal("Error while attaching XDP program to %s: %s", iface->name, strerror(-err));
+    return err;
+}
+
+/*
+ * Replace the program of the idx-th interface. The swap is atomic: every
+ * packet is processed either by the old or by the new program.
+ */
+static int xdp_attach_replace(struct xdp_attach *xa, int idx, int prog_fd) {
+    struct xdp_iface *iface = &xa->ifaces[idx];
+    int err;
+
+    if (!iface->attached)
+        return xdp_attach_iface(xa, idx, prog_fd);
+
+    if (xa->netlink) {
+        int old_fd = bpf_prog_get_fd_by_id(iface->prog_id);
+
+        if (old_fd < 0) {
+            log_error("Error while getting the program attached to %s: %s", iface->name,
+                      strerror(errno));
+            return old_fd;
+        }
+
+        LIBBPF_OPTS(bpf_xdp_attach_opts, opts, .old_prog_fd = old_fd);
+        err = bpf_xdp_attach(iface->ifindex, prog_fd,
+                             xdp_attach_mode_flags[iface->mode] | XDP_FLAGS_REPLACE, &opts);
+        close(old_fd);
+    } else {
+        err = bpf_link_update(iface->link_fd, prog_fd, NULL);
+    }
+
+    if (err) {
+        log_error("Error while replacing the XDP program of %s: %s", iface->name, strerror(-err));
+        return err;
+    }
+
+    iface->prog_id = xdp_attach_prog_id(prog_fd);
+    log_info("XDP program of %s replaced", iface->name);
+
+    return 0;
+}
+
+/*
+ * Detach the program of the idx-th interface. With keep_pinned, as on a normal
+ * shutdown, a pinned link stays in bpffs and its program stays attached.
+ */
+static void xdp_attach_detach_iface(struct xdp_attach *xa, int idx, bool keep_pinned) {
+    struct xdp_iface *iface = &xa->ifaces[idx];
+    __u32 curr_prog_id = 0;
+
+    if (!iface->attached)
+        return;
+
+    xdp_attach_release_old_prog(iface);
+
+    if (!xa->netlink) {
+        if (xa->pin_dir && !keep_pinned) {
+            char path[PATH_MAX];
+
+            xdp_attach_link_path(xa, iface, path, sizeof(path));
+            if (unlink(path))
+                log_error("Error while unpinning %s: %s", path, strerror(errno));
+        }
+
+        /* Closing the last reference to the link detaches the program */
+        close(iface->link_fd);
+        if (xa->pin_dir && keep_pinned) {
+            iface->attached = false;
+            log_info("XDP program left attached to %s, its link is pinned in %s", iface->name, xa->pin_dir);
+            return;
+        }
+    } else if (!bpf_xdp_query_id(iface->ifindex, xdp_attach_mode_flags[iface->mode], &curr_prog_id) &&
+               curr_prog_id == iface->prog_id) {
+        bpf_xdp_detach(iface->ifindex, xdp_attach_mode_flags[iface->mode], NULL);
+    }
+
+    iface->attached = false;
+    log_trace("Detached XDP program from interface %d", iface->ifindex);
+}
+
+/*
+ * Undo the attachment of the idx-th interface after a failure on another
+ * one. A reused link gets its previous program back and stays pinned, so a
+ * failed restart leaves the interface filtered as before. A link created by
+ * this run is unpinned too, or its program would stay attached.
+ */
+static void xdp_attach_rollback_iface(struct xdp_attach *xa, int idx) {
+    struct xdp_iface *iface = &xa->ifaces[idx];
+    int err;
+
+    if (!iface->reused) {
+        xdp_attach_detach_iface(xa, idx, false);
+        return;
+    }
+
+    err = bpf_link_update(iface->link_fd, iface->old_prog_fd, NULL);
+    if (err)
+        log_error("Error while restoring the previous XDP program of %s: %s", iface->name, strerror(-err));
+    else
+        log_info("Previous XDP program of %s restored", iface->name);
+
+    xdp_attach_detach_iface(xa, idx, true);
+}
+
+/* Attach the same program to every interface, all or nothing */
+static int xdp_attach_all(struct xdp_attach *xa, int prog_fd) {
+    for (int i = 0; i < xa->count; i++) {
+        int err = xdp_attach_iface(xa, i, prog_fd);
+
+        if (err) {
+            while (--i >= 0)
+                xdp_attach_rollback_iface(xa, i);
+            return err;
+        }
+    }
+
+    for (int i = 0; i < xa->count; i++)
+        xdp_attach_release_old_prog(&xa->ifaces[i]);
+
+    return 0;
+}
+
+static int xdp_attach_replace_all(struct xdp_attach *xa, int prog_fd) {
+    for (int i = 0; i < xa->count; i++) {
+        int err = xdp_attach_replace(xa, i, prog_fd);
+
+        if (err)
+            return err;
+    }
+
+    return 0;
+}
+
+static void xdp_attach_detach_all(struct xdp_attach *xa) {
+    for (int i = 0; i < xa->count; i++)
+        xdp_attach_detach_iface(xa, i, true);
+}
+
+#endif // XDP_ATTACH_H_
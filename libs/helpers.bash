@@ -0,0 +1,41 @@
+#!/bin/bash
+# Topology helpers shared by the create-topo.sh scripts and bench/e2e.
+#
+# create_veth N creates the namespaces ns1..nsN and, for each i, the veth pair
+# veth<i> (root namespace, where the XDP program under test is attached) and
+# veth<i>_ (in ns<i>, address 10.0.0.<i>/24).
+
+function create_veth {
+  local n=$1
+
+  for i in $(seq 1 "$n"); do
+    sudo ip netns add ns$i
+    sudo ip link add veth$i type veth peer name veth${i}_
+    sudo ip link set veth${i}_ netns ns$i
+    sudo ip netns exec ns$i ip link set dev lo up
+    sudo ip netns exec ns$i ip addr add 10.0.0.$i/24 dev veth${i}_
+    sudo ip netns exec ns$i ip link set dev veth${i}_ up
+    sudo ip link set dev veth$i up
+  done
+}
+
+function delete_veth {
+  local n=$1
+
+  for i in $(seq 1 "$n"); do
+    # Deleting the namespace deletes veth<i>_ and its peer
+    sudo ip link del veth$i 2>/dev/null
+    sudo ip netns del ns$i 2>/dev/null
+  done
+}
+
+# MAC address of an interface, in the root namespace or in the given one
+function iface_mac {
+  local iface=$1 ns=$2
+
+  if [ -n "$ns" ]; then
+    sudo ip netns exec "$ns" cat /sys/class/net/"$iface"/address
+  else
+    cat /sys/class/net/"$iface"/address
+  fi
+}